@@ -6,28 +6,32 @@
 #pragma comment(lib, "WS2_32.lib")
 
 IClient::IClient()
+	: IClient(nullptr)
+{
+}
+
+IClient::IClient(IOEngine *pEngine)
 	: m_nPort(0)
-	, m_completionPort(NULL)
-	, m_pWorkerThreads(nullptr)
-	, m_workerThreadNum(0)
+	, m_dwShmSpinUs(SHM_DEFAULT_SPIN_US)
+	, m_pEngine(pEngine ? pEngine : &m_ownEngine)
 	, m_pSocketContext(nullptr)
+	, m_bCompressEnabled(false)
+	, m_dwCompressThreshold(COMPRESS_DEFAULT_THRESHOLD)
+	, m_hNegotiatedEvent(::CreateEvent(NULL, TRUE, FALSE, NULL))
+	, m_dwTimerPeriod(0)
+	, m_hTimer(NULL)
+	, m_pTimerOverlappedContext(nullptr)
+	, m_nTimerPosted(0)
 {
 	WSADATA wsaData;
 	::WSAStartup(MAKEWORD(2, 2), &wsaData);
-
-	m_stopEvent = ::CreateEvent(nullptr, TRUE, FALSE, nullptr);
 }
 
 IClient::~IClient()
 {
 	DisConnect();
-	
-	if (m_stopEvent)
-	{
-		::CloseHandle(m_stopEvent);
-		m_stopEvent = NULL;
-	}
 
+	::CloseHandle(m_hNegotiatedEvent);
 	::WSACleanup();
 }
 
@@ -35,6 +39,8 @@ bool IClient::Connect(const std::string & ipAddress, USHORT nPort)
 {
 	m_ipAddress = ipAddress;
 	m_nPort = nPort;
+	m_unixPath.clear();
+	m_shmName.clear();
 
 	bool result = Init();
 	if (!result)
@@ -44,58 +50,104 @@ bool IClient::Connect(const std::string & ipAddress, USHORT nPort)
 	return result;
 }
 
-bool IClient::DisConnect()
+bool IClient::ConnectUnix(const std::string & unixPath)
 {
-	if (m_stopEvent)
+	m_ipAddress.clear();
+	m_nPort = 0;
+	m_unixPath = unixPath;
+	m_shmName.clear();
+
+	bool result = Init();
+	if (!result)
 	{
-		::SetEvent(m_stopEvent);
+		UnInit();
 	}
+	return result;
+}
 
-	for (unsigned int index = 0; index < m_workerThreadNum; ++index)
+bool IClient::ConnectShm(const std::string & shmName, DWORD dwSpinUs)
+{
+	m_ipAddress.clear();
+	m_nPort = 0;
+	m_unixPath.clear();
+	m_shmName = shmName;
+	m_dwShmSpinUs = dwSpinUs;
+
+	bool result = Init();
+	if (!result)
 	{
-		::PostQueuedCompletionStatus(m_completionPort, 0, EXIT_SERVER_CODE, nullptr);
+		UnInit();
 	}
+	return result;
+}
 
-	if (m_pWorkerThreads && m_workerThreadNum)
+bool IClient::DisConnect()
+{
+	UnInit();
+
+	// 等待连接上下文销毁，之后引擎不会再向本客户端分发完成包；超时或在工作者线程上调用时不停止引擎
+	if (m_pEngine->IsRunning() && !WaitForContexts())
 	{
-		::WaitForMultipleObjects(m_workerThreadNum, m_pWorkerThreads, TRUE, INFINITE);
+		return false;
 	}
 
-	UnInit();
+	if (m_pEngine == &m_ownEngine)
+	{
+		m_ownEngine.Stop();
+	}
 
 	return true;
 }
 
 bool IClient::Send(const char *buffer, int nLen)
 {
-	if (!buffer)
+	IOInlineSendScope inlineSendScope;
+	if (!buffer || !m_pSocketContext || m_pSocketContext->IsClosed())
 	{
 		return false;
 	}
 
-	IOOverlappedContext *pNewOverlappedContext = m_pSocketContext->NewIOOverlappedContext();
-	pNewOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_SEND;
-	pNewOverlappedContext->ioSocket = m_pSocketContext->connSocket;
-	::memcpy_s(pNewOverlappedContext->wsaBuffer.buf, MAX_BUFFER_SIZE, buffer, nLen);
-	pNewOverlappedContext->wsaBuffer.len = (ULONG)nLen;
+	// 服务端未应答压缩协商时原样发送
+	IOCompressStream *pCompressStream = m_pSocketContext->pCompressStream;
+	if (!pCompressStream || !pCompressStream->IsActive())
+	{
+		return SendRaw(m_pSocketContext, buffer, nLen);
+	}
+
+	// 每块消息编码为一帧，帧长度不超过一个缓冲区
+	char frame[MAX_BUFFER_SIZE];
+	DWORD dwMaxChunk = IOCompressStream::GetMaxRawChunk(MAX_BUFFER_SIZE);
 
-	if (false == PostSend(m_pSocketContext, pNewOverlappedContext))
+	DWORD dwOffset = 0;
+	while (dwOffset < (DWORD)nLen)
 	{
-		DoClose(m_pSocketContext);
-		return false;
+		DWORD dwChunk = ((DWORD)nLen - dwOffset < dwMaxChunk) ? ((DWORD)nLen - dwOffset) : dwMaxChunk;
+		DWORD dwFrameLen = 0;
+		if (!pCompressStream->Encode(buffer + dwOffset, dwChunk, frame, MAX_BUFFER_SIZE, dwFrameLen) ||
+			!SendRaw(m_pSocketContext, frame, (int)dwFrameLen))
+		{
+			return false;
+		}
+		dwOffset += dwChunk;
 	}
 
 	return true;
 }
 
-bool IClient::Init()
+void IClient::EnableCompression(DWORD dwThreshold)
 {
-	if (m_stopEvent)
-	{
-		::ResetEvent(m_stopEvent);
-	}
+	m_bCompressEnabled = true;
+	m_dwCompressThreshold = dwThreshold;
+}
+
+void IClient::EnableBusyPoll(DWORD dwSpinUs, LONG nMaxSpinners)
+{
+	m_pEngine->EnableBusyPoll(dwSpinUs, nMaxSpinners);
+}
 
-	if (!(InitIOCP() && InitConnectSocket()))
+bool IClient::Init()
+{
+	if (!(m_pEngine->Start() && InitConnectSocket() && StartTimer()))
 	{
 		UnInit();
 		return false;
@@ -106,68 +158,47 @@ bool IClient::Init()
 
 bool IClient::UnInit()
 {
-	if (m_pWorkerThreads)
-	{
-		for (unsigned int index = 0; index < m_workerThreadNum; ++index)
-		{
-			if (m_pWorkerThreads[index] != INVALID_HANDLE_VALUE)
-			{
-				::CloseHandle(m_pWorkerThreads[index]);
-				m_pWorkerThreads[index] = INVALID_HANDLE_VALUE;
-			}
-		}
-
-		delete []m_pWorkerThreads;
-		m_pWorkerThreads = nullptr;
-	}
-
-	if (m_completionPort)
-	{
-		::CloseHandle(m_completionPort);
-		m_completionPort = NULL;
-	}
+	// 先停止定时器，之后不会再有新的定时完成包；已投递的完成包持有连接引用，由工作者线程处理后释放
+	StopTimer();
 
+	// 关闭连接并取消在途IO，上下文在最后一个在途IO完成后销毁
 	if (m_pSocketContext)
 	{
-		delete m_pSocketContext;
+		DoClose(m_pSocketContext);
+		m_pSocketContext->Release();
 		m_pSocketContext = nullptr;
 	}
 
 	return true;
 }
 
-bool IClient::InitIOCP()
+bool IClient::InitConnectSocket()
 {
-	// 初始化完成端口及工作线程集
-	m_completionPort = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
-	if (!m_completionPort)
-	{
-		return false;
-	}
-
-	m_workerThreadNum = 2 * GetNumOfProcessors() + 2;
-	m_pWorkerThreads = new HANDLE[m_workerThreadNum];
-
-	for (DWORD index = 0; index < m_workerThreadNum; ++index)
+	if (!m_shmName.empty())
 	{
-		m_pWorkerThreads[index] = ::CreateThread(0, 0, &IClient::WorkerThreadProc, (void *)this, 0, 0);
+		return InitShmConnection();
 	}
-	return true;
-}
 
-bool IClient::InitConnectSocket()
-{
 	// 生成用于通信的socket的Context
-	m_pSocketContext = new IOSocketContext();
-	m_pSocketContext->connSocket = ::WSASocket(AF_INET, SOCK_STREAM, 0, NULL, 0, WSA_FLAG_OVERLAPPED);
+	m_pSocketContext = new IOSocketContext(this);
+	bool bUnix = !m_unixPath.empty();
+	m_pSocketContext->connSocket = ::WSASocket(bUnix ? AF_UNIX : AF_INET, SOCK_STREAM, 0, NULL, 0, WSA_FLAG_OVERLAPPED);
 	if (INVALID_SOCKET == m_pSocketContext->connSocket)
 	{
-		delete m_pSocketContext;
+		m_pSocketContext->Release();
 		m_pSocketContext = nullptr;
 
 		return false;
 	}
 
+	// 环回快速路径须在connect之前设置，AF_UNIX连接本就不经过TCP/IP协议栈
+	if (!bUnix && m_pEngine->GetBusyPoller().IsEnabled())
+	{
+		BOOL bNoDelay = TRUE;
+		::setsockopt(m_pSocketContext->connSocket, IPPROTO_TCP, TCP_NODELAY, (char *)&bNoDelay, sizeof(bNoDelay));
+		IOBusyPoller::EnableLoopbackFastPath(m_pSocketContext->connSocket);
+	}
+
 	// 填充地址信息
 	sockaddr_in serverAddr;
 	::memset(&serverAddr, 0, sizeof(serverAddr));
@@ -175,57 +206,190 @@ bool IClient::InitConnectSocket()
 	::inet_pton(AF_INET, m_ipAddress.c_str(), (PVOID)&serverAddr.sin_addr.s_addr);
 	serverAddr.sin_port = ::htons(m_nPort);
 
-	if (::connect(
+	SOCKADDR_UN unixAddr;
+	int nUnixAddrLen = 0;
+	bool bAddrValid = !bUnix || IOUnixSocket::FillAddress(m_unixPath, unixAddr, nUnixAddrLen);
+
+	if (!bAddrValid || ::connect(
 		m_pSocketContext->connSocket,
-		(struct sockaddr*)&serverAddr,
-		sizeof(sockaddr_in)) == -1)
+		bUnix ? (struct sockaddr*)&unixAddr : (struct sockaddr*)&serverAddr,
+		bUnix ? nUnixAddrLen : (int)sizeof(sockaddr_in)) == -1)
 	{
 		::closesocket(m_pSocketContext->connSocket);
 		m_pSocketContext->connSocket = INVALID_SOCKET;
 
-		delete m_pSocketContext;
+		m_pSocketContext->Release();
 		m_pSocketContext = nullptr;
 
 		return false;
 	}
 
 	// 将socket绑定到完成端口中
-	if (NULL == ::CreateIoCompletionPort(
-		(HANDLE)m_pSocketContext->connSocket, m_completionPort, (ULONG_PTR)m_pSocketContext, 0))
+	if (!m_pEngine->Attach(m_pSocketContext, m_pSocketContext->connSocket))
 	{
 		::closesocket(m_pSocketContext->connSocket);
 		m_pSocketContext->connSocket = INVALID_SOCKET;
 
-		delete m_pSocketContext;
+		m_pSocketContext->Release();
 		m_pSocketContext = nullptr;
 
 		return false;
 	}
 
+	// 请求压缩，服务端应答后双向的数据才分帧
+	if (m_bCompressEnabled)
+	{
+		::ResetEvent(m_hNegotiatedEvent);
+		m_pSocketContext->pCompressStream =
+			new IOCompressStream(COMPRESS_STREAM_STATE::COMPRESS_STATE_PROBING, m_dwCompressThreshold);
+	}
+
 	IOOverlappedContext *pOverlappedContext = m_pSocketContext->NewIOOverlappedContext();
-	pOverlappedContext->ioSocket = m_pSocketContext->connSocket;
+	if (pOverlappedContext)
+	{
+		pOverlappedContext->ioSocket = m_pSocketContext->connSocket;
+	}
 
-	if (false == PostRecv(m_pSocketContext, pOverlappedContext))
+	if (!pOverlappedContext || false == PostRecv(m_pSocketContext, pOverlappedContext))
 	{
-		m_pSocketContext->ReleaseIOOverlappedContext(pOverlappedContext);
+		if (pOverlappedContext)
+		{
+			m_pSocketContext->ReleaseIOOverlappedContext(pOverlappedContext);
+		}
 
 		::closesocket(m_pSocketContext->connSocket);
 		m_pSocketContext->connSocket = INVALID_SOCKET;
 
-		delete m_pSocketContext;
+		m_pSocketContext->Release();
+		m_pSocketContext = nullptr;
+
+		return false;
+	}
+
+	if (m_pSocketContext->pCompressStream && !NegotiateCompression())
+	{
+		return false;
+	}
+
+	return true;
+}
+
+bool IClient::InitShmConnection()
+{
+	// 共享内存连接没有socket，不绑定完成端口；接收唤醒包与定时完成包仍经引擎的完成端口投递
+	IOShmChannel *pChannel = IOShmChannel::Connect(m_shmName);
+	if (!pChannel)
+	{
+		return false;
+	}
+	pChannel->SetSpinTime(m_dwShmSpinUs);
+
+	m_pSocketContext = new IOSocketContext(this);
+	m_pSocketContext->pShmChannel = pChannel;
+	m_pEngine->AttachPostOnly(m_pSocketContext);
+
+	if (m_bCompressEnabled)
+	{
+		::ResetEvent(m_hNegotiatedEvent);
+		m_pSocketContext->pCompressStream =
+			new IOCompressStream(COMPRESS_STREAM_STATE::COMPRESS_STATE_PROBING, m_dwCompressThreshold);
+	}
+
+	IOOverlappedContext *pOverlappedContext = m_pSocketContext->NewIOOverlappedContext();
+	if (!pOverlappedContext || !m_pSocketContext->StartShmReader(pOverlappedContext))
+	{
+		m_pSocketContext->Release();
 		m_pSocketContext = nullptr;
 
 		return false;
 	}
 
+	if (m_pSocketContext->pCompressStream && !NegotiateCompression())
+	{
+		return false;
+	}
+
 	return true;
 }
 
-DWORD IClient::GetNumOfProcessors()
+bool IClient::NegotiateCompression()
+{
+	char hello[sizeof(IOCompressFrameHeader)];
+	DWORD dwHelloLen = IOCompressStream::WriteHello(hello, sizeof(hello));
+	if (!SendRaw(m_pSocketContext, hello, (int)dwHelloLen))
+	{
+		return false;
+	}
+
+	// 启用压缩的服务端以协商帧应答；不支持压缩的服务端把协商帧当作普通数据，可能回应其他数据，也可能一直不发送
+	// 超时仍未收到数据时放弃协商，之后原样收发；在唯一的工作者线程上调用时只能等到超时
+	::WaitForSingleObject(m_hNegotiatedEvent, COMPRESS_HELLO_TIMEOUT_MS);
+	m_pSocketContext->pCompressStream->StopProbing();
+
+	return !m_pSocketContext->IsClosed();
+}
+
+void IClient::SetTimerPeriod(DWORD dwPeriodMs)
+{
+	m_dwTimerPeriod = dwPeriodMs;
+}
+
+bool IClient::StartTimer()
+{
+	if (0 == m_dwTimerPeriod)
+	{
+		return true;
+	}
+
+	// 定时器回调在定时器线程上访问连接，引擎锁不是线程安全的时不可用
+	if (!IO_ENGINE_LOCK_THREAD_SAFE)
+	{
+		return false;
+	}
+
+	m_pTimerOverlappedContext = m_pSocketContext->NewIOOverlappedContext();
+	if (!m_pTimerOverlappedContext)
+	{
+		return false;
+	}
+	m_pTimerOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_TIMER;
+	m_nTimerPosted = 0;
+
+	return (FALSE != ::CreateTimerQueueTimer(
+		&m_hTimer, NULL, TimerProc, this, m_dwTimerPeriod, m_dwTimerPeriod, WT_EXECUTEINTIMERTHREAD));
+}
+
+void IClient::StopTimer()
+{
+	if (m_hTimer)
+	{
+		// 等待正在执行的回调返回
+		::DeleteTimerQueueTimer(NULL, m_hTimer, INVALID_HANDLE_VALUE);
+		m_hTimer = NULL;
+	}
+
+	// 重叠结构随连接上下文一起释放
+	m_pTimerOverlappedContext = nullptr;
+}
+
+VOID CALLBACK IClient::TimerProc(PVOID lpParam, BOOLEAN bTimerFired)
 {
-	SYSTEM_INFO si;
-	::GetSystemInfo(&si);
-	return si.dwNumberOfProcessors;
+	IClient *pThis = reinterpret_cast<IClient*>(lpParam);
+
+	// 工作者线程尚未处理上一个定时完成包时跳过本次
+	if (0 != ::InterlockedCompareExchange(&pThis->m_nTimerPosted, 1, 0))
+	{
+		return;
+	}
+
+	// 定时完成包持有连接引用，由工作者线程处理后释放
+	IOSocketContext *pSocketContext = pThis->m_pSocketContext;
+	pSocketContext->AddRef();
+	if (!pThis->m_pEngine->Post(pSocketContext, pThis->m_pTimerOverlappedContext))
+	{
+		pSocketContext->Release();
+		::InterlockedExchange(&pThis->m_nTimerPosted, 0);
+	}
 }
 
 bool IClient::IsSocketAlive(SOCKET sock)
@@ -238,8 +402,11 @@ bool IClient::PostRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOv
 	DWORD dwFlags = 0, dwBytes = 0;
 	pOverlappedContext->ResetBufferAndOptType();
 	pOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_RECV;
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_POST_RECV);
 
-	if ((::WSARecv(
+	// 在途IO持有连接的引用，完成后由工作线程释放
+	pSocketContext->AddRef();
+	int nRet = ::WSARecv(
 		pOverlappedContext->ioSocket,
 		&pOverlappedContext->wsaBuffer,
 		1,
@@ -247,9 +414,22 @@ bool IClient::PostRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOv
 		&dwFlags,
 		&pOverlappedContext->wsaOverlapped,
 		NULL
-		) == SOCKET_ERROR) && (WSA_IO_PENDING != ::WSAGetLastError()))
+		);
+	if ((SOCKET_ERROR == nRet) && (WSA_IO_PENDING != ::WSAGetLastError()))
 	{
 		DoClose(pSocketContext);
+		pSocketContext->Release();
+		return false;
+	}
+
+	pSocketContext->CancelIfClosed(pOverlappedContext);
+
+	// 同步完成的recv没有完成包，补投一个交给工作线程处理，避免在此递归并保持读取的调度顺序
+	if ((NO_ERROR == nRet) && pSocketContext->bSkipCompletionOnSuccess &&
+		!m_pEngine->Post(pSocketContext, pOverlappedContext, dwBytes))
+	{
+		DoClose(pSocketContext);
+		pSocketContext->Release();
 		return false;
 	}
 
@@ -258,11 +438,18 @@ bool IClient::PostRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOv
 
 bool IClient::PostSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
 {
+	if (pSocketContext->pShmChannel)
+	{
+		return PostShmSend(pSocketContext, pOverlappedContext);
+	}
+
 	pOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_SEND;
 	DWORD dwBytes = 0;
 	DWORD dwFlags = 0;
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_POST_SEND, 0, pOverlappedContext->wsaBuffer.len);
 
-	if ((::WSASend(
+	pSocketContext->AddRef();
+	int nRet = ::WSASend(
 		pOverlappedContext->ioSocket,
 		&pOverlappedContext->wsaBuffer,
 		1,
@@ -270,18 +457,50 @@ bool IClient::PostSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOv
 		dwFlags,
 		&pOverlappedContext->wsaOverlapped,
 		NULL
-	) != NO_ERROR) && (::WSAGetLastError() != WSA_IO_PENDING))
+	);
+	if ((nRet != NO_ERROR) && (::WSAGetLastError() != WSA_IO_PENDING))
+	{
+		DoClose(pSocketContext);
+		pSocketContext->Release();
+		return false;
+	}
+
+	pSocketContext->CancelIfClosed(pOverlappedContext);
+
+	// 数据已全部进入socket发送缓冲区且不会再有完成包，由当前线程完成本次send(OnSend在最外层的Send返回前回调)
+	if ((NO_ERROR == nRet) && pSocketContext->bSkipCompletionOnSuccess)
+	{
+		IOInlineSendScope::Complete(pSocketContext, pOverlappedContext, dwBytes);
+	}
+
+	return true;
+}
+
+bool IClient::PostShmSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+{
+	pOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_SEND;
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_POST_SEND, 0, pOverlappedContext->wsaBuffer.len);
+
+	if (!pSocketContext->pShmChannel->Send(pOverlappedContext->wsaBuffer.buf, pOverlappedContext->wsaBuffer.len))
 	{
 		DoClose(pSocketContext);
 		return false;
 	}
 
+	// 写入环形队列即完成发送，由当前线程完成本次send(OnSend在最外层的Send返回前回调)
+	pSocketContext->AddRef();
+	IOInlineSendScope::Complete(pSocketContext, pOverlappedContext, pOverlappedContext->wsaBuffer.len);
+
 	return true;
 }
 
-bool IClient::DoRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+bool IClient::DoRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD dwBytes)
 {
-	OnRecv(pSocketContext, pOverlappedContext);
+	if (!DeliverRecv(pSocketContext, pOverlappedContext, dwBytes))
+	{
+		return false;
+	}
+
 	pOverlappedContext->ResetBufferAndOptType();
 	if (false == PostRecv(pSocketContext, pOverlappedContext))
 	{
@@ -292,110 +511,246 @@ bool IClient::DoRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOver
 	return true;
 }
 
+bool IClient::DoShmRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+{
+	// 本端已关闭时唤醒包只用于释放登记的等待所持有的引用
+	DWORD dwBytes = 0;
+	SHM_WAIT_RESULT result = pSocketContext->ReceiveShm(dwBytes);
+	if (pSocketContext->IsClosed() || SHM_WAIT_RESULT::SHM_WAIT_CLOSED == result)
+	{
+		return false;
+	}
+
+	if (SHM_WAIT_RESULT::SHM_WAIT_PEER_CLOSED == result)
+	{
+		DoNotifyClose(pSocketContext);
+		return false;
+	}
+
+	if (SHM_WAIT_RESULT::SHM_WAIT_PEER_DEAD == result || SHM_WAIT_RESULT::SHM_WAIT_INVALID_DATA == result)
+	{
+		DoNotifyClose(pSocketContext, (SHM_WAIT_RESULT::SHM_WAIT_PEER_DEAD == result) ? ERROR_BROKEN_PIPE : ERROR_INVALID_DATA);
+		return false;
+	}
+
+	if (SHM_WAIT_RESULT::SHM_WAIT_DATA == result && !DeliverRecv(pSocketContext, pOverlappedContext, dwBytes))
+	{
+		return false;
+	}
+
+	if (pSocketContext->IsClosed())
+	{
+		return false;
+	}
+
+	// 登记下一次接收，由新的等待或唤醒包持有引用
+	pSocketContext->AddRef();
+	if (!pSocketContext->ArmShmReader())
+	{
+		pSocketContext->Release();
+		DoNotifyClose(pSocketContext, ::GetLastError());
+		return false;
+	}
+
+	return true;
+}
+
+bool IClient::DeliverRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD dwBytes)
+{
+	IOCompressStream *pCompressStream = pSocketContext->pCompressStream;
+	if (!pCompressStream)
+	{
+		pOverlappedContext->wsaBuffer.len = dwBytes;
+		IOCallbackScope callbackScope;
+		IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_RECV_BEGIN, 0, dwBytes);
+		OnRecv(pSocketContext, pOverlappedContext);
+		IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_RECV_END);
+	}
+	else
+	{
+		bool bProbing = pCompressStream->IsProbing();
+		if (!pCompressStream->Feed(pOverlappedContext->wsaBuffer.buf, dwBytes))
+		{
+			DoNotifyClose(pSocketContext, ERROR_INVALID_DATA);
+			return false;
+		}
+
+		// 服务端的首个数据已决定是否压缩，唤醒在Connect中等待协商的线程
+		if (bProbing && !pCompressStream->IsProbing())
+		{
+			::SetEvent(m_hNegotiatedEvent);
+		}
+
+		// 完整的帧逐条解压到重叠结构的缓冲区中交给上层，服务端的协商应答帧被直接跳过
+		for (;;)
+		{
+			DWORD dwMessageLen = 0;
+			pOverlappedContext->ResetBufferAndOptType();
+			if (!pCompressStream->NextMessage(pOverlappedContext->wsaBuffer.buf, MAX_BUFFER_SIZE, dwMessageLen))
+			{
+				DoNotifyClose(pSocketContext, ERROR_INVALID_DATA);
+				return false;
+			}
+
+			if (0 == dwMessageLen)
+			{
+				break;
+			}
+
+			pOverlappedContext->wsaBuffer.len = dwMessageLen;
+			IOCallbackScope callbackScope;
+			IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_RECV_BEGIN, 0, dwMessageLen);
+			OnRecv(pSocketContext, pOverlappedContext);
+			IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_RECV_END);
+		}
+	}
+
+	return true;
+}
+
+bool IClient::SendRaw(IOSocketContext *pSocketContext, const char *buffer, int nLen)
+{
+	IOOverlappedContext *pNewOverlappedContext = pSocketContext->NewIOOverlappedContext();
+	if (!pNewOverlappedContext)
+	{
+		DoClose(pSocketContext);
+		return false;
+	}
+	pNewOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_SEND;
+	pNewOverlappedContext->ioSocket = pSocketContext->connSocket;
+	::memcpy_s(pNewOverlappedContext->wsaBuffer.buf, MAX_BUFFER_SIZE, buffer, nLen);
+	pNewOverlappedContext->wsaBuffer.len = (ULONG)nLen;
+
+	if (false == PostSend(pSocketContext, pNewOverlappedContext))
+	{
+		DoClose(pSocketContext);
+		return false;
+	}
+
+	return true;
+}
+
 bool IClient::DoSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
 {
+	IOCallbackScope callbackScope;
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_SEND_BEGIN, 0, pOverlappedContext->wsaBuffer.len);
 	OnSend(pSocketContext, pOverlappedContext);
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_SEND_END);
 	return true;
 }
 
 bool IClient::DoClose(IOSocketContext *pSocketContext)
 {
-// 	if (pSocketContext)
-// 	{
-// 		delete pSocketContext;
-// 	}
+	// 同一连接上的多个IO可能同时失败，只有第一次关闭生效
+	if (!pSocketContext || !pSocketContext->MarkClosed())
+	{
+		return false;
+	}
 
+	// 协商期间连接关闭时Connect不必等到超时
+	if (pSocketContext->pCompressStream)
+	{
+		::SetEvent(m_hNegotiatedEvent);
+	}
+
+	pSocketContext->CancelIO();
 	return true;
 }
 
-DWORD WINAPI IClient::WorkerThreadProc(LPVOID lpParam)
+bool IClient::DoNotifyClose(IOSocketContext *pSocketContext, DWORD dwError)
 {
-	IClient *pThis = reinterpret_cast<IClient*>(lpParam);
-	if (!pThis)
+	// 多个IO同时失败时各自都会走到这里，先关闭再通知，未能关闭的一方已由别人通知过
+	if (!DoClose(pSocketContext))
 	{
-		return 0;
+		return false;
 	}
 
-	OVERLAPPED *pOverlapped = nullptr;
-	IOSocketContext *pSocketContext = nullptr;
-	DWORD dwBytes = 0;
-	IOOverlappedContext *pOverlappedContext = nullptr;
-
-	// 采用退出信号及退出事件的双保险方式，以确保退出所有工作者线程
-	while (WAIT_OBJECT_0 != ::WaitForSingleObject(pThis->m_stopEvent, 0))
+	IOCallbackScope callbackScope;
+	if (NO_ERROR == dwError)
 	{
-		BOOL bRet = ::GetQueuedCompletionStatus(
-			pThis->m_completionPort,
-			&dwBytes,
-			(PULONG_PTR)&pSocketContext,
-			&pOverlapped,
-			INFINITE
-		);
+		OnClosed(pSocketContext);
+	}
+	else
+	{
+		OnError(pSocketContext, dwError);
+	}
+	return true;
+}
 
-		if (EXIT_SERVER_CODE == (ULONG_PTR)pSocketContext)
+void IClient::OnCompletion(
+	IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, BOOL bRet, DWORD dwBytes, DWORD dwError)
+{
+	// 定时完成包：连接未关闭时交给上层，处理完后才允许投递下一个
+	if (IOCP_OPERATOR_TYPE::IOCP_OPT_TIMER == pOverlappedContext->optType)
+	{
+		if (!pSocketContext->IsClosed())
 		{
-			break;
+			IOCallbackScope callbackScope;
+			OnTimer(pSocketContext);
 		}
+		::InterlockedExchange(&m_nTimerPosted, 0);
+		pSocketContext->Release();
+		return;
+	}
 
-		// 获取到传入的重叠结构参数IOOverlappedContext
-		pOverlappedContext = CONTAINING_RECORD(pOverlapped, IOOverlappedContext, wsaOverlapped);
+	// 共享内存连接的接收唤醒包
+	if (IOCP_OPERATOR_TYPE::IOCP_OPT_SHM_RECV == pOverlappedContext->optType)
+	{
+		DoShmRecv(pSocketContext, pOverlappedContext);
+		pSocketContext->Release();
+		return;
+	}
 
+	// 已关闭的连接上被取消的IO不再通知上层
+	if (!pSocketContext->IsClosed())
+	{
 		if (!bRet)
 		{
-			DWORD dwErr = ::WSAGetLastError();
-			if (WAIT_TIMEOUT == dwErr)
+			if (WAIT_TIMEOUT == dwError)
 			{
-				if (!pThis->IsSocketAlive(pSocketContext->connSocket))
+				if (!IsSocketAlive(pSocketContext->connSocket))
 				{
-					pThis->OnClosed(pSocketContext);
-					pThis->DoClose(pSocketContext);
+					DoNotifyClose(pSocketContext);
 				}
-				continue;
-			}
-			else if (ERROR_NETNAME_DELETED == dwErr)
-			{
-				pThis->OnError(pSocketContext, dwErr);
-				pThis->DoClose(pSocketContext);
-				continue;
 			}
-			else // others error
+			else // ERROR_NETNAME_DELETED and others error
 			{
-				pThis->OnError(pSocketContext, dwErr);
-				pThis->DoClose(pSocketContext);
-				continue;
+				DoNotifyClose(pSocketContext, dwError);
 			}
 		}
-		else
+		else if ((0 == dwBytes) &&
+			(IOCP_OPERATOR_TYPE::IOCP_OPT_RECV == pOverlappedContext->optType ||
+			IOCP_OPERATOR_TYPE::IOCP_OPT_SEND == pOverlappedContext->optType))
 		{
 			// 若对端断开，则关闭连接
-			if ((0 == dwBytes) && 
-				(IOCP_OPERATOR_TYPE::IOCP_OPT_RECV == pOverlappedContext->optType ||
-				IOCP_OPERATOR_TYPE::IOCP_OPT_SEND == pOverlappedContext->optType))
+			DoNotifyClose(pSocketContext);
+		}
+		else
+		{
+			switch (pOverlappedContext->optType)
 			{
-				pThis->OnClosed(pSocketContext);
-				pThis->DoClose(pSocketContext);
-				continue;
+			case IOCP_OPERATOR_TYPE::IOCP_OPT_RECV:
+			{
+				DoRecv(pSocketContext, pOverlappedContext, dwBytes);
 			}
-			else
+			break;
+			case IOCP_OPERATOR_TYPE::IOCP_OPT_SEND:
 			{
-				switch (pOverlappedContext->optType)
-				{
-				case IOCP_OPERATOR_TYPE::IOCP_OPT_RECV:
-				{
-					pThis->DoRecv(pSocketContext, pOverlappedContext);
-				}
-				break;
-				case IOCP_OPERATOR_TYPE::IOCP_OPT_SEND:
-				{
-					pThis->DoSend(pSocketContext, pOverlappedContext);
-				}
+				DoSend(pSocketContext, pOverlappedContext);
+			}
+			break;
+			default:
 				break;
-				default:
-					break;
-				}
 			}
 		}
 	}
 
-	return 0;
+	// send的重叠结构用完即归还到池中，长连接上持续发送时连接持有的重叠结构不会累积
+	if (IOCP_OPERATOR_TYPE::IOCP_OPT_SEND == pOverlappedContext->optType)
+	{
+		pSocketContext->ReleaseIOOverlappedContext(pOverlappedContext);
+	}
+
+	// 释放本次完成的IO所持有的连接引用
+	pSocketContext->Release();
 }
@@ -4,322 +4,128 @@
 #include <WinSock2.h>
 #include <Windows.h>
 #include <MSWSock.h>
-#include <list>
+#include "iocontext.h"
+#include "ioengine.h"
+#include "iounix.h"
 #include <string>
 
-#define MAX_BUFFER_SIZE  (1024 * 4)	// 完成端口操作的数据缓冲区大小(4K)
-#define EXIT_SERVER_CODE (-1)		// 传递给Worker线程的退出信号
-
-//	完成端口投递操作类型
-enum class IOCP_OPERATOR_TYPE
-{
-	IOCP_OPT_NONE = 0,	
-	IOCP_OPT_ACCPEPT,	// 接受连接
-	IOCP_OPT_SEND,		// 发送数据
-	IOCP_OPT_RECV,		// 接受数据
-};
-
-//	完成端口OVERLAPPED的重叠结构
-struct IOOverlappedContext 
-{
-	WSAOVERLAPPED wsaOverlapped;	// 重叠结构必须的成员且放置在第一个位置
-	SOCKET ioSocket;
-	WSABUF wsaBuffer;
-	IOCP_OPERATOR_TYPE optType;
-	// TODO: 也可以附加其他需要的数据成员
-
-	IOOverlappedContext()
-		: ioSocket(NULL)
-		, optType(IOCP_OPERATOR_TYPE::IOCP_OPT_NONE)
-	{
-		::memset(&wsaOverlapped, 0, sizeof(wsaOverlapped));
-		MallocWsaBuffer(wsaBuffer);
-	}
-
-	~IOOverlappedContext()
-	{
-		if (wsaBuffer.buf)
-		{
-			::HeapFree(::GetProcessHeap(), 0, wsaBuffer.buf);
-			wsaBuffer.buf = nullptr;
-		}
-	}
-
-	void ResetBufferAndOptType()
-	{
-		if (wsaBuffer.buf)
-		{
-			::memset(wsaBuffer.buf, 0, MAX_BUFFER_SIZE);
-		}
-		else
-		{
-			MallocWsaBuffer(wsaBuffer);
-		}
-
-		::memset(&wsaOverlapped, 0, sizeof(wsaOverlapped));
-		optType = IOCP_OPERATOR_TYPE::IOCP_OPT_NONE;
-	}
-
-	void MallocWsaBuffer(WSABUF &wsaBuffer)
-	{
-		wsaBuffer.buf = (CHAR *)::HeapAlloc(::GetProcessHeap(), HEAP_ZERO_MEMORY, MAX_BUFFER_SIZE);
-		wsaBuffer.len = MAX_BUFFER_SIZE;
-	}
-};
-
-// 关键段包装锁
-class CriticalSectionLock
-{
-public:
-
-	CriticalSectionLock()
-	{
-		::InitializeCriticalSection(&m_csLock);
-	}
-
-	~CriticalSectionLock()
-	{
-		::DeleteCriticalSection(&m_csLock);
-	}
-
-	void Lock()
-	{
-		::EnterCriticalSection(&m_csLock);
-	}
-
-	void UnLock()
-	{
-		::LeaveCriticalSection(&m_csLock);
-	}
-
-private:
-
-	CRITICAL_SECTION m_csLock;
-};
-
-
-// 自动锁模板类
-template<typename Lock>
-class AutoLock
-{
-public:
-
-	explicit AutoLock(Lock& lock) : m_lock(lock)
-	{
-		m_lock.Lock();
-	}
-
-	~AutoLock()
-	{
-		m_lock.UnLock();
-	}
-
-private:
-
-	Lock& m_lock;
-};
-
-// OverlappedContext重叠结构共享池，避免频繁创建/释放IOOverlappedContext的操作
-class IOOverlappedContextPool
-{
-public:
-
-	explicit IOOverlappedContextPool(unsigned int nOverlappedContextNum)
-	{
-		for (size_t i = 0; i < nOverlappedContextNum; i++)
-		{
-			IOOverlappedContext *pOverlappedContext = new IOOverlappedContext();
-			m_overlappedContextList.push_back(pOverlappedContext);
-		}
-	}
-
-	~IOOverlappedContextPool()
-	{
-		while (!m_overlappedContextList.empty())
-		{
-			std::list<IOOverlappedContext*>::iterator iter = 
-				m_overlappedContextList.begin();
-			delete (*iter);
-			m_overlappedContextList.erase(iter);
-		}
-	}
-
-public:
-
-	static IOOverlappedContextPool& GetInstance()
-	{
-		static IOOverlappedContextPool s_overlappedContextPool;
-		return s_overlappedContextPool;
-	}
-
-	IOOverlappedContext* AllocIOOverlappedContext()
-	{
-		IOOverlappedContext* pOverlappedContext = nullptr;
-		AutoLock<CriticalSectionLock> lock(m_criticalSectionLock);
-
-		if (m_overlappedContextList.size())
-		{
-			pOverlappedContext = m_overlappedContextList.back();
-			m_overlappedContextList.pop_back();
-		}
-		else
-		{
-			pOverlappedContext = new IOOverlappedContext();
-		}
-		return pOverlappedContext;
-	}
-
-	void ReleaseIOOverlappedContext(IOOverlappedContext* overlappedContext)
-	{
-		if (!overlappedContext)
-		{
-			return;
-		}
-
-		AutoLock<CriticalSectionLock> lock(m_criticalSectionLock);
-		m_overlappedContextList.push_front(overlappedContext);
-	}
-
-private:
-
-	IOOverlappedContextPool() = default;
-	IOOverlappedContextPool(const IOOverlappedContextPool&) = delete;
-	IOOverlappedContextPool& operator= (const IOOverlappedContextPool&) = delete;
-
-private:
-
-	std::list<IOOverlappedContext*> m_overlappedContextList;
-	CriticalSectionLock m_criticalSectionLock;
-};
-
-
-// 每个连接对应的套接字上下文结构对象
-class IOSocketContext
+// IOCP完成端口客户端抽象基类
+// 子类可实现抽象接口实现自定义业务处理逻辑
+// 默认使用自身私有的IO引擎；构造时传入共享引擎则与同一进程中的其他服务端/客户端共用工作者线程
+class IClient : public IOCompletionHandler
 {
 public:
 
-	SOCKET connSocket;		// 连接的socket
-	SOCKADDR_IN clientAddr;	// 连接的客户端地址
-
-public:
-
-	IOSocketContext()
-		: connSocket(INVALID_SOCKET)
-	{
-		::memset(&clientAddr, 0, sizeof(clientAddr));
-	}
-
-	~IOSocketContext()
-	{
-		if (connSocket != INVALID_SOCKET)
-		{
-			::closesocket(connSocket);
-			connSocket = INVALID_SOCKET;
-		}
+	bool Connect(const std::string & ipAddress, USHORT nPort = 9988);
 
-		while (!m_overlappedContextList.empty())
-		{
-			std::list<IOOverlappedContext*>::iterator iter =
-				m_overlappedContextList.begin();
-			IOOverlappedContextPool::GetInstance().ReleaseIOOverlappedContext(*iter);
-			m_overlappedContextList.erase(iter);
-		}
-	}
+	// 连接同机服务端的AF_UNIX监听(见IOListenerConfig::unixPath)，之后的收发与TCP连接相同
+	bool ConnectUnix(const std::string & unixPath);
 
-	IOOverlappedContext* NewIOOverlappedContext()
-	{
-		IOOverlappedContext *pOverlappedContext =
-			IOOverlappedContextPool::GetInstance().AllocIOOverlappedContext();
-		if (pOverlappedContext)
-		{
-			AutoLock<CriticalSectionLock> lock(m_criticalSectionLock);
-			m_overlappedContextList.push_back(pOverlappedContext);
-		}
-		return pOverlappedContext;
-	}
+	// 连接同机服务端的共享内存监听(见IOListenerConfig::shmName)，之后的收发与TCP连接相同
+	// 接收由引擎的工作者线程驱动，登记等待前先忙轮询dwSpinUs微秒，OnRecv在工作者线程上回调；OnSend在调用Send的线程上回调
+	bool ConnectShm(const std::string & shmName, DWORD dwSpinUs = SHM_DEFAULT_SPIN_US);
+	// 关闭连接并等待在途IO结束后返回；私有引擎随之停止，共享引擎继续运行
+	// 子类应在析构前调用，避免在途IO完成时回调已析构的子类；在工作者线程上调用或在途IO未在CONTEXT_DRAIN_TIMEOUT内结束时返回false
+	bool DisConnect();
+	bool Send(const char *buffer, int nLen);
 
-	void ReleaseIOOverlappedContext(IOOverlappedContext* pOverlappedContext)
+	// 连接已建立且尚未关闭
+	bool IsConnected() const
 	{
-		for (auto iter = m_overlappedContextList.begin();
-			 iter != m_overlappedContextList.end();
-			 ++iter)
-		{
-			if (*iter == pOverlappedContext)
-			{
-				IOOverlappedContextPool::GetInstance().ReleaseIOOverlappedContext(*iter);
-
-				AutoLock<CriticalSectionLock> lock(m_criticalSectionLock);
-				m_overlappedContextList.erase(iter);
-				break;
-			}
-		}
+		return m_pSocketContext && !m_pSocketContext->IsClosed();
 	}
 
-private:
+	// 启用消息压缩，需在Connect之前调用，小于dwThreshold的消息不压缩
+	// 连接建立后向服务端发送协商帧，Connect等待服务端的首个数据(最多COMPRESS_HELLO_TIMEOUT_MS)后返回：
+	// 是协商应答则之后双向分帧；是其他数据或超时则按服务端不支持压缩处理，之后原样收发
+	void EnableCompression(DWORD dwThreshold = COMPRESS_DEFAULT_THRESHOLD);
 
-	// 同一socket上的多个IO重叠请求上下文且管理此些上下文生命周期
-	std::list<IOOverlappedContext*> m_overlappedContextList; 
-	CriticalSectionLock m_criticalSectionLock;
-};
-
-// IOCP完成端口客户端抽象基类
-// 子类可实现抽象接口实现自定义业务处理逻辑
-class IClient
-{
-public:
-
-	bool Connect(const std::string & ipAddress, USHORT nPort = 9988);
-	bool DisConnect();
-	bool Send(const char *buffer, int nLen);
+	// 低延迟模式：工作线程阻塞等待前先忙轮询完成端口dwSpinUs微秒，需在Connect之前调用
+	// 同时为连接开启环回快速路径并关闭Nagle算法；使用共享引擎时作用于整个引擎
+	void EnableBusyPoll(DWORD dwSpinUs, LONG nMaxSpinners = 0);
+	const IOBusyPoller& GetBusyPoller() const { return m_pEngine->GetBusyPoller(); }
 
 public:
 
 	// 处理结果回调函数，子类可继承重写此类函数，以实现相应的业务处理逻辑
+	// 回调中的临时内存可从IOBumpArena::GetThreadArena()或其GetResource()(供std::pmr容器使用)分配，回调返回后自动回收，不得跨回调保留
 	virtual void OnEstablished(IOSocketContext *pSocketContext) = 0;
 	virtual void OnClosed(IOSocketContext *pSocketContext) = 0;
 	virtual void OnError(IOSocketContext *pSocketContext, DWORD dwError) = 0;
 	virtual void OnRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext) = 0;
+
+	// 同步完成的send不经过完成端口(见IOEngine::SetInlineCompletion)，此时OnSend在调用Send的线程上、Send返回之前回调
 	virtual void OnSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext) = 0;
 
+protected:
+
+	// 连接期间每隔dwPeriodMs毫秒由引擎的工作者线程调用一次OnTimer，需在Connect之前设置，0为不启用
+	// 上一次OnTimer未处理完时不会再次投递，同一时刻最多一个工作者线程在OnTimer中
+	// 定时器线程会访问连接，引擎锁策略不是线程安全的(NullLock)时启用定时器的Connect失败
+	void SetTimerPeriod(DWORD dwPeriodMs);
+	virtual void OnTimer(IOSocketContext *pSocketContext) {}
+
 private:
 
 	bool Init();
 	bool UnInit();
-	bool InitIOCP();
 	bool InitConnectSocket();
-	DWORD GetNumOfProcessors();
+	bool InitShmConnection();
+	bool NegotiateCompression();
 	bool IsSocketAlive(SOCKET sock);
+	bool StartTimer();
+	void StopTimer();
+
+	// 定时器线程回调，向连接的完成端口投递定时完成包
+	static VOID CALLBACK TimerProc(PVOID lpParam, BOOLEAN bTimerFired);
 
 private:
 
 	// 投递IO请求
 	bool PostRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
 	bool PostSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
+	bool PostShmSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
 
 	// IO处理函数
-	bool DoRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
+	bool DoRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD dwBytes);
+	bool DoShmRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
+	bool DeliverRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD dwBytes);
 	bool DoSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
 	bool DoClose(IOSocketContext *pSocketContext);
+	// 对端关闭或出错时关闭连接：只有生效的那次关闭回调OnClosed(dwError为NO_ERROR)或OnError，同一连接只通知一次
+	bool DoNotifyClose(IOSocketContext *pSocketContext, DWORD dwError = NO_ERROR);
+	bool SendRaw(IOSocketContext *pSocketContext, const char *buffer, int nLen);
 
-	// 工作中线程函数
-	static DWORD WINAPI WorkerThreadProc(LPVOID lpParam);
+	// 由引擎的工作者线程调用，处理本客户端连接的完成包
+	virtual void OnCompletion(
+		IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, BOOL bRet, DWORD dwBytes, DWORD dwError);
 
 protected:
 
 	IClient();
+	explicit IClient(IOEngine *pEngine);
 	virtual ~IClient();
 
 private:
 
 	std::string m_ipAddress;				// 服务端地址
 	USHORT m_nPort;							// 服务端口号
+	std::string m_unixPath;					// 服务端的AF_UNIX路径，非空时以AF_UNIX连接
+	std::string m_shmName;					// 服务端的共享内存监听名称，非空时以共享内存连接
+	DWORD m_dwShmSpinUs;					// 共享内存连接登记接收等待前忙轮询的时长(微秒)
+
+	IOEngine m_ownEngine;					// 私有引擎，未传入共享引擎时使用
+	IOEngine *m_pEngine;					// 当前使用的引擎
 
-	HANDLE m_stopEvent;						// 通知工作者线程退出的事件
-	HANDLE m_completionPort;				// 完成端口
-	HANDLE *m_pWorkerThreads;				// 工作者线程的句柄指针
-	unsigned int m_workerThreadNum;			// 工作者线程的数量
-	
 	IOSocketContext *m_pSocketContext;		// 当前连接上下文
+	bool m_bCompressEnabled;				// 是否向服务端请求压缩
+	DWORD m_dwCompressThreshold;			// 压缩阈值
+	HANDLE m_hNegotiatedEvent;				// 压缩协商得出结果或连接关闭时置位
+
+	DWORD m_dwTimerPeriod;					// OnTimer的周期(毫秒)，0为不启用
+	HANDLE m_hTimer;						// 定时器队列中的定时器
+	IOOverlappedContext *m_pTimerOverlappedContext;	// 定时完成包使用的重叠结构，属于当前连接上下文
+	volatile LONG m_nTimerPosted;			// 定时完成包已投递但尚未处理
 };
 
 #endif	// _TINY_IOCP_IOCPCLIENT_ICLIENT_H_
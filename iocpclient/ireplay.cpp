@@ -0,0 +1,147 @@
+#include "pch.h"
+#include "ireplay.h"
+
+#define REPLAY_SPIN_THRESHOLD_MS (2)	// 距目标时刻小于此值时改为让出时间片等待，保证时序精度
+
+IOReplayer::IOReplayer()
+	: m_ullReplayedRecords(0)
+{
+}
+
+IOReplayer::~IOReplayer()
+{
+	CloseAllClients();
+	m_engine.Stop();
+}
+
+bool IOReplayer::Run(const std::string &capturePath, const std::string &ipAddress, USHORT nPort, double dSpeed)
+{
+	IOCaptureReader reader;
+	if (!reader.Open(capturePath) || !m_engine.Start())
+	{
+		return false;
+	}
+
+	LARGE_INTEGER frequency, start;
+	::QueryPerformanceFrequency(&frequency);
+	::QueryPerformanceCounter(&start);
+
+	// 抓包时刻换算为本机QPC计数，并按倍速缩放
+	double dTickScale = 0.0;
+	if (dSpeed > 0.0 && reader.GetFrequency() > 0)
+	{
+		dTickScale = (double)frequency.QuadPart / (double)reader.GetFrequency() / dSpeed;
+	}
+
+	const std::vector<const IOCaptureRecord *> &records = reader.GetRecords();
+	LONGLONG llFirstTicks = records.empty() ? 0 : records.front()->llTicks;
+
+	for (size_t index = 0; index < records.size(); ++index)
+	{
+		const IOCaptureRecord *pRecord = records[index];
+		if (dTickScale > 0.0)
+		{
+			WaitUntil(start.QuadPart + (LONGLONG)((pRecord->llTicks - llFirstTicks) * dTickScale));
+		}
+
+		switch ((CAPTURE_RECORD_TYPE)pRecord->dwType)
+		{
+		case CAPTURE_RECORD_TYPE::CAPTURE_RECORD_OPEN:
+		{
+			GetClient(pRecord->ullConnId, ipAddress, nPort);
+		}
+		break;
+		case CAPTURE_RECORD_TYPE::CAPTURE_RECORD_DATA:
+		{
+			// 抓包开始前已建立的连接在首次收到数据时建立
+			ReplayClient *pClient = GetClient(pRecord->ullConnId, ipAddress, nPort);
+			if (pClient && pRecord->dwLen > 0 && pRecord->dwLen <= MAX_BUFFER_SIZE)
+			{
+				pClient->Send(pRecord->GetData(), (int)pRecord->dwLen);
+			}
+		}
+		break;
+		case CAPTURE_RECORD_TYPE::CAPTURE_RECORD_CLOSE:
+		{
+			CloseClient(pRecord->ullConnId);
+		}
+		break;
+		default:
+			break;
+		}
+
+		++m_ullReplayedRecords;
+	}
+
+	CloseAllClients();
+	return true;
+}
+
+void IOReplayer::WaitUntil(LONGLONG llTargetTicks)
+{
+	LARGE_INTEGER frequency, now;
+	::QueryPerformanceFrequency(&frequency);
+
+	for (;;)
+	{
+		::QueryPerformanceCounter(&now);
+		if (now.QuadPart >= llTargetTicks)
+		{
+			return;
+		}
+
+		LONGLONG llRemainMs = (llTargetTicks - now.QuadPart) * 1000 / frequency.QuadPart;
+		if (llRemainMs > REPLAY_SPIN_THRESHOLD_MS)
+		{
+			::Sleep((DWORD)(llRemainMs - REPLAY_SPIN_THRESHOLD_MS));
+		}
+		else
+		{
+			::SwitchToThread();
+		}
+	}
+}
+
+ReplayClient* IOReplayer::GetClient(ULONGLONG ullConnId, const std::string &ipAddress, USHORT nPort)
+{
+	std::map<ULONGLONG, ReplayClient *>::iterator iter = m_clients.find(ullConnId);
+	if (iter != m_clients.end())
+	{
+		return iter->second;
+	}
+
+	// 连接失败时同样登记(nullptr)，该连接后续的记录均被跳过
+	ReplayClient *pClient = new ReplayClient(&m_engine);
+	if (!pClient->Connect(ipAddress, nPort))
+	{
+		delete pClient;
+		pClient = nullptr;
+	}
+
+	m_clients[ullConnId] = pClient;
+	return pClient;
+}
+
+void IOReplayer::CloseClient(ULONGLONG ullConnId)
+{
+	std::map<ULONGLONG, ReplayClient *>::iterator iter = m_clients.find(ullConnId);
+	if (iter == m_clients.end())
+	{
+		return;
+	}
+
+	if (iter->second)
+	{
+		iter->second->DisConnect();
+		delete iter->second;
+	}
+	m_clients.erase(iter);
+}
+
+void IOReplayer::CloseAllClients()
+{
+	while (!m_clients.empty())
+	{
+		CloseClient(m_clients.begin()->first);
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef _TINY_IOCP_IOCPCLIENT_IREPLAY_H_
+#define _TINY_IOCP_IOCPCLIENT_IREPLAY_H_
+
+#include "iclient.h"
+#include "iocapture.h"
+#include <map>
+
+// 回放连接，只发送抓包数据，忽略服务端的响应
+class ReplayClient : public IClient
+{
+public:
+
+	explicit ReplayClient(IOEngine *pEngine) : IClient(pEngine) {}
+	~ReplayClient() {}
+
+public:
+
+	virtual void OnEstablished(IOSocketContext *pSocketContext) {}
+	virtual void OnClosed(IOSocketContext *pSocketContext) {}
+	virtual void OnError(IOSocketContext *pSocketContext, DWORD dwError) {}
+	virtual void OnRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext) {}
+	virtual void OnSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext) {}
+};
+
+// 抓包回放工具：读取IServer::StartCapture生成的抓包文件，按原始时序重建连接并发送数据
+// 每个抓包连接对应一个ReplayClient，所有回放连接共享同一个IO引擎
+class IOReplayer
+{
+public:
+
+	IOReplayer();
+	~IOReplayer();
+
+public:
+
+	// dSpeed为回放倍速，1.0为原始时序，大于1.0加速，小于等于0不等待
+	bool Run(const std::string &capturePath, const std::string &ipAddress, USHORT nPort, double dSpeed = 1.0);
+
+	ULONGLONG GetReplayedRecords() const
+	{
+		return m_ullReplayedRecords;
+	}
+
+private:
+
+	void WaitUntil(LONGLONG llTargetTicks);
+	ReplayClient* GetClient(ULONGLONG ullConnId, const std::string &ipAddress, USHORT nPort);
+	void CloseClient(ULONGLONG ullConnId);
+	void CloseAllClients();
+
+	IOReplayer(const IOReplayer&) = delete;
+	IOReplayer& operator= (const IOReplayer&) = delete;
+
+private:
+
+	IOEngine m_engine;								// 回放连接共享的IO引擎
+	std::map<ULONGLONG, ReplayClient *> m_clients;	// 抓包连接ID到回放连接的映射
+	ULONGLONG m_ullReplayedRecords;					// 已回放的记录数
+};
+
+#endif	// _TINY_IOCP_IOCPCLIENT_IREPLAY_H_
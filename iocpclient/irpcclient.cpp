@@ -0,0 +1,225 @@
+#include "pch.h"
+#include "irpcclient.h"
+
+IRpcClient::IRpcClient(DWORD dwMaxPending)
+	: IRpcClient(nullptr, dwMaxPending)
+{
+}
+
+IRpcClient::IRpcClient(IOEngine *pEngine, DWORD dwMaxPending)
+	: IClient(pEngine)
+	, m_pendingTable(dwMaxPending)
+	, m_sendLock("IRpcClient")
+	, m_ullCounterFrequency(1)
+{
+	LARGE_INTEGER frequency;
+	::QueryPerformanceFrequency(&frequency);
+	m_ullCounterFrequency = (ULONGLONG)frequency.QuadPart;
+
+	SetTimerPeriod(RPC_TIMER_PERIOD_MS);
+}
+
+IRpcClient::~IRpcClient()
+{
+	DisConnect();
+
+	// 子类已析构，不能再回调OnResponse
+	std::vector<IORpcPendingEntry> removed;
+	m_pendingTable.RemoveAll(removed);
+	for (size_t index = 0; index < removed.size(); ++index)
+	{
+		if (removed[index].pPromise)
+		{
+			Complete(removed[index], RPC_STATUS::RPC_STATUS_CLOSED, nullptr, 0);
+		}
+	}
+}
+
+ULONGLONG IRpcClient::Call(const char *pData, DWORD dwLen, DWORD dwTimeoutMs)
+{
+	return SendRequest(pData, dwLen, dwTimeoutMs, nullptr);
+}
+
+std::future<IORpcResponse> IRpcClient::CallAsync(const char *pData, DWORD dwLen, DWORD dwTimeoutMs)
+{
+	std::promise<IORpcResponse> *pPromise = new std::promise<IORpcResponse>();
+	std::future<IORpcResponse> future = pPromise->get_future();
+
+	// 未能发出时登记已撤回，promise仍归此处所有
+	if (RPC_INVALID_ID == SendRequest(pData, dwLen, dwTimeoutMs, pPromise))
+	{
+		IORpcPendingEntry entry = { RPC_INVALID_ID, 0, pPromise };
+		Complete(entry, RPC_STATUS::RPC_STATUS_SEND_FAILED, nullptr, 0);
+	}
+
+	return future;
+}
+
+bool IRpcClient::Reconnect(const std::string & ipAddress, USHORT nPort)
+{
+	// 等连接上下文销毁后才重置解析器：此前工作者线程可能仍在OnRecv中使用它
+	// 在途IO未能在超时内结束时不重连，解析器保持原样
+	if (!DisConnect())
+	{
+		return false;
+	}
+	FailAll(RPC_STATUS::RPC_STATUS_CLOSED);
+	m_decoder.Reset();
+
+	return Connect(ipAddress, nPort);
+}
+
+void IRpcClient::OnClosed(IOSocketContext *pSocketContext)
+{
+	FailAll(RPC_STATUS::RPC_STATUS_CLOSED);
+}
+
+void IRpcClient::OnError(IOSocketContext *pSocketContext, DWORD dwError)
+{
+	FailAll(RPC_STATUS::RPC_STATUS_CLOSED);
+}
+
+void IRpcClient::OnRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+{
+	m_decoder.Feed(pOverlappedContext->wsaBuffer.buf, pOverlappedContext->wsaBuffer.len);
+
+	RPC_PARSE_RESULT result = RPC_PARSE_RESULT::RPC_PARSE_INCOMPLETE;
+	while (RPC_PARSE_RESULT::RPC_PARSE_FRAME == (result = m_decoder.Next()))
+	{
+		// 已超时的请求的迟到响应直接丢弃
+		const IORpcFrame &frame = m_decoder.GetFrame();
+		IORpcPendingEntry entry;
+		if (m_pendingTable.Remove(frame.nCorrelationId, entry))
+		{
+			Complete(entry, RPC_STATUS::RPC_STATUS_OK, frame.pData, frame.dwLen);
+		}
+	}
+
+	m_decoder.EndFeed();
+
+	// 字节流已无法分帧，关闭连接后由recv的完成通知OnClosed/OnError
+	if (RPC_PARSE_RESULT::RPC_PARSE_ERROR == result)
+	{
+		::shutdown(pSocketContext->connSocket, SD_BOTH);
+	}
+}
+
+void IRpcClient::OnTimer(IOSocketContext *pSocketContext)
+{
+	m_expired.clear();
+	m_pendingTable.Expire(::GetTickCount64(), m_expired);
+	for (size_t index = 0; index < m_expired.size(); ++index)
+	{
+		Complete(m_expired[index], RPC_STATUS::RPC_STATUS_TIMEOUT, nullptr, 0);
+	}
+}
+
+ULONGLONG IRpcClient::SendRequest(const char *pData, DWORD dwLen, DWORD dwTimeoutMs, std::promise<IORpcResponse> *pPromise)
+{
+	if ((!pData && dwLen) || dwLen > RPC_MAX_PAYLOAD_SIZE)
+	{
+		return RPC_INVALID_ID;
+	}
+
+	ULONGLONG ullDeadline = dwTimeoutMs ? ::GetTickCount64() + dwTimeoutMs : 0;
+	LARGE_INTEGER start;
+	::QueryPerformanceCounter(&start);
+	ULONGLONG nCorrelationId = m_pendingTable.Add(ullDeadline, (ULONGLONG)start.QuadPart, pPromise);
+	if (RPC_INVALID_ID == nCorrelationId)
+	{
+		return RPC_INVALID_ID;
+	}
+
+	IOInlineSendScope inlineSendScope;
+	bool result = false;
+	{
+		AutoLock<EngineLock> lock(m_sendLock);
+		result = SendFrame(nCorrelationId, pData, dwLen);
+	}
+
+	if (result)
+	{
+		return nCorrelationId;
+	}
+
+	// 撤回失败说明请求已被连接关闭或超时检查完成，调用者会收到通知，仍返回关联ID
+	IORpcPendingEntry entry;
+	bool bWithdrawn = m_pendingTable.Remove(nCorrelationId, entry);
+
+	// 发送失败时连接已关闭，客户端主动关闭的连接不会回调OnClosed，其他在途请求在此完成
+	FailAll(RPC_STATUS::RPC_STATUS_CLOSED);
+
+	return bWithdrawn ? RPC_INVALID_ID : nCorrelationId;
+}
+
+bool IRpcClient::SendFrame(ULONGLONG nCorrelationId, const char *pData, DWORD dwLen)
+{
+	// 帧头与载荷的开头合并为一次投递，其余载荷按缓冲区大小依次投递
+	char buffer[MAX_BUFFER_SIZE];
+	DWORD dwHeaderLen = IORpcFrameDecoder::WriteHeader(buffer, nCorrelationId, dwLen);
+	DWORD dwFirst = dwLen;
+	if (dwFirst > MAX_BUFFER_SIZE - dwHeaderLen)
+	{
+		dwFirst = MAX_BUFFER_SIZE - dwHeaderLen;
+	}
+	if (dwFirst)
+	{
+		::memcpy(buffer + dwHeaderLen, pData, dwFirst);
+	}
+
+	if (!Send(buffer, (int)(dwHeaderLen + dwFirst)))
+	{
+		return false;
+	}
+
+	for (DWORD dwOffset = dwFirst; dwOffset < dwLen; dwOffset += MAX_BUFFER_SIZE)
+	{
+		DWORD dwChunk = dwLen - dwOffset;
+		if (dwChunk > MAX_BUFFER_SIZE)
+		{
+			dwChunk = MAX_BUFFER_SIZE;
+		}
+
+		if (!Send(pData + dwOffset, (int)dwChunk))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void IRpcClient::Complete(const IORpcPendingEntry &entry, RPC_STATUS status, const char *pData, DWORD dwLen)
+{
+	if (entry.ullStartCounter)
+	{
+		LARGE_INTEGER now;
+		::QueryPerformanceCounter(&now);
+		OnRequestDone(status, ((ULONGLONG)now.QuadPart - entry.ullStartCounter) * 1000000 / m_ullCounterFrequency);
+	}
+
+	if (!entry.pPromise)
+	{
+		OnResponse(entry.nCorrelationId, status, pData, dwLen);
+		return;
+	}
+
+	IORpcResponse response;
+	response.status = status;
+	if (pData && dwLen)
+	{
+		response.data.assign(pData, dwLen);
+	}
+	entry.pPromise->set_value(std::move(response));
+	delete entry.pPromise;
+}
+
+void IRpcClient::FailAll(RPC_STATUS status)
+{
+	std::vector<IORpcPendingEntry> removed;
+	m_pendingTable.RemoveAll(removed);
+	for (size_t index = 0; index < removed.size(); ++index)
+	{
+		Complete(removed[index], status, nullptr, 0);
+	}
+}
@@ -0,0 +1,77 @@
+#ifndef _TINY_IOCP_IOCPCLIENT_IRPCCLIENT_H_
+#define _TINY_IOCP_IOCPCLIENT_IRPCCLIENT_H_
+
+#include "iclient.h"
+#include "iorpc.h"
+
+// 请求/响应式RPC客户端抽象基类：每个请求帧携带关联ID，同一连接上可流水线发出大量请求而无需逐个等待响应
+// 响应按关联ID在无锁的在途请求表中找到对应请求，以OnResponse回调或future通知；响应顺序可与请求顺序不同
+// 请求期限由引擎的工作者线程定时检查(见IClient::SetTimerPeriod)，到期未响应的请求以RPC_STATUS_TIMEOUT完成
+// 服务端原样返回载荷并保留帧头中的关联ID即构成响应，回显服务端可直接用于压测
+class IRpcClient : public IClient
+{
+public:
+
+	// 发送请求，返回关联ID；响应、超时或连接关闭时以OnResponse通知，回调可能早于Call返回
+	// 可在任意线程调用；未能发出时返回RPC_INVALID_ID且不会回调；dwTimeoutMs为0时不超时
+	ULONGLONG Call(const char *pData, DWORD dwLen, DWORD dwTimeoutMs = RPC_DEFAULT_TIMEOUT_MS);
+
+	// 发送请求，结果通过future获取，不会回调OnResponse；未能发出时future立即就绪
+	std::future<IORpcResponse> CallAsync(const char *pData, DWORD dwLen, DWORD dwTimeoutMs = RPC_DEFAULT_TIMEOUT_MS);
+
+	LONG GetPendingCount() const
+	{
+		return m_pendingTable.GetPendingCount();
+	}
+
+	// 断开当前连接后重新连接，在途请求以RPC_STATUS_CLOSED完成，上一连接未解析完的数据被丢弃
+	// 不能与Call/CallAsync并发调用，也不能在工作者线程上调用；上一连接的在途IO未能结束时返回false
+	bool Reconnect(const std::string & ipAddress, USHORT nPort);
+
+public:
+
+	// 请求完成，status不为RPC_STATUS_OK时pData为nullptr；pData只在回调期间有效
+	virtual void OnResponse(ULONGLONG nCorrelationId, RPC_STATUS status, const char *pData, DWORD dwLen) = 0;
+
+	// 连接断开时在途请求均以RPC_STATUS_CLOSED完成，子类重写时应调用基类实现
+	virtual void OnEstablished(IOSocketContext *pSocketContext) {}
+	virtual void OnClosed(IOSocketContext *pSocketContext);
+	virtual void OnError(IOSocketContext *pSocketContext, DWORD dwError);
+
+private:
+
+	virtual void OnRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
+	virtual void OnSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext) {}
+	virtual void OnTimer(IOSocketContext *pSocketContext);
+
+	// 登记并发送请求，返回关联ID；未能发出时撤回登记并返回RPC_INVALID_ID
+	ULONGLONG SendRequest(const char *pData, DWORD dwLen, DWORD dwTimeoutMs, std::promise<IORpcResponse> *pPromise);
+
+	// 发送一帧，调用者需持有m_sendLock
+	bool SendFrame(ULONGLONG nCorrelationId, const char *pData, DWORD dwLen);
+
+	void Complete(const IORpcPendingEntry &entry, RPC_STATUS status, const char *pData, DWORD dwLen);
+	void FailAll(RPC_STATUS status);
+
+protected:
+
+	// 每个已发出的请求完成时调用，早于OnResponse或future就绪；ullLatencyUs为发出到完成的微秒数
+	// 在完成请求的线程上调用，可能与其他请求的完成并发
+	virtual void OnRequestDone(RPC_STATUS status, ULONGLONG ullLatencyUs) {}
+
+	explicit IRpcClient(DWORD dwMaxPending = RPC_DEFAULT_MAX_PENDING);
+	explicit IRpcClient(IOEngine *pEngine, DWORD dwMaxPending = RPC_DEFAULT_MAX_PENDING);
+
+	// 析构时仍在途的请求：future以RPC_STATUS_CLOSED就绪，回调方式的请求不再通知
+	virtual ~IRpcClient();
+
+private:
+
+	IORpcPendingTable m_pendingTable;		// 在途请求
+	IORpcFrameDecoder m_decoder;			// 响应帧解析，只在持有recv的工作线程上使用
+	EngineLock m_sendLock;					// 保证超过一个缓冲区的请求帧不与其他帧交错
+	std::vector<IORpcPendingEntry> m_expired;	// 超时检查的结果，只在OnTimer中使用
+	ULONGLONG m_ullCounterFrequency;		// QueryPerformanceCounter的频率
+};
+
+#endif	// _TINY_IOCP_IOCPCLIENT_IRPCCLIENT_H_
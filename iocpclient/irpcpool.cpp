@@ -0,0 +1,550 @@
+#include "pch.h"
+#include "irpcpool.h"
+#include <algorithm>
+
+#define RPC_POOL_SLOT_DOWN			(0)		// 连接未建立或已断开，等待维护线程重连
+#define RPC_POOL_SLOT_UP			(1)		// 连接可用
+#define RPC_POOL_SLOT_RECONNECTING	(2)		// 维护线程正在重连
+
+IRpcPoolConnection::IRpcPoolConnection(IRpcClientPool *pPool, IOEngine *pEngine, DWORD dwEndpoint, DWORD dwSlot)
+	: IRpcClient(pEngine)
+	, m_pPool(pPool)
+	, m_dwEndpoint(dwEndpoint)
+	, m_dwSlot(dwSlot)
+{
+}
+
+IRpcPoolConnection::~IRpcPoolConnection()
+{
+	DisConnect();
+}
+
+void IRpcPoolConnection::OnResponse(ULONGLONG nCorrelationId, RPC_STATUS status, const char *pData, DWORD dwLen)
+{
+	m_pPool->OnResponse(RPC_POOL_MAKE_ID(m_dwSlot, nCorrelationId), status, pData, dwLen);
+}
+
+void IRpcPoolConnection::OnClosed(IOSocketContext *pSocketContext)
+{
+	m_pPool->MarkDown(m_dwSlot);
+	IRpcClient::OnClosed(pSocketContext);
+}
+
+void IRpcPoolConnection::OnError(IOSocketContext *pSocketContext, DWORD dwError)
+{
+	m_pPool->MarkDown(m_dwSlot);
+	IRpcClient::OnError(pSocketContext, dwError);
+}
+
+void IRpcPoolConnection::OnRequestDone(RPC_STATUS status, ULONGLONG ullLatencyUs)
+{
+	m_pPool->RecordSample(m_dwEndpoint, status, ullLatencyUs);
+}
+
+IRpcClientPool::IRpcClientPool()
+	: IRpcClientPool(nullptr)
+{
+}
+
+IRpcClientPool::IRpcClientPool(IOEngine *pEngine)
+	: m_pEngine(pEngine ? pEngine : &m_ownEngine)
+	, m_pSlots(nullptr)
+	, m_dwSlotCount(0)
+	, m_dwConnectionsPerEndpoint(RPC_POOL_DEFAULT_CONNECTIONS)
+	, m_policy(RPC_BALANCE_POLICY::RPC_BALANCE_P2C)
+	, m_nNextScan(0)
+	, m_dMaxErrorRate(RPC_POOL_DEFAULT_MAX_ERROR_RATE)
+	, m_dMaxLatencyRatio(RPC_POOL_DEFAULT_MAX_LATENCY_RATIO)
+	, m_dwMaxEjectPercent(RPC_POOL_DEFAULT_MAX_EJECT_PERCENT)
+	, m_stopEvent(NULL)
+	, m_hMaintainThread(NULL)
+{
+}
+
+IRpcClientPool::~IRpcClientPool()
+{
+	Stop();
+
+	for (size_t index = 0; index < m_endpoints.size(); ++index)
+	{
+		delete m_endpoints[index];
+	}
+	m_endpoints.clear();
+}
+
+bool IRpcClientPool::AddEndpoint(const std::string & ipAddress, USHORT nPort)
+{
+	if (m_pSlots)
+	{
+		return false;
+	}
+
+	IRpcEndpoint *pEndpoint = new IRpcEndpoint();
+	pEndpoint->ipAddress = ipAddress;
+	pEndpoint->nPort = nPort;
+	pEndpoint->bEjected = 0;
+	pEndpoint->ullEjectUntil = 0;
+	pEndpoint->dwEjectCount = 0;
+	pEndpoint->nSamples = 0;
+	ResetStats(pEndpoint);
+
+	m_endpoints.push_back(pEndpoint);
+	return true;
+}
+
+void IRpcClientPool::SetConnectionsPerEndpoint(DWORD dwConnections)
+{
+	m_dwConnectionsPerEndpoint = dwConnections ? dwConnections : 1;
+}
+
+void IRpcClientPool::SetBalancePolicy(RPC_BALANCE_POLICY policy)
+{
+	m_policy = policy;
+}
+
+void IRpcClientPool::SetOutlierDetection(double dMaxErrorRate, double dMaxLatencyRatio, DWORD dwMaxEjectPercent)
+{
+	m_dMaxErrorRate = dMaxErrorRate;
+	m_dMaxLatencyRatio = dMaxLatencyRatio;
+	m_dwMaxEjectPercent = (dwMaxEjectPercent > 100) ? 100 : dwMaxEjectPercent;
+}
+
+bool IRpcClientPool::Start()
+{
+	if (m_pSlots || m_endpoints.empty() ||
+		m_endpoints.size() * m_dwConnectionsPerEndpoint > RPC_POOL_MAX_CONNECTIONS ||
+		!m_pEngine->Start())
+	{
+		return false;
+	}
+
+	m_dwSlotCount = (DWORD)m_endpoints.size() * m_dwConnectionsPerEndpoint;
+	m_pSlots = new IRpcPoolSlot[m_dwSlotCount];
+
+	// 同一后端的连接不相邻，使扫描顺序在后端之间交错
+	DWORD dwConnected = 0;
+	for (DWORD index = 0; index < m_dwSlotCount; ++index)
+	{
+		IRpcPoolSlot &slot = m_pSlots[index];
+		slot.dwEndpoint = index % (DWORD)m_endpoints.size();
+		slot.nUsers = 0;
+		slot.pConnection = new IRpcPoolConnection(this, m_pEngine, slot.dwEndpoint, index);
+
+		IRpcEndpoint *pEndpoint = m_endpoints[slot.dwEndpoint];
+		if (slot.pConnection->Connect(pEndpoint->ipAddress, pEndpoint->nPort))
+		{
+			slot.nState = RPC_POOL_SLOT_UP;
+			++dwConnected;
+		}
+		else
+		{
+			slot.nState = RPC_POOL_SLOT_DOWN;
+		}
+	}
+
+	m_stopEvent = ::CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	if (0 == dwConnected || NULL == m_stopEvent)
+	{
+		Stop();
+		return false;
+	}
+
+	m_hMaintainThread = ::CreateThread(0, 0, &IRpcClientPool::MaintainThreadProc, this, 0, 0);
+	if (NULL == m_hMaintainThread)
+	{
+		Stop();
+		return false;
+	}
+
+	return true;
+}
+
+bool IRpcClientPool::Stop()
+{
+	if (m_hMaintainThread)
+	{
+		::SetEvent(m_stopEvent);
+		::WaitForSingleObject(m_hMaintainThread, INFINITE);
+		::CloseHandle(m_hMaintainThread);
+		m_hMaintainThread = NULL;
+	}
+
+	if (m_stopEvent)
+	{
+		::CloseHandle(m_stopEvent);
+		m_stopEvent = NULL;
+	}
+
+	// 先断开所有连接并等各自的在途IO结束，之后引擎不会再向它们分发完成包，才能销毁
+	// 连接的关闭回调会访问槽位，所有连接都断开后才一并释放；有连接未能断开时全部保留，可在其他线程上再次调用
+	if (m_pSlots)
+	{
+		bool result = true;
+		for (DWORD index = 0; index < m_dwSlotCount; ++index)
+		{
+			if (!m_pSlots[index].pConnection->DisConnect())
+			{
+				result = false;
+			}
+		}
+		if (!result)
+		{
+			return false;
+		}
+
+		for (DWORD index = 0; index < m_dwSlotCount; ++index)
+		{
+			delete m_pSlots[index].pConnection;
+		}
+		delete []m_pSlots;
+		m_pSlots = nullptr;
+		m_dwSlotCount = 0;
+	}
+
+	if (m_pEngine == &m_ownEngine)
+	{
+		m_ownEngine.Stop();
+	}
+	return true;
+}
+
+ULONGLONG IRpcClientPool::Call(const char *pData, DWORD dwLen, DWORD dwTimeoutMs)
+{
+	DWORD dwSlot = Acquire();
+	if (dwSlot == m_dwSlotCount)
+	{
+		return RPC_INVALID_ID;
+	}
+
+	IRpcPoolConnection *pConnection = m_pSlots[dwSlot].pConnection;
+	ULONGLONG nCorrelationId = pConnection->Call(pData, dwLen, dwTimeoutMs);
+	if (RPC_INVALID_ID == nCorrelationId && !pConnection->IsConnected())
+	{
+		MarkDown(dwSlot);
+	}
+	Leave(dwSlot);
+
+	return (RPC_INVALID_ID == nCorrelationId) ? RPC_INVALID_ID : RPC_POOL_MAKE_ID(dwSlot, nCorrelationId);
+}
+
+std::future<IORpcResponse> IRpcClientPool::CallAsync(const char *pData, DWORD dwLen, DWORD dwTimeoutMs)
+{
+	DWORD dwSlot = Acquire();
+	if (dwSlot == m_dwSlotCount)
+	{
+		std::promise<IORpcResponse> promise;
+		IORpcResponse response;
+		response.status = RPC_STATUS::RPC_STATUS_SEND_FAILED;
+		promise.set_value(std::move(response));
+		return promise.get_future();
+	}
+
+	IRpcPoolConnection *pConnection = m_pSlots[dwSlot].pConnection;
+	std::future<IORpcResponse> future = pConnection->CallAsync(pData, dwLen, dwTimeoutMs);
+	if (!pConnection->IsConnected())
+	{
+		MarkDown(dwSlot);
+	}
+	Leave(dwSlot);
+
+	return future;
+}
+
+LONG IRpcClientPool::GetPendingCount() const
+{
+	LONG nPending = 0;
+	for (DWORD index = 0; index < m_dwSlotCount; ++index)
+	{
+		nPending += m_pSlots[index].pConnection->GetPendingCount();
+	}
+	return nPending;
+}
+
+bool IRpcClientPool::GetEndpointStats(DWORD dwEndpoint, IRpcEndpointStats &stats) const
+{
+	if (dwEndpoint >= m_endpoints.size())
+	{
+		return false;
+	}
+
+	IRpcEndpoint *pEndpoint = m_endpoints[dwEndpoint];
+	stats.dLatencyUs = pEndpoint->latencyUs.Load();
+	stats.dErrorRate = pEndpoint->errorRate.Load();
+	stats.ullCompleted = (ULONGLONG)pEndpoint->nSamples;
+	stats.dwEjectCount = pEndpoint->dwEjectCount;
+	stats.bEjected = (0 != pEndpoint->bEjected);
+
+	stats.dwConnected = 0;
+	for (DWORD index = 0; index < m_dwSlotCount; ++index)
+	{
+		if (m_pSlots[index].dwEndpoint == dwEndpoint && RPC_POOL_SLOT_UP == m_pSlots[index].nState)
+		{
+			++stats.dwConnected;
+		}
+	}
+
+	return true;
+}
+
+DWORD IRpcClientPool::Acquire()
+{
+	// 先只在未剔除的后端中选择，都不可用时退而使用被剔除的后端
+	for (int nPass = 0; nPass < 2; ++nPass)
+	{
+		bool bIgnoreEject = (1 == nPass);
+		DWORD dwSlot = (RPC_BALANCE_POLICY::RPC_BALANCE_P2C == m_policy) ?
+			PickTwoChoices(bIgnoreEject) : PickLeastPending(bIgnoreEject);
+
+		if (dwSlot < m_dwSlotCount && Enter(dwSlot))
+		{
+			return dwSlot;
+		}
+	}
+
+	return m_dwSlotCount;
+}
+
+DWORD IRpcClientPool::PickLeastPending(bool bIgnoreEject)
+{
+	DWORD dwBest = m_dwSlotCount;
+	LONG nBestPending = 0;
+
+	DWORD dwStart = (DWORD)::InterlockedIncrement(&m_nNextScan) % m_dwSlotCount;
+	for (DWORD index = 0; index < m_dwSlotCount; ++index)
+	{
+		DWORD dwSlot = (dwStart + index) % m_dwSlotCount;
+		if (!IsUsable(dwSlot, bIgnoreEject))
+		{
+			continue;
+		}
+
+		LONG nPending = m_pSlots[dwSlot].pConnection->GetPendingCount();
+		if (dwBest == m_dwSlotCount || nPending < nBestPending)
+		{
+			dwBest = dwSlot;
+			nBestPending = nPending;
+			if (0 == nPending)
+			{
+				break;
+			}
+		}
+	}
+
+	return dwBest;
+}
+
+DWORD IRpcClientPool::PickTwoChoices(bool bIgnoreEject)
+{
+	// 每个线程独立的xorshift随机数，避免共享状态
+	static thread_local ULONGLONG s_ullRandom = 0;
+	if (0 == s_ullRandom)
+	{
+		s_ullRandom = ((ULONGLONG)::GetCurrentThreadId() << 32) ^ ::GetTickCount64() ^ 0x9E3779B97F4A7C15ULL;
+	}
+
+	DWORD dwChoices[2];
+	DWORD dwFound = 0;
+	for (DWORD nTry = 0; nTry < m_dwSlotCount * 2 && dwFound < 2; ++nTry)
+	{
+		s_ullRandom ^= s_ullRandom << 13;
+		s_ullRandom ^= s_ullRandom >> 7;
+		s_ullRandom ^= s_ullRandom << 17;
+
+		DWORD dwSlot = (DWORD)(s_ullRandom % m_dwSlotCount);
+		if (IsUsable(dwSlot, bIgnoreEject) && (0 == dwFound || dwChoices[0] != dwSlot))
+		{
+			dwChoices[dwFound++] = dwSlot;
+		}
+	}
+
+	// 可用连接很少时随机取不到两个，退化为完整扫描
+	if (dwFound < 2)
+	{
+		return PickLeastPending(bIgnoreEject);
+	}
+
+	return (m_pSlots[dwChoices[1]].pConnection->GetPendingCount() < m_pSlots[dwChoices[0]].pConnection->GetPendingCount()) ?
+		dwChoices[1] : dwChoices[0];
+}
+
+bool IRpcClientPool::IsUsable(DWORD dwSlot, bool bIgnoreEject) const
+{
+	const IRpcPoolSlot &slot = m_pSlots[dwSlot];
+	return (RPC_POOL_SLOT_UP == slot.nState) && (bIgnoreEject || !m_endpoints[slot.dwEndpoint]->bEjected);
+}
+
+bool IRpcClientPool::Enter(DWORD dwSlot)
+{
+	IRpcPoolSlot &slot = m_pSlots[dwSlot];
+	::InterlockedIncrement(&slot.nUsers);
+	if (RPC_POOL_SLOT_UP != slot.nState)
+	{
+		::InterlockedDecrement(&slot.nUsers);
+		return false;
+	}
+	return true;
+}
+
+void IRpcClientPool::Leave(DWORD dwSlot)
+{
+	::InterlockedDecrement(&m_pSlots[dwSlot].nUsers);
+}
+
+void IRpcClientPool::MarkDown(DWORD dwSlot)
+{
+	// 重连中的连接由维护线程决定最终状态
+	::InterlockedCompareExchange(&m_pSlots[dwSlot].nState, RPC_POOL_SLOT_DOWN, RPC_POOL_SLOT_UP);
+}
+
+void IRpcClientPool::RecordSample(DWORD dwEndpoint, RPC_STATUS status, ULONGLONG ullLatencyUs)
+{
+	// 每个请求完成时都会调用，同一后端的各连接在不同工作者线程上并发更新，不加锁
+	IRpcEndpoint *pEndpoint = m_endpoints[dwEndpoint];
+	bool bError = (RPC_STATUS::RPC_STATUS_OK != status);
+	pEndpoint->errorRate.AddSample(bError ? 1.0 : 0.0, RPC_POOL_EWMA_WEIGHT, false);
+
+	// 只有成功的请求计入延迟，超时的请求已计入错误率
+	if (!bError)
+	{
+		pEndpoint->latencyUs.AddSample((double)ullLatencyUs, RPC_POOL_EWMA_WEIGHT, true);
+	}
+
+	::InterlockedIncrement64(&pEndpoint->nSamples);
+}
+
+DWORD WINAPI IRpcClientPool::MaintainThreadProc(LPVOID lpParam)
+{
+	IRpcClientPool *pPool = (IRpcClientPool *)lpParam;
+	while (WAIT_TIMEOUT == ::WaitForSingleObject(pPool->m_stopEvent, RPC_POOL_MAINTAIN_PERIOD_MS))
+	{
+		ULONGLONG ullNow = ::GetTickCount64();
+		pPool->DetectOutliers(ullNow);
+		pPool->ReconnectSlots(ullNow);
+	}
+
+	return 0;
+}
+
+void IRpcClientPool::DetectOutliers(ULONGLONG ullNow)
+{
+	// 剔除期满的后端以空白统计重新接入
+	for (DWORD index = 0; index < m_endpoints.size(); ++index)
+	{
+		IRpcEndpoint *pEndpoint = m_endpoints[index];
+		if (pEndpoint->bEjected && ullNow >= pEndpoint->ullEjectUntil)
+		{
+			ResetStats(pEndpoint);
+			::InterlockedExchange(&pEndpoint->bEjected, 0);
+			OnEndpointEjected(index, false);
+		}
+	}
+
+	// 健康后端的延迟中位数，取偏低的一个，两个后端时以较快者为基准
+	std::vector<double> latencies;
+	std::vector<IRpcEndpointStats> stats(m_endpoints.size());
+	for (DWORD index = 0; index < m_endpoints.size(); ++index)
+	{
+		IRpcEndpoint *pEndpoint = m_endpoints[index];
+		stats[index].dLatencyUs = pEndpoint->latencyUs.Load();
+		stats[index].dErrorRate = pEndpoint->errorRate.Load();
+		stats[index].ullCompleted = (ULONGLONG)pEndpoint->nSamples;
+
+		if (!pEndpoint->bEjected && stats[index].ullCompleted >= RPC_POOL_MIN_SAMPLES && stats[index].dLatencyUs > 0.0)
+		{
+			latencies.push_back(stats[index].dLatencyUs);
+		}
+	}
+
+	double dMedianUs = 0.0;
+	if (!latencies.empty())
+	{
+		std::vector<double>::iterator median = latencies.begin() + (latencies.size() - 1) / 2;
+		std::nth_element(latencies.begin(), median, latencies.end());
+		dMedianUs = *median;
+	}
+
+	for (DWORD index = 0; index < m_endpoints.size(); ++index)
+	{
+		if (m_endpoints[index]->bEjected || stats[index].ullCompleted < RPC_POOL_MIN_SAMPLES)
+		{
+			continue;
+		}
+
+		bool bOutlier = (stats[index].dErrorRate > m_dMaxErrorRate) ||
+			(dMedianUs > 0.0 && stats[index].dLatencyUs >= RPC_POOL_MIN_LATENCY_US &&
+			stats[index].dLatencyUs > dMedianUs * m_dMaxLatencyRatio);
+		if (bOutlier)
+		{
+			TryEject(index, ullNow);
+		}
+	}
+}
+
+void IRpcClientPool::ReconnectSlots(ULONGLONG ullNow)
+{
+	for (DWORD index = 0; index < m_dwSlotCount; ++index)
+	{
+		IRpcPoolSlot &slot = m_pSlots[index];
+		IRpcEndpoint *pEndpoint = m_endpoints[slot.dwEndpoint];
+		if (pEndpoint->bEjected ||
+			RPC_POOL_SLOT_DOWN != ::InterlockedCompareExchange(&slot.nState, RPC_POOL_SLOT_RECONNECTING, RPC_POOL_SLOT_DOWN))
+		{
+			continue;
+		}
+
+		// 等待已进入的调用者离开，之后不会再有调用者使用该连接
+		while (slot.nUsers > 0)
+		{
+			::SwitchToThread();
+		}
+
+		if (slot.pConnection->Reconnect(pEndpoint->ipAddress, pEndpoint->nPort))
+		{
+			::InterlockedExchange(&slot.nState, RPC_POOL_SLOT_UP);
+		}
+		else
+		{
+			// 连接被拒绝说明后端不可用，直接剔除，避免每个周期都重试
+			::InterlockedExchange(&slot.nState, RPC_POOL_SLOT_DOWN);
+			TryEject(slot.dwEndpoint, ullNow);
+		}
+	}
+}
+
+bool IRpcClientPool::TryEject(DWORD dwEndpoint, ULONGLONG ullNow)
+{
+	IRpcEndpoint *pEndpoint = m_endpoints[dwEndpoint];
+	if (pEndpoint->bEjected)
+	{
+		return true;
+	}
+
+	DWORD dwEjected = 0;
+	for (size_t index = 0; index < m_endpoints.size(); ++index)
+	{
+		if (m_endpoints[index]->bEjected)
+		{
+			++dwEjected;
+		}
+	}
+
+	if ((dwEjected + 1) * 100 > m_endpoints.size() * m_dwMaxEjectPercent)
+	{
+		return false;
+	}
+
+	++pEndpoint->dwEjectCount;
+	DWORD dwFactor = (pEndpoint->dwEjectCount < RPC_POOL_MAX_EJECT_FACTOR) ? pEndpoint->dwEjectCount : RPC_POOL_MAX_EJECT_FACTOR;
+	pEndpoint->ullEjectUntil = ullNow + (ULONGLONG)RPC_POOL_BASE_EJECT_MS * dwFactor;
+	::InterlockedExchange(&pEndpoint->bEjected, 1);
+
+	OnEndpointEjected(dwEndpoint, true);
+	return true;
+}
+
+void IRpcClientPool::ResetStats(IRpcEndpoint *pEndpoint)
+{
+	pEndpoint->latencyUs.Store(0.0);
+	pEndpoint->errorRate.Store(0.0);
+	::InterlockedExchange64(&pEndpoint->nSamples, 0);
+}
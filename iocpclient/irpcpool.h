@@ -0,0 +1,248 @@
+#ifndef _TINY_IOCP_IOCPCLIENT_IRPCPOOL_H_
+#define _TINY_IOCP_IOCPCLIENT_IRPCPOOL_H_
+
+#include "irpcclient.h"
+#include "iolock.h"
+#include <string>
+#include <vector>
+
+#define RPC_POOL_DEFAULT_CONNECTIONS		(2)			// 每个后端默认的连接数
+#define RPC_POOL_MAX_CONNECTIONS			(0xFFFF)	// 连接总数上限
+#define RPC_POOL_ID_SHIFT					(48)		// 连接池请求ID中连接序号的位置，低位为该连接上的关联ID
+#define RPC_POOL_MAINTAIN_PERIOD_MS			(100)		// 维护线程检查离群后端与断开连接的周期(毫秒)
+#define RPC_POOL_EWMA_WEIGHT				(0.05)		// 延迟与错误率的指数滑动平均中新样本的权重
+#define RPC_POOL_MIN_SAMPLES				(50)		// 后端至少完成这么多请求后才参与离群判定
+#define RPC_POOL_DEFAULT_MAX_ERROR_RATE		(0.5)		// 默认的错误率剔除阈值
+#define RPC_POOL_DEFAULT_MAX_LATENCY_RATIO	(3.0)		// 默认的延迟剔除阈值：平均延迟超过健康后端中位数的倍数
+#define RPC_POOL_MIN_LATENCY_US				(1000)		// 平均延迟低于此值(微秒)的后端不因延迟被剔除，避免微秒级抖动误判
+#define RPC_POOL_DEFAULT_MAX_EJECT_PERCENT	(50)		// 默认最多剔除的后端比例(百分比)
+#define RPC_POOL_BASE_EJECT_MS				(5000)		// 首次剔除的时长(毫秒)，再次剔除按次数倍增
+#define RPC_POOL_MAX_EJECT_FACTOR			(8)			// 剔除时长的最大倍数
+
+#define RPC_POOL_MAKE_ID(dwSlot, nCorrelationId)	(((ULONGLONG)(dwSlot) << RPC_POOL_ID_SHIFT) | (nCorrelationId))
+
+//	为请求选择连接的策略
+enum class RPC_BALANCE_POLICY
+{
+	RPC_BALANCE_LEAST_PENDING = 0,	// 所有可用连接中在途请求最少的一个
+	RPC_BALANCE_P2C,				// 随机取两个可用连接，选在途请求较少的一个(power of two choices)
+};
+
+// 后端的统计快照
+struct IRpcEndpointStats
+{
+	double dLatencyUs;			// 成功请求延迟的滑动平均(微秒)
+	double dErrorRate;			// 超时与连接断开的滑动平均比例
+	ULONGLONG ullCompleted;		// 本次接入以来完成的请求数
+	DWORD dwConnected;			// 已建立的连接数
+	DWORD dwEjectCount;			// 累计被剔除的次数
+	bool bEjected;				// 当前是否被剔除
+};
+
+// 可在多个线程上无锁更新的double，以64位整数的位模式存放
+class IRpcAtomicDouble
+{
+public:
+
+	IRpcAtomicDouble()
+		: m_llBits(0)
+	{
+	}
+
+	double Load() const
+	{
+		return FromBits(m_llBits);
+	}
+
+	void Store(double dValue)
+	{
+		::InterlockedExchange64(&m_llBits, ToBits(dValue));
+	}
+
+	// 以权重dWeight把样本并入滑动平均；bSeed时尚无样本(值不大于0)直接取样本值
+	void AddSample(double dSample, double dWeight, bool bSeed)
+	{
+		for (;;)
+		{
+			LONG64 llOld = m_llBits;
+			double dOld = FromBits(llOld);
+			double dNew = (bSeed && dOld <= 0.0) ? dSample : dOld + dWeight * (dSample - dOld);
+			if (llOld == ::InterlockedCompareExchange64(&m_llBits, ToBits(dNew), llOld))
+			{
+				return;
+			}
+		}
+	}
+
+private:
+
+	static LONG64 ToBits(double dValue)
+	{
+		LONG64 llBits = 0;
+		::memcpy(&llBits, &dValue, sizeof(llBits));
+		return llBits;
+	}
+
+	static double FromBits(LONG64 llBits)
+	{
+		double dValue = 0.0;
+		::memcpy(&dValue, &llBits, sizeof(dValue));
+		return dValue;
+	}
+
+private:
+
+	volatile LONG64 m_llBits;
+};
+
+class IRpcClientPool;
+
+// 连接池中的一条连接，完成通知与统计转交给连接池
+class IRpcPoolConnection : public IRpcClient
+{
+public:
+
+	IRpcPoolConnection(IRpcClientPool *pPool, IOEngine *pEngine, DWORD dwEndpoint, DWORD dwSlot);
+	virtual ~IRpcPoolConnection();
+
+public:
+
+	virtual void OnResponse(ULONGLONG nCorrelationId, RPC_STATUS status, const char *pData, DWORD dwLen);
+	virtual void OnClosed(IOSocketContext *pSocketContext);
+	virtual void OnError(IOSocketContext *pSocketContext, DWORD dwError);
+
+protected:
+
+	virtual void OnRequestDone(RPC_STATUS status, ULONGLONG ullLatencyUs);
+
+private:
+
+	IRpcClientPool *m_pPool;
+	DWORD m_dwEndpoint;			// 所属后端的序号
+	DWORD m_dwSlot;				// 在连接池中的序号
+};
+
+// RPC客户端连接池：对每个后端保持若干条IRpcClient连接，按在途请求数为每个请求选择连接
+// 每个后端统计延迟与错误率的滑动平均，维护线程定期把错误率过高或延迟远高于其他后端的后端剔除一段时间，
+// 期满后重新接入；断开的连接也由维护线程重连。所有连接共用一个IO引擎
+class IRpcClientPool
+{
+public:
+
+	// 以下设置需在Start之前调用
+	bool AddEndpoint(const std::string & ipAddress, USHORT nPort = 9988);
+	void SetConnectionsPerEndpoint(DWORD dwConnections);
+	void SetBalancePolicy(RPC_BALANCE_POLICY policy);
+
+	// dMaxErrorRate：错误率超过此值时剔除；dMaxLatencyRatio：平均延迟超过健康后端中位数的此倍数时剔除
+	// 被剔除的后端数不超过总数的dwMaxEjectPercent%，因此只有一个后端时不会剔除
+	void SetOutlierDetection(double dMaxErrorRate, double dMaxLatencyRatio, DWORD dwMaxEjectPercent);
+
+	// 建立到所有后端的连接并启动维护线程，至少一条连接建立时返回true
+	bool Start();
+
+	// 停止维护线程并断开所有连接，子类应在析构前调用；不能与Call/CallAsync并发调用
+	// 有连接的在途IO未在CONTEXT_DRAIN_TIMEOUT内结束(或在工作者线程上调用)时不销毁任何连接并返回false，引擎仍可能向其分发完成包
+	bool Stop();
+
+	// 选择一条连接发送请求，返回连接池请求ID(高位为连接序号，低位为关联ID)，完成时以OnResponse通知
+	// 所有后端均被剔除时仍使用其中可用的连接；没有可用连接时返回RPC_INVALID_ID且不会回调
+	ULONGLONG Call(const char *pData, DWORD dwLen, DWORD dwTimeoutMs = RPC_DEFAULT_TIMEOUT_MS);
+
+	// 选择一条连接发送请求，结果通过future获取
+	std::future<IORpcResponse> CallAsync(const char *pData, DWORD dwLen, DWORD dwTimeoutMs = RPC_DEFAULT_TIMEOUT_MS);
+
+	LONG GetPendingCount() const;
+
+	DWORD GetEndpointCount() const
+	{
+		return (DWORD)m_endpoints.size();
+	}
+
+	bool GetEndpointStats(DWORD dwEndpoint, IRpcEndpointStats &stats) const;
+
+public:
+
+	// 请求完成，参数含义同IRpcClient::OnResponse
+	virtual void OnResponse(ULONGLONG nRequestId, RPC_STATUS status, const char *pData, DWORD dwLen) = 0;
+
+	// 后端被剔除或重新接入，在维护线程上回调
+	virtual void OnEndpointEjected(DWORD dwEndpoint, bool bEjected) {}
+
+protected:
+
+	IRpcClientPool();
+	explicit IRpcClientPool(IOEngine *pEngine);
+	virtual ~IRpcClientPool();
+
+private:
+
+	friend class IRpcPoolConnection;
+
+	// 后端的地址与健康状态，统计由完成请求的工作者线程无锁更新(各字段分别原子更新，读者看到的不一定是同一时刻的组合)，
+	// 剔除状态只由维护线程修改
+	struct IRpcEndpoint
+	{
+		std::string ipAddress;
+		USHORT nPort;
+		IRpcAtomicDouble latencyUs;	// 成功请求延迟的滑动平均(微秒)
+		IRpcAtomicDouble errorRate;	// 错误率的滑动平均
+		volatile LONG64 nSamples;	// 本次接入以来的样本数
+		volatile LONG bEjected;
+		ULONGLONG ullEjectUntil;	// 剔除期满的GetTickCount64时间
+		DWORD dwEjectCount;
+	};
+
+	// 连接槽位：调用者进入前先增加nUsers再确认状态，重连前先改为重连状态再等待nUsers归零，
+	// 因此重连时没有调用者在使用该连接
+	struct IRpcPoolSlot
+	{
+		IRpcPoolConnection *pConnection;
+		DWORD dwEndpoint;
+		volatile LONG nState;
+		volatile LONG nUsers;
+	};
+
+	// 选择并进入一个可用连接，返回槽位序号，没有可用连接时返回m_dwSlotCount
+	DWORD Acquire();
+	DWORD PickLeastPending(bool bIgnoreEject);
+	DWORD PickTwoChoices(bool bIgnoreEject);
+	bool IsUsable(DWORD dwSlot, bool bIgnoreEject) const;
+	bool Enter(DWORD dwSlot);
+	void Leave(DWORD dwSlot);
+
+	// 由IRpcPoolConnection回调
+	void MarkDown(DWORD dwSlot);
+	void RecordSample(DWORD dwEndpoint, RPC_STATUS status, ULONGLONG ullLatencyUs);
+
+	// 维护线程
+	static DWORD WINAPI MaintainThreadProc(LPVOID lpParam);
+	void DetectOutliers(ULONGLONG ullNow);
+	void ReconnectSlots(ULONGLONG ullNow);
+	bool TryEject(DWORD dwEndpoint, ULONGLONG ullNow);
+	void ResetStats(IRpcEndpoint *pEndpoint);
+
+	IRpcClientPool(const IRpcClientPool&) = delete;
+	IRpcClientPool& operator= (const IRpcClientPool&) = delete;
+
+private:
+
+	IOEngine m_ownEngine;					// 私有引擎，未传入共享引擎时使用
+	IOEngine *m_pEngine;					// 所有连接共用的引擎
+
+	std::vector<IRpcEndpoint*> m_endpoints;
+	IRpcPoolSlot *m_pSlots;
+	DWORD m_dwSlotCount;
+	DWORD m_dwConnectionsPerEndpoint;
+	RPC_BALANCE_POLICY m_policy;
+	volatile LONG m_nNextScan;				// 最少在途策略的扫描起点，使在途数相同的连接轮流被选中
+
+	double m_dMaxErrorRate;
+	double m_dMaxLatencyRatio;
+	DWORD m_dwMaxEjectPercent;
+
+	HANDLE m_stopEvent;						// 通知维护线程退出的事件
+	HANDLE m_hMaintainThread;
+};
+
+#endif	// _TINY_IOCP_IOCPCLIENT_IRPCPOOL_H_
@@ -4,6 +4,11 @@
 #include "pch.h"
 #include <iostream>
 #include "iclient.h"
+#include "ireplay.h"
+#include "irpcclient.h"
+#include "irpcpool.h"
+#include <vector>
+#include <algorithm>
 
 class ConcreteClient : public IClient
 {
@@ -31,7 +36,7 @@ public:
 
 	virtual void OnRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
 	{
-		printf("Received data: %s\n", pOverlappedContext->wsaBuffer.buf);
+		printf("Received data: %.*s\n", (int)pOverlappedContext->wsaBuffer.len, pOverlappedContext->wsaBuffer.buf);
 	}
 
 	virtual void OnSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
@@ -41,10 +46,476 @@ public:
 
 };
 
-int main()
+// 往返延迟测试：每次发送一条小消息，收到服务端完整回显后再发送下一条
+class PingClient : public IClient
 {
+public:
+
+	PingClient()
+		: m_nReceivedBytes(0)
+	{
+		m_recvEvent = ::CreateEvent(nullptr, FALSE, FALSE, nullptr);
+	}
+
+	~PingClient()
+	{
+		DisConnect();
+		::CloseHandle(m_recvEvent);
+	}
+
+public:
+
+	virtual void OnEstablished(IOSocketContext *pSocketContext) {}
+	virtual void OnClosed(IOSocketContext *pSocketContext) {}
+	virtual void OnError(IOSocketContext *pSocketContext, DWORD dwError) {}
+	virtual void OnSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext) {}
+
+	virtual void OnRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+	{
+		::InterlockedExchangeAdd64(&m_nReceivedBytes, (LONG64)pOverlappedContext->wsaBuffer.len);
+		::SetEvent(m_recvEvent);
+	}
+
+	// 等待累计收到nBytes字节；忙轮询模式下主线程同样自旋，否则阻塞在事件上
+	bool WaitReceived(LONG64 nBytes, bool bSpin)
+	{
+		ULONGLONG ullDeadline = ::GetTickCount64() + 1000;
+		while (m_nReceivedBytes < nBytes)
+		{
+			if (::GetTickCount64() > ullDeadline)
+			{
+				return false;
+			}
+
+			if (bSpin)
+			{
+				YieldProcessor();
+			}
+			else
+			{
+				::WaitForSingleObject(m_recvEvent, 100);
+			}
+		}
+		return true;
+	}
+
+	LONG64 GetReceivedBytes() const { return m_nReceivedBytes; }
+
+private:
+
+	volatile LONG64 m_nReceivedBytes;
+	HANDLE m_recvEvent;
+};
+
+// 切换服务端的忙轮询，使两端在同一轮中同时关闭或开启；服务端未运行(事件不存在)时返回false
+// 服务端在主线程中处理事件，稍等片刻使其生效后再开始测量
+static bool SetServerBusyPoll(bool bEnable)
+{
+	HANDLE hEvent = ::OpenEvent(EVENT_MODIFY_STATE, FALSE, bEnable ? L"BusyPollOnEvent" : L"BusyPollOffEvent");
+	if (!hEvent)
+	{
+		return false;
+	}
+
+	::SetEvent(hEvent);
+	::CloseHandle(hEvent);
+	::Sleep(100);
+	return true;
+}
+
+// 分别在关闭/开启忙轮询时运行，对比唤醒延迟，服务端应以--quiet --busy-poll <微秒>启动
+// 每轮开始前经命名事件令服务端的引擎随客户端一同关闭/开启忙轮询，两轮对比的是两端都轮询与都不轮询
+// 指定szUnixPath时经AF_UNIX连接，对比同机TCP环回与AF_UNIX的往返延迟(服务端以--unix启动)
+// 指定szShmName时经共享内存连接(服务端以--shm启动)，接收方登记等待前按dwSpinUs忙轮询
+static bool RunPing(int nCount, DWORD dwSpinUs, const char *szUnixPath = nullptr, const char *szShmName = nullptr)
+{
+	PingClient client;
+	if (dwSpinUs)
+	{
+		client.EnableBusyPoll(dwSpinUs);
+	}
+
+	if (!SetServerBusyPoll(dwSpinUs > 0))
+	{
+		std::cout << "server busy poll control unavailable, only the client side is toggled" << std::endl;
+	}
+
+	bool bConnected = false;
+	if (szShmName)
+	{
+		bConnected = client.ConnectShm(szShmName, dwSpinUs);
+	}
+	else
+	{
+		bConnected = szUnixPath ? client.ConnectUnix(szUnixPath) : client.Connect("127.0.0.1", 9988);
+	}
+
+	if (!bConnected)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER frequency, start, end;
+	::QueryPerformanceFrequency(&frequency);
+
+	const char msg[16] = "ping";
+	std::vector<double> rtts;
+	rtts.reserve(nCount);
+
+	for (int index = 0; index < nCount; ++index)
+	{
+		LONG64 nExpected = client.GetReceivedBytes() + sizeof(msg);
+		::QueryPerformanceCounter(&start);
+		if (!client.Send(msg, sizeof(msg)) || !client.WaitReceived(nExpected, dwSpinUs > 0))
+		{
+			break;
+		}
+		::QueryPerformanceCounter(&end);
+		rtts.push_back((double)(end.QuadPart - start.QuadPart) * 1000000.0 / (double)frequency.QuadPart);
+	}
+
+	if (rtts.empty())
+	{
+		return false;
+	}
+
+	std::sort(rtts.begin(), rtts.end());
+	printf("%s, busy poll %s: %u round trips, min %.1fus, p50 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus\n",
+		szShmName ? "shm" : (szUnixPath ? "unix" : "tcp"),
+		dwSpinUs ? "on" : "off",
+		(unsigned int)rtts.size(),
+		rtts.front(),
+		rtts[rtts.size() / 2],
+		rtts[rtts.size() * 99 / 100],
+		rtts[rtts.size() * 999 / 1000],
+		rtts.back());
+	client.GetBusyPoller().Dump(stdout);
+	return true;
+}
+
+// 流水线RPC压测：保持nWindow个请求在途，每收到一个响应就发出下一个，服务端应以--quiet启动的回显服务端
+class RpcBenchClient : public IRpcClient
+{
+public:
+
+	RpcBenchClient(int nTotal, DWORD dwPayloadLen)
+		: m_nTotal(nTotal)
+		, m_nIssued(0)
+		, m_nCompleted(0)
+		, m_nTimeouts(0)
+		, m_nFailed(0)
+		, m_payload(dwPayloadLen, 'r')
+	{
+		m_doneEvent = ::CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	}
+
+	~RpcBenchClient()
+	{
+		DisConnect();
+		::CloseHandle(m_doneEvent);
+	}
+
+public:
+
+	// 发出下一个请求，全部发出后返回false
+	bool IssueNext()
+	{
+		if (::InterlockedIncrement(&m_nIssued) > m_nTotal)
+		{
+			return false;
+		}
+
+		if (RPC_INVALID_ID == Call(m_payload.data(), (DWORD)m_payload.size(), 1000))
+		{
+			::InterlockedIncrement(&m_nFailed);
+			Finish();
+		}
+		return true;
+	}
+
+	virtual void OnResponse(ULONGLONG nCorrelationId, RPC_STATUS status, const char *pData, DWORD dwLen)
+	{
+		if (RPC_STATUS::RPC_STATUS_TIMEOUT == status)
+		{
+			::InterlockedIncrement(&m_nTimeouts);
+		}
+		else if (RPC_STATUS::RPC_STATUS_OK != status || dwLen != m_payload.size())
+		{
+			::InterlockedIncrement(&m_nFailed);
+		}
+		Finish();
+		IssueNext();
+	}
+
+	bool Wait(DWORD dwTimeoutMs)
+	{
+		return WAIT_OBJECT_0 == ::WaitForSingleObject(m_doneEvent, dwTimeoutMs);
+	}
+
+	LONG GetTimeouts() const { return m_nTimeouts; }
+	LONG GetFailed() const { return m_nFailed; }
+
+private:
+
+	void Finish()
+	{
+		if (::InterlockedIncrement(&m_nCompleted) == m_nTotal)
+		{
+			::SetEvent(m_doneEvent);
+		}
+	}
+
+private:
+
+	LONG m_nTotal;
+	volatile LONG m_nIssued;
+	volatile LONG m_nCompleted;
+	volatile LONG m_nTimeouts;
+	volatile LONG m_nFailed;
+	std::string m_payload;
+	HANDLE m_doneEvent;
+};
+
+static bool RunRpc(int nTotal, int nWindow, DWORD dwPayloadLen)
+{
+	RpcBenchClient client(nTotal, dwPayloadLen);
+	if (!client.Connect("127.0.0.1", 9988))
+	{
+		return false;
+	}
+
+	LARGE_INTEGER frequency, start, end;
+	::QueryPerformanceFrequency(&frequency);
+	::QueryPerformanceCounter(&start);
+
+	for (int index = 0; index < nWindow && client.IssueNext(); ++index)
+	{
+	}
+
+	bool bDone = client.Wait(60000);
+	::QueryPerformanceCounter(&end);
+
+	double dSeconds = (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+	printf("rpc: %d requests, window %d, payload %lu bytes, %.3fs, %.0f req/s, timeouts %ld, failed %ld%s\n",
+		nTotal, nWindow, dwPayloadLen, dSeconds, dSeconds > 0.0 ? nTotal / dSeconds : 0.0,
+		client.GetTimeouts(), client.GetFailed(), bDone ? "" : " (incomplete)");
+	return bDone;
+}
+
+// 连接池压测：请求按P2C分散到多个后端，结束后输出各后端的延迟、错误率与剔除次数
+class PoolBenchClient : public IRpcClientPool
+{
+public:
+
+	explicit PoolBenchClient(int nTotal)
+		: m_nTotal(nTotal)
+		, m_nIssued(0)
+		, m_nCompleted(0)
+		, m_nFailed(0)
+		, m_payload(64, 'p')
+	{
+		m_doneEvent = ::CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	}
+
+	~PoolBenchClient()
+	{
+		Stop();
+		::CloseHandle(m_doneEvent);
+	}
+
+public:
+
+	bool IssueNext()
+	{
+		if (::InterlockedIncrement(&m_nIssued) > m_nTotal)
+		{
+			return false;
+		}
+
+		if (RPC_INVALID_ID == Call(m_payload.data(), (DWORD)m_payload.size(), 1000))
+		{
+			::InterlockedIncrement(&m_nFailed);
+			Finish();
+		}
+		return true;
+	}
+
+	virtual void OnResponse(ULONGLONG nRequestId, RPC_STATUS status, const char *pData, DWORD dwLen)
+	{
+		if (RPC_STATUS::RPC_STATUS_OK != status)
+		{
+			::InterlockedIncrement(&m_nFailed);
+		}
+		Finish();
+		IssueNext();
+	}
+
+	virtual void OnEndpointEjected(DWORD dwEndpoint, bool bEjected)
+	{
+		printf("endpoint %lu %s\n", dwEndpoint, bEjected ? "ejected" : "readmitted");
+	}
+
+	bool Wait(DWORD dwTimeoutMs)
+	{
+		return WAIT_OBJECT_0 == ::WaitForSingleObject(m_doneEvent, dwTimeoutMs);
+	}
+
+	LONG GetFailed() const { return m_nFailed; }
+
+private:
+
+	void Finish()
+	{
+		if (::InterlockedIncrement(&m_nCompleted) == m_nTotal)
+		{
+			::SetEvent(m_doneEvent);
+		}
+	}
+
+private:
+
+	LONG m_nTotal;
+	volatile LONG m_nIssued;
+	volatile LONG m_nCompleted;
+	volatile LONG m_nFailed;
+	std::string m_payload;
+	HANDLE m_doneEvent;
+};
+
+static bool RunPool(int nTotal, int argc, char *argv[])
+{
+	PoolBenchClient pool(nTotal);
+	for (int index = 0; index < argc; ++index)
+	{
+		std::string endpoint(argv[index]);
+		size_t nColon = endpoint.rfind(':');
+		USHORT nPort = (std::string::npos == nColon) ? 9988 : (USHORT)::atoi(endpoint.c_str() + nColon + 1);
+		pool.AddEndpoint(endpoint.substr(0, nColon), nPort);
+	}
+	if (0 == argc)
+	{
+		pool.AddEndpoint("127.0.0.1", 9988);
+	}
+
+	if (!pool.Start())
+	{
+		return false;
+	}
+
+	LARGE_INTEGER frequency, start, end;
+	::QueryPerformanceFrequency(&frequency);
+	::QueryPerformanceCounter(&start);
+
+	for (int index = 0; index < 256 && pool.IssueNext(); ++index)
+	{
+	}
+
+	bool bDone = pool.Wait(60000);
+	::QueryPerformanceCounter(&end);
+
+	double dSeconds = (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+	printf("pool: %d requests, %.3fs, %.0f req/s, failed %ld%s\n",
+		nTotal, dSeconds, dSeconds > 0.0 ? nTotal / dSeconds : 0.0, pool.GetFailed(), bDone ? "" : " (incomplete)");
+
+	for (DWORD index = 0; index < pool.GetEndpointCount(); ++index)
+	{
+		IRpcEndpointStats stats;
+		pool.GetEndpointStats(index, stats);
+		printf("  endpoint %lu: connected %lu, latency %.1fus, error rate %.3f, ejected %lu times%s\n",
+			index, stats.dwConnected, stats.dLatencyUs, stats.dErrorRate, stats.dwEjectCount, stats.bEjected ? " (ejected)" : "");
+	}
+	return bDone;
+}
+
+int main(int argc, char *argv[])
+{
+	// --ping <次数> [轮询微秒] 测量环回往返延迟，先关闭忙轮询运行一次，指定轮询时长时再开启运行一次
+	if (argc > 2 && 0 == ::strcmp(argv[1], "--ping"))
+	{
+		int nCount = ::atoi(argv[2]);
+		DWORD dwSpinUs = (argc > 3) ? (DWORD)::atoi(argv[3]) : 0;
+		if (nCount <= 0 || !RunPing(nCount, 0) || (dwSpinUs && !RunPing(nCount, dwSpinUs)))
+		{
+			std::cout << "ping failed ......" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	// --ping-unix <路径> <次数> 先经TCP环回、再经AF_UNIX测量往返延迟
+	if (argc > 3 && 0 == ::strcmp(argv[1], "--ping-unix"))
+	{
+		int nCount = ::atoi(argv[3]);
+		if (!RunPing(nCount, 0) || !RunPing(nCount, 0, argv[2]))
+		{
+			std::cout << "ping failed ......" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	// --ping-shm <名称> <次数> 均开启忙轮询，先经TCP环回、再经共享内存测量往返延迟(服务端以--shm --busy-poll启动)
+	if (argc > 3 && 0 == ::strcmp(argv[1], "--ping-shm"))
+	{
+		int nCount = ::atoi(argv[3]);
+		if (!RunPing(nCount, SHM_DEFAULT_SPIN_US) || !RunPing(nCount, SHM_DEFAULT_SPIN_US, nullptr, argv[2]))
+		{
+			std::cout << "ping failed ......" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	// --rpc <请求数> [在途窗口] [载荷字节] 流水线RPC压测，对比窗口为1(逐个等待)与更大窗口的吞吐
+	if (argc > 2 && 0 == ::strcmp(argv[1], "--rpc"))
+	{
+		int nTotal = ::atoi(argv[2]);
+		int nWindow = (argc > 3) ? ::atoi(argv[3]) : 1024;
+		DWORD dwPayloadLen = (argc > 4) ? (DWORD)::atoi(argv[4]) : 64;
+		if (nTotal <= 0 || nWindow <= 0 || !RunRpc(nTotal, nWindow, dwPayloadLen))
+		{
+			std::cout << "rpc failed ......" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	// --pool <请求数> [ip:port ...] 经连接池向多个后端发出请求，未指定后端时使用本机9988端口
+	if (argc > 2 && 0 == ::strcmp(argv[1], "--pool"))
+	{
+		int nTotal = ::atoi(argv[2]);
+		if (nTotal <= 0 || !RunPool(nTotal, argc - 3, argv + 3))
+		{
+			std::cout << "pool failed ......" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	// --replay <抓包文件> [倍速] 按原始时序回放服务端抓取的流量
+	if (argc > 2 && 0 == ::strcmp(argv[1], "--replay"))
+	{
+		double dSpeed = (argc > 3) ? ::atof(argv[3]) : 1.0;
+		IOReplayer replayer;
+		if (!replayer.Run(argv[2], "127.0.0.1", 9988, dSpeed))
+		{
+			std::cout << "open capture file failed ......" << std::endl;
+			return 1;
+		}
+
+		printf("replayed %llu records\n", replayer.GetReplayedRecords());
+		return 0;
+	}
+
 	std::cout << "start client ......." << std::endl;
 	ConcreteClient client;
+
+	// --compress 向服务端请求消息压缩
+	if (argc > 1 && 0 == ::strcmp(argv[1], "--compress"))
+	{
+		client.EnableCompression();
+	}
+
 	client.Connect("127.0.0.1", 9988);
 	std::string strMsg1 = "Hello Server1!";
 	client.Send(strMsg1.c_str(), (int)strMsg1.length());
@@ -58,6 +529,8 @@ int main()
 
 	client.DisConnect();
 
+	IOCompressStats::GetInstance().Dump(stdout);
+
 	std::cout << "stop server ......" << std::endl;
 
 	return 0;
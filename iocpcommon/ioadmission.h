@@ -0,0 +1,167 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOADMISSION_H_
+#define _TINY_IOCP_IOCPCOMMON_IOADMISSION_H_
+
+#include <Windows.h>
+#include <stdio.h>
+#include "iolock.h"
+
+#define ADMISSION_DEFAULT_TARGET_US		(5000)	// 默认的排队时延目标(微秒)
+#define ADMISSION_DEFAULT_INTERVAL_MS	(100)	// 默认的判定窗口：时延持续超过目标这么久才判定为过载(毫秒)
+#define ADMISSION_PROBE_PERIOD_MS		(10)	// 未过载时探针的投递周期(毫秒)
+
+// 排队时延探针：经完成端口投递一个带时间戳的完成包，完成端口按先进先出取出完成包，
+// 探针从投递到被工作者线程取出的耗时即为此刻完成包在队列中的等待时间
+// 每个完成端口一个探针，同一时刻最多一个在途
+struct IOAdmissionProbe
+{
+	OVERLAPPED overlapped;			// 投递时的重叠结构，取出后据此找到探针
+	HANDLE completionPort;
+	LONGLONG llPostQpc;				// 投递时的QPC
+	volatile ULONGLONG ullNextPostMs;	// 下次可投递的GetTickCount64时间
+	volatile LONG nInFlight;		// 是否有在途的探针
+};
+
+// 准入控制统计
+struct IOAdmissionStats
+{
+	ULONGLONG ullSamples;			// 探针样本数
+	ULONGLONG ullOverloads;			// 进入过载状态的次数
+	ULONGLONG ullOverloadMs;		// 累计处于过载状态的时长(毫秒)
+	double dLastDelayUs;			// 最近一次的排队时延
+	double dMaxDelayUs;				// 最大排队时延
+};
+
+// CoDel式的准入控制：排队时延低于目标时一切正常；超过目标后开始计时，
+// 在一个判定窗口内始终未回落到目标以下则判定为过载，任一样本回落到目标以下即解除
+// 过载期间服务端暂停投递AcceptEx、HTTP服务端对新请求快速返回503，使已接纳的请求保持正常时延
+class IOAdmissionController
+{
+public:
+
+	IOAdmissionController()
+		: m_llTargetTicks(0)
+		, m_dwIntervalMs(ADMISSION_DEFAULT_INTERVAL_MS)
+		, m_dTickUs(0.0)
+		, m_nOverloaded(0)
+		, m_ullFirstAboveMs(0)
+		, m_ullOverloadSinceMs(0)
+	{
+		::memset(&m_stats, 0, sizeof(m_stats));
+	}
+
+	~IOAdmissionController() = default;
+
+public:
+
+	// dwTargetUs为0时关闭
+	void Enable(DWORD dwTargetUs, DWORD dwIntervalMs)
+	{
+		LARGE_INTEGER frequency;
+		::QueryPerformanceFrequency(&frequency);
+
+		// 工作者线程可能正在Sample中读取这些参数
+		AutoLock<SpinLock> lock(m_lock);
+		m_dTickUs = 1000000.0 / (double)frequency.QuadPart;
+		m_dwIntervalMs = dwIntervalMs ? dwIntervalMs : ADMISSION_DEFAULT_INTERVAL_MS;
+		m_llTargetTicks = (LONGLONG)dwTargetUs * frequency.QuadPart / 1000000;
+		if (!m_llTargetTicks)
+		{
+			::InterlockedExchange(&m_nOverloaded, 0);
+		}
+	}
+
+	bool IsEnabled() const
+	{
+		return m_llTargetTicks > 0;
+	}
+
+	bool IsOverloaded() const
+	{
+		return (0 != m_nOverloaded);
+	}
+
+	// 最近的样本超过了目标(判定窗口中或已过载)，此时探针应连续投递以尽快得出结论
+	bool IsAboveTarget() const
+	{
+		return (0 != m_ullFirstAboveMs);
+	}
+
+	// 记录一个排队时延样本(QPC计数)，过载状态发生变化时返回true
+	bool Sample(LONGLONG llDelayTicks, ULONGLONG ullNowMs)
+	{
+		AutoLock<SpinLock> lock(m_lock);
+
+		double dDelayUs = llDelayTicks * m_dTickUs;
+		++m_stats.ullSamples;
+		m_stats.dLastDelayUs = dDelayUs;
+		if (dDelayUs > m_stats.dMaxDelayUs)
+		{
+			m_stats.dMaxDelayUs = dDelayUs;
+		}
+
+		if (llDelayTicks < m_llTargetTicks)
+		{
+			m_ullFirstAboveMs = 0;
+			if (m_nOverloaded)
+			{
+				m_stats.ullOverloadMs += ullNowMs - m_ullOverloadSinceMs;
+				::InterlockedExchange(&m_nOverloaded, 0);
+				return true;
+			}
+			return false;
+		}
+
+		// 首次超过目标，开始一个判定窗口
+		if (0 == m_ullFirstAboveMs)
+		{
+			m_ullFirstAboveMs = ullNowMs;
+			return false;
+		}
+
+		if (!m_nOverloaded && ullNowMs - m_ullFirstAboveMs >= m_dwIntervalMs)
+		{
+			++m_stats.ullOverloads;
+			m_ullOverloadSinceMs = ullNowMs;
+			::InterlockedExchange(&m_nOverloaded, 1);
+			return true;
+		}
+		return false;
+	}
+
+	void GetStats(IOAdmissionStats &stats) const
+	{
+		AutoLock<SpinLock> lock(m_lock);
+		stats = m_stats;
+	}
+
+	void Dump(FILE *pFile) const
+	{
+		if (!pFile || !IsEnabled())
+		{
+			return;
+		}
+
+		IOAdmissionStats stats;
+		GetStats(stats);
+		::fprintf(pFile, "admission: %llu samples, %llu overloads, overloaded %llu ms, last delay %.1f us, max delay %.1f us\n",
+			stats.ullSamples, stats.ullOverloads, stats.ullOverloadMs, stats.dLastDelayUs, stats.dMaxDelayUs);
+	}
+
+private:
+
+	IOAdmissionController(const IOAdmissionController&) = delete;
+	IOAdmissionController& operator= (const IOAdmissionController&) = delete;
+
+private:
+
+	LONGLONG m_llTargetTicks;		// 排队时延目标(QPC计数)，为0时关闭
+	DWORD m_dwIntervalMs;			// 判定窗口
+	double m_dTickUs;				// 每个QPC计数的微秒数
+	volatile LONG m_nOverloaded;	// 是否处于过载状态，任意线程可无锁读取
+	ULONGLONG m_ullFirstAboveMs;	// 本轮首次超过目标的时间，0为当前未超过
+	ULONGLONG m_ullOverloadSinceMs;	// 进入过载状态的时间
+	IOAdmissionStats m_stats;
+	mutable SpinLock m_lock;		// 样本来自各完成端口的工作者线程
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOADMISSION_H_
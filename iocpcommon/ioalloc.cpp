@@ -0,0 +1,71 @@
+#include "ioalloc.h"
+#include <stdlib.h>
+#include <new>
+
+#ifdef IOCP_ALLOC_TRACKING
+
+// 替换全局operator new/delete，分配前递增本线程的计数，内存仍由CRT堆管理
+// 对齐版本(std::align_val_t)的分配不经过以下函数，使用默认实现
+
+static void* TrackedAlloc(size_t nSize)
+{
+	++IOAllocTracker::ThreadAllocCount();
+	return ::malloc(nSize ? nSize : 1);
+}
+
+void* operator new(size_t nSize)
+{
+	void *p = TrackedAlloc(nSize);
+	if (!p)
+	{
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void* operator new[](size_t nSize)
+{
+	return operator new(nSize);
+}
+
+void* operator new(size_t nSize, const std::nothrow_t&) noexcept
+{
+	return TrackedAlloc(nSize);
+}
+
+void* operator new[](size_t nSize, const std::nothrow_t&) noexcept
+{
+	return TrackedAlloc(nSize);
+}
+
+void operator delete(void *p) noexcept
+{
+	::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	::free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	::free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t&) noexcept
+{
+	::free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t&) noexcept
+{
+	::free(p);
+}
+
+#endif	// IOCP_ALLOC_TRACKING
@@ -0,0 +1,145 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOALLOC_H_
+#define _TINY_IOCP_IOCPCOMMON_IOALLOC_H_
+
+#include <Windows.h>
+
+#define ALLOC_TRACK_MAX_OPS		(16)	// 按操作类型统计的最大类型数
+
+// 堆分配统计(调试插桩)：定义IOCP_ALLOC_TRACKING时替换全局operator new，按线程计数，
+// 引擎每次分发完成通知时以IOAllocScope把期间的分配次数记到对应的操作类型上(嵌套分发只计入内层)
+// 未定义时IOAllocScope为空操作，统计始终为0；直接调用malloc/HeapAlloc的分配不在统计之内
+class IOAllocTracker
+{
+public:
+
+	static bool IsEnabled()
+	{
+#ifdef IOCP_ALLOC_TRACKING
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	static IOAllocTracker& GetInstance()
+	{
+		static IOAllocTracker s_allocTracker;
+		return s_allocTracker;
+	}
+
+	// 本线程累计的operator new次数
+	static ULONGLONG& ThreadAllocCount()
+	{
+		static thread_local ULONGLONG t_ullAllocs = 0;
+		return t_ullAllocs;
+	}
+
+	void Record(DWORD dwOp, ULONGLONG ullAllocs)
+	{
+		if (dwOp >= ALLOC_TRACK_MAX_OPS)
+		{
+			return;
+		}
+
+		::InterlockedIncrement64(&m_nOps[dwOp]);
+		if (ullAllocs)
+		{
+			::InterlockedExchangeAdd64(&m_nAllocs[dwOp], (LONG64)ullAllocs);
+		}
+	}
+
+	// 清零统计，预热结束后调用，之后的统计只反映稳态
+	void Reset()
+	{
+		for (DWORD dwOp = 0; dwOp < ALLOC_TRACK_MAX_OPS; ++dwOp)
+		{
+			::InterlockedExchange64(&m_nOps[dwOp], 0);
+			::InterlockedExchange64(&m_nAllocs[dwOp], 0);
+		}
+	}
+
+	ULONGLONG GetOpCount(DWORD dwOp) const
+	{
+		return (dwOp < ALLOC_TRACK_MAX_OPS) ? (ULONGLONG)m_nOps[dwOp] : 0;
+	}
+
+	ULONGLONG GetAllocCount(DWORD dwOp) const
+	{
+		return (dwOp < ALLOC_TRACK_MAX_OPS) ? (ULONGLONG)m_nAllocs[dwOp] : 0;
+	}
+
+private:
+
+	IOAllocTracker()
+	{
+		Reset();
+	}
+
+	IOAllocTracker(const IOAllocTracker&) = delete;
+	IOAllocTracker& operator= (const IOAllocTracker&) = delete;
+
+private:
+
+	volatile LONG64 m_nOps[ALLOC_TRACK_MAX_OPS];		// 分发的次数
+	volatile LONG64 m_nAllocs[ALLOC_TRACK_MAX_OPS];		// 分发期间的堆分配次数
+};
+
+// 一次分发的分配统计范围，dwOp为操作类型(IOCP_OPERATOR_TYPE)
+class IOAllocScope
+{
+public:
+
+#ifdef IOCP_ALLOC_TRACKING
+
+	explicit IOAllocScope(DWORD dwOp)
+		: m_dwOp(dwOp)
+		, m_ullStart(IOAllocTracker::ThreadAllocCount())
+		, m_ullNested(0)
+		, m_pParent(Current())
+	{
+		Current() = this;
+	}
+
+	~IOAllocScope()
+	{
+		ULONGLONG ullTotal = IOAllocTracker::ThreadAllocCount() - m_ullStart;
+		IOAllocTracker::GetInstance().Record(m_dwOp, ullTotal - m_ullNested);
+		if (m_pParent)
+		{
+			m_pParent->m_ullNested += ullTotal;
+		}
+		Current() = m_pParent;
+	}
+
+#else
+
+	explicit IOAllocScope(DWORD /*dwOp*/)
+	{
+	}
+
+#endif
+
+private:
+
+	IOAllocScope(const IOAllocScope&) = delete;
+	IOAllocScope& operator= (const IOAllocScope&) = delete;
+
+#ifdef IOCP_ALLOC_TRACKING
+
+	static IOAllocScope*& Current()
+	{
+		static thread_local IOAllocScope *t_pCurrent = nullptr;
+		return t_pCurrent;
+	}
+
+private:
+
+	DWORD m_dwOp;
+	ULONGLONG m_ullStart;
+	ULONGLONG m_ullNested;		// 嵌套分发中的分配次数，已计入内层的操作类型
+	IOAllocScope *m_pParent;
+
+#endif
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOALLOC_H_
@@ -0,0 +1,215 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOARENA_H_
+#define _TINY_IOCP_IOCPCOMMON_IOARENA_H_
+
+#include <Windows.h>
+#include <memory_resource>
+#include <new>
+#include <vector>
+
+#define ARENA_CHUNK_SIZE		(1024 * 64)		// 每次向系统申请的块大小(64K)，超过此大小的单次分配独占一块
+#define ARENA_DEFAULT_ALIGN		(alignof(std::max_align_t))
+
+class IOBumpArena;
+
+// 以线程的碰撞分配区为后端的std::pmr内存资源，释放为空操作，内存在回调返回时整体回收
+class IOArenaResource : public std::pmr::memory_resource
+{
+public:
+
+	explicit IOArenaResource(IOBumpArena &arena) : m_arena(arena) {}
+
+protected:
+
+	virtual void* do_allocate(size_t bytes, size_t alignment) override;
+
+	virtual void do_deallocate(void * /*p*/, size_t /*bytes*/, size_t /*alignment*/) override
+	{
+	}
+
+	virtual bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+	{
+		return this == &other;
+	}
+
+private:
+
+	IOBumpArena &m_arena;
+};
+
+// 碰撞分配区：在当前块内顺序移动指针分配，不支持单独释放，只能整体回退到之前记录的位置
+// 块用VirtualAlloc申请，回退后保留供之后复用，稳态下不再向系统申请内存
+// 每个线程一个实例(GetThreadArena)，只在所属线程使用，无需加锁
+class IOBumpArena
+{
+public:
+
+	// 分配区中的位置，回退到此位置即释放其后分配的全部内存
+	struct Mark
+	{
+		size_t nChunk;
+		size_t nOffset;
+	};
+
+	IOBumpArena() : m_resource(*this), m_nChunk(0), m_nOffset(0), m_ullChunkAllocs(0)
+	{
+	}
+
+	~IOBumpArena()
+	{
+		for (size_t index = 0; index < m_chunks.size(); ++index)
+		{
+			::VirtualFree(m_chunks[index].pData, 0, MEM_RELEASE);
+		}
+	}
+
+public:
+
+	// alignment须为2的幂，内存不足时返回nullptr
+	void* Allocate(size_t nSize, size_t nAlign = ARENA_DEFAULT_ALIGN)
+	{
+		if (0 == nSize)
+		{
+			nSize = 1;
+		}
+
+		while (m_nChunk < m_chunks.size())
+		{
+			IOArenaChunk &chunk = m_chunks[m_nChunk];
+			size_t nOffset = (m_nOffset + nAlign - 1) & ~(nAlign - 1);
+			if (nOffset <= chunk.nSize && nSize <= chunk.nSize - nOffset)
+			{
+				m_nOffset = nOffset + nSize;
+				return chunk.pData + nOffset;
+			}
+
+			// 当前块放不下，后面保留的块若足够大则继续使用，否则在当前块之后插入新块
+			if (m_nChunk + 1 < m_chunks.size() && nSize + nAlign <= m_chunks[m_nChunk + 1].nSize)
+			{
+				++m_nChunk;
+				m_nOffset = 0;
+				continue;
+			}
+			break;
+		}
+
+		size_t nChunkSize = ARENA_CHUNK_SIZE;
+		if (nSize + nAlign > nChunkSize)
+		{
+			nChunkSize = (nSize + nAlign + ARENA_CHUNK_SIZE - 1) & ~((size_t)ARENA_CHUNK_SIZE - 1);
+		}
+
+		char *pData = (char*)::VirtualAlloc(nullptr, nChunkSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (!pData)
+		{
+			return nullptr;
+		}
+		++m_ullChunkAllocs;
+
+		IOArenaChunk chunk = { pData, nChunkSize };
+		size_t nInsert = m_chunks.empty() ? 0 : m_nChunk + 1;
+		m_chunks.insert(m_chunks.begin() + nInsert, chunk);
+		m_nChunk = nInsert;
+		m_nOffset = nSize;		// VirtualAlloc按页对齐，块首满足任意不超过页大小的对齐
+		return pData;
+	}
+
+	template<typename T>
+	T* Allocate(size_t nCount = 1)
+	{
+		return (T*)Allocate(sizeof(T) * nCount, alignof(T));
+	}
+
+	Mark GetMark() const
+	{
+		Mark mark = { m_nChunk, m_nOffset };
+		return mark;
+	}
+
+	// 回退到mark，mark之后分配的内存全部失效
+	void Rewind(const Mark &mark)
+	{
+		m_nChunk = mark.nChunk;
+		m_nOffset = mark.nOffset;
+	}
+
+	void Reset()
+	{
+		m_nChunk = 0;
+		m_nOffset = 0;
+	}
+
+	std::pmr::memory_resource* GetResource()
+	{
+		return &m_resource;
+	}
+
+	// 累计向系统申请块的次数，稳态下应不再增长
+	ULONGLONG GetChunkAllocCount() const
+	{
+		return m_ullChunkAllocs;
+	}
+
+	static IOBumpArena& GetThreadArena()
+	{
+		static thread_local IOBumpArena t_arena;
+		return t_arena;
+	}
+
+private:
+
+	IOBumpArena(const IOBumpArena&) = delete;
+	IOBumpArena& operator= (const IOBumpArena&) = delete;
+
+private:
+
+	struct IOArenaChunk
+	{
+		char *pData;
+		size_t nSize;
+	};
+
+	IOArenaResource m_resource;
+	std::vector<IOArenaChunk> m_chunks;		// 已申请的块，回退后保留
+	size_t m_nChunk;						// 当前分配所在的块
+	size_t m_nOffset;						// 当前块中已分配的字节数
+	ULONGLONG m_ullChunkAllocs;
+};
+
+inline void* IOArenaResource::do_allocate(size_t bytes, size_t alignment)
+{
+	void *p = m_arena.Allocate(bytes, alignment);
+	if (!p)
+	{
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+// 回调的分配区范围：进入时记录本线程分配区的位置，退出时回退到该位置
+// 引擎在每次分发完成通知时定义本对象，回调中从GetThreadArena/GetResource分配的临时内存在回调返回后自动回收
+// 回调内嵌套分发(如同步完成的send)时按后进先出回退，外层回调已分配的内存不受影响
+class IOArenaScope
+{
+public:
+
+	IOArenaScope() : m_arena(IOBumpArena::GetThreadArena()), m_mark(m_arena.GetMark())
+	{
+	}
+
+	~IOArenaScope()
+	{
+		m_arena.Rewind(m_mark);
+	}
+
+private:
+
+	IOArenaScope(const IOArenaScope&) = delete;
+	IOArenaScope& operator= (const IOArenaScope&) = delete;
+
+private:
+
+	IOBumpArena &m_arena;
+	IOBumpArena::Mark m_mark;
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOARENA_H_
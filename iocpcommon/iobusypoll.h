@@ -0,0 +1,129 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOBUSYPOLL_H_
+#define _TINY_IOCP_IOCPCOMMON_IOBUSYPOLL_H_
+
+#include <WinSock2.h>
+#include <Windows.h>
+#include <mstcpip.h>
+#include <stdio.h>
+
+// 忙轮询等待完成包：阻塞等待前先以零超时反复轮询完成端口，以CPU换取唤醒延迟
+// 完成包在轮询期间到达时工作线程无需经历内核调度唤醒
+// 同时轮询的线程数受限，其余线程直接阻塞等待，避免轮询线程数超过处理器数
+class IOBusyPoller
+{
+public:
+
+	IOBusyPoller()
+		: m_llSpinTicks(0)
+		, m_nMaxSpinners(0)
+		, m_nSpinners(0)
+		, m_nSpinHits(0)
+		, m_nSpinMisses(0)
+		, m_nBlockingWaits(0)
+	{
+	}
+
+	~IOBusyPoller() = default;
+
+public:
+
+	// 阻塞前的轮询时长(微秒)，0表示关闭；nMaxSpinners为同时轮询的线程数上限，0表示处理器数的一半
+	// 可在工作线程运行中调用，各线程下一次等待完成包时生效
+	void Enable(DWORD dwSpinUs, LONG nMaxSpinners = 0)
+	{
+		LARGE_INTEGER frequency;
+		::QueryPerformanceFrequency(&frequency);
+
+		if (nMaxSpinners <= 0)
+		{
+			SYSTEM_INFO si;
+			::GetSystemInfo(&si);
+			nMaxSpinners = (si.dwNumberOfProcessors > 1) ? (LONG)(si.dwNumberOfProcessors / 2) : 1;
+		}
+		::InterlockedExchange(&m_nMaxSpinners, nMaxSpinners);
+		::InterlockedExchange64(&m_llSpinTicks, (LONGLONG)dwSpinUs * frequency.QuadPart / 1000000);
+	}
+
+	bool IsEnabled() const
+	{
+		return m_llSpinTicks > 0;
+	}
+
+	// 与GetQueuedCompletionStatus(..., INFINITE)语义相同
+	BOOL GetQueuedCompletionStatus(
+		HANDLE completionPort,
+		LPDWORD lpNumberOfBytes,
+		PULONG_PTR lpCompletionKey,
+		LPOVERLAPPED *lpOverlapped)
+	{
+		// 轮询时长只读取一次，运行中被关闭或修改时本次等待仍按读到的值完成，轮询线程计数保持配对
+		LONGLONG llSpinTicks = m_llSpinTicks;
+		if (llSpinTicks > 0 && ::InterlockedIncrement(&m_nSpinners) <= m_nMaxSpinners)
+		{
+			LARGE_INTEGER start, now;
+			::QueryPerformanceCounter(&start);
+			do
+			{
+				*lpOverlapped = nullptr;
+				BOOL bRet = ::GetQueuedCompletionStatus(completionPort, lpNumberOfBytes, lpCompletionKey, lpOverlapped, 0);
+
+				// 取出了完成包(成功或失败的IO)，或完成端口本身出错
+				if (bRet || *lpOverlapped || WAIT_TIMEOUT != ::GetLastError())
+				{
+					::InterlockedDecrement(&m_nSpinners);
+					::InterlockedIncrement64(&m_nSpinHits);
+					return bRet;
+				}
+
+				YieldProcessor();
+				::QueryPerformanceCounter(&now);
+			} while (now.QuadPart - start.QuadPart < llSpinTicks);
+
+			::InterlockedDecrement(&m_nSpinners);
+			::InterlockedIncrement64(&m_nSpinMisses);
+		}
+		else if (llSpinTicks > 0)
+		{
+			::InterlockedDecrement(&m_nSpinners);
+		}
+
+		::InterlockedIncrement64(&m_nBlockingWaits);
+		return ::GetQueuedCompletionStatus(completionPort, lpNumberOfBytes, lpCompletionKey, lpOverlapped, INFINITE);
+	}
+
+	// 轮询命中率：命中越高，越多的完成包免于调度唤醒
+	void Dump(FILE *pFile) const
+	{
+		if (!pFile)
+		{
+			return;
+		}
+
+		::fprintf(pFile, "busy poll: spin hits %lld, spin misses %lld, blocking waits %lld\n",
+			m_nSpinHits, m_nSpinMisses, m_nBlockingWaits);
+	}
+
+	// 环回连接走快速路径，绕过大部分TCP/IP协议栈，须在connect/listen之前设置
+	static void EnableLoopbackFastPath(SOCKET sock)
+	{
+		int nOptionValue = 1;
+		DWORD dwBytes = 0;
+		::WSAIoctl(sock, SIO_LOOPBACK_FAST_PATH, &nOptionValue, sizeof(nOptionValue), nullptr, 0, &dwBytes, nullptr, nullptr);
+	}
+
+private:
+
+	IOBusyPoller(const IOBusyPoller&) = delete;
+	IOBusyPoller& operator= (const IOBusyPoller&) = delete;
+
+private:
+
+	volatile LONGLONG m_llSpinTicks;	// 轮询时长(QPC计数)
+	volatile LONG m_nMaxSpinners;	// 同时轮询的线程数上限
+	volatile LONG m_nSpinners;		// 正在轮询的线程数
+	volatile LONG64 m_nSpinHits;	// 轮询期间取得完成包的次数
+	volatile LONG64 m_nSpinMisses;	// 轮询超时转为阻塞的次数
+	volatile LONG64 m_nBlockingWaits;	// 阻塞等待的次数(含未轮询直接阻塞)
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOBUSYPOLL_H_
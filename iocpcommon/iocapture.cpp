@@ -0,0 +1,300 @@
+#include "iocapture.h"
+#include <algorithm>
+
+#define CAPTURE_ALIGN(n) (((n) + (CAPTURE_RECORD_ALIGN - 1)) & ~(CAPTURE_RECORD_ALIGN - 1))
+
+// 每个线程当前写入的段，所属写入器或代数变化后重新领取
+struct IOCaptureThreadSegment
+{
+	const IOCaptureWriter *pWriter;
+	LONG nGeneration;
+	IOCaptureSegmentHeader *pSegment;
+};
+
+static thread_local IOCaptureThreadSegment t_captureSegment = { nullptr, 0, nullptr };
+static volatile LONG s_nCaptureGeneration = 0;
+
+IOCaptureWriter::IOCaptureWriter()
+	: m_hFile(INVALID_HANDLE_VALUE)
+	, m_hMapping(NULL)
+	, m_pFileHeader(nullptr)
+	, m_llStartTicks(0)
+	, m_nGeneration(0)
+	, m_nDroppedRecords(0)
+	, m_nWriters(0)
+	, m_nClosing(0)
+{
+}
+
+IOCaptureWriter::~IOCaptureWriter()
+{
+	Close();
+}
+
+bool IOCaptureWriter::Open(const std::string &path, DWORD dwSegmentNum, DWORD dwSegmentSize)
+{
+	Close();
+
+	if (0 == dwSegmentNum || dwSegmentSize <= sizeof(IOCaptureSegmentHeader) + sizeof(IOCaptureRecord))
+	{
+		return false;
+	}
+
+	m_hFile = ::CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, 0, nullptr);
+	if (INVALID_HANDLE_VALUE == m_hFile)
+	{
+		return false;
+	}
+
+	// 文件大小在创建时固定，写入时无需扩展文件
+	ULONGLONG ullFileSize = CAPTURE_HEADER_SIZE + (ULONGLONG)dwSegmentNum * dwSegmentSize;
+	m_hMapping = ::CreateFileMappingA(
+		m_hFile, nullptr, PAGE_READWRITE, (DWORD)(ullFileSize >> 32), (DWORD)(ullFileSize & 0xFFFFFFFF), nullptr);
+	if (!m_hMapping)
+	{
+		Close();
+		return false;
+	}
+
+	m_pFileHeader = static_cast<IOCaptureFileHeader *>(::MapViewOfFile(m_hMapping, FILE_MAP_WRITE, 0, 0, 0));
+	if (!m_pFileHeader)
+	{
+		Close();
+		return false;
+	}
+
+	LARGE_INTEGER frequency, now;
+	::QueryPerformanceFrequency(&frequency);
+	::QueryPerformanceCounter(&now);
+	m_llStartTicks = now.QuadPart;
+
+	m_pFileHeader->dwMagic = CAPTURE_FILE_MAGIC;
+	m_pFileHeader->dwVersion = CAPTURE_FILE_VERSION;
+	m_pFileHeader->dwSegmentSize = dwSegmentSize;
+	m_pFileHeader->dwSegmentNum = dwSegmentNum;
+	m_pFileHeader->llFrequency = frequency.QuadPart;
+	m_pFileHeader->nSegmentsClaimed = 0;
+
+	m_nGeneration = ::InterlockedIncrement(&s_nCaptureGeneration);
+	m_nDroppedRecords = 0;
+	::InterlockedExchange(&m_nClosing, 0);
+	return true;
+}
+
+void IOCaptureWriter::Close()
+{
+	// 先拒绝新的写入，再等已进入Append的线程写完，之后才能解除映射
+	// 服务端停止时用户线程上的Send仍可能失败并经DoClose写入关闭记录，工作者线程也可能仍在DispatchRecv中写入
+	::InterlockedExchange(&m_nClosing, 1);
+	while (m_nWriters > 0)
+	{
+		::Sleep(0);
+	}
+
+	if (m_pFileHeader)
+	{
+		::FlushViewOfFile(m_pFileHeader, 0);
+		::UnmapViewOfFile(m_pFileHeader);
+		m_pFileHeader = nullptr;
+	}
+
+	if (m_hMapping)
+	{
+		::CloseHandle(m_hMapping);
+		m_hMapping = NULL;
+	}
+
+	if (INVALID_HANDLE_VALUE != m_hFile)
+	{
+		::CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+}
+
+bool IOCaptureWriter::Append(CAPTURE_RECORD_TYPE type, ULONGLONG ullConnId, const char *buffer, DWORD dwLen)
+{
+	// 先登记再检查关闭标志，与Close的先置标志再等待配对，两者均为完整的内存屏障
+	::InterlockedIncrement(&m_nWriters);
+	bool result = !m_nClosing && AppendRecord(type, ullConnId, buffer, dwLen);
+	::InterlockedDecrement(&m_nWriters);
+	return result;
+}
+
+bool IOCaptureWriter::AppendRecord(CAPTURE_RECORD_TYPE type, ULONGLONG ullConnId, const char *buffer, DWORD dwLen)
+{
+	if (!m_pFileHeader)
+	{
+		return false;
+	}
+
+	DWORD dwRecordSize = CAPTURE_ALIGN((DWORD)sizeof(IOCaptureRecord) + dwLen);
+	if (dwRecordSize > m_pFileHeader->dwSegmentSize - sizeof(IOCaptureSegmentHeader))
+	{
+		::InterlockedIncrement64(&m_nDroppedRecords);
+		return false;
+	}
+
+	IOCaptureThreadSegment &threadSegment = t_captureSegment;
+	if (threadSegment.pWriter != this || threadSegment.nGeneration != m_nGeneration)
+	{
+		threadSegment.pWriter = this;
+		threadSegment.nGeneration = m_nGeneration;
+		threadSegment.pSegment = ClaimSegment();
+	}
+
+	// 当前段剩余空间不足时领取新段
+	if (threadSegment.pSegment &&
+		(DWORD)threadSegment.pSegment->nUsed + dwRecordSize > m_pFileHeader->dwSegmentSize)
+	{
+		threadSegment.pSegment = ClaimSegment();
+	}
+
+	IOCaptureSegmentHeader *pSegment = threadSegment.pSegment;
+	if (!pSegment)
+	{
+		::InterlockedIncrement64(&m_nDroppedRecords);
+		return false;
+	}
+
+	LARGE_INTEGER now;
+	::QueryPerformanceCounter(&now);
+
+	IOCaptureRecord *pRecord = reinterpret_cast<IOCaptureRecord *>(reinterpret_cast<char *>(pSegment) + pSegment->nUsed);
+	pRecord->llTicks = now.QuadPart - m_llStartTicks;
+	pRecord->ullConnId = ullConnId;
+	pRecord->dwType = (DWORD)type;
+	pRecord->dwLen = dwLen;
+	if (dwLen > 0)
+	{
+		::memcpy(pRecord + 1, buffer, dwLen);
+	}
+
+	// 记录写完后再发布，读者不会读到不完整的记录
+	::InterlockedExchange(&pSegment->nUsed, pSegment->nUsed + (LONG)dwRecordSize);
+	return true;
+}
+
+IOCaptureSegmentHeader* IOCaptureWriter::ClaimSegment()
+{
+	LONG nSegment = ::InterlockedIncrement(&m_pFileHeader->nSegmentsClaimed) - 1;
+	if (nSegment >= (LONG)m_pFileHeader->dwSegmentNum)
+	{
+		return nullptr;
+	}
+
+	IOCaptureSegmentHeader *pSegment = reinterpret_cast<IOCaptureSegmentHeader *>(
+		reinterpret_cast<char *>(m_pFileHeader) + CAPTURE_HEADER_SIZE + (ULONGLONG)nSegment * m_pFileHeader->dwSegmentSize);
+	pSegment->dwThreadId = ::GetCurrentThreadId();
+	pSegment->nUsed = sizeof(IOCaptureSegmentHeader);
+	return pSegment;
+}
+
+IOCaptureReader::IOCaptureReader()
+	: m_hFile(INVALID_HANDLE_VALUE)
+	, m_hMapping(NULL)
+	, m_pFileHeader(nullptr)
+{
+}
+
+IOCaptureReader::~IOCaptureReader()
+{
+	Close();
+}
+
+bool IOCaptureReader::Open(const std::string &path)
+{
+	Close();
+
+	m_hFile = ::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (INVALID_HANDLE_VALUE == m_hFile)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!::GetFileSizeEx(m_hFile, &fileSize) || fileSize.QuadPart < CAPTURE_HEADER_SIZE)
+	{
+		Close();
+		return false;
+	}
+
+	m_hMapping = ::CreateFileMappingA(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!m_hMapping)
+	{
+		Close();
+		return false;
+	}
+
+	m_pFileHeader = static_cast<const IOCaptureFileHeader *>(::MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+	if (!m_pFileHeader)
+	{
+		Close();
+		return false;
+	}
+
+	const IOCaptureFileHeader &header = *m_pFileHeader;
+	if (CAPTURE_FILE_MAGIC != header.dwMagic || CAPTURE_FILE_VERSION != header.dwVersion ||
+		header.dwSegmentSize <= sizeof(IOCaptureSegmentHeader) ||
+		(ULONGLONG)fileSize.QuadPart < CAPTURE_HEADER_SIZE + (ULONGLONG)header.dwSegmentNum * header.dwSegmentSize)
+	{
+		Close();
+		return false;
+	}
+
+	DWORD dwSegments = ((DWORD)header.nSegmentsClaimed < header.dwSegmentNum) ? (DWORD)header.nSegmentsClaimed : header.dwSegmentNum;
+	for (DWORD index = 0; index < dwSegments; ++index)
+	{
+		const char *pSegmentBase = reinterpret_cast<const char *>(m_pFileHeader) +
+			CAPTURE_HEADER_SIZE + (ULONGLONG)index * header.dwSegmentSize;
+		const IOCaptureSegmentHeader *pSegment = reinterpret_cast<const IOCaptureSegmentHeader *>(pSegmentBase);
+
+		DWORD dwUsed = (DWORD)pSegment->nUsed;
+		if (dwUsed > header.dwSegmentSize)
+		{
+			dwUsed = header.dwSegmentSize;
+		}
+
+		DWORD dwOffset = sizeof(IOCaptureSegmentHeader);
+		while (dwOffset + sizeof(IOCaptureRecord) <= dwUsed)
+		{
+			const IOCaptureRecord *pRecord = reinterpret_cast<const IOCaptureRecord *>(pSegmentBase + dwOffset);
+			DWORD dwRecordSize = CAPTURE_ALIGN((DWORD)sizeof(IOCaptureRecord) + pRecord->dwLen);
+			if (pRecord->dwLen > header.dwSegmentSize || dwOffset + dwRecordSize > dwUsed)
+			{
+				break;
+			}
+
+			m_records.push_back(pRecord);
+			dwOffset += dwRecordSize;
+		}
+	}
+
+	// 段内有序，段之间按时间戳合并，时间相同时保持写入顺序
+	std::stable_sort(m_records.begin(), m_records.end(),
+		[](const IOCaptureRecord *pLeft, const IOCaptureRecord *pRight) { return pLeft->llTicks < pRight->llTicks; });
+
+	return true;
+}
+
+void IOCaptureReader::Close()
+{
+	m_records.clear();
+
+	if (m_pFileHeader)
+	{
+		::UnmapViewOfFile(m_pFileHeader);
+		m_pFileHeader = nullptr;
+	}
+
+	if (m_hMapping)
+	{
+		::CloseHandle(m_hMapping);
+		m_hMapping = NULL;
+	}
+
+	if (INVALID_HANDLE_VALUE != m_hFile)
+	{
+		::CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+}
@@ -0,0 +1,143 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOCAPTURE_H_
+#define _TINY_IOCP_IOCPCOMMON_IOCAPTURE_H_
+
+#include <Windows.h>
+#include <string>
+#include <vector>
+
+#define CAPTURE_FILE_MAGIC		(0x50414354)	// 抓包文件魔数('TCAP')
+#define CAPTURE_FILE_VERSION	(1)
+#define CAPTURE_HEADER_SIZE		(4096)			// 文件头占用的空间，段从此偏移开始
+#define CAPTURE_SEGMENT_SIZE	(1024 * 1024)	// 每个段的大小(1M)
+#define CAPTURE_RECORD_ALIGN	(8)				// 记录按8字节对齐
+
+//	抓包记录类型
+enum class CAPTURE_RECORD_TYPE
+{
+	CAPTURE_RECORD_OPEN = 1,	// 连接建立
+	CAPTURE_RECORD_DATA,		// 交给OnRecv的数据
+	CAPTURE_RECORD_CLOSE,		// 连接关闭
+};
+
+// 抓包文件格式：
+// [文件头(CAPTURE_HEADER_SIZE)] [段0] [段1] ... [段N-1]
+// 每个工作线程独占一个段顺序追加记录，段写满后再领取新段，写入过程不需要加锁
+// 各段内的记录按时间有序，段之间需按时间戳合并
+struct IOCaptureFileHeader
+{
+	DWORD dwMagic;
+	DWORD dwVersion;
+	DWORD dwSegmentSize;			// 段大小
+	DWORD dwSegmentNum;				// 段数量
+	LONGLONG llFrequency;			// 抓包时的QPC频率
+	volatile LONG nSegmentsClaimed;	// 已领取的段数量，可能超过dwSegmentNum(段用尽)
+	DWORD dwReserved;
+};
+
+// 段头，nUsed为已写入的字节数(含段头)，记录写完后才更新，读者据此判断记录是否完整
+struct IOCaptureSegmentHeader
+{
+	volatile LONG nUsed;
+	DWORD dwThreadId;
+};
+
+// 记录头，数据紧随其后
+struct IOCaptureRecord
+{
+	LONGLONG llTicks;		// 相对于抓包开始的QPC计数
+	ULONGLONG ullConnId;	// 连接ID
+	DWORD dwType;			// CAPTURE_RECORD_TYPE
+	DWORD dwLen;			// 数据长度
+
+	const char* GetData() const
+	{
+		return reinterpret_cast<const char *>(this + 1);
+	}
+};
+
+// 抓包写入器，记录写入内存映射文件，工作线程之间互不阻塞
+// Open需在工作线程启动前调用；Close可与任意线程上的Append并发：先拒绝新的写入，等在途的写入结束后才解除映射
+// 写入来自工作者线程(DispatchRecv的数据记录)，以及用户线程上失败的Send(pSocketContext)/Send(connId)经DoClose写入的关闭记录
+class IOCaptureWriter
+{
+public:
+
+	IOCaptureWriter();
+	~IOCaptureWriter();
+
+public:
+
+	bool Open(const std::string &path, DWORD dwSegmentNum, DWORD dwSegmentSize = CAPTURE_SEGMENT_SIZE);
+	void Close();
+
+	bool IsOpen() const
+	{
+		return (nullptr != m_pFileHeader);
+	}
+
+	// 追加一条记录，段已用尽、记录过大或已关闭时丢弃并返回false
+	bool Append(CAPTURE_RECORD_TYPE type, ULONGLONG ullConnId, const char *buffer, DWORD dwLen);
+
+	LONG64 GetDroppedRecords() const
+	{
+		return m_nDroppedRecords;
+	}
+
+private:
+
+	bool AppendRecord(CAPTURE_RECORD_TYPE type, ULONGLONG ullConnId, const char *buffer, DWORD dwLen);
+	IOCaptureSegmentHeader* ClaimSegment();
+
+	IOCaptureWriter(const IOCaptureWriter&) = delete;
+	IOCaptureWriter& operator= (const IOCaptureWriter&) = delete;
+
+private:
+
+	HANDLE m_hFile;
+	HANDLE m_hMapping;
+	IOCaptureFileHeader *m_pFileHeader;	// 映射视图的起始位置
+	LONGLONG m_llStartTicks;			// 抓包开始时的QPC计数
+	LONG m_nGeneration;					// 每次Open递增，使线程缓存的旧段失效
+	volatile LONG64 m_nDroppedRecords;	// 丢弃的记录数
+	volatile LONG m_nWriters;			// 正在Append的线程数，Close等其归零后才解除映射
+	volatile LONG m_nClosing;			// Close已开始，不再接受新的写入
+};
+
+// 抓包读取器，映射抓包文件并按时间戳合并所有段的记录
+class IOCaptureReader
+{
+public:
+
+	IOCaptureReader();
+	~IOCaptureReader();
+
+public:
+
+	bool Open(const std::string &path);
+	void Close();
+
+	// 按时间戳排序的记录，在Close之前有效
+	const std::vector<const IOCaptureRecord *>& GetRecords() const
+	{
+		return m_records;
+	}
+
+	LONGLONG GetFrequency() const
+	{
+		return m_pFileHeader ? m_pFileHeader->llFrequency : 0;
+	}
+
+private:
+
+	IOCaptureReader(const IOCaptureReader&) = delete;
+	IOCaptureReader& operator= (const IOCaptureReader&) = delete;
+
+private:
+
+	HANDLE m_hFile;
+	HANDLE m_hMapping;
+	const IOCaptureFileHeader *m_pFileHeader;
+	std::vector<const IOCaptureRecord *> m_records;
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOCAPTURE_H_
@@ -0,0 +1,297 @@
+#include "iocompress.h"
+
+#pragma comment(lib, "Cabinet.lib")
+
+#define COMPRESS_FRAME_HEADER_SIZE ((DWORD)sizeof(IOCompressFrameHeader))
+#define COMPRESS_MAX_FRAME_PAYLOAD (0xFFFF)
+
+void IOCompressStats::Dump(FILE *pFile) const
+{
+	LARGE_INTEGER frequency;
+	::QueryPerformanceFrequency(&frequency);
+	double dTickUs = 1000000.0 / (double)frequency.QuadPart;
+
+	::fprintf(pFile, "compress: raw %lld bytes, wire %lld bytes, ratio %.3f\n",
+		(long long)nRawBytes,
+		(long long)nWireBytes,
+		nRawBytes ? (double)nWireBytes / (double)nRawBytes : 1.0);
+	::fprintf(pFile, "compress: %lld compressed frames, %lld stored frames, compress %.1f us, decompress %.1f us\n",
+		(long long)nCompressedFrames,
+		(long long)nStoredFrames,
+		nCompressTicks * dTickUs,
+		nDecompressTicks * dTickUs);
+}
+
+IOCompressor::IOCompressor()
+	: m_hCompressor(NULL)
+	, m_hDecompressor(NULL)
+{
+	// RAW模式不写入压缩格式自身的头部，解压长度由帧头携带
+	if (!::CreateCompressor(COMPRESS_ALGORITHM_XPRESS_HUFF | COMPRESS_RAW, nullptr, &m_hCompressor))
+	{
+		m_hCompressor = NULL;
+	}
+
+	if (!::CreateDecompressor(COMPRESS_ALGORITHM_XPRESS_HUFF | COMPRESS_RAW, nullptr, &m_hDecompressor))
+	{
+		m_hDecompressor = NULL;
+	}
+}
+
+IOCompressor::~IOCompressor()
+{
+	if (m_hCompressor)
+	{
+		::CloseCompressor(m_hCompressor);
+		m_hCompressor = NULL;
+	}
+
+	if (m_hDecompressor)
+	{
+		::CloseDecompressor(m_hDecompressor);
+		m_hDecompressor = NULL;
+	}
+}
+
+bool IOCompressor::Compress(const char *pSrc, DWORD dwSrcLen, char *pDst, DWORD dwDstSize, DWORD &dwOutLen)
+{
+	dwOutLen = 0;
+	if (!m_hCompressor)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER begin, end;
+	::QueryPerformanceCounter(&begin);
+
+	SIZE_T nCompressedSize = 0;
+	BOOL bRet = ::Compress(m_hCompressor, pSrc, dwSrcLen, pDst, dwDstSize, &nCompressedSize);
+
+	::QueryPerformanceCounter(&end);
+	::InterlockedExchangeAdd64(&IOCompressStats::GetInstance().nCompressTicks, end.QuadPart - begin.QuadPart);
+
+	// 输出缓冲区不足(ERROR_INSUFFICIENT_BUFFER)即说明压缩没有收益
+	if (!bRet || nCompressedSize >= dwDstSize)
+	{
+		return false;
+	}
+
+	dwOutLen = (DWORD)nCompressedSize;
+	return true;
+}
+
+bool IOCompressor::Decompress(const char *pSrc, DWORD dwSrcLen, char *pDst, DWORD dwRawLen)
+{
+	if (!m_hDecompressor)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER begin, end;
+	::QueryPerformanceCounter(&begin);
+
+	SIZE_T nDecompressedSize = 0;
+	BOOL bRet = ::Decompress(m_hDecompressor, pSrc, dwSrcLen, pDst, dwRawLen, &nDecompressedSize);
+
+	::QueryPerformanceCounter(&end);
+	::InterlockedExchangeAdd64(&IOCompressStats::GetInstance().nDecompressTicks, end.QuadPart - begin.QuadPart);
+
+	return bRet && nDecompressedSize == dwRawLen;
+}
+
+IOCompressStream::IOCompressStream(COMPRESS_STREAM_STATE state, DWORD dwThreshold)
+	: m_nState((LONG)state)
+	, m_dwThreshold(dwThreshold)
+	, m_bHelloReceived(false)
+	, m_dwReadPos(0)
+{
+}
+
+DWORD IOCompressStream::WriteHello(char *pOutBuffer, DWORD dwOutSize)
+{
+	if (dwOutSize < COMPRESS_FRAME_HEADER_SIZE)
+	{
+		return 0;
+	}
+
+	IOCompressFrameHeader header;
+	header.wMagic = COMPRESS_FRAME_MAGIC;
+	header.wFlags = COMPRESS_FLAG_HELLO;
+	header.wPayloadLen = 0;
+	header.wRawLen = 0;
+	::memcpy(pOutBuffer, &header, COMPRESS_FRAME_HEADER_SIZE);
+	return COMPRESS_FRAME_HEADER_SIZE;
+}
+
+DWORD IOCompressStream::GetMaxRawChunk(DWORD dwBufferSize)
+{
+	if (dwBufferSize <= COMPRESS_FRAME_HEADER_SIZE)
+	{
+		return 0;
+	}
+
+	DWORD dwChunk = dwBufferSize - COMPRESS_FRAME_HEADER_SIZE;
+	return (dwChunk < COMPRESS_MAX_FRAME_PAYLOAD) ? dwChunk : COMPRESS_MAX_FRAME_PAYLOAD;
+}
+
+bool IOCompressStream::Encode(const char *buffer, DWORD dwLen, char *pOutBuffer, DWORD dwOutSize, DWORD &dwOutLen) const
+{
+	dwOutLen = 0;
+	if (dwLen > GetMaxRawChunk(dwOutSize))
+	{
+		return false;
+	}
+
+	IOCompressFrameHeader header;
+	header.wMagic = COMPRESS_FRAME_MAGIC;
+	header.wFlags = 0;
+	header.wRawLen = (WORD)dwLen;
+
+	// 压缩直接写入输出缓冲区的帧体位置，输出上限为原始长度，无收益时回退为原样拷贝
+	DWORD dwPayloadLen = 0;
+	if (dwLen >= m_dwThreshold &&
+		IOCompressor::GetThreadInstance().Compress(buffer, dwLen, pOutBuffer + COMPRESS_FRAME_HEADER_SIZE, dwLen, dwPayloadLen))
+	{
+		header.wFlags |= COMPRESS_FLAG_COMPRESSED;
+		::InterlockedIncrement64(&IOCompressStats::GetInstance().nCompressedFrames);
+	}
+	else
+	{
+		::memcpy(pOutBuffer + COMPRESS_FRAME_HEADER_SIZE, buffer, dwLen);
+		dwPayloadLen = dwLen;
+		::InterlockedIncrement64(&IOCompressStats::GetInstance().nStoredFrames);
+	}
+
+	header.wPayloadLen = (WORD)dwPayloadLen;
+	::memcpy(pOutBuffer, &header, COMPRESS_FRAME_HEADER_SIZE);
+	dwOutLen = COMPRESS_FRAME_HEADER_SIZE + dwPayloadLen;
+
+	::InterlockedExchangeAdd64(&IOCompressStats::GetInstance().nRawBytes, dwLen);
+	::InterlockedExchangeAdd64(&IOCompressStats::GetInstance().nWireBytes, dwOutLen);
+	return true;
+}
+
+bool IOCompressStream::Feed(const char *buffer, DWORD dwLen)
+{
+	if (m_dwReadPos > 0)
+	{
+		m_inBuffer.erase(m_inBuffer.begin(), m_inBuffer.begin() + m_dwReadPos);
+		m_dwReadPos = 0;
+	}
+	m_inBuffer.insert(m_inBuffer.end(), buffer, buffer + dwLen);
+
+	if ((LONG)COMPRESS_STREAM_STATE::COMPRESS_STATE_PROBING != m_nState)
+	{
+		return true;
+	}
+
+	// 对端的首个数据若是协商帧则启用压缩，否则整条连接透传
+	// 状态只从PROBING切换一次，客户端的StopProbing先生效时协商帧按普通数据透传
+	DWORD dwProbeLen = (m_inBuffer.size() < COMPRESS_FRAME_HEADER_SIZE) ? (DWORD)m_inBuffer.size() : COMPRESS_FRAME_HEADER_SIZE;
+	IOCompressFrameHeader hello;
+	WriteHello((char *)&hello, COMPRESS_FRAME_HEADER_SIZE);
+	if (0 != ::memcmp(m_inBuffer.data(), &hello, dwProbeLen))
+	{
+		::InterlockedCompareExchange(&m_nState, (LONG)COMPRESS_STREAM_STATE::COMPRESS_STATE_PLAIN, (LONG)COMPRESS_STREAM_STATE::COMPRESS_STATE_PROBING);
+		return true;
+	}
+
+	if (dwProbeLen == COMPRESS_FRAME_HEADER_SIZE &&
+		(LONG)COMPRESS_STREAM_STATE::COMPRESS_STATE_PROBING == ::InterlockedCompareExchange(
+			&m_nState, (LONG)COMPRESS_STREAM_STATE::COMPRESS_STATE_ACTIVE, (LONG)COMPRESS_STREAM_STATE::COMPRESS_STATE_PROBING))
+	{
+		Consume(COMPRESS_FRAME_HEADER_SIZE);
+		m_bHelloReceived = true;
+	}
+
+	return true;
+}
+
+bool IOCompressStream::NextMessage(char *pOutBuffer, DWORD dwOutSize, DWORD &dwOutLen)
+{
+	dwOutLen = 0;
+	DWORD dwAvailable = (DWORD)m_inBuffer.size() - m_dwReadPos;
+
+	if ((LONG)COMPRESS_STREAM_STATE::COMPRESS_STATE_PLAIN == m_nState)
+	{
+		dwOutLen = (dwAvailable < dwOutSize) ? dwAvailable : dwOutSize;
+		::memcpy(pOutBuffer, m_inBuffer.data() + m_dwReadPos, dwOutLen);
+		Consume(dwOutLen);
+		return true;
+	}
+
+	if ((LONG)COMPRESS_STREAM_STATE::COMPRESS_STATE_ACTIVE != m_nState)
+	{
+		return true;
+	}
+
+	// 协商帧不携带数据，直接跳过
+	while (dwAvailable >= COMPRESS_FRAME_HEADER_SIZE)
+	{
+		IOCompressFrameHeader header;
+		::memcpy(&header, m_inBuffer.data() + m_dwReadPos, COMPRESS_FRAME_HEADER_SIZE);
+		if (COMPRESS_FRAME_MAGIC != header.wMagic)
+		{
+			return false;
+		}
+
+		if (dwAvailable < COMPRESS_FRAME_HEADER_SIZE + header.wPayloadLen)
+		{
+			return true;
+		}
+
+		const char *pPayload = m_inBuffer.data() + m_dwReadPos + COMPRESS_FRAME_HEADER_SIZE;
+		if (header.wFlags & COMPRESS_FLAG_HELLO)
+		{
+			m_bHelloReceived = true;
+		}
+		else if (header.wRawLen > dwOutSize)
+		{
+			return false;
+		}
+		else if (header.wFlags & COMPRESS_FLAG_COMPRESSED)
+		{
+			if (!IOCompressor::GetThreadInstance().Decompress(pPayload, header.wPayloadLen, pOutBuffer, header.wRawLen))
+			{
+				return false;
+			}
+			dwOutLen = header.wRawLen;
+		}
+		else
+		{
+			if (header.wRawLen != header.wPayloadLen)
+			{
+				return false;
+			}
+			::memcpy(pOutBuffer, pPayload, header.wPayloadLen);
+			dwOutLen = header.wPayloadLen;
+		}
+
+		Consume(COMPRESS_FRAME_HEADER_SIZE + header.wPayloadLen);
+		dwAvailable -= COMPRESS_FRAME_HEADER_SIZE + header.wPayloadLen;
+
+		if (dwOutLen > 0)
+		{
+			return true;
+		}
+	}
+
+	return true;
+}
+
+bool IOCompressStream::TakeHello()
+{
+	bool bHelloReceived = m_bHelloReceived;
+	m_bHelloReceived = false;
+	return bHelloReceived;
+}
+
+void IOCompressStream::Consume(DWORD dwLen)
+{
+	m_dwReadPos += dwLen;
+	if (m_dwReadPos >= m_inBuffer.size())
+	{
+		m_inBuffer.clear();
+		m_dwReadPos = 0;
+	}
+}
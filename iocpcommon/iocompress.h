@@ -0,0 +1,153 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOCOMPRESS_H_
+#define _TINY_IOCP_IOCPCOMMON_IOCOMPRESS_H_
+
+#include <Windows.h>
+#include <compressapi.h>
+#include <stdio.h>
+#include <vector>
+
+#define COMPRESS_FRAME_MAGIC		(0x4354)	// 压缩帧头魔数('TC')
+#define COMPRESS_FLAG_HELLO			(0x0001)	// 协商帧，客户端发起，服务端以同样的帧应答
+#define COMPRESS_FLAG_COMPRESSED	(0x0002)	// 帧体为压缩数据，否则为原始数据
+#define COMPRESS_DEFAULT_THRESHOLD	(256)		// 小于此长度的消息不压缩
+#define COMPRESS_HELLO_TIMEOUT_MS	(1000)		// 客户端等待服务端协商应答的时长，超时按对端不支持压缩处理
+
+// 压缩帧头，帧体紧随其后
+// 协商成功后连接上双向的数据均以此格式分帧
+#pragma pack(push, 1)
+struct IOCompressFrameHeader
+{
+	WORD wMagic;		// COMPRESS_FRAME_MAGIC
+	WORD wFlags;		// COMPRESS_FLAG_*
+	WORD wPayloadLen;	// 帧体长度
+	WORD wRawLen;		// 帧体解压后的长度，未压缩时与wPayloadLen相同
+};
+#pragma pack(pop)
+
+//	连接的压缩协商状态
+enum class COMPRESS_STREAM_STATE
+{
+	COMPRESS_STATE_PROBING = 0,	// 等待对端的首个帧头：服务端据此判断对端是否请求压缩，客户端据此判断服务端是否应答
+	COMPRESS_STATE_ACTIVE,		// 已协商，收发数据均分帧
+	COMPRESS_STATE_PLAIN,		// 对端未请求压缩，数据原样透传
+};
+
+// 压缩统计，用于评估压缩带来的CPU开销与带宽节省
+struct IOCompressStats
+{
+	volatile LONG64 nRawBytes;			// 压缩前的字节数
+	volatile LONG64 nWireBytes;			// 实际发送的字节数(含帧头)
+	volatile LONG64 nCompressedFrames;	// 压缩发送的帧数
+	volatile LONG64 nStoredFrames;		// 低于阈值或压缩无收益而原样发送的帧数
+	volatile LONG64 nCompressTicks;		// 压缩耗时(QPC计数)
+	volatile LONG64 nDecompressTicks;	// 解压耗时(QPC计数)
+
+	static IOCompressStats& GetInstance()
+	{
+		static IOCompressStats s_compressStats = { 0 };
+		return s_compressStats;
+	}
+
+	void Dump(FILE *pFile) const;
+};
+
+// 每个工作线程独占的压缩/解压上下文(XPRESS_HUFF)，避免每条消息创建上下文，也无需加锁
+class IOCompressor
+{
+public:
+
+	~IOCompressor();
+
+public:
+
+	static IOCompressor& GetThreadInstance()
+	{
+		static thread_local IOCompressor t_compressor;
+		return t_compressor;
+	}
+
+	// 压缩结果不小于dwDstSize时返回false，调用者应原样发送
+	bool Compress(const char *pSrc, DWORD dwSrcLen, char *pDst, DWORD dwDstSize, DWORD &dwOutLen);
+	bool Decompress(const char *pSrc, DWORD dwSrcLen, char *pDst, DWORD dwRawLen);
+
+private:
+
+	IOCompressor();
+
+	IOCompressor(const IOCompressor&) = delete;
+	IOCompressor& operator= (const IOCompressor&) = delete;
+
+private:
+
+	COMPRESSOR_HANDLE m_hCompressor;
+	DECOMPRESSOR_HANDLE m_hDecompressor;
+};
+
+// 每个连接的压缩分帧层，位于recv/send路径(TLS之上)与OnRecv/Send之间
+// 收数据只在持有recv的工作线程上进行，不需要加锁；Encode无状态，可在任意线程调用
+class IOCompressStream
+{
+public:
+
+	IOCompressStream(COMPRESS_STREAM_STATE state, DWORD dwThreshold);
+	~IOCompressStream() = default;
+
+public:
+
+	// 写入协商帧，返回写入长度
+	static DWORD WriteHello(char *pOutBuffer, DWORD dwOutSize);
+
+	// 大小为dwBufferSize的输出缓冲区中一帧可以容纳的最大消息长度
+	static DWORD GetMaxRawChunk(DWORD dwBufferSize);
+
+	// 将一条消息编码为一帧写入pOutBuffer，dwLen不能超过GetMaxRawChunk
+	bool Encode(const char *buffer, DWORD dwLen, char *pOutBuffer, DWORD dwOutSize, DWORD &dwOutLen) const;
+
+	// 处理收到的数据，返回false表示帧格式错误，需关闭连接
+	bool Feed(const char *buffer, DWORD dwLen);
+
+	// 取出下一条完整消息，dwOutLen为0表示数据不足；返回false表示帧格式错误
+	bool NextMessage(char *pOutBuffer, DWORD dwOutSize, DWORD &dwOutLen);
+
+	// 收到对端的协商帧后仅返回一次true，服务端据此应答
+	bool TakeHello();
+
+	bool IsActive() const
+	{
+		return (LONG)COMPRESS_STREAM_STATE::COMPRESS_STATE_ACTIVE == m_nState;
+	}
+
+	bool IsProbing() const
+	{
+		return (LONG)COMPRESS_STREAM_STATE::COMPRESS_STATE_PROBING == m_nState;
+	}
+
+	// 协商未在限定时间内得出结果(对端一直没有发来数据)时放弃，整条连接透传；已得出结果时不改变
+	void StopProbing()
+	{
+		::InterlockedCompareExchange(&m_nState, (LONG)COMPRESS_STREAM_STATE::COMPRESS_STATE_PLAIN, (LONG)COMPRESS_STREAM_STATE::COMPRESS_STATE_PROBING);
+	}
+
+	// 已确定透传且没有缓存的数据，调用者可直接将收到的数据交给上层
+	bool IsPassThrough() const
+	{
+		return (LONG)COMPRESS_STREAM_STATE::COMPRESS_STATE_PLAIN == m_nState && m_dwReadPos == m_inBuffer.size();
+	}
+
+private:
+
+	void Consume(DWORD dwLen);
+
+	IOCompressStream(const IOCompressStream&) = delete;
+	IOCompressStream& operator= (const IOCompressStream&) = delete;
+
+private:
+
+	volatile LONG m_nState;			// COMPRESS_STREAM_STATE，发送线程据此决定是否分帧
+	DWORD m_dwThreshold;			// 压缩阈值
+	bool m_bHelloReceived;			// 是否收到尚未应答的协商帧
+	std::vector<char> m_inBuffer;	// 尚未组成完整帧的数据
+	DWORD m_dwReadPos;				// m_inBuffer中已处理数据的位置，下次Feed时整理
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOCOMPRESS_H_
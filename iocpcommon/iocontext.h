@@ -0,0 +1,996 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOCONTEXT_H_
+#define _TINY_IOCP_IOCPCOMMON_IOCONTEXT_H_
+
+#include <WinSock2.h>
+#include <Windows.h>
+#include "iolock.h"
+#include "iotls.h"
+#include "iocompress.h"
+#include "iotrace.h"
+#include "ionuma.h"
+#include "ioshm.h"
+#include "ioarena.h"
+#include "ioalloc.h"
+#include <vector>
+
+#define MAX_BUFFER_SIZE  (1024 * 4)	// 完成端口操作的数据缓冲区大小(4K)
+#define RECV_BUFFER_SIZE_MEDIUM	(1024 * 16)	// recv缓冲区的中档容量(16K)
+#define RECV_BUFFER_SIZE_MAX	(1024 * 64)	// recv缓冲区的最大容量(64K)，可按监听配置加大recv缓冲区
+#define BUFFER_CAPACITY_TIERS	(3)			// 缓冲区容量档位数(4K/16K/64K)
+#define INVALID_CONN_ID	 (0)		// 无效的连接ID
+#define CONTEXT_DRAIN_TIMEOUT	(10 * 1000)	// 停止时等待名下连接上下文全部销毁的最长时间(毫秒)
+
+// 连接ID：高32位为槽位代数，低32位为槽位序号与分片序号的组合
+// 连接关闭后槽位代数递增，持有旧ID的线程据此判定连接已失效
+typedef ULONGLONG CONN_ID;
+
+//	完成端口投递操作类型
+enum class IOCP_OPERATOR_TYPE
+{
+	IOCP_OPT_NONE = 0,	
+	IOCP_OPT_ACCPEPT,	// 接受连接
+	IOCP_OPT_SEND,		// 发送数据
+	IOCP_OPT_RECV,		// 接受数据
+	IOCP_OPT_RESUME,	// 恢复被推迟的recv(由PostQueuedCompletionStatus投递)
+	IOCP_OPT_TIMER,		// 定时检查(由定时器经PostQueuedCompletionStatus投递)
+	IOCP_OPT_SHM_RECV,	// 共享内存连接可接收(通道登记的等待触发后由PostQueuedCompletionStatus投递的唤醒包)
+	IOCP_OPT_RECV_INTO,	// 直接读入应用缓冲区的recv(见IServer::RecvInto)
+};
+
+//	热重启交接状态
+enum class IOCP_HANDOFF_STATE
+{
+	IOCP_HANDOFF_NONE = 0,
+	IOCP_HANDOFF_PENDING,	// 等待在途的recv完成或被取消
+	IOCP_HANDOFF_PARKED,	// recv已停止投递，可以交接给新进程
+};
+
+//	完成端口OVERLAPPED的重叠结构
+struct IOOverlappedContext 
+{
+	WSAOVERLAPPED wsaOverlapped;	// 重叠结构必须的成员且放置在第一个位置
+	SOCKET ioSocket;
+	WSABUF wsaBuffer;
+	IOCP_OPERATOR_TYPE optType;
+	USHORT nNumaNode;				// 缓冲区所在的NUMA节点，释放时归还到该节点
+	DWORD dwBufferSize;				// 缓冲区的可用大小，默认MAX_BUFFER_SIZE，不小于MAX_BUFFER_SIZE的容量始终可用
+	IOOverlappedContext *pListPrev;	// 所在链表(连接持有的链表或池的空闲链表)中的前后节点，链表操作不再分配节点
+	IOOverlappedContext *pListNext;
+	// TODO: 也可以附加其他需要的数据成员
+
+	explicit IOOverlappedContext(USHORT nNode = 0)
+		: ioSocket(NULL)
+		, optType(IOCP_OPERATOR_TYPE::IOCP_OPT_NONE)
+		, nNumaNode(nNode)
+		, dwBufferSize(MAX_BUFFER_SIZE)
+		, pListPrev(nullptr)
+		, pListNext(nullptr)
+	{
+		::memset(&wsaOverlapped, 0, sizeof(wsaOverlapped));
+		MallocWsaBuffer(wsaBuffer);
+	}
+
+	~IOOverlappedContext()
+	{
+		if (wsaBuffer.buf)
+		{
+			FreeBuffer(nNumaNode, dwBufferSize, wsaBuffer.buf);
+			wsaBuffer.buf = nullptr;
+		}
+	}
+
+	// 缓冲区内容不清零，有效数据以wsaBuffer.len为准
+	void ResetBufferAndOptType()
+	{
+		if (wsaBuffer.buf)
+		{
+			wsaBuffer.len = dwBufferSize;
+		}
+		else
+		{
+			MallocWsaBuffer(wsaBuffer);
+		}
+
+		::memset(&wsaOverlapped, 0, sizeof(wsaOverlapped));
+		optType = IOCP_OPERATOR_TYPE::IOCP_OPT_NONE;
+	}
+
+	void MallocWsaBuffer(WSABUF &wsaBuffer)
+	{
+		wsaBuffer.buf = AllocBuffer(nNumaNode, dwBufferSize);
+		wsaBuffer.len = dwBufferSize;
+	}
+
+	// 调整缓冲区的可用大小(1到RECV_BUFFER_SIZE_MAX)，容量档位变化时换用对应档位的缓冲区，原有内容不保留
+	bool SetBufferSize(DWORD dwSize)
+	{
+		if (0 == dwSize || dwSize > RECV_BUFFER_SIZE_MAX)
+		{
+			return false;
+		}
+
+		if (GetBufferCapacity(dwSize) != GetBufferCapacity(dwBufferSize) || !wsaBuffer.buf)
+		{
+			if (wsaBuffer.buf)
+			{
+				FreeBuffer(nNumaNode, dwBufferSize, wsaBuffer.buf);
+			}
+			dwBufferSize = dwSize;
+			MallocWsaBuffer(wsaBuffer);
+			return nullptr != wsaBuffer.buf;
+		}
+
+		dwBufferSize = dwSize;
+		wsaBuffer.len = dwSize;
+		return true;
+	}
+
+	// 缓冲区按4K/16K/64K三档分配，每档由各自的NUMA分配器管理
+	static DWORD GetBufferCapacity(DWORD dwSize)
+	{
+		if (dwSize <= MAX_BUFFER_SIZE)
+		{
+			return MAX_BUFFER_SIZE;
+		}
+		return (dwSize <= RECV_BUFFER_SIZE_MEDIUM) ? RECV_BUFFER_SIZE_MEDIUM : RECV_BUFFER_SIZE_MAX;
+	}
+
+	// 容量档位的序号，重叠结构池按此分链表
+	static unsigned int GetBufferTier(DWORD dwSize)
+	{
+		switch (GetBufferCapacity(dwSize))
+		{
+		case MAX_BUFFER_SIZE:
+			return 0;
+		case RECV_BUFFER_SIZE_MEDIUM:
+			return 1;
+		default:
+			return 2;
+		}
+	}
+
+	static char* AllocBuffer(USHORT nNode, DWORD dwSize)
+	{
+		switch (GetBufferCapacity(dwSize))
+		{
+		case MAX_BUFFER_SIZE:
+			return IONumaBufferAllocator<MAX_BUFFER_SIZE>::GetInstance().Alloc(nNode);
+		case RECV_BUFFER_SIZE_MEDIUM:
+			return IONumaBufferAllocator<RECV_BUFFER_SIZE_MEDIUM>::GetInstance().Alloc(nNode);
+		default:
+			return IONumaBufferAllocator<RECV_BUFFER_SIZE_MAX>::GetInstance().Alloc(nNode);
+		}
+	}
+
+	static void FreeBuffer(USHORT nNode, DWORD dwSize, char *pBuffer)
+	{
+		switch (GetBufferCapacity(dwSize))
+		{
+		case MAX_BUFFER_SIZE:
+			IONumaBufferAllocator<MAX_BUFFER_SIZE>::GetInstance().Free(nNode, pBuffer);
+			break;
+		case RECV_BUFFER_SIZE_MEDIUM:
+			IONumaBufferAllocator<RECV_BUFFER_SIZE_MEDIUM>::GetInstance().Free(nNode, pBuffer);
+			break;
+		default:
+			IONumaBufferAllocator<RECV_BUFFER_SIZE_MAX>::GetInstance().Free(nNode, pBuffer);
+			break;
+		}
+	}
+
+	// 先于重叠结构池构造各档分配器，保证其析构晚于池
+	static void InitBufferAllocators()
+	{
+		IONumaBufferAllocator<MAX_BUFFER_SIZE>::GetInstance();
+		IONumaBufferAllocator<RECV_BUFFER_SIZE_MEDIUM>::GetInstance();
+		IONumaBufferAllocator<RECV_BUFFER_SIZE_MAX>::GetInstance();
+	}
+};
+
+// OverlappedContext重叠结构共享池，避免频繁创建/释放IOOverlappedContext的操作
+// 按NUMA节点分池：从当前线程所在节点的池中分配，释放时归还到缓冲区所属节点的池
+// 空闲链表经重叠结构自身的pListNext串联(后进先出)，出入池均不分配内存
+// 每个节点按缓冲区容量档位分链表：加大过的recv缓冲区随重叠结构留在池中，下次按同样大小分配时直接复用
+class IOOverlappedContextPool
+{
+public:
+
+	explicit IOOverlappedContextPool(unsigned int nOverlappedContextNum)
+	{
+		IOOverlappedContext::InitBufferAllocators();
+
+		for (size_t i = 0; i < nOverlappedContextNum; i++)
+		{
+			IOOverlappedContext *pOverlappedContext = new IOOverlappedContext();
+			pOverlappedContext->pListNext = m_nodePools[0].pFreeHeads[0];
+			m_nodePools[0].pFreeHeads[0] = pOverlappedContext;
+		}
+	}
+
+	~IOOverlappedContextPool()
+	{
+		for (unsigned int nNode = 0; nNode < MAX_NUMA_NODES; ++nNode)
+		{
+			for (unsigned int nTier = 0; nTier < BUFFER_CAPACITY_TIERS; ++nTier)
+			{
+				while (m_nodePools[nNode].pFreeHeads[nTier])
+				{
+					IOOverlappedContext *pOverlappedContext = m_nodePools[nNode].pFreeHeads[nTier];
+					m_nodePools[nNode].pFreeHeads[nTier] = pOverlappedContext->pListNext;
+					delete pOverlappedContext;
+				}
+			}
+		}
+	}
+
+public:
+
+	static IOOverlappedContextPool& GetInstance()
+	{
+		static IOOverlappedContextPool s_overlappedContextPool;
+		return s_overlappedContextPool;
+	}
+
+	// 从nNode节点分配缓冲区可用大小为dwBufferSize(1到RECV_BUFFER_SIZE_MAX)的重叠结构，缓冲区分配失败时返回nullptr
+	// nNode为NUMA_NODE_UNBOUND时取当前线程所在的节点
+	IOOverlappedContext* AllocIOOverlappedContext(DWORD dwBufferSize = MAX_BUFFER_SIZE, USHORT nNode = NUMA_NODE_UNBOUND)
+	{
+		if (0 == dwBufferSize || dwBufferSize > RECV_BUFFER_SIZE_MAX)
+		{
+			return nullptr;
+		}
+
+		IOOverlappedContext* pOverlappedContext = nullptr;
+		if (nNode >= MAX_NUMA_NODES)
+		{
+			nNode = IONuma::GetCurrentNode();
+		}
+		NodePool &nodePool = m_nodePools[nNode];
+		unsigned int nTier = IOOverlappedContext::GetBufferTier(dwBufferSize);
+
+		IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_POOL_BEGIN);
+		{
+			AutoLock<EngineLock> lock(nodePool.lock);
+
+			pOverlappedContext = nodePool.pFreeHeads[nTier];
+			if (pOverlappedContext)
+			{
+				nodePool.pFreeHeads[nTier] = pOverlappedContext->pListNext;
+			}
+		}
+		if (!pOverlappedContext)
+		{
+			pOverlappedContext = new IOOverlappedContext(nNode);
+		}
+		pOverlappedContext->pListPrev = nullptr;
+		pOverlappedContext->pListNext = nullptr;
+
+		// 同档位的重叠结构只调整可用大小；新建的重叠结构在此换用对应档位的缓冲区
+		if (!pOverlappedContext->SetBufferSize(dwBufferSize))
+		{
+			ReleaseIOOverlappedContext(pOverlappedContext);
+			pOverlappedContext = nullptr;
+		}
+		IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_POOL_END);
+		return pOverlappedContext;
+	}
+
+	void ReleaseIOOverlappedContext(IOOverlappedContext* overlappedContext)
+	{
+		if (!overlappedContext)
+		{
+			return;
+		}
+
+		// 缓冲区连同重叠结构一起留在所属档位的链表中，不在归还时释放；缓冲区分配失败过的重叠结构直接销毁
+		if (!overlappedContext->wsaBuffer.buf)
+		{
+			delete overlappedContext;
+			return;
+		}
+
+		NodePool &nodePool = m_nodePools[(overlappedContext->nNumaNode < MAX_NUMA_NODES) ? overlappedContext->nNumaNode : 0];
+		unsigned int nTier = IOOverlappedContext::GetBufferTier(overlappedContext->dwBufferSize);
+		AutoLock<EngineLock> lock(nodePool.lock);
+		overlappedContext->pListPrev = nullptr;
+		overlappedContext->pListNext = nodePool.pFreeHeads[nTier];
+		nodePool.pFreeHeads[nTier] = overlappedContext;
+	}
+
+private:
+
+	IOOverlappedContextPool()
+	{
+		IOOverlappedContext::InitBufferAllocators();
+	}
+
+	IOOverlappedContextPool(const IOOverlappedContextPool&) = delete;
+	IOOverlappedContextPool& operator= (const IOOverlappedContextPool&) = delete;
+
+private:
+
+	struct NodePool
+	{
+		IOOverlappedContext *pFreeHeads[BUFFER_CAPACITY_TIERS];	// 按缓冲区容量档位分的空闲链表
+		EngineLock lock;
+
+		NodePool() : lock("IOOverlappedContextPool")
+		{
+			::memset(pFreeHeads, 0, sizeof(pFreeHeads));
+		}
+	};
+
+	NodePool m_nodePools[MAX_NUMA_NODES];
+};
+
+
+// 当前线程在上层回调中的累计耗时(TSC计数)，不含回调中的引擎锁等待
+// 工作者线程据此把一个完成包的处理时间分为上层回调与引擎(含服务端/客户端自身的协议处理与簿记)两部分
+struct CallbackTimeCounter
+{
+	ULONGLONG ullCallbackTsc;
+	LONG nDepth;			// 嵌套的回调层数
+
+	static CallbackTimeCounter& GetThreadInstance()
+	{
+		static thread_local CallbackTimeCounter t_callbackTimeCounter = { 0, 0 };
+		return t_callbackTimeCounter;
+	}
+};
+
+// 在调用上层回调(OnRecv/OnSend/OnEstablished等)前定义，作用域内的耗时计入当前线程的CallbackTimeCounter
+// 回调中同步完成的send触发的OnSend等嵌套回调只由最外层计时
+class IOCallbackScope
+{
+public:
+
+	IOCallbackScope()
+		: m_counter(CallbackTimeCounter::GetThreadInstance())
+		, m_ullBegin(0)
+		, m_ullLockWaitBegin(0)
+	{
+		if (0 == m_counter.nDepth++)
+		{
+			m_ullLockWaitBegin = LockWaitCounter::GetThreadInstance().ullWaitTsc;
+			m_ullBegin = __rdtsc();
+		}
+	}
+
+	~IOCallbackScope()
+	{
+		if (0 == --m_counter.nDepth)
+		{
+			ULONGLONG ullElapsed = __rdtsc() - m_ullBegin;
+			ULONGLONG ullLockWait = LockWaitCounter::GetThreadInstance().ullWaitTsc - m_ullLockWaitBegin;
+			m_counter.ullCallbackTsc += (ullLockWait < ullElapsed) ? (ullElapsed - ullLockWait) : 0;
+		}
+	}
+
+private:
+
+	IOCallbackScope(const IOCallbackScope&) = delete;
+	IOCallbackScope& operator= (const IOCallbackScope&) = delete;
+
+private:
+
+	CallbackTimeCounter &m_counter;
+	ULONGLONG m_ullBegin;
+	ULONGLONG m_ullLockWaitBegin;
+};
+
+class IOSocketContext;
+
+// 完成包的处理者(服务端/客户端)，引擎的工作线程按连接上下文所属的处理者分发完成包
+// 处理者记录名下尚未销毁的连接上下文数量，停止时据此等待在途IO全部结束
+class IOCompletionHandler
+{
+public:
+
+	// 处理一个完成包，bRet/dwError为GetQueuedCompletionStatus的结果
+	// 实现者负责释放本次IO持有的连接引用
+	virtual void OnCompletion(
+		IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, BOOL bRet, DWORD dwBytes, DWORD dwError) = 0;
+
+	// 引擎的过载状态发生变化(见IOEngine::EnableAdmissionControl)，在工作者线程上回调，须经IOEngine::RegisterHandler注册
+	virtual void OnOverloadChanged(bool /*bOverloaded*/)
+	{
+	}
+
+	// 引擎的分片负载失衡(见IOEngine::EnableRebalance)，在引擎的检查线程上回调：从名下位于fromPort分片的连接中
+	// 挑选约占其负载dFraction的连接，以IOSocketContext::RequestMigrate迁往toPort分片
+	virtual void OnRebalance(HANDLE /*fromPort*/, HANDLE /*toPort*/, double /*dFraction*/)
+	{
+	}
+
+	// 连接上下文即将销毁，此后不再有任何线程访问它；协议层在此释放挂在pProtocolSession上的会话
+	virtual void OnContextDestroyed(IOSocketContext* /*pSocketContext*/)
+	{
+	}
+
+	void AttachContext()
+	{
+		::InterlockedIncrement(&m_nContexts);
+	}
+
+	void DetachContext()
+	{
+		::InterlockedDecrement(&m_nContexts);
+	}
+
+	// 名下是否还有尚未销毁的连接上下文，析构前应为false
+	bool HasContexts() const
+	{
+		return m_nContexts > 0;
+	}
+
+	// 标记当前线程为引擎的工作者线程，由工作者线程启动时调用
+	static void MarkWorkerThread()
+	{
+		OnWorkerThread() = true;
+	}
+
+protected:
+
+	IOCompletionHandler()
+		: m_nContexts(0)
+	{
+	}
+
+	virtual ~IOCompletionHandler() = default;
+
+	// 等待名下所有连接上下文销毁，之后不会再有完成包分发到此处理者；超时返回false
+	// 在工作者线程上等待时，该线程本应处理的完成包无法取出，连接上下文可能永远不会销毁，此时直接返回false
+	bool WaitForContexts(DWORD dwTimeout = CONTEXT_DRAIN_TIMEOUT)
+	{
+		if (m_nContexts > 0 && OnWorkerThread())
+		{
+			return false;
+		}
+
+		ULONGLONG ullDeadline = ::GetTickCount64() + dwTimeout;
+		while (m_nContexts > 0)
+		{
+			if (::GetTickCount64() >= ullDeadline)
+			{
+				return false;
+			}
+			::Sleep(10);
+		}
+		return true;
+	}
+
+private:
+
+	static bool& OnWorkerThread()
+	{
+		static thread_local bool t_bWorkerThread = false;
+		return t_bWorkerThread;
+	}
+
+private:
+
+	volatile LONG m_nContexts;	// 名下尚未销毁的连接上下文数量
+};
+
+// 固定大小内存块的空闲链表，释放的块留待下次分配复用，直到进程退出才归还
+class IOBlockFreeList
+{
+public:
+
+	IOBlockFreeList() : m_pHead(nullptr) {}
+
+	// 没有空闲块时返回nullptr
+	void* Pop()
+	{
+		AutoLock<SpinLock> lock(m_lock);
+		IOFreeBlock *pBlock = m_pHead;
+		if (pBlock)
+		{
+			m_pHead = pBlock->pNext;
+		}
+		return pBlock;
+	}
+
+	void Push(void *p)
+	{
+		IOFreeBlock *pBlock = reinterpret_cast<IOFreeBlock*>(p);
+		AutoLock<SpinLock> lock(m_lock);
+		pBlock->pNext = m_pHead;
+		m_pHead = pBlock;
+	}
+
+private:
+
+	IOBlockFreeList(const IOBlockFreeList&) = delete;
+	IOBlockFreeList& operator= (const IOBlockFreeList&) = delete;
+
+private:
+
+	struct IOFreeBlock
+	{
+		IOFreeBlock *pNext;
+	};
+
+	SpinLock m_lock;
+	IOFreeBlock *m_pHead;
+};
+
+// 每个连接对应的套接字上下文结构对象
+class IOSocketContext
+{
+public:
+
+	SOCKET connSocket;		// 连接的socket
+	SOCKADDR_IN clientAddr;	// 连接的客户端地址
+	CONN_ID connId;			// 连接ID，其他线程应持有此ID而非IOSocketContext指针
+	IOTlsSession *pTlsSession;	// TLS会话，未启用TLS时为nullptr
+	IOCompressStream *pCompressStream;	// 压缩分帧层，未启用压缩时为nullptr
+	void *pProtocolSession;	// 协议层(如IHttpServer)的会话，由pHandler创建并在OnContextDestroyed中释放，引擎不解读
+	IOShmChannel *pShmChannel;	// 共享内存通道，仅共享内存连接使用(connSocket为INVALID_SOCKET)
+	IOCompletionHandler *pHandler;	// 处理本连接完成包的服务端/客户端
+	HANDLE completionPort;	// 连接绑定的完成端口
+	USHORT nNumaNode;		// completionPort所在分片的NUMA节点，连接的重叠结构与缓冲区从此节点分配；NUMA_NODE_UNBOUND为尚未绑定
+	bool bSkipCompletionOnSuccess;	// 同步完成的IO不再投递完成包，由投递方就地处理(FILE_SKIP_COMPLETION_PORT_ON_SUCCESS)
+	DWORD dwRoundRecvBytes;	// 本轮已读取的字节数，同一时刻只有一个recv在途，无需加锁
+	LONG64 nRecvRound;		// dwRoundRecvBytes所属的调度轮次
+	volatile LONG64 nLoadEpoch;	// ullEpochRecvBytes所属的负载检查周期(IOEngine::GetRebalanceEpoch)
+	volatile ULONGLONG ullEpochRecvBytes;	// nLoadEpoch周期内读取的字节数，只由recv路径写入
+	volatile ULONGLONG ullLastEpochRecvBytes;	// nLoadEpoch的前一个周期读取的字节数，迁移时据此挑选负载重的连接
+	char *pRecvIntoBuffer;	// 直接接收的应用缓冲区，nullptr为未在直接接收；与recv一样只由recv路径访问，无需加锁
+	DWORD dwRecvIntoLen;	// 直接接收的总字节数
+	DWORD dwRecvIntoDone;	// 直接接收已读入的字节数
+
+public:
+
+	explicit IOSocketContext(IOCompletionHandler *pCompletionHandler = nullptr)
+		: connSocket(INVALID_SOCKET)
+		, connId(INVALID_CONN_ID)
+		, pTlsSession(nullptr)
+		, pCompressStream(nullptr)
+		, pProtocolSession(nullptr)
+		, pShmChannel(nullptr)
+		, pHandler(pCompletionHandler)
+		, completionPort(NULL)
+		, nNumaNode(NUMA_NODE_UNBOUND)
+		, bSkipCompletionOnSuccess(false)
+		, dwRoundRecvBytes(0)
+		, nRecvRound(0)
+		, nLoadEpoch(0)
+		, ullEpochRecvBytes(0)
+		, ullLastEpochRecvBytes(0)
+		, pRecvIntoBuffer(nullptr)
+		, dwRecvIntoLen(0)
+		, dwRecvIntoDone(0)
+		, m_pOverlappedContextHead(nullptr)
+		, m_lock("IOSocketContext")
+		, m_nRefCount(1)
+		, m_nClosed(0)
+		, m_nPendingSends(0)
+		, m_nHandOffState((LONG)IOCP_HANDOFF_STATE::IOCP_HANDOFF_NONE)
+		, m_pRecvOverlappedContext(nullptr)
+		, m_pParkedOverlappedContext(nullptr)
+		, m_dwParkedBytes(0)
+		, m_migratePort(NULL)
+	{
+		::memset(&clientAddr, 0, sizeof(clientAddr));
+
+		if (pHandler)
+		{
+			pHandler->AttachContext();
+		}
+	}
+
+	~IOSocketContext()
+	{
+		if (connSocket != INVALID_SOCKET)
+		{
+			::closesocket(connSocket);
+			connSocket = INVALID_SOCKET;
+		}
+
+		if (pTlsSession)
+		{
+			delete pTlsSession;
+			pTlsSession = nullptr;
+		}
+
+		if (pCompressStream)
+		{
+			delete pCompressStream;
+			pCompressStream = nullptr;
+		}
+
+		if (pHandler && pProtocolSession)
+		{
+			pHandler->OnContextDestroyed(this);
+			pProtocolSession = nullptr;
+		}
+
+		if (pShmChannel)
+		{
+			delete pShmChannel;
+			pShmChannel = nullptr;
+		}
+
+		while (m_pOverlappedContextHead)
+		{
+			IOOverlappedContext *pOverlappedContext = m_pOverlappedContextHead;
+			m_pOverlappedContextHead = pOverlappedContext->pListNext;
+			IOOverlappedContextPool::GetInstance().ReleaseIOOverlappedContext(pOverlappedContext);
+		}
+
+		if (pHandler)
+		{
+			pHandler->DetachContext();
+		}
+	}
+
+	// 连接上下文的内存在释放后留在空闲链表中，接入新连接时不再向堆申请
+	static void* operator new(size_t nSize)
+	{
+		void *p = (sizeof(IOSocketContext) == nSize) ? GetFreeList().Pop() : nullptr;
+		return p ? p : ::operator new(nSize);
+	}
+
+	static void operator delete(void *p, size_t nSize)
+	{
+		if (!p)
+		{
+			return;
+		}
+
+		if (sizeof(IOSocketContext) == nSize)
+		{
+			GetFreeList().Push(p);
+			return;
+		}
+		::operator delete(p);
+	}
+
+	// dwBufferSize为缓冲区的可用大小，缓冲区分配失败时返回nullptr
+	// 从连接所在分片的节点分配，而不是当前线程的节点：接受连接的线程属于监听socket所在的分片
+	IOOverlappedContext* NewIOOverlappedContext(DWORD dwBufferSize = MAX_BUFFER_SIZE)
+	{
+		IOOverlappedContext *pOverlappedContext =
+			IOOverlappedContextPool::GetInstance().AllocIOOverlappedContext(dwBufferSize, nNumaNode);
+		if (pOverlappedContext)
+		{
+			AutoLock<EngineLock> lock(m_lock);
+			pOverlappedContext->pListNext = m_pOverlappedContextHead;
+			if (m_pOverlappedContextHead)
+			{
+				m_pOverlappedContextHead->pListPrev = pOverlappedContext;
+			}
+			m_pOverlappedContextHead = pOverlappedContext;
+		}
+		return pOverlappedContext;
+	}
+
+	// 从连接持有的链表中摘下(O(1))并归还到池中，pOverlappedContext须由本连接的NewIOOverlappedContext分配
+	void ReleaseIOOverlappedContext(IOOverlappedContext* pOverlappedContext)
+	{
+		if (!pOverlappedContext)
+		{
+			return;
+		}
+
+		{
+			AutoLock<EngineLock> lock(m_lock);
+			if (pOverlappedContext->pListPrev)
+			{
+				pOverlappedContext->pListPrev->pListNext = pOverlappedContext->pListNext;
+			}
+			else
+			{
+				m_pOverlappedContextHead = pOverlappedContext->pListNext;
+			}
+			if (pOverlappedContext->pListNext)
+			{
+				pOverlappedContext->pListNext->pListPrev = pOverlappedContext->pListPrev;
+			}
+		}
+
+		IOOverlappedContextPool::GetInstance().ReleaseIOOverlappedContext(pOverlappedContext);
+	}
+
+	// 引用计数：连接本身持有初始引用，每个投递中的IO及跨线程的使用者各持有一个引用
+	// 最后一个引用释放时才真正销毁上下文，避免IO仍在途时被delete
+	void AddRef()
+	{
+		::InterlockedIncrement(&m_nRefCount);
+	}
+
+	void Release()
+	{
+		if (0 == ::InterlockedDecrement(&m_nRefCount))
+		{
+			delete this;
+		}
+	}
+
+	// 标记连接已关闭，仅第一次调用返回true
+	bool MarkClosed()
+	{
+		return (0 == ::InterlockedExchange(&m_nClosed, 1));
+	}
+
+	bool IsClosed() const
+	{
+		return (0 != m_nClosed);
+	}
+
+	// 取消socket上所有在途IO，socket句柄在上下文销毁时才关闭，防止句柄被复用
+	// 共享内存连接则关闭本端通道，登记的接收等待随之触发并释放其持有的引用
+	void CancelIO()
+	{
+		if (connSocket != INVALID_SOCKET)
+		{
+			::CancelIoEx((HANDLE)connSocket, nullptr);
+		}
+
+		if (pShmChannel)
+		{
+			pShmChannel->Close();
+		}
+	}
+
+	// 投递IO之后调用：连接在投递期间被其他线程关闭时，关闭方的CancelIO可能早于本次投递而未取消到它，在此补一次
+	// 否则对端不再发送数据时该recv永不完成，其持有的引用使连接上下文无法销毁
+	// 只按地址取消本socket上的IO，重叠结构此时已完成并被复用也不会误取消其他连接的IO
+	void CancelIfClosed(IOOverlappedContext *pOverlappedContext)
+	{
+		if (IsClosed() && connSocket != INVALID_SOCKET)
+		{
+			::CancelIoEx((HANDLE)connSocket, &pOverlappedContext->wsaOverlapped);
+		}
+	}
+
+	// 共享内存连接：由引擎驱动接收，以pOverlappedContext的缓冲区接收数据
+	// 通道登记的等待触发后向完成端口投递IOCP_OPT_SHM_RECV唤醒包，处理者经ReceiveShm读取并交给上层后调用ArmShmReader登记下一次
+	// 登记的等待与在途的唤醒包持有连接的一个引用，同一时刻只有其一
+	bool StartShmReader(IOOverlappedContext *pOverlappedContext)
+	{
+		BeginRecv(pOverlappedContext);
+		pOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_SHM_RECV;
+
+		AddRef();
+		if (!ArmShmReader())
+		{
+			Release();
+			return false;
+		}
+		return true;
+	}
+
+	// 处理者取出唤醒包后调用：非阻塞地读入接收缓冲区
+	SHM_WAIT_RESULT ReceiveShm(DWORD &dwBytes)
+	{
+		IOOverlappedContext *pOverlappedContext = m_pRecvOverlappedContext;
+		pOverlappedContext->ResetBufferAndOptType();
+		pOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_SHM_RECV;
+		SHM_WAIT_RESULT result = pShmChannel->Receive(pOverlappedContext->wsaBuffer.buf, pOverlappedContext->dwBufferSize, dwBytes);
+		pOverlappedContext->wsaBuffer.len = dwBytes;
+		return result;
+	}
+
+	// 登记下一次接收，已有数据或关闭待处理时直接投递唤醒包；调用者须先为其AddRef，失败时由调用者释放
+	bool ArmShmReader()
+	{
+		bool bReady = false;
+		if (!pShmChannel->ArmReceive(ShmWaitCallback, this, bReady))
+		{
+			return false;
+		}
+		return !bReady || PostShmWakeup();
+	}
+
+	// 在途send计数，热重启交接需等待其归零；send完成时先减计数再回调OnSend
+	void BeginSend()
+	{
+		::InterlockedIncrement(&m_nPendingSends);
+	}
+
+	void EndSend()
+	{
+		::InterlockedDecrement(&m_nPendingSends);
+	}
+
+	LONG GetPendingSends() const
+	{
+		return m_nPendingSends;
+	}
+
+	// 记录当前投递的recv重叠结构，交接时只取消recv而不影响在途的send
+	void BeginRecv(IOOverlappedContext *pOverlappedContext)
+	{
+		m_pRecvOverlappedContext = pOverlappedContext;
+	}
+
+	// 开始交接：停止继续投递recv并取消在途的recv
+	void BeginHandOff()
+	{
+		::InterlockedCompareExchange(&m_nHandOffState,
+			(LONG)IOCP_HANDOFF_STATE::IOCP_HANDOFF_PENDING, (LONG)IOCP_HANDOFF_STATE::IOCP_HANDOFF_NONE);
+		CancelRecv();
+	}
+
+	void CancelRecv()
+	{
+		IOOverlappedContext *pRecvOverlappedContext = m_pRecvOverlappedContext;
+		if (connSocket != INVALID_SOCKET && pRecvOverlappedContext)
+		{
+			::CancelIoEx((HANDLE)connSocket, &pRecvOverlappedContext->wsaOverlapped);
+		}
+	}
+
+	bool IsHandingOff() const
+	{
+		return ((LONG)IOCP_HANDOFF_STATE::IOCP_HANDOFF_NONE != m_nHandOffState);
+	}
+
+	bool IsParked() const
+	{
+		return ((LONG)IOCP_HANDOFF_STATE::IOCP_HANDOFF_PARKED == m_nHandOffState);
+	}
+
+	// 停止投递recv，已收到但未交给上层的数据随连接一起交接
+	void Park(IOOverlappedContext *pOverlappedContext, DWORD dwBytes)
+	{
+		m_pParkedOverlappedContext = pOverlappedContext;
+		m_dwParkedBytes = dwBytes;
+		::InterlockedExchange(&m_nHandOffState, (LONG)IOCP_HANDOFF_STATE::IOCP_HANDOFF_PARKED);
+	}
+
+	IOOverlappedContext* GetParkedOverlappedContext(DWORD &dwBytes) const
+	{
+		dwBytes = m_dwParkedBytes;
+		return m_pParkedOverlappedContext;
+	}
+
+	// 把读取量计入nEpoch周期，只由recv路径调用；跨入新周期时上一周期的读取量转存，不需要检查线程清零
+	void AddRecvBytes(DWORD dwBytes, LONG64 nEpoch)
+	{
+		if (nLoadEpoch != nEpoch)
+		{
+			ullLastEpochRecvBytes = (nLoadEpoch + 1 == nEpoch) ? ullEpochRecvBytes : 0;
+			ullEpochRecvBytes = 0;
+			nLoadEpoch = nEpoch;
+		}
+		ullEpochRecvBytes += dwBytes;
+	}
+
+	// 最近一个完整周期(nEpoch的前一个周期)读取的字节数，检查线程与recv路径并发时可能取到相邻周期的值，只作挑选依据
+	ULONGLONG GetLastEpochRecvBytes(LONG64 nEpoch) const
+	{
+		LONG64 nLoadEpochNow = nLoadEpoch;
+		if (nLoadEpochNow == nEpoch)
+		{
+			return ullLastEpochRecvBytes;
+		}
+		return (nLoadEpochNow + 1 == nEpoch) ? ullEpochRecvBytes : 0;
+	}
+
+	// 请求把连接迁往targetPort分片，由处理者在下一个安全点(recv完成尚未再次投递且没有在途send)调用IOEngine::Migrate执行
+	void RequestMigrate(HANDLE targetPort)
+	{
+		::InterlockedExchangePointer(&m_migratePort, targetPort);
+	}
+
+	bool IsMigratePending() const
+	{
+		return (NULL != m_migratePort);
+	}
+
+	// 取出待迁往的完成端口，没有时返回NULL
+	HANDLE TakeMigrate()
+	{
+		return ::InterlockedExchangePointer(&m_migratePort, NULL);
+	}
+
+private:
+
+	static IOBlockFreeList& GetFreeList()
+	{
+		static IOBlockFreeList s_freeList;
+		return s_freeList;
+	}
+
+	bool PostShmWakeup()
+	{
+		return (FALSE != ::PostQueuedCompletionStatus(
+			completionPort, 0, (ULONG_PTR)this, &m_pRecvOverlappedContext->wsaOverlapped));
+	}
+
+	// 线程池等待的回调：只投递唤醒包，读取与分发均在工作者线程中进行
+	// 投递失败(完成端口已关闭)时无法再分发，关闭通道并释放等待持有的引用
+	static VOID CALLBACK ShmWaitCallback(PVOID lpParam, BOOLEAN bTimerOrWaitFired)
+	{
+		IOSocketContext *pThis = reinterpret_cast<IOSocketContext*>(lpParam);
+		if (!pThis->PostShmWakeup())
+		{
+			pThis->pShmChannel->Close();
+			pThis->Release();
+		}
+	}
+
+private:
+
+	// 同一socket上的多个IO重叠请求上下文且管理此些上下文生命周期(经pListPrev/pListNext串联)
+	IOOverlappedContext *m_pOverlappedContextHead;
+	EngineLock m_lock;
+
+	volatile LONG m_nRefCount;	// 引用计数
+	volatile LONG m_nClosed;	// 是否已关闭
+
+	volatile LONG m_nPendingSends;							// 在途的send数量
+	volatile LONG m_nHandOffState;							// 热重启交接状态
+	IOOverlappedContext * volatile m_pRecvOverlappedContext;	// 当前投递的recv
+	IOOverlappedContext *m_pParkedOverlappedContext;			// 交接时停止投递的recv
+	DWORD m_dwParkedBytes;									// 交接时尚未交给上层的数据长度
+	HANDLE volatile m_migratePort;							// 待迁往的完成端口，NULL为没有待迁移请求
+};
+
+// 一个同步完成的send
+struct IOInlineSendCompletion
+{
+	IOSocketContext *pSocketContext;
+	IOOverlappedContext *pOverlappedContext;
+	DWORD dwBytes;
+};
+
+// 同步完成快速路径：连接的socket设置了FILE_SKIP_COMPLETION_PORT_ON_SUCCESS时，同步完成的send不再经过完成端口，
+// 由投递线程直接完成。完成推迟到本线程最外层的发送调用返回时依次处理，
+// 这样OnSend中再次发送的数据排在后面，不会插入到一次多块发送的中间，也不会形成递归
+// 发送调用在加锁之前定义本对象，完成处理时不持有发送路径上的锁(引擎的锁按策略可能不可重入)
+class IOInlineSendScope
+{
+public:
+
+	IOInlineSendScope()
+	{
+		++GetState().nDepth;
+	}
+
+	~IOInlineSendScope()
+	{
+		IOInlineSendState &state = GetState();
+		if (1 == state.nDepth)
+		{
+			// 完成处理中产生的同步完成追加在队尾，同样在此处理；队列可能扩容，按值取出
+			for (size_t index = 0; index < state.completions.size(); ++index)
+			{
+				IOInlineSendCompletion completion = state.completions[index];
+				IOArenaScope arenaScope;
+				IOAllocScope allocScope((DWORD)IOCP_OPERATOR_TYPE::IOCP_OPT_SEND);
+				completion.pSocketContext->pHandler->OnCompletion(
+					completion.pSocketContext, completion.pOverlappedContext, TRUE, completion.dwBytes, NO_ERROR);
+			}
+			state.completions.clear();
+		}
+		--state.nDepth;
+	}
+
+	// 完成一个同步完成的send，不在发送调用之内时立即处理
+	static void Complete(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD dwBytes)
+	{
+		IOInlineSendScope scope;
+		IOInlineSendCompletion completion = { pSocketContext, pOverlappedContext, dwBytes };
+		GetState().completions.push_back(completion);
+	}
+
+private:
+
+	struct IOInlineSendState
+	{
+		int nDepth;
+		std::vector<IOInlineSendCompletion> completions;
+	};
+
+	static IOInlineSendState& GetState()
+	{
+		static thread_local IOInlineSendState t_state = { 0 };
+		return t_state;
+	}
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOCONTEXT_H_
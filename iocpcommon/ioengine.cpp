@@ -0,0 +1,883 @@
+#include "ioengine.h"
+#include <algorithm>
+
+// 工作者线程的计时：每次Charge把上次计时以来的耗时记到一个类别上，期间的引擎锁等待单独记入锁等待
+// 处理完成包的耗时由ChargeCompletion拆分：上层回调(IOCallbackScope)计入回调，其余计入引擎
+// 每轮循环在工作者线程上只读取三次TSC(等待前、等待后、处理后)，另有每次上层回调前后各一次
+class IOWorkerClock
+{
+public:
+
+	explicit IOWorkerClock(IOWorkerTimeSlot *pSlot)
+		: m_pSlot(pSlot)
+		, m_lockWaitCounter(LockWaitCounter::GetThreadInstance())
+		, m_callbackCounter(CallbackTimeCounter::GetThreadInstance())
+		, m_ullMark(__rdtsc())
+		, m_ullLockWaitMark(m_lockWaitCounter.ullWaitTsc)
+		, m_ullLockWaitsMark(m_lockWaitCounter.ullWaits)
+		, m_ullCallbackMark(m_callbackCounter.ullCallbackTsc)
+	{
+	}
+
+	void Charge(volatile ULONGLONG &ullTarget)
+	{
+		ullTarget += Elapse();
+	}
+
+	void ChargeCompletion(volatile ULONGLONG &ullCallback, volatile ULONGLONG &ullEngine)
+	{
+		ULONGLONG ullElapsed = Elapse();
+		ULONGLONG ullCallbackTsc = m_callbackCounter.ullCallbackTsc - m_ullCallbackMark;
+		if (ullCallbackTsc > ullElapsed)
+		{
+			ullCallbackTsc = ullElapsed;
+		}
+
+		ullCallback += ullCallbackTsc;
+		ullEngine += ullElapsed - ullCallbackTsc;
+	}
+
+private:
+
+	// 上次计时以来扣除锁等待后的耗时，锁等待记入锁等待；同时越过期间的回调耗时
+	ULONGLONG Elapse()
+	{
+		ULONGLONG ullNow = __rdtsc();
+		ULONGLONG ullElapsed = ullNow - m_ullMark;
+		ULONGLONG ullLockWait = m_lockWaitCounter.ullWaitTsc - m_ullLockWaitMark;
+		if (ullLockWait > ullElapsed)
+		{
+			ullLockWait = ullElapsed;
+		}
+
+		m_pSlot->ullLockWaitTsc += ullLockWait;
+		m_pSlot->ullLockWaits += m_lockWaitCounter.ullWaits - m_ullLockWaitsMark;
+
+		m_ullMark = ullNow;
+		m_ullLockWaitMark = m_lockWaitCounter.ullWaitTsc;
+		m_ullLockWaitsMark = m_lockWaitCounter.ullWaits;
+		m_ullCallbackMark = m_callbackCounter.ullCallbackTsc;
+		return ullElapsed - ullLockWait;
+	}
+
+private:
+
+	IOWorkerClock(const IOWorkerClock&) = delete;
+	IOWorkerClock& operator= (const IOWorkerClock&) = delete;
+
+private:
+
+	IOWorkerTimeSlot *m_pSlot;
+	LockWaitCounter &m_lockWaitCounter;
+	CallbackTimeCounter &m_callbackCounter;
+	ULONGLONG m_ullMark;			// 上次计时的TSC
+	ULONGLONG m_ullLockWaitMark;	// 上次计时时本线程累计的锁等待
+	ULONGLONG m_ullLockWaitsMark;
+	ULONGLONG m_ullCallbackMark;	// 上次计时时本线程累计的回调耗时
+};
+
+// FileReplaceCompletionInformation(Windows 8.1起)：更换文件句柄绑定的完成端口，见NtSetInformationFile
+#define FILE_REPLACE_COMPLETION_INFORMATION (61)
+
+struct IOFileCompletionInformation
+{
+	HANDLE port;
+	PVOID key;
+};
+
+struct IOStatusBlock
+{
+	union
+	{
+		LONG status;
+		PVOID pointer;
+	};
+	ULONG_PTR information;
+};
+
+typedef LONG (NTAPI *LPFN_NTSETINFORMATIONFILE)(HANDLE, IOStatusBlock*, PVOID, ULONG, int);
+
+// 把句柄改绑到completionPort，完成键不变；系统不支持时返回false
+static bool ReplaceCompletionPort(HANDLE handle, HANDLE completionPort, ULONG_PTR completionKey)
+{
+	static LPFN_NTSETINFORMATIONFILE s_fnNtSetInformationFile = reinterpret_cast<LPFN_NTSETINFORMATIONFILE>(
+		::GetProcAddress(::GetModuleHandleW(L"ntdll.dll"), "NtSetInformationFile"));
+	if (!s_fnNtSetInformationFile)
+	{
+		return false;
+	}
+
+	IOStatusBlock statusBlock;
+	IOFileCompletionInformation info = { completionPort, reinterpret_cast<PVOID>(completionKey) };
+	return (s_fnNtSetInformationFile(handle, &statusBlock, &info, sizeof(info), FILE_REPLACE_COMPLETION_INFORMATION) >= 0);
+}
+
+IOEngine::IOEngine()
+	: m_llBaseQpc(0)
+	, m_ullBaseTsc(0)
+	, m_nNextPort(0)
+	, m_pWorkerThreads(nullptr)
+	, m_workerThreadNum(0)
+	, m_handlerLock("IOEngineHandlers")
+	, m_nShardCount(0)
+	, m_bMultiNode(false)
+	, m_dwRebalanceIntervalMs(0)
+	, m_dwImbalancePercent(REBALANCE_DEFAULT_IMBALANCE)
+	, m_hRebalanceThread(NULL)
+	, m_nRebalanceEpoch(0)
+	, m_rebalanceLock("IOEngineRebalance")
+	, m_nMigrations(0)
+	, m_bInlineCompletion(true)
+	, m_bSkipCompletionSafe(false)
+{
+	m_stopEvent = ::CreateEvent(nullptr, TRUE, FALSE, nullptr);
+}
+
+IOEngine::~IOEngine()
+{
+	Stop();
+
+	if (m_stopEvent)
+	{
+		::CloseHandle(m_stopEvent);
+		m_stopEvent = NULL;
+	}
+}
+
+bool IOEngine::Start(unsigned int nWorkerThreadNum)
+{
+	if (IsRunning())
+	{
+		return true;
+	}
+
+	if (m_stopEvent)
+	{
+		::ResetEvent(m_stopEvent);
+	}
+
+	m_bSkipCompletionSafe = IsSkipCompletionSafe();
+
+	// 空锁策略下引擎不具备线程安全性，只能使用单个完成端口及单个工作线程
+	bool bThreadSafe = LockPolicyTraits<EngineLock>::bThreadSafe;
+
+	// 每个有处理器的NUMA节点至少一个完成端口(分片)，连接的完成包只在其接收中断所在节点上处理
+	std::vector<USHORT> nodes;
+	USHORT nNodeCount = bThreadSafe ? IONuma::GetNodeCount() : 1;
+	for (USHORT nNode = 0; nNode < nNodeCount; ++nNode)
+	{
+		GROUP_AFFINITY affinity;
+		if (nNodeCount > 1 && !IONuma::GetNodeAffinity(nNode, affinity))
+		{
+			continue;
+		}
+		nodes.push_back(nNode);
+	}
+
+	if (nodes.empty())
+	{
+		return false;
+	}
+	m_bMultiNode = (nodes.size() > 1);
+
+	// 指定的分片数多于节点数时，各分片轮流分布到各节点
+	size_t nShards = nodes.size();
+	if (bThreadSafe && m_nShardCount > nShards)
+	{
+		nShards = m_nShardCount;
+	}
+
+	for (size_t nShard = 0; nShard < nShards; ++nShard)
+	{
+		HANDLE completionPort = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+		if (!completionPort)
+		{
+			Stop();
+			return false;
+		}
+		m_completionPorts.push_back(completionPort);
+		m_portNodes.push_back(nodes[nShard % nodes.size()]);
+	}
+
+	if (!bThreadSafe)
+	{
+		m_workerThreadNum = 1;
+	}
+	else
+	{
+		m_workerThreadNum = nWorkerThreadNum ? nWorkerThreadNum : (2 * GetNumOfProcessors() + 2);
+		if (m_workerThreadNum < m_completionPorts.size())
+		{
+			m_workerThreadNum = (unsigned int)m_completionPorts.size();
+		}
+	}
+
+	// 工作者线程的时间统计从本次启动开始累计
+	LARGE_INTEGER now;
+	::QueryPerformanceCounter(&now);
+	m_llBaseQpc = now.QuadPart;
+	m_ullBaseTsc = __rdtsc();
+	m_workerTimes.clear();
+	m_workerTimes.resize(m_workerThreadNum);
+	m_shardLoads.clear();
+	m_shardLoads.resize(m_completionPorts.size());
+
+	// 每个完成端口一个排队时延探针
+	m_probes.clear();
+	m_probes.resize(m_completionPorts.size());
+	for (size_t nPort = 0; nPort < m_completionPorts.size(); ++nPort)
+	{
+		::memset(&m_probes[nPort].overlapped, 0, sizeof(OVERLAPPED));
+		m_probes[nPort].completionPort = m_completionPorts[nPort];
+		m_probes[nPort].llPostQpc = 0;
+		m_probes[nPort].ullNextPostMs = 0;
+		m_probes[nPort].nInFlight = 0;
+	}
+
+	// 工作者线程按各节点的处理器数分配，节点上的多个分片平分该节点的份额，每个分片至少一个线程
+	// 参数须在线程创建前全部就绪
+	std::vector<size_t> workerPorts;
+	AssignWorkers(workerPorts);
+	m_workerParams.resize(m_workerThreadNum);
+	for (DWORD index = 0; index < m_workerThreadNum; ++index)
+	{
+		size_t nPort = workerPorts[index];
+		m_workerParams[index].pEngine = this;
+		m_workerParams[index].completionPort = m_completionPorts[nPort];
+		m_workerParams[index].nNumaNode = m_portNodes[nPort];
+		m_workerParams[index].nShard = nPort;
+		m_workerParams[index].pTimeSlot = &m_workerTimes[index];
+		m_workerParams[index].pProbe = &m_probes[nPort];
+	}
+
+	m_pWorkerThreads = new HANDLE[m_workerThreadNum];
+	for (DWORD index = 0; index < m_workerThreadNum; ++index)
+	{
+		m_pWorkerThreads[index] = ::CreateThread(0, 0, &IOEngine::WorkerThreadProc, (void *)&m_workerParams[index], 0, 0);
+	}
+
+	// 只有一个分片时无处可迁；检查线程不是工作者线程，引擎锁不是线程安全的时不能创建
+	if (m_completionPorts.size() > 1 && IO_ENGINE_LOCK_THREAD_SAFE)
+	{
+		m_hRebalanceThread = ::CreateThread(0, 0, &IOEngine::RebalanceThreadProc, this, 0, 0);
+	}
+	return true;
+}
+
+void IOEngine::Stop()
+{
+	if (m_stopEvent)
+	{
+		::SetEvent(m_stopEvent);
+	}
+
+	for (unsigned int index = 0; index < m_workerThreadNum && index < m_workerParams.size(); ++index)
+	{
+		::PostQueuedCompletionStatus(m_workerParams[index].completionPort, 0, EXIT_ENGINE_CODE, nullptr);
+	}
+
+	if (m_pWorkerThreads && m_workerThreadNum)
+	{
+		::WaitForMultipleObjects(m_workerThreadNum, m_pWorkerThreads, TRUE, INFINITE);
+	}
+
+	if (m_hRebalanceThread)
+	{
+		::WaitForSingleObject(m_hRebalanceThread, INFINITE);
+		::CloseHandle(m_hRebalanceThread);
+		m_hRebalanceThread = NULL;
+	}
+
+	if (m_pWorkerThreads)
+	{
+		for (unsigned int index = 0; index < m_workerThreadNum; ++index)
+		{
+			if (m_pWorkerThreads[index] != INVALID_HANDLE_VALUE)
+			{
+				::CloseHandle(m_pWorkerThreads[index]);
+				m_pWorkerThreads[index] = INVALID_HANDLE_VALUE;
+			}
+		}
+
+		delete []m_pWorkerThreads;
+		m_pWorkerThreads = nullptr;
+	}
+	m_workerThreadNum = 0;
+
+	for (size_t index = 0; index < m_completionPorts.size(); ++index)
+	{
+		::CloseHandle(m_completionPorts[index]);
+	}
+	m_completionPorts.clear();
+	m_portNodes.clear();
+	m_workerParams.clear();
+	m_probes.clear();
+}
+
+bool IOEngine::GetWorkerTimeStats(unsigned int nWorker, IOWorkerTimeStats &stats) const
+{
+	if (nWorker >= m_workerTimes.size())
+	{
+		return false;
+	}
+
+	// 以QPC校准TSC频率
+	LARGE_INTEGER frequency, now;
+	::QueryPerformanceFrequency(&frequency);
+	::QueryPerformanceCounter(&now);
+	ULONGLONG ullNowTsc = __rdtsc();
+
+	double dElapsedUs = (double)(now.QuadPart - m_llBaseQpc) * 1000000.0 / (double)frequency.QuadPart;
+	double dTscPerUs = (dElapsedUs > 0.0) ? (double)(ullNowTsc - m_ullBaseTsc) / dElapsedUs : 1.0;
+	if (dTscPerUs <= 0.0)
+	{
+		dTscPerUs = 1.0;
+	}
+
+	const IOWorkerTimeSlot &slot = m_workerTimes[nWorker];
+	stats.dWaitUs = slot.ullWaitTsc / dTscPerUs;
+	stats.dEngineUs = slot.ullEngineTsc / dTscPerUs;
+	stats.dLockWaitUs = slot.ullLockWaitTsc / dTscPerUs;
+	stats.ullLockWaits = slot.ullLockWaits;
+	for (DWORD dwOp = 0; dwOp < WORKER_TIME_MAX_OPS; ++dwOp)
+	{
+		stats.dCallbackUs[dwOp] = slot.ullCallbackTsc[dwOp] / dTscPerUs;
+		stats.ullCallbacks[dwOp] = slot.ullCallbacks[dwOp];
+	}
+	return true;
+}
+
+void IOEngine::DumpWorkerTimes(FILE *pFile) const
+{
+	if (!pFile || m_workerTimes.empty())
+	{
+		return;
+	}
+
+	IOWorkerTimeStats total;
+	::memset(&total, 0, sizeof(total));
+	for (unsigned int nWorker = 0; nWorker < GetWorkerCount(); ++nWorker)
+	{
+		IOWorkerTimeStats stats;
+		GetWorkerTimeStats(nWorker, stats);
+		total.dWaitUs += stats.dWaitUs;
+		total.dEngineUs += stats.dEngineUs;
+		total.dLockWaitUs += stats.dLockWaitUs;
+		total.ullLockWaits += stats.ullLockWaits;
+		for (DWORD dwOp = 0; dwOp < WORKER_TIME_MAX_OPS; ++dwOp)
+		{
+			total.dCallbackUs[dwOp] += stats.dCallbackUs[dwOp];
+			total.ullCallbacks[dwOp] += stats.ullCallbacks[dwOp];
+		}
+	}
+
+	double dCallbackUs = 0.0;
+	for (DWORD dwOp = 0; dwOp < WORKER_TIME_MAX_OPS; ++dwOp)
+	{
+		dCallbackUs += total.dCallbackUs[dwOp];
+	}
+	double dTotalUs = total.dWaitUs + total.dEngineUs + total.dLockWaitUs + dCallbackUs;
+	double dPercent = (dTotalUs > 0.0) ? 100.0 / dTotalUs : 0.0;
+
+	::fprintf(pFile, "workers: %u threads, wait %.1f us (%.1f%%), engine %.1f us (%.1f%%), callbacks %.1f us (%.1f%%), lock wait %.1f us (%.1f%%, %llu waits)\n",
+		GetWorkerCount(),
+		total.dWaitUs, total.dWaitUs * dPercent,
+		total.dEngineUs, total.dEngineUs * dPercent,
+		dCallbackUs, dCallbackUs * dPercent,
+		total.dLockWaitUs, total.dLockWaitUs * dPercent,
+		total.ullLockWaits);
+
+	if (m_shardLoads.size() > 1)
+	{
+		::fprintf(pFile, "shards: %llu migrations, load", GetMigrationCount());
+		for (size_t nShard = 0; nShard < m_shardLoads.size(); ++nShard)
+		{
+			::fprintf(pFile, " %.1f%%", m_shardLoads[nShard].dLoad * 100.0);
+		}
+		::fprintf(pFile, "\n");
+	}
+
+	// 按IOCP_OPERATOR_TYPE的顺序
+	static const char *s_opNames[] = { "none", "accept", "send", "recv", "resume", "timer", "shm_recv", "recv_into" };
+	const DWORD dwOpNames = (DWORD)(sizeof(s_opNames) / sizeof(s_opNames[0]));
+	for (DWORD dwOp = 0; dwOp < WORKER_TIME_MAX_OPS; ++dwOp)
+	{
+		if (total.ullCallbacks[dwOp])
+		{
+			::fprintf(pFile, "workers: %-8s %12llu callbacks, %12.1f us, %8.2f us avg\n",
+				(dwOp < dwOpNames) ? s_opNames[dwOp] : "other",
+				total.ullCallbacks[dwOp],
+				total.dCallbackUs[dwOp],
+				total.dCallbackUs[dwOp] / total.ullCallbacks[dwOp]);
+		}
+	}
+}
+
+bool IOEngine::Attach(IOSocketContext *pSocketContext, SOCKET sock, bool bListen)
+{
+	if (!IsRunning())
+	{
+		return false;
+	}
+
+	pSocketContext->completionPort = bListen ? m_completionPorts[0] : SelectCompletionPort(sock);
+	pSocketContext->nNumaNode = GetPortNode(pSocketContext->completionPort);
+	if (NULL == ::CreateIoCompletionPort((HANDLE)sock, pSocketContext->completionPort, (ULONG_PTR)pSocketContext, 0))
+	{
+		return false;
+	}
+
+	// 监听socket上只有AcceptEx，保持原样；设置失败时该连接仍走完成端口
+	pSocketContext->bSkipCompletionOnSuccess = !bListen && m_bInlineCompletion && m_bSkipCompletionSafe &&
+		::SetFileCompletionNotificationModes((HANDLE)sock, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS | FILE_SKIP_SET_EVENT_ON_HANDLE);
+
+	return true;
+}
+
+bool IOEngine::AttachPostOnly(IOSocketContext *pSocketContext)
+{
+	if (!IsRunning())
+	{
+		return false;
+	}
+
+	pSocketContext->completionPort = m_completionPorts[0];
+	pSocketContext->nNumaNode = m_portNodes[0];
+	return true;
+}
+
+bool IOEngine::Post(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD dwBytes)
+{
+	return (FALSE != ::PostQueuedCompletionStatus(
+		pSocketContext->completionPort, dwBytes, (ULONG_PTR)pSocketContext, &pOverlappedContext->wsaOverlapped));
+}
+
+void IOEngine::EnableBusyPoll(DWORD dwSpinUs, LONG nMaxSpinners)
+{
+	m_busyPoller.Enable(dwSpinUs, nMaxSpinners);
+}
+
+void IOEngine::EnableAdmissionControl(DWORD dwTargetUs, DWORD dwIntervalMs)
+{
+	bool bWasOverloaded = m_admission.IsOverloaded();
+	m_admission.Enable(dwTargetUs, dwIntervalMs);
+
+	// 关闭时若正处于过载状态，通知处理者恢复
+	if (bWasOverloaded && !m_admission.IsOverloaded())
+	{
+		AutoLock<EngineLock> lock(m_handlerLock);
+		for (size_t index = 0; index < m_handlers.size(); ++index)
+		{
+			m_handlers[index]->OnOverloadChanged(false);
+		}
+	}
+}
+
+void IOEngine::RegisterHandler(IOCompletionHandler *pHandler)
+{
+	AutoLock<EngineLock> lock(m_handlerLock);
+	if (std::find(m_handlers.begin(), m_handlers.end(), pHandler) == m_handlers.end())
+	{
+		m_handlers.push_back(pHandler);
+	}
+}
+
+void IOEngine::UnregisterHandler(IOCompletionHandler *pHandler)
+{
+	{
+		AutoLock<EngineLock> lock(m_handlerLock);
+		m_handlers.erase(std::remove(m_handlers.begin(), m_handlers.end(), pHandler), m_handlers.end());
+	}
+
+	// OnRebalance在m_handlerLock之外回调，等待进行中的一轮结束，之后的轮次已取不到此处理者
+	AutoLock<EngineLock> lock(m_rebalanceLock);
+}
+
+void IOEngine::PostProbe(IOAdmissionProbe *pProbe, bool bForce)
+{
+	ULONGLONG ullNowMs = ::GetTickCount64();
+	if (!bForce && ullNowMs < pProbe->ullNextPostMs)
+	{
+		return;
+	}
+
+	if (0 != ::InterlockedCompareExchange(&pProbe->nInFlight, 1, 0))
+	{
+		return;
+	}
+
+	pProbe->ullNextPostMs = ullNowMs + ADMISSION_PROBE_PERIOD_MS;
+	LARGE_INTEGER now;
+	::QueryPerformanceCounter(&now);
+	pProbe->llPostQpc = now.QuadPart;
+	if (!::PostQueuedCompletionStatus(pProbe->completionPort, 0, (ULONG_PTR)ADMISSION_PROBE_CODE, &pProbe->overlapped))
+	{
+		::InterlockedExchange(&pProbe->nInFlight, 0);
+	}
+}
+
+void IOEngine::OnProbe(IOAdmissionProbe *pProbe)
+{
+	LARGE_INTEGER now;
+	::QueryPerformanceCounter(&now);
+	LONGLONG llDelayTicks = now.QuadPart - pProbe->llPostQpc;
+	::InterlockedExchange(&pProbe->nInFlight, 0);
+
+	if (!m_admission.IsEnabled())
+	{
+		return;
+	}
+
+	if (m_admission.Sample(llDelayTicks, ::GetTickCount64()))
+	{
+		bool bOverloaded = m_admission.IsOverloaded();
+		AutoLock<EngineLock> lock(m_handlerLock);
+		for (size_t index = 0; index < m_handlers.size(); ++index)
+		{
+			m_handlers[index]->OnOverloadChanged(bOverloaded);
+		}
+	}
+
+	// 超过目标期间不等周期连续测量：过载时新的完成包可能很少，队列排空后的第一个探针即解除过载
+	// 探针自身至少排队一个目标时延才会走到这里，不会空转
+	if (m_admission.IsAboveTarget())
+	{
+		PostProbe(pProbe, true);
+	}
+}
+
+void IOEngine::EnableRebalance(DWORD dwIntervalMs, DWORD dwImbalancePercent)
+{
+	m_dwImbalancePercent = dwImbalancePercent;
+	m_dwRebalanceIntervalMs = dwIntervalMs;
+}
+
+bool IOEngine::Migrate(IOSocketContext *pSocketContext)
+{
+	HANDLE targetPort = pSocketContext->TakeMigrate();
+	if (!targetPort || targetPort == pSocketContext->completionPort ||
+		std::find(m_completionPorts.begin(), m_completionPorts.end(), targetPort) == m_completionPorts.end())
+	{
+		return false;
+	}
+
+	if (INVALID_SOCKET == pSocketContext->connSocket ||
+		!ReplaceCompletionPort((HANDLE)pSocketContext->connSocket, targetPort, (ULONG_PTR)pSocketContext))
+	{
+		return false;
+	}
+
+	// 迁移前已分配的重叠结构仍归还到原节点，之后新分配的来自目标分片的节点
+	pSocketContext->completionPort = targetPort;
+	pSocketContext->nNumaNode = GetPortNode(targetPort);
+	::InterlockedIncrement64(&m_nMigrations);
+	return true;
+}
+
+DWORD WINAPI IOEngine::RebalanceThreadProc(LPVOID lpParam)
+{
+	IOEngine *pThis = static_cast<IOEngine *>(lpParam);
+	for (;;)
+	{
+		DWORD dwIntervalMs = pThis->m_dwRebalanceIntervalMs;
+		if (WAIT_TIMEOUT != ::WaitForSingleObject(pThis->m_stopEvent, dwIntervalMs ? dwIntervalMs : REBALANCE_IDLE_WAIT_MS))
+		{
+			break;
+		}
+
+		if (pThis->m_dwRebalanceIntervalMs)
+		{
+			::InterlockedIncrement64(&pThis->m_nRebalanceEpoch);
+			pThis->Rebalance();
+		}
+	}
+
+	return 0;
+}
+
+void IOEngine::Rebalance()
+{
+	size_t nShards = m_shardLoads.size();
+	if (nShards < 2 || nShards != m_completionPorts.size())
+	{
+		return;
+	}
+
+	// 各分片本周期的忙碌占比：等待完成包以外的时间均为忙碌
+	for (size_t nShard = 0; nShard < nShards; ++nShard)
+	{
+		ULONGLONG ullBusyTsc = 0;
+		ULONGLONG ullTotalTsc = 0;
+		for (size_t nWorker = 0; nWorker < m_workerTimes.size() && nWorker < m_workerParams.size(); ++nWorker)
+		{
+			if (m_workerParams[nWorker].nShard != nShard)
+			{
+				continue;
+			}
+
+			const IOWorkerTimeSlot &slot = m_workerTimes[nWorker];
+			ULONGLONG ullBusy = slot.ullEngineTsc + slot.ullLockWaitTsc;
+			for (DWORD dwOp = 0; dwOp < WORKER_TIME_MAX_OPS; ++dwOp)
+			{
+				ullBusy += slot.ullCallbackTsc[dwOp];
+			}
+			ullBusyTsc += ullBusy;
+			ullTotalTsc += ullBusy + slot.ullWaitTsc;
+		}
+
+		IOShardLoad &load = m_shardLoads[nShard];
+		ULONGLONG ullTotalDelta = ullTotalTsc - load.ullTotalTsc;
+		load.dLoad = ullTotalDelta ? (double)(ullBusyTsc - load.ullBusyTsc) / (double)ullTotalDelta : 0.0;
+		load.ullBusyTsc = ullBusyTsc;
+		load.ullTotalTsc = ullTotalTsc;
+	}
+
+	size_t nBusiest = 0;
+	size_t nIdlest = 0;
+	for (size_t nShard = 1; nShard < nShards; ++nShard)
+	{
+		if (m_shardLoads[nShard].dLoad > m_shardLoads[nBusiest].dLoad)
+		{
+			nBusiest = nShard;
+		}
+		if (m_shardLoads[nShard].dLoad < m_shardLoads[nIdlest].dLoad)
+		{
+			nIdlest = nShard;
+		}
+	}
+
+	double dGap = m_shardLoads[nBusiest].dLoad - m_shardLoads[nIdlest].dLoad;
+	if (dGap * 100.0 < (double)m_dwImbalancePercent)
+	{
+		return;
+	}
+
+	// 迁走差额的一半即可使两个分片持平
+	double dFraction = dGap / (2.0 * m_shardLoads[nBusiest].dLoad);
+
+	// 挑选连接需遍历处理者名下的连接，在m_handlerLock之外进行，不阻塞探针的过载通知及处理者的注册
+	AutoLock<EngineLock> lock(m_rebalanceLock);
+	std::vector<IOCompletionHandler*> handlers;
+	{
+		AutoLock<EngineLock> handlerLock(m_handlerLock);
+		handlers = m_handlers;
+	}
+
+	for (size_t index = 0; index < handlers.size(); ++index)
+	{
+		handlers[index]->OnRebalance(m_completionPorts[nBusiest], m_completionPorts[nIdlest], dFraction);
+	}
+}
+
+bool IOEngine::IsSkipCompletionSafe()
+{
+	DWORD dwBufferLen = 0;
+	if (SOCKET_ERROR != ::WSAEnumProtocolsW(nullptr, nullptr, &dwBufferLen) || WSAENOBUFS != ::WSAGetLastError())
+	{
+		return false;
+	}
+
+	std::vector<char> buffer(dwBufferLen);
+	LPWSAPROTOCOL_INFOW pProtocols = reinterpret_cast<LPWSAPROTOCOL_INFOW>(buffer.data());
+	int nCount = ::WSAEnumProtocolsW(nullptr, pProtocols, &dwBufferLen);
+	if (SOCKET_ERROR == nCount)
+	{
+		return false;
+	}
+
+	for (int index = 0; index < nCount; ++index)
+	{
+		bool bStream = (IPPROTO_TCP == pProtocols[index].iProtocol) || (AF_UNIX == pProtocols[index].iAddressFamily);
+		if (bStream && !(pProtocols[index].dwServiceFlags1 & XP1_IFS_HANDLES))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+HANDLE IOEngine::SelectCompletionPort(SOCKET sock)
+{
+	if (m_completionPorts.size() > 1)
+	{
+		LONG nNext = ::InterlockedIncrement(&m_nNextPort);
+
+		// 同一节点上有多个分片时在其中轮询
+		USHORT nNode = 0;
+		if (m_bMultiNode && IONuma::GetSocketNode(sock, nNode))
+		{
+			size_t nMatches = std::count(m_portNodes.begin(), m_portNodes.end(), nNode);
+			if (nMatches)
+			{
+				size_t nPick = (ULONG)nNext % nMatches;
+				for (size_t index = 0; index < m_portNodes.size(); ++index)
+				{
+					if (m_portNodes[index] == nNode && 0 == nPick--)
+					{
+						return m_completionPorts[index];
+					}
+				}
+			}
+		}
+
+		return m_completionPorts[(ULONG)nNext % m_completionPorts.size()];
+	}
+
+	return m_completionPorts[0];
+}
+
+USHORT IOEngine::GetPortNode(HANDLE completionPort) const
+{
+	for (size_t index = 0; index < m_completionPorts.size(); ++index)
+	{
+		if (m_completionPorts[index] == completionPort)
+		{
+			return m_portNodes[index];
+		}
+	}
+	return NUMA_NODE_UNBOUND;
+}
+
+void IOEngine::AssignWorkers(std::vector<size_t> &workerPorts)
+{
+	size_t nPorts = m_completionPorts.size();
+	workerPorts.clear();
+
+	// 各分片的权重：所在节点的处理器数除以该节点上的分片数；单节点时各分片相同
+	std::vector<double> weights(nPorts, 1.0);
+	double dTotalWeight = (double)nPorts;
+	if (m_bMultiNode)
+	{
+		dTotalWeight = 0.0;
+		for (size_t nPort = 0; nPort < nPorts; ++nPort)
+		{
+			size_t nNodePorts = std::count(m_portNodes.begin(), m_portNodes.end(), m_portNodes[nPort]);
+			DWORD dwProcessors = IONuma::GetNodeProcessorCount(m_portNodes[nPort]);
+			weights[nPort] = (double)(dwProcessors ? dwProcessors : 1) / (double)nNodePorts;
+			dTotalWeight += weights[nPort];
+		}
+	}
+
+	// 每个分片先得一个线程，其余按权重依次分给当前线程数与应得份额相差最多的分片
+	std::vector<size_t> counts(nPorts, 1);
+	for (size_t nAssigned = nPorts; nAssigned < m_workerThreadNum; ++nAssigned)
+	{
+		size_t nPick = 0;
+		double dMaxDeficit = -1.0e300;
+		for (size_t nPort = 0; nPort < nPorts; ++nPort)
+		{
+			double dDeficit = weights[nPort] / dTotalWeight * (double)(nAssigned + 1) - (double)counts[nPort];
+			if (dDeficit > dMaxDeficit)
+			{
+				dMaxDeficit = dDeficit;
+				nPick = nPort;
+			}
+		}
+		++counts[nPick];
+	}
+
+	// 线程序号按分片轮流排列，与分片数整除时同原先的取模分布一致
+	while (workerPorts.size() < m_workerThreadNum)
+	{
+		for (size_t nPort = 0; nPort < nPorts; ++nPort)
+		{
+			if (counts[nPort])
+			{
+				--counts[nPort];
+				workerPorts.push_back(nPort);
+			}
+		}
+	}
+}
+
+DWORD IOEngine::GetNumOfProcessors()
+{
+	SYSTEM_INFO si;
+	::GetSystemInfo(&si);
+	return si.dwNumberOfProcessors;
+}
+
+DWORD WINAPI IOEngine::WorkerThreadProc(LPVOID lpParam)
+{
+	IOWorkerParam *pParam = reinterpret_cast<IOWorkerParam*>(lpParam);
+	if (!pParam || !pParam->pEngine)
+	{
+		return 0;
+	}
+
+	IOEngine *pThis = pParam->pEngine;
+	HANDLE completionPort = pParam->completionPort;
+	IOCompletionHandler::MarkWorkerThread();
+
+	// 多节点时绑定到节点的处理器上，之后分配的重叠结构及缓冲区均来自本节点内存
+	if (pThis->m_bMultiNode)
+	{
+		IONuma::BindCurrentThread(pParam->nNumaNode);
+	}
+
+	OVERLAPPED *pOverlapped = nullptr;
+	IOSocketContext *pSocketContext = nullptr;
+	DWORD dwBytes = 0;
+	IOWorkerTimeSlot *pTimeSlot = pParam->pTimeSlot;
+	IOWorkerClock clock(pTimeSlot);
+
+	// 采用退出信号及退出事件的双保险方式，以确保退出所有工作者线程
+	while (WAIT_OBJECT_0 != ::WaitForSingleObject(pThis->m_stopEvent, 0))
+	{
+		clock.Charge(pTimeSlot->ullEngineTsc);
+		IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_WAIT_BEGIN);
+		BOOL bRet = pThis->m_busyPoller.GetQueuedCompletionStatus(
+			completionPort,
+			&dwBytes,
+			(PULONG_PTR)&pSocketContext,
+			&pOverlapped
+		);
+		DWORD dwError = bRet ? NO_ERROR : ::WSAGetLastError();
+		clock.Charge(pTimeSlot->ullWaitTsc);
+		IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_WAIT_END, 0, dwBytes);
+
+		if (EXIT_ENGINE_CODE == (ULONG_PTR)pSocketContext)
+		{
+			break;
+		}
+
+		if (ADMISSION_PROBE_CODE == (ULONG_PTR)pSocketContext && pOverlapped)
+		{
+			pThis->OnProbe(CONTAINING_RECORD(pOverlapped, IOAdmissionProbe, overlapped));
+			continue;
+		}
+
+		// GetQueuedCompletionStatus自身失败，未取出任何完成包
+		if (!pOverlapped || !pSocketContext || !pSocketContext->pHandler)
+		{
+			continue;
+		}
+
+		// 获取到传入的重叠结构参数IOOverlappedContext，交给连接所属的服务端/客户端处理
+		// 回调中从本线程分配区申请的临时内存在回调返回时回收
+		IOOverlappedContext *pOverlappedContext = CONTAINING_RECORD(pOverlapped, IOOverlappedContext, wsaOverlapped);
+		DWORD dwOp = (DWORD)pOverlappedContext->optType;
+		{
+			IOArenaScope arenaScope;
+			IOAllocScope allocScope(dwOp);
+			pSocketContext->pHandler->OnCompletion(pSocketContext, pOverlappedContext, bRet, dwBytes, dwError);
+		}
+
+		// 回调返回后重叠结构可能已归还到池中，类型须在分发前取出
+		if (dwOp < WORKER_TIME_MAX_OPS)
+		{
+			clock.ChargeCompletion(pTimeSlot->ullCallbackTsc[dwOp], pTimeSlot->ullEngineTsc);
+			++pTimeSlot->ullCallbacks[dwOp];
+		}
+
+		// 有完成包在处理时才需要测量排队时延，空闲时不投递探针
+		if (pThis->m_admission.IsEnabled())
+		{
+			pThis->PostProbe(pParam->pProbe, false);
+		}
+
+	}
+
+	return 0;
+}
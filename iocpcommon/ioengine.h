@@ -0,0 +1,230 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOENGINE_H_
+#define _TINY_IOCP_IOCPCOMMON_IOENGINE_H_
+
+#include <WinSock2.h>
+#include <Windows.h>
+#include "iocontext.h"
+#include "iobusypoll.h"
+#include "ioadmission.h"
+#include <stdio.h>
+#include <vector>
+
+#define EXIT_ENGINE_CODE (-1)		// 传递给Worker线程的退出信号
+#define ADMISSION_PROBE_CODE (-2)	// 准入控制的排队时延探针
+#define WORKER_TIME_MAX_OPS (16)	// 按完成通知类型(IOCP_OPERATOR_TYPE)分别统计回调耗时的最大类型数
+#define REBALANCE_DEFAULT_INTERVAL_MS	(1000)	// 默认的分片负载检查周期(毫秒)
+#define REBALANCE_DEFAULT_IMBALANCE		(25)	// 默认的失衡阈值：最忙与最闲分片的忙碌占比之差(百分点)
+#define REBALANCE_IDLE_WAIT_MS			(1000)	// 未启用连接迁移时检查线程查看是否已启用的周期(毫秒)
+
+class IOEngine;
+
+// 工作者线程的时间累计(TSC计数)，只由所属线程写入，其他线程读取快照
+// 各项互不重叠：回调与引擎处理中的锁等待只计入锁等待；回调只计IOCallbackScope包住的上层回调，完成包处理的其余部分计入引擎
+struct alignas(64) IOWorkerTimeSlot
+{
+	volatile ULONGLONG ullWaitTsc;		// 阻塞(或忙轮询)等待完成包
+	volatile ULONGLONG ullEngineTsc;	// 引擎自身的处理：分发前后的检查与簿记，及服务端/客户端在上层回调之外的处理
+	volatile ULONGLONG ullLockWaitTsc;	// 等待引擎锁
+	volatile ULONGLONG ullLockWaits;	// 等待引擎锁的次数
+	volatile ULONGLONG ullCallbackTsc[WORKER_TIME_MAX_OPS];	// 各类完成通知中的上层回调，同步完成的send在回调内处理时计入外层
+	volatile ULONGLONG ullCallbacks[WORKER_TIME_MAX_OPS];
+};
+
+// 工作者线程的时间统计快照(微秒)
+struct IOWorkerTimeStats
+{
+	double dWaitUs;
+	double dEngineUs;
+	double dLockWaitUs;
+	double dCallbackUs[WORKER_TIME_MAX_OPS];
+	ULONGLONG ullLockWaits;
+	ULONGLONG ullCallbacks[WORKER_TIME_MAX_OPS];
+};
+
+// 分片的负载统计：分片内所有工作者线程累计的忙碌与总计时(TSC计数)，及最近一次检查时的忙碌占比
+struct IOShardLoad
+{
+	ULONGLONG ullBusyTsc;
+	ULONGLONG ullTotalTsc;
+	double dLoad;
+};
+
+// 工作者线程参数：线程绑定到nNumaNode节点的处理器上，只等待该节点的完成端口
+struct IOWorkerParam
+{
+	IOEngine *pEngine;
+	HANDLE completionPort;
+	USHORT nNumaNode;
+	size_t nShard;					// 所属分片(完成端口)的序号
+	IOWorkerTimeSlot *pTimeSlot;	// 本线程的时间累计
+	IOAdmissionProbe *pProbe;		// 本线程所在完成端口的排队时延探针
+};
+
+// IO引擎：持有完成端口与工作者线程，服务端与客户端的连接均绑定到引擎上，
+// 工作者线程取出完成包后按连接上下文的pHandler分发给所属的服务端/客户端
+// 同一进程中的多个服务端与客户端可共享一个引擎，入站与出站连接共用同一组线程
+// 每个完成端口连同等待它的工作者线程为一个分片，连接在其生命期内由所在分片处理，可在分片间迁移
+class IOEngine
+{
+public:
+
+	IOEngine();
+	~IOEngine();
+
+public:
+
+	// 创建完成端口并启动工作者线程，nWorkerThreadNum为0时按处理器数决定；已启动时直接返回true
+	bool Start(unsigned int nWorkerThreadNum = 0);
+
+	// 停止工作者线程并关闭完成端口，调用前所有绑定的服务端/客户端应已停止
+	void Stop();
+
+	bool IsRunning() const
+	{
+		return !m_completionPorts.empty();
+	}
+
+	// 分片数：nShards为0时每个有处理器的NUMA节点一个；超过节点数时各分片轮流分布到各节点，需在Start之前调用
+	void SetShardCount(USHORT nShards)
+	{
+		m_nShardCount = nShards;
+	}
+
+	size_t GetShardCount() const
+	{
+		return m_completionPorts.size();
+	}
+
+	// 连接迁移：每dwIntervalMs按各分片工作者线程的忙碌占比检查一次，最忙与最闲的分片相差超过dwImbalancePercent个百分点时，
+	// 由已注册处理者的OnRebalance挑选最忙分片上的连接迁往最闲分片；dwIntervalMs为0时关闭，可在任意时刻调用
+	// 检查与OnRebalance在引擎的检查线程(多于一个分片时创建)上进行，不占用工作者线程；引擎锁策略不是线程安全的(NullLock)时不创建，迁移不生效
+	void EnableRebalance(DWORD dwIntervalMs = REBALANCE_DEFAULT_INTERVAL_MS, DWORD dwImbalancePercent = REBALANCE_DEFAULT_IMBALANCE);
+
+	// 负载检查的周期序号，每次检查前加一；连接按此把读取量归入各周期(见IOSocketContext::AddRecvBytes)
+	LONG64 GetRebalanceEpoch() const
+	{
+		return m_nRebalanceEpoch;
+	}
+
+	// 在安全点(连接上没有在途IO)把连接改绑到IOSocketContext::RequestMigrate指定的完成端口，此后的完成包由目标分片处理
+	// 没有待迁移请求或改绑失败(系统早于Windows 8.1或存在非IFS的分层协议)时返回false，连接留在原分片
+	bool Migrate(IOSocketContext *pSocketContext);
+
+	ULONGLONG GetMigrationCount() const
+	{
+		return (ULONGLONG)m_nMigrations;
+	}
+
+	// 将socket绑定到完成端口，连接按其接收中断所在的NUMA节点选择完成端口，监听socket固定使用第一个
+	// 同时记下分片所在的节点(IOSocketContext::nNumaNode)，此后连接的重叠结构与缓冲区均从该节点分配
+	// 启用同步完成快速路径时，连接的socket同步完成的IO不再投递完成包，见IOSocketContext::bSkipCompletionOnSuccess
+	// 失败时返回false，错误码由WSAGetLastError获取
+	bool Attach(IOSocketContext *pSocketContext, SOCKET sock, bool bListen = false);
+
+	// 没有句柄可绑定的连接(共享内存连接)只经Post投递完成包，为其指定第一个完成端口
+	bool AttachPostOnly(IOSocketContext *pSocketContext);
+
+	// 向连接所在的完成端口投递一个完成包，由工作者线程交给连接的处理者
+	bool Post(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD dwBytes = 0);
+
+	// 低延迟模式：工作线程阻塞等待前先忙轮询完成端口dwSpinUs微秒，运行中也可调用(dwSpinUs为0时关闭)
+	void EnableBusyPoll(DWORD dwSpinUs, LONG nMaxSpinners = 0);
+
+	const IOBusyPoller& GetBusyPoller() const
+	{
+		return m_busyPoller;
+	}
+
+	// 同步完成快速路径，默认启用；只影响之后绑定的连接，系统中存在非IFS的分层协议时自动禁用
+	void SetInlineCompletion(bool bEnable)
+	{
+		m_bInlineCompletion = bEnable;
+	}
+
+	// 准入控制：以探针测量完成包在完成端口中的排队时延，持续超过dwTargetUs达dwIntervalMs即判定为过载
+	// 过载状态变化时在工作者线程上回调已注册处理者的OnOverloadChanged；dwTargetUs为0时关闭，可在任意时刻调用
+	void EnableAdmissionControl(DWORD dwTargetUs = ADMISSION_DEFAULT_TARGET_US, DWORD dwIntervalMs = ADMISSION_DEFAULT_INTERVAL_MS);
+
+	bool IsOverloaded() const
+	{
+		return m_admission.IsOverloaded();
+	}
+
+	const IOAdmissionController& GetAdmissionController() const
+	{
+		return m_admission;
+	}
+
+	// 接收引擎事件(过载状态变化、分片失衡)的处理者，停止前须注销，注销返回后不会再收到回调
+	void RegisterHandler(IOCompletionHandler *pHandler);
+	void UnregisterHandler(IOCompletionHandler *pHandler);
+
+	// 工作者线程的时间统计：等待完成包、引擎处理、各类回调及等待引擎锁各自的耗时
+	// 用于判断应增加线程(等待少)、优化回调(回调占比高)还是减少锁竞争(锁等待高)；Stop后仍保留最近一次运行的统计
+	unsigned int GetWorkerCount() const
+	{
+		return (unsigned int)m_workerTimes.size();
+	}
+
+	bool GetWorkerTimeStats(unsigned int nWorker, IOWorkerTimeStats &stats) const;
+
+	// 输出所有工作者线程的合计及各类耗时的占比，多个分片时另输出各分片的忙碌占比与迁移次数
+	void DumpWorkerTimes(FILE *pFile) const;
+
+private:
+
+	HANDLE SelectCompletionPort(SOCKET sock);
+	USHORT GetPortNode(HANDLE completionPort) const;
+
+	// 非IFS的分层服务提供者(LSP)可能在同步完成后仍投递完成包，此时不能跳过完成端口
+	static bool IsSkipCompletionSafe();
+	DWORD GetNumOfProcessors();
+
+	// 为m_workerThreadNum个工作者线程各指定一个分片(完成端口序号)
+	void AssignWorkers(std::vector<size_t> &workerPorts);
+
+	// 投递探针：未过载时每ADMISSION_PROBE_PERIOD_MS最多一次，bForce时不受周期限制；已有在途探针时不投递
+	void PostProbe(IOAdmissionProbe *pProbe, bool bForce);
+	void OnProbe(IOAdmissionProbe *pProbe);
+
+	// 分片负载检查，只在检查线程上执行
+	void Rebalance();
+	static DWORD WINAPI RebalanceThreadProc(LPVOID lpParam);
+
+	// 工作中线程函数
+	static DWORD WINAPI WorkerThreadProc(LPVOID lpParam);
+
+	IOEngine(const IOEngine&) = delete;
+	IOEngine& operator= (const IOEngine&) = delete;
+
+private:
+
+	HANDLE m_stopEvent;						// 通知工作者线程退出的事件
+	std::vector<HANDLE> m_completionPorts;	// 完成端口，每个有处理器的NUMA节点一个
+	std::vector<USHORT> m_portNodes;		// 各完成端口对应的NUMA节点
+	std::vector<IOWorkerParam> m_workerParams;	// 各工作者线程的参数
+	std::vector<IOWorkerTimeSlot> m_workerTimes;	// 各工作者线程的时间累计，Start时重新分配
+	LONGLONG m_llBaseQpc;					// Start时的QPC与TSC，统计时以QPC校准TSC频率
+	ULONGLONG m_ullBaseTsc;
+	volatile LONG m_nNextPort;				// 无法确定节点时轮询分配完成端口
+	HANDLE *m_pWorkerThreads;				// 工作者线程的句柄指针
+	unsigned int m_workerThreadNum;			// 工作者线程的数量
+	IOBusyPoller m_busyPoller;				// 工作线程等待完成包的方式
+	IOAdmissionController m_admission;		// 准入控制
+	std::vector<IOAdmissionProbe> m_probes;	// 各完成端口的排队时延探针，Start时分配
+	std::vector<IOCompletionHandler*> m_handlers;	// 接收引擎事件的处理者
+	EngineLock m_handlerLock;
+	USHORT m_nShardCount;					// 指定的分片数，0为每个节点一个
+	bool m_bMultiNode;						// 分片分布在多个NUMA节点上，工作者线程需绑定到节点
+	std::vector<IOShardLoad> m_shardLoads;	// 各分片的负载统计，只由执行检查的线程写入
+	DWORD m_dwRebalanceIntervalMs;			// 分片负载检查周期，0为关闭
+	DWORD m_dwImbalancePercent;				// 失衡阈值
+	HANDLE m_hRebalanceThread;				// 分片负载检查线程，只有一个分片时不创建
+	volatile LONG64 m_nRebalanceEpoch;		// 负载检查的周期序号
+	EngineLock m_rebalanceLock;				// OnRebalance期间持有，注销处理者时据此等待进行中的回调结束
+	volatile LONG64 m_nMigrations;			// 累计迁移的连接数
+	bool m_bInlineCompletion;				// 是否启用同步完成快速路径
+	bool m_bSkipCompletionSafe;				// 所有TCP服务提供者均为IFS，Start时检测
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOENGINE_H_
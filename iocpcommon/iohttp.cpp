@@ -0,0 +1,889 @@
+#include "iohttp.h"
+#include <intrin.h>
+#include <string.h>
+#include <stdio.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#define HTTP_SCAN_SSE2
+#endif
+
+namespace
+{
+	inline char ToLowerAscii(char c)
+	{
+		return ('A' <= c && c <= 'Z') ? (char)(c + ('a' - 'A')) : c;
+	}
+
+	inline bool IsOws(char c)
+	{
+		return ' ' == c || '\t' == c;
+	}
+
+	inline bool InRange(unsigned char c, unsigned char lo, unsigned char hi)
+	{
+		return (unsigned char)(c - lo) <= (unsigned char)(hi - lo);
+	}
+
+	// tchar = "!" / "#" / "$" / "%" / "&" / "'" / "*" / "+" / "-" / "." / "^" / "_" / "`" / "|" / "~" / DIGIT / ALPHA
+	inline bool IsTokenChar(unsigned char c)
+	{
+		return InRange(c, 0x21, 0x7E) &&
+			!(0x22 == c || InRange(c, 0x28, 0x29) || 0x2C == c || 0x2F == c ||
+			InRange(c, 0x3A, 0x40) || InRange(c, 0x5B, 0x5D) || 0x7B == c || 0x7D == c);
+	}
+
+	inline bool IsFieldValueChar(unsigned char c)
+	{
+		return !((c < 0x20 && '\t' != c) || 0x7F == c);
+	}
+
+	inline bool IsTargetChar(unsigned char c)
+	{
+		return c > 0x20 && 0x7F != c;
+	}
+
+#ifdef HTTP_SCAN_SSE2
+	// 逐字节判断是否位于[lo, hi]内，结果为0xFF/0x00的掩码：减去lo后按无符号比较不超过hi-lo
+	inline __m128i RangeMask(__m128i v, char lo, char hi)
+	{
+		__m128i limit = _mm_set1_epi8((char)(hi - lo));
+		__m128i offset = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+		return _mm_cmpeq_epi8(_mm_max_epu8(offset, limit), limit);
+	}
+
+	inline __m128i EqualMask(__m128i v, char c)
+	{
+		return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+	}
+
+	// 16字节中非token字符的掩码
+	inline int InvalidTokenMask(__m128i v)
+	{
+		__m128i separators = _mm_or_si128(
+			_mm_or_si128(
+				_mm_or_si128(EqualMask(v, 0x22), RangeMask(v, 0x28, 0x29)),
+				_mm_or_si128(EqualMask(v, 0x2C), EqualMask(v, 0x2F))),
+			_mm_or_si128(
+				_mm_or_si128(RangeMask(v, 0x3A, 0x40), RangeMask(v, 0x5B, 0x5D)),
+				_mm_or_si128(EqualMask(v, 0x7B), EqualMask(v, 0x7D))));
+		return _mm_movemask_epi8(_mm_andnot_si128(separators, RangeMask(v, 0x21, 0x7E))) ^ 0xFFFF;
+	}
+
+	inline int InvalidFieldValueMask(__m128i v)
+	{
+		__m128i controls = _mm_andnot_si128(EqualMask(v, '\t'), RangeMask(v, 0x00, 0x1F));
+		return _mm_movemask_epi8(_mm_or_si128(controls, EqualMask(v, 0x7F)));
+	}
+
+	inline int InvalidTargetMask(__m128i v)
+	{
+		return _mm_movemask_epi8(_mm_or_si128(RangeMask(v, 0x00, 0x20), EqualMask(v, 0x7F)));
+	}
+#endif
+
+	const char* GetReasonPhrase(WORD wStatus)
+	{
+		switch (wStatus)
+		{
+		case 100: return "Continue";
+		case 101: return "Switching Protocols";
+		case 200: return "OK";
+		case 201: return "Created";
+		case 202: return "Accepted";
+		case 204: return "No Content";
+		case 206: return "Partial Content";
+		case 301: return "Moved Permanently";
+		case 302: return "Found";
+		case 304: return "Not Modified";
+		case 400: return "Bad Request";
+		case 401: return "Unauthorized";
+		case 403: return "Forbidden";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 408: return "Request Timeout";
+		case 411: return "Length Required";
+		case 413: return "Content Too Large";
+		case 414: return "URI Too Long";
+		case 426: return "Upgrade Required";
+		case 431: return "Request Header Fields Too Large";
+		case 500: return "Internal Server Error";
+		case 501: return "Not Implemented";
+		case 503: return "Service Unavailable";
+		case 505: return "HTTP Version Not Supported";
+		default:  return "Unknown";
+		}
+	}
+
+	void AppendDecimal(std::string &out, ULONGLONG ullValue)
+	{
+		char digits[24];
+		int nCount = 0;
+		do
+		{
+			digits[nCount++] = (char)('0' + ullValue % 10);
+			ullValue /= 10;
+		} while (ullValue);
+
+		while (nCount)
+		{
+			out.push_back(digits[--nCount]);
+		}
+	}
+
+	// Date头部按秒缓存在各工作线程中，同一秒内的响应不再重新格式化
+	const char* GetDateHeader()
+	{
+		static const char *s_weekDays[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+		static const char *s_months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+		static thread_local char t_dateHeader[64] = { 0 };
+		static thread_local SYSTEMTIME t_cachedTime = { 0 };
+
+		SYSTEMTIME now;
+		::GetSystemTime(&now);
+		if (!t_dateHeader[0] ||
+			now.wSecond != t_cachedTime.wSecond || now.wMinute != t_cachedTime.wMinute ||
+			now.wHour != t_cachedTime.wHour || now.wDay != t_cachedTime.wDay ||
+			now.wMonth != t_cachedTime.wMonth || now.wYear != t_cachedTime.wYear)
+		{
+			t_cachedTime = now;
+			::sprintf_s(t_dateHeader, sizeof(t_dateHeader), "Date: %s, %02u %s %04u %02u:%02u:%02u GMT\r\n",
+				s_weekDays[now.wDayOfWeek % 7], now.wDay, s_months[(now.wMonth + 11) % 12], now.wYear,
+				now.wHour, now.wMinute, now.wSecond);
+		}
+		return t_dateHeader;
+	}
+}
+
+bool IOHttpStringView::Equals(const char *str) const
+{
+	size_t nLen = ::strlen(str);
+	return nLen == dwLen && 0 == ::memcmp(pData, str, nLen);
+}
+
+bool IOHttpStringView::EqualsNoCase(const char *str) const
+{
+	size_t nLen = ::strlen(str);
+	if (nLen != dwLen)
+	{
+		return false;
+	}
+
+	for (DWORD index = 0; index < dwLen; ++index)
+	{
+		if (ToLowerAscii(pData[index]) != ToLowerAscii(str[index]))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool IOHttpStringView::ContainsToken(const char *token) const
+{
+	const char *p = pData;
+	const char *pEnd = pData + dwLen;
+	while (p < pEnd)
+	{
+		const char *pComma = IOHttpScanner::FindChar(p, pEnd, ',');
+		const char *pElementEnd = pComma ? pComma : pEnd;
+
+		const char *pBegin = p;
+		while (pBegin < pElementEnd && IsOws(*pBegin))
+		{
+			++pBegin;
+		}
+		const char *pLast = pElementEnd;
+		while (pLast > pBegin && IsOws(pLast[-1]))
+		{
+			--pLast;
+		}
+
+		if (IOHttpStringView(pBegin, (DWORD)(pLast - pBegin)).EqualsNoCase(token))
+		{
+			return true;
+		}
+		p = pElementEnd + 1;
+	}
+	return false;
+}
+
+const IOHttpStringView* IOHttpRequest::FindHeader(const char *name) const
+{
+	for (DWORD index = 0; index < dwHeaderCount; ++index)
+	{
+		if (headers[index].name.EqualsNoCase(name))
+		{
+			return &headers[index].value;
+		}
+	}
+	return nullptr;
+}
+
+const char* IOHttpScanner::FindChar(const char *pBegin, const char *pEnd, char c)
+{
+	const char *p = pBegin;
+#ifdef HTTP_SCAN_SSE2
+	__m128i needle = _mm_set1_epi8(c);
+	for (; pEnd - p >= 16; p += 16)
+	{
+		int nMask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), needle));
+		if (nMask)
+		{
+			unsigned long nIndex = 0;
+			_BitScanForward(&nIndex, (unsigned long)nMask);
+			return p + nIndex;
+		}
+	}
+#endif
+	for (; p < pEnd; ++p)
+	{
+		if (c == *p)
+		{
+			return p;
+		}
+	}
+	return nullptr;
+}
+
+const char* IOHttpScanner::FindHeaderEnd(const char *pMessage, const char *pScanFrom, const char *pEnd)
+{
+	// 头部中换行较少，先定位'\n'再向前确认"\r\n\r"
+	const char *p = pScanFrom;
+	while (p < pEnd)
+	{
+		const char *pNewLine = FindChar(p, pEnd, '\n');
+		if (!pNewLine)
+		{
+			break;
+		}
+
+		if (pNewLine - pMessage >= 3 && '\r' == pNewLine[-1] && '\n' == pNewLine[-2] && '\r' == pNewLine[-3])
+		{
+			return pNewLine + 1;
+		}
+		p = pNewLine + 1;
+	}
+	return nullptr;
+}
+
+bool IOHttpScanner::IsToken(const char *p, DWORD dwLen)
+{
+	const char *pEnd = p + dwLen;
+#ifdef HTTP_SCAN_SSE2
+	for (; pEnd - p >= 16; p += 16)
+	{
+		if (InvalidTokenMask(_mm_loadu_si128((const __m128i *)p)))
+		{
+			return false;
+		}
+	}
+#endif
+	for (; p < pEnd; ++p)
+	{
+		if (!IsTokenChar((unsigned char)*p))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool IOHttpScanner::IsFieldValue(const char *p, DWORD dwLen)
+{
+	const char *pEnd = p + dwLen;
+#ifdef HTTP_SCAN_SSE2
+	for (; pEnd - p >= 16; p += 16)
+	{
+		if (InvalidFieldValueMask(_mm_loadu_si128((const __m128i *)p)))
+		{
+			return false;
+		}
+	}
+#endif
+	for (; p < pEnd; ++p)
+	{
+		if (!IsFieldValueChar((unsigned char)*p))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool IOHttpScanner::IsTarget(const char *p, DWORD dwLen)
+{
+	const char *pEnd = p + dwLen;
+#ifdef HTTP_SCAN_SSE2
+	for (; pEnd - p >= 16; p += 16)
+	{
+		if (InvalidTargetMask(_mm_loadu_si128((const __m128i *)p)))
+		{
+			return false;
+		}
+	}
+#endif
+	for (; p < pEnd; ++p)
+	{
+		if (!IsTargetChar((unsigned char)*p))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+IOHttpSession::IOHttpSession()
+	: m_bBuffered(false)
+	, m_pData(nullptr)
+	, m_dwDataLen(0)
+	, m_dwOffset(0)
+	, m_dwHeadScanned(0)
+	, m_dwHeadLen(0)
+	, m_pHeadBase(nullptr)
+	, m_chunkState(HTTP_CHUNK_STATE::HTTP_CHUNK_SIZE)
+	, m_dwChunkCursor(0)
+	, m_ullChunkRemaining(0)
+	, m_bStopped(false)
+	, m_wErrorStatus(0)
+	, m_nErrorSequence(HTTP_INVALID_SEQUENCE)
+	, m_nNextSequence(0)
+	, m_nNextSendSequence(0)
+	, m_nCloseSequence(HTTP_INVALID_SEQUENCE)
+	, m_nUpgradeSequence(HTTP_INVALID_SEQUENCE)
+	, m_bCorked(false)
+	, m_bCloseQueued(false)
+	, m_nShutdownState(0)
+	, m_lock("IOHttpSession")
+{
+	m_request.dwHeaderCount = 0;
+	m_request.wVersionMinor = 1;
+	m_request.bKeepAlive = true;
+	m_request.bChunked = false;
+	m_request.ullContentLength = 0;
+	m_request.nSequence = HTTP_INVALID_SEQUENCE;
+}
+
+void IOHttpSession::Feed(const char *buffer, DWORD dwLen)
+{
+	m_dwOffset = 0;
+
+	// 已收到最后一个请求，之后的数据直接丢弃
+	if (m_bStopped)
+	{
+		m_bBuffered = false;
+		m_pData = nullptr;
+		m_dwDataLen = 0;
+		return;
+	}
+
+	// 没有残留数据时直接解析接收缓冲区，否则追加到残留的不完整请求之后
+	if (m_buffer.empty())
+	{
+		m_bBuffered = false;
+		m_pData = buffer;
+		m_dwDataLen = dwLen;
+	}
+	else
+	{
+		m_buffer.insert(m_buffer.end(), buffer, buffer + dwLen);
+		m_bBuffered = true;
+		m_pData = m_buffer.data();
+		m_dwDataLen = (DWORD)m_buffer.size();
+	}
+}
+
+void IOHttpSession::EndFeed()
+{
+	if (m_bStopped)
+	{
+		std::vector<char>().swap(m_buffer);
+	}
+	else if (m_bBuffered)
+	{
+		m_buffer.erase(m_buffer.begin(), m_buffer.begin() + m_dwOffset);
+	}
+	else if (m_dwOffset < m_dwDataLen)
+	{
+		// 请求跨越了recv边界，拷贝其已收到的部分，相对请求起始的解析进度保持不变
+		m_buffer.assign(m_pData + m_dwOffset, m_pData + m_dwDataLen);
+	}
+
+	m_bBuffered = false;
+	m_pData = nullptr;
+	m_dwDataLen = 0;
+	m_dwOffset = 0;
+}
+
+HTTP_PARSE_RESULT IOHttpSession::NextRequest()
+{
+	if (m_bStopped)
+	{
+		return HTTP_PARSE_RESULT::HTTP_PARSE_INCOMPLETE;
+	}
+
+	// 请求之前允许出现空行
+	if (0 == m_dwHeadScanned)
+	{
+		while (m_dwOffset < m_dwDataLen && ('\r' == m_pData[m_dwOffset] || '\n' == m_pData[m_dwOffset]))
+		{
+			++m_dwOffset;
+		}
+	}
+
+	const char *pMessage = m_pData + m_dwOffset;
+	DWORD dwAvailable = m_dwDataLen - m_dwOffset;
+	if (0 == dwAvailable)
+	{
+		return HTTP_PARSE_RESULT::HTTP_PARSE_INCOMPLETE;
+	}
+
+	if (0 == m_dwHeadLen)
+	{
+		const char *pHeadEnd = IOHttpScanner::FindHeaderEnd(pMessage, pMessage + m_dwHeadScanned, pMessage + dwAvailable);
+		if (!pHeadEnd)
+		{
+			m_dwHeadScanned = dwAvailable;
+			return (dwAvailable > HTTP_MAX_HEADER_SIZE) ? Fail(431) : HTTP_PARSE_RESULT::HTTP_PARSE_INCOMPLETE;
+		}
+
+		m_dwHeadLen = (DWORD)(pHeadEnd - pMessage);
+		m_dwHeadScanned = m_dwHeadLen;
+		if (m_dwHeadLen > HTTP_MAX_HEADER_SIZE)
+		{
+			return Fail(431);
+		}
+
+		HTTP_PARSE_RESULT result = ParseHead(pMessage);
+		if (HTTP_PARSE_RESULT::HTTP_PARSE_COMPLETE != result)
+		{
+			return result;
+		}
+
+		m_body.clear();
+		m_chunkState = HTTP_CHUNK_STATE::HTTP_CHUNK_SIZE;
+		m_dwChunkCursor = m_dwHeadLen;
+	}
+	else if (m_pHeadBase != pMessage)
+	{
+		// 请求已从接收缓冲区移动到会话缓冲区，重建指向新位置的视图
+		ParseHead(pMessage);
+	}
+
+	DWORD dwMessageLen = 0;
+	if (m_request.bChunked)
+	{
+		HTTP_PARSE_RESULT result = DecodeChunks(pMessage, dwAvailable, dwMessageLen);
+		if (HTTP_PARSE_RESULT::HTTP_PARSE_COMPLETE != result)
+		{
+			return result;
+		}
+		m_request.body = IOHttpStringView(m_body.data(), (DWORD)m_body.size());
+	}
+	else
+	{
+		if ((ULONGLONG)(dwAvailable - m_dwHeadLen) < m_request.ullContentLength)
+		{
+			return HTTP_PARSE_RESULT::HTTP_PARSE_INCOMPLETE;
+		}
+
+		dwMessageLen = m_dwHeadLen + (DWORD)m_request.ullContentLength;
+		m_request.body = IOHttpStringView(pMessage + m_dwHeadLen, (DWORD)m_request.ullContentLength);
+	}
+
+	m_dwOffset += dwMessageLen;
+	DWORD dwResponseFlags = 0;
+	if (m_request.method.Equals("HEAD"))
+	{
+		dwResponseFlags |= HTTP_RESPONSE_NO_BODY;
+	}
+	if (0 == m_request.wVersionMinor && m_request.bKeepAlive)
+	{
+		dwResponseFlags |= HTTP_RESPONSE_KEEP_ALIVE;
+	}
+	m_request.nSequence = NextSequence(dwResponseFlags, !m_request.bKeepAlive);
+	if (!m_request.bKeepAlive)
+	{
+		m_bStopped = true;
+	}
+	ResetMessage();
+
+	return HTTP_PARSE_RESULT::HTTP_PARSE_COMPLETE;
+}
+
+HTTP_PARSE_RESULT IOHttpSession::ParseHead(const char *pMessage)
+{
+	const char *pEnd = pMessage + m_dwHeadLen;
+	IOHttpRequest &request = m_request;
+	request.dwHeaderCount = 0;
+	request.body = IOHttpStringView();
+	request.bChunked = false;
+	request.ullContentLength = 0;
+	request.nSequence = HTTP_INVALID_SEQUENCE;
+	m_pHeadBase = pMessage;
+
+	// 请求行：method SP request-target SP HTTP-version CRLF
+	const char *pLineEnd = IOHttpScanner::FindChar(pMessage, pEnd, '\n');
+	if (!pLineEnd || pLineEnd == pMessage || '\r' != pLineEnd[-1])
+	{
+		return Fail(400);
+	}
+
+	const char *pMethodEnd = IOHttpScanner::FindChar(pMessage, pLineEnd, ' ');
+	if (!pMethodEnd || pMethodEnd == pMessage)
+	{
+		return Fail(400);
+	}
+	request.method = IOHttpStringView(pMessage, (DWORD)(pMethodEnd - pMessage));
+
+	const char *pTarget = pMethodEnd + 1;
+	const char *pTargetEnd = IOHttpScanner::FindChar(pTarget, pLineEnd, ' ');
+	if (!pTargetEnd || pTargetEnd == pTarget)
+	{
+		return Fail(400);
+	}
+	request.target = IOHttpStringView(pTarget, (DWORD)(pTargetEnd - pTarget));
+
+	if (!IOHttpScanner::IsToken(request.method.pData, request.method.dwLen) ||
+		!IOHttpScanner::IsTarget(request.target.pData, request.target.dwLen))
+	{
+		return Fail(400);
+	}
+
+	IOHttpStringView version(pTargetEnd + 1, (DWORD)(pLineEnd - 1 - (pTargetEnd + 1)));
+	if (8 != version.dwLen || 0 != ::memcmp(version.pData, "HTTP/", 5) || '.' != version.pData[6] ||
+		!InRange((unsigned char)version.pData[5], '0', '9') || !InRange((unsigned char)version.pData[7], '0', '9'))
+	{
+		return Fail(400);
+	}
+	if ('1' != version.pData[5])
+	{
+		return Fail(505);
+	}
+	request.wVersionMinor = (WORD)(version.pData[7] - '0');
+	request.bKeepAlive = (request.wVersionMinor >= 1);
+
+	// 头部字段：field-name ":" OWS field-value OWS CRLF，直到空行
+	bool bHasContentLength = false, bHasTransferEncoding = false;
+	const char *p = pLineEnd + 1;
+	while (p < pEnd)
+	{
+		pLineEnd = IOHttpScanner::FindChar(p, pEnd, '\n');
+		if (!pLineEnd || '\r' != pLineEnd[-1])
+		{
+			return Fail(400);
+		}
+
+		const char *pLineLast = pLineEnd - 1;
+		if (pLineLast == p)
+		{
+			break;
+		}
+
+		// 不支持已废弃的折行
+		if (IsOws(*p))
+		{
+			return Fail(400);
+		}
+
+		if (request.dwHeaderCount >= HTTP_MAX_HEADERS)
+		{
+			return Fail(431);
+		}
+
+		const char *pColon = IOHttpScanner::FindChar(p, pLineLast, ':');
+		if (!pColon || pColon == p || !IOHttpScanner::IsToken(p, (DWORD)(pColon - p)))
+		{
+			return Fail(400);
+		}
+
+		const char *pValue = pColon + 1;
+		const char *pValueEnd = pLineLast;
+		while (pValue < pValueEnd && IsOws(*pValue))
+		{
+			++pValue;
+		}
+		while (pValueEnd > pValue && IsOws(pValueEnd[-1]))
+		{
+			--pValueEnd;
+		}
+		if (!IOHttpScanner::IsFieldValue(pValue, (DWORD)(pValueEnd - pValue)))
+		{
+			return Fail(400);
+		}
+
+		IOHttpHeader &header = request.headers[request.dwHeaderCount++];
+		header.name = IOHttpStringView(p, (DWORD)(pColon - p));
+		header.value = IOHttpStringView(pValue, (DWORD)(pValueEnd - pValue));
+
+		// 决定请求体长度及连接是否保持的字段
+		if (header.name.EqualsNoCase("content-length"))
+		{
+			ULONGLONG ullLength = 0;
+			if (0 == header.value.dwLen)
+			{
+				return Fail(400);
+			}
+			for (DWORD index = 0; index < header.value.dwLen; ++index)
+			{
+				char c = header.value.pData[index];
+				if (!InRange((unsigned char)c, '0', '9') || ullLength > HTTP_MAX_BODY_SIZE)
+				{
+					return (ullLength > HTTP_MAX_BODY_SIZE) ? Fail(413) : Fail(400);
+				}
+				ullLength = ullLength * 10 + (c - '0');
+			}
+
+			if (bHasContentLength && ullLength != request.ullContentLength)
+			{
+				return Fail(400);
+			}
+			bHasContentLength = true;
+			request.ullContentLength = ullLength;
+		}
+		else if (header.name.EqualsNoCase("transfer-encoding"))
+		{
+			// 只支持chunked，其余传输编码无法确定请求体边界
+			if (!header.value.EqualsNoCase("chunked"))
+			{
+				return Fail(501);
+			}
+			bHasTransferEncoding = true;
+			request.bChunked = true;
+		}
+		else if (header.name.EqualsNoCase("connection"))
+		{
+			if (header.value.ContainsToken("close"))
+			{
+				request.bKeepAlive = false;
+			}
+			else if (header.value.ContainsToken("keep-alive"))
+			{
+				request.bKeepAlive = true;
+			}
+		}
+
+		p = pLineEnd + 1;
+	}
+
+	// 同时携带两者的请求可能被前后两级代理解析为不同的边界(请求走私)
+	if (bHasContentLength && bHasTransferEncoding)
+	{
+		return Fail(400);
+	}
+	if (request.ullContentLength > HTTP_MAX_BODY_SIZE)
+	{
+		return Fail(413);
+	}
+
+	return HTTP_PARSE_RESULT::HTTP_PARSE_COMPLETE;
+}
+
+HTTP_PARSE_RESULT IOHttpSession::DecodeChunks(const char *pMessage, DWORD dwAvailable, DWORD &dwMessageLen)
+{
+	const char *pEnd = pMessage + dwAvailable;
+	while (true)
+	{
+		const char *pCursor = pMessage + m_dwChunkCursor;
+		switch (m_chunkState)
+		{
+		case HTTP_CHUNK_STATE::HTTP_CHUNK_SIZE:
+		{
+			// chunk-size [ chunk-ext ] CRLF
+			const char *pLineEnd = IOHttpScanner::FindChar(pCursor, pEnd, '\n');
+			if (!pLineEnd)
+			{
+				return (pEnd - pCursor > HTTP_MAX_CHUNK_LINE) ? Fail(400) : HTTP_PARSE_RESULT::HTTP_PARSE_INCOMPLETE;
+			}
+			if (pLineEnd == pCursor || '\r' != pLineEnd[-1])
+			{
+				return Fail(400);
+			}
+
+			ULONGLONG ullSize = 0;
+			const char *p = pCursor;
+			for (; p < pLineEnd - 1; ++p)
+			{
+				char c = ToLowerAscii(*p);
+				int nDigit = InRange((unsigned char)c, '0', '9') ? (c - '0') : (InRange((unsigned char)c, 'a', 'f') ? (c - 'a' + 10) : -1);
+				if (nDigit < 0)
+				{
+					break;
+				}
+				if (ullSize > HTTP_MAX_BODY_SIZE)
+				{
+					return Fail(413);
+				}
+				ullSize = ullSize * 16 + nDigit;
+			}
+			if (p == pCursor || (p < pLineEnd - 1 && ';' != *p && !IsOws(*p)))
+			{
+				return Fail(400);
+			}
+			if (m_body.size() + ullSize > HTTP_MAX_BODY_SIZE)
+			{
+				return Fail(413);
+			}
+
+			m_dwChunkCursor = (DWORD)(pLineEnd + 1 - pMessage);
+			m_ullChunkRemaining = ullSize;
+			m_chunkState = ullSize ? HTTP_CHUNK_STATE::HTTP_CHUNK_DATA : HTTP_CHUNK_STATE::HTTP_CHUNK_TRAILER;
+		}
+		break;
+		case HTTP_CHUNK_STATE::HTTP_CHUNK_DATA:
+		{
+			// chunk-data CRLF
+			if ((ULONGLONG)(pEnd - pCursor) < m_ullChunkRemaining + 2)
+			{
+				return HTTP_PARSE_RESULT::HTTP_PARSE_INCOMPLETE;
+			}
+
+			const char *pDataEnd = pCursor + m_ullChunkRemaining;
+			if ('\r' != pDataEnd[0] || '\n' != pDataEnd[1])
+			{
+				return Fail(400);
+			}
+
+			m_body.insert(m_body.end(), pCursor, pDataEnd);
+			m_dwChunkCursor = (DWORD)(pDataEnd + 2 - pMessage);
+			m_chunkState = HTTP_CHUNK_STATE::HTTP_CHUNK_SIZE;
+		}
+		break;
+		case HTTP_CHUNK_STATE::HTTP_CHUNK_TRAILER:
+		{
+			// trailer字段不交给上层，遇到空行时请求结束
+			const char *pLineEnd = IOHttpScanner::FindChar(pCursor, pEnd, '\n');
+			if (!pLineEnd)
+			{
+				return (pEnd - pCursor > HTTP_MAX_HEADER_SIZE) ? Fail(431) : HTTP_PARSE_RESULT::HTTP_PARSE_INCOMPLETE;
+			}
+			if (pLineEnd == pCursor || '\r' != pLineEnd[-1])
+			{
+				return Fail(400);
+			}
+
+			m_dwChunkCursor = (DWORD)(pLineEnd + 1 - pMessage);
+			if (pLineEnd - 1 == pCursor)
+			{
+				dwMessageLen = m_dwChunkCursor;
+				return HTTP_PARSE_RESULT::HTTP_PARSE_COMPLETE;
+			}
+		}
+		break;
+		default:
+			return Fail(400);
+		}
+	}
+}
+
+HTTP_PARSE_RESULT IOHttpSession::Fail(WORD wStatus)
+{
+	m_bStopped = true;
+	m_wErrorStatus = wStatus;
+	m_nErrorSequence = NextSequence(0, true);
+	ResetMessage();
+	return HTTP_PARSE_RESULT::HTTP_PARSE_ERROR;
+}
+
+void IOHttpSession::ResetMessage()
+{
+	m_dwHeadScanned = 0;
+	m_dwHeadLen = 0;
+	m_pHeadBase = nullptr;
+	m_chunkState = HTTP_CHUNK_STATE::HTTP_CHUNK_SIZE;
+	m_dwChunkCursor = 0;
+	m_ullChunkRemaining = 0;
+}
+
+ULONGLONG IOHttpSession::NextSequence(DWORD dwResponseFlags, bool bClose)
+{
+	AutoLock<EngineLock> lock(m_lock);
+	ULONGLONG nSequence = m_nNextSequence++;
+	if (dwResponseFlags)
+	{
+		m_responseFlags[nSequence] = dwResponseFlags;
+	}
+	if (bClose)
+	{
+		m_nCloseSequence = nSequence;
+	}
+	return nSequence;
+}
+
+bool IOHttpSession::AppendResponse(ULONGLONG nSequence, WORD wStatus, const char *pContentType,
+	const char *pBody, DWORD dwBodyLen, const char *pExtraHeaders)
+{
+	if (nSequence >= m_nNextSequence || nSequence < m_nNextSendSequence || m_bCloseQueued ||
+		m_pendingResponses.end() != m_pendingResponses.find(nSequence))
+	{
+		return false;
+	}
+
+	bool bInOrder = (nSequence == m_nNextSendSequence);
+	DWORD dwResponseFlags = 0;
+	std::map<ULONGLONG, DWORD>::iterator flagIter = m_responseFlags.find(nSequence);
+	if (flagIter != m_responseFlags.end())
+	{
+		dwResponseFlags = flagIter->second;
+		m_responseFlags.erase(flagIter);
+	}
+
+	// 轮到的响应直接写入输出缓冲区，提前提交的响应暂存到轮到为止
+	std::string &response = bInOrder ? m_output : m_pendingResponses[nSequence];
+	response.append("HTTP/1.1 ");
+	AppendDecimal(response, wStatus);
+	response.push_back(' ');
+	response.append(GetReasonPhrase(wStatus));
+	response.append("\r\nServer: tinyiocp\r\n");
+	response.append(GetDateHeader());
+	if (pContentType)
+	{
+		response.append("Content-Type: ");
+		response.append(pContentType);
+		response.append("\r\n");
+	}
+	// 1xx及204响应不能携带Content-Length
+	if (wStatus >= 200 && 204 != wStatus)
+	{
+		response.append("Content-Length: ");
+		AppendDecimal(response, dwBodyLen);
+		response.append("\r\n");
+	}
+	if (nSequence == m_nCloseSequence)
+	{
+		response.append("Connection: close\r\n");
+	}
+	else if (dwResponseFlags & HTTP_RESPONSE_KEEP_ALIVE)
+	{
+		response.append("Connection: keep-alive\r\n");
+	}
+	if (pExtraHeaders)
+	{
+		response.append(pExtraHeaders);
+	}
+	response.append("\r\n");
+	if (pBody && dwBodyLen && wStatus >= 200 && 204 != wStatus && !(dwResponseFlags & HTTP_RESPONSE_NO_BODY))
+	{
+		response.append(pBody, dwBodyLen);
+	}
+
+	if (!bInOrder)
+	{
+		return true;
+	}
+
+	m_bCloseQueued = (nSequence == m_nCloseSequence);
+	++m_nNextSendSequence;
+
+	// 已提前提交的后续响应依次输出
+	std::map<ULONGLONG, std::string>::iterator iter = m_pendingResponses.begin();
+	while (!m_bCloseQueued && iter != m_pendingResponses.end() && iter->first == m_nNextSendSequence)
+	{
+		m_output.append(iter->second);
+		m_bCloseQueued = (iter->first == m_nCloseSequence);
+		++m_nNextSendSequence;
+		iter = m_pendingResponses.erase(iter);
+	}
+
+	return true;
+}
@@ -0,0 +1,259 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOHTTP_H_
+#define _TINY_IOCP_IOCPCOMMON_IOHTTP_H_
+
+#include <Windows.h>
+#include "iolock.h"
+#include <vector>
+#include <string>
+#include <map>
+
+#define HTTP_MAX_HEADERS		(64)				// 每个请求最多的头部字段数
+#define HTTP_MAX_HEADER_SIZE	(1024 * 16)			// 请求行与头部的最大长度(16K)
+#define HTTP_MAX_BODY_SIZE		(1024 * 1024 * 4)	// 请求体的最大长度(4M)
+#define HTTP_MAX_CHUNK_LINE		(1024)				// chunk大小行(含扩展)的最大长度
+#define HTTP_INVALID_SEQUENCE	((ULONGLONG)-1)		// 无效的请求序号
+
+#define HTTP_RESPONSE_NO_BODY		(0x0001)	// HEAD请求，响应不带响应体
+#define HTTP_RESPONSE_KEEP_ALIVE	(0x0002)	// HTTP/1.0请求要求保持连接，响应需显式声明
+
+//	请求解析结果
+enum class HTTP_PARSE_RESULT
+{
+	HTTP_PARSE_COMPLETE = 0,	// 取出了一个完整的请求
+	HTTP_PARSE_INCOMPLETE,		// 数据不足，等待下一次recv
+	HTTP_PARSE_ERROR,			// 请求格式错误，应以GetErrorStatus响应后关闭连接
+};
+
+//	chunked请求体的解码状态
+enum class HTTP_CHUNK_STATE
+{
+	HTTP_CHUNK_SIZE = 0,		// 等待chunk大小行
+	HTTP_CHUNK_DATA,			// 等待chunk数据及其后的CRLF
+	HTTP_CHUNK_TRAILER,			// 等待trailer字段及结束空行
+};
+
+// 指向接收缓冲区的只读视图，不拥有数据
+struct IOHttpStringView
+{
+	const char *pData;
+	DWORD dwLen;
+
+	IOHttpStringView() : pData(nullptr), dwLen(0) {}
+	IOHttpStringView(const char *p, DWORD dwLength) : pData(p), dwLen(dwLength) {}
+
+	bool Equals(const char *str) const;
+
+	// ASCII大小写不敏感比较
+	bool EqualsNoCase(const char *str) const;
+
+	// 按逗号分隔的列表中是否含有token(大小写不敏感)，用于Connection/Transfer-Encoding
+	bool ContainsToken(const char *token) const;
+};
+
+struct IOHttpHeader
+{
+	IOHttpStringView name;
+	IOHttpStringView value;
+};
+
+// 解析出的请求，各字段均为指向接收缓冲区的视图，只在OnRequest回调期间有效
+// Content-Length请求体同样直接指向接收缓冲区；chunked请求体解码到会话内部的缓冲区中
+struct IOHttpRequest
+{
+	IOHttpStringView method;
+	IOHttpStringView target;
+	WORD wVersionMinor;					// HTTP/1.x中的x
+	IOHttpHeader headers[HTTP_MAX_HEADERS];
+	DWORD dwHeaderCount;
+	IOHttpStringView body;
+	bool bKeepAlive;					// 响应后是否保持连接
+	bool bChunked;						// 请求体是否为chunked编码
+	ULONGLONG ullContentLength;
+	ULONGLONG nSequence;				// 请求在连接上的序号，响应时原样传回
+
+	// 按名称查找头部字段(大小写不敏感)，不存在时返回nullptr
+	const IOHttpStringView* FindHeader(const char *name) const;
+};
+
+// 分隔符查找与字符校验，x86/x64上以SSE2每次处理16字节，不足16字节的尾部逐字节处理
+class IOHttpScanner
+{
+public:
+
+	// 返回[pBegin, pEnd)中第一个字符c的位置，不存在时返回nullptr
+	static const char* FindChar(const char *pBegin, const char *pEnd, char c);
+
+	// 从pScanFrom开始查找头部结束的空行"\r\n\r\n"，返回空行之后的位置，不存在时返回nullptr
+	// pMessage为请求的起始位置，空行可以跨越pScanFrom之前已扫描过的部分
+	static const char* FindHeaderEnd(const char *pMessage, const char *pScanFrom, const char *pEnd);
+
+	// 是否全部为token字符(RFC 9110 tchar)，用于方法及头部字段名
+	static bool IsToken(const char *p, DWORD dwLen);
+
+	// 是否为合法的头部字段值：不含除HTAB外的控制字符及DEL
+	static bool IsFieldValue(const char *p, DWORD dwLen);
+
+	// 是否为合法的请求目标：不含空白、控制字符及DEL
+	static bool IsTarget(const char *p, DWORD dwLen);
+};
+
+// 每个连接的HTTP/1.1会话
+// 收数据只在持有recv的工作线程上进行，Feed/NextRequest/EndFeed不需要加锁：
+// 请求完整位于本次收到的数据中时直接在接收缓冲区上解析，只有跨越recv边界的不完整请求才拷贝到会话缓冲区
+// 响应可在任意线程按任意顺序提交，会话按请求序号排序后依次输出；响应相关的接口调用者需持有GetLock返回的锁
+class IOHttpSession
+{
+public:
+
+	IOHttpSession();
+	~IOHttpSession() = default;
+
+public:
+
+	// 开始处理本次收到的数据
+	void Feed(const char *buffer, DWORD dwLen);
+
+	// 取出下一个完整的请求，结果通过GetRequest获取
+	HTTP_PARSE_RESULT NextRequest();
+
+	// 本次数据处理完毕，未解析完的部分保留到会话缓冲区
+	void EndFeed();
+
+	const IOHttpRequest& GetRequest() const
+	{
+		return m_request;
+	}
+
+	// 解析出错时应响应的状态码，错误响应占用一个请求序号，由GetErrorSequence获取
+	WORD GetErrorStatus() const
+	{
+		return m_wErrorStatus;
+	}
+
+	ULONGLONG GetErrorSequence() const
+	{
+		return m_nErrorSequence;
+	}
+
+public:
+
+	// 提交序号为nSequence的响应，序号未分配、已响应或连接即将关闭时返回false
+	// 轮到该序号时响应被追加到输出缓冲区，之后已提交的后续响应也依次追加
+	bool AppendResponse(ULONGLONG nSequence, WORD wStatus, const char *pContentType,
+		const char *pBody, DWORD dwBodyLen, const char *pExtraHeaders);
+
+	// 待发送的响应数据，调用者发送后清空
+	std::string& GetOutput()
+	{
+		return m_output;
+	}
+
+	// 收数据期间暂缓发送，一次recv中的多个流水线请求的响应合并为一次发送
+	void Cork()
+	{
+		m_bCorked = true;
+	}
+
+	void Uncork()
+	{
+		m_bCorked = false;
+	}
+
+	bool IsCorked() const
+	{
+		return m_bCorked;
+	}
+
+	// 连接已升级为其他协议(如WebSocket)，之后的数据不再按HTTP解析；只在持有recv的工作线程上、在升级请求的OnRequest中调用
+	// 客户端须在收到101响应后才发送新协议的数据，升级请求之后同一次recv中的残留数据直接丢弃
+	void Upgrade()
+	{
+		m_bStopped = true;
+
+		AutoLock<EngineLock> lock(m_lock);
+		m_nUpgradeSequence = m_nNextSequence - 1;
+	}
+
+	// 升级请求的响应及其前序的流水线响应均已取出发送时仅第一次调用返回true，之后才可发送新协议的数据
+	bool TakeUpgradeSent()
+	{
+		if (HTTP_INVALID_SEQUENCE == m_nUpgradeSequence || m_nNextSendSequence <= m_nUpgradeSequence || !m_output.empty())
+		{
+			return false;
+		}
+
+		m_nUpgradeSequence = HTTP_INVALID_SEQUENCE;
+		return true;
+	}
+
+	// 最后一个请求(Connection: close或出错)的响应已进入输出缓冲区，发送完毕后应关闭连接
+	bool IsCloseQueued() const
+	{
+		return m_bCloseQueued;
+	}
+
+	EngineLock& GetLock()
+	{
+		return m_lock;
+	}
+
+	// 最后的响应已投递发送，之后由最后一个完成的send关闭写端
+	void BeginShutdown()
+	{
+		::InterlockedCompareExchange(&m_nShutdownState, 1, 0);
+	}
+
+	// 最后的响应已投递时仅第一次调用返回true
+	bool TakeShutdown()
+	{
+		return (1 == ::InterlockedCompareExchange(&m_nShutdownState, 2, 1));
+	}
+
+private:
+
+	HTTP_PARSE_RESULT ParseHead(const char *pMessage);
+	HTTP_PARSE_RESULT DecodeChunks(const char *pMessage, DWORD dwAvailable, DWORD &dwMessageLen);
+	HTTP_PARSE_RESULT Fail(WORD wStatus);
+	void ResetMessage();
+
+	// 为请求分配序号，dwResponseFlags(HTTP_RESPONSE_*)及bClose记录其响应的特殊处理
+	ULONGLONG NextSequence(DWORD dwResponseFlags, bool bClose);
+
+	IOHttpSession(const IOHttpSession&) = delete;
+	IOHttpSession& operator= (const IOHttpSession&) = delete;
+
+private:
+
+	// 收数据状态，只在持有recv的工作线程上访问
+	std::vector<char> m_buffer;			// 跨越recv边界的不完整请求
+	bool m_bBuffered;					// 本次解析的数据位于m_buffer中
+	const char *m_pData;				// 本次解析的数据：接收缓冲区或m_buffer
+	DWORD m_dwDataLen;
+	DWORD m_dwOffset;					// 当前请求在m_pData中的起始位置
+	DWORD m_dwHeadScanned;				// 已扫描过的头部长度，下次从此处继续查找空行
+	DWORD m_dwHeadLen;					// 头部长度(含结束空行)，0表示头部尚不完整
+	const char *m_pHeadBase;			// m_request中的视图所指向的请求起始位置
+	HTTP_CHUNK_STATE m_chunkState;
+	DWORD m_dwChunkCursor;				// chunked请求体中下一个待解码的位置(相对请求起始)
+	ULONGLONG m_ullChunkRemaining;		// 当前chunk的数据长度
+	std::vector<char> m_body;			// 已解码的chunked请求体
+	bool m_bStopped;					// 已收到最后一个请求或出错，之后的数据丢弃
+	WORD m_wErrorStatus;
+	ULONGLONG m_nErrorSequence;
+	IOHttpRequest m_request;
+
+	// 响应状态，由m_lock保护
+	ULONGLONG m_nNextSequence;					// 下一个请求的序号
+	ULONGLONG m_nNextSendSequence;				// 下一个应输出的响应序号
+	ULONGLONG m_nCloseSequence;					// 响应后需关闭连接的请求序号
+	ULONGLONG m_nUpgradeSequence;				// 升级请求的序号，其响应取出发送前新协议不可发送数据
+	std::map<ULONGLONG, std::string> m_pendingResponses;	// 先于前序请求提交的响应
+	std::map<ULONGLONG, DWORD> m_responseFlags;	// 响应需特殊处理的请求序号及其HTTP_RESPONSE_*标志
+	std::string m_output;						// 已按序排好、待发送的响应
+	bool m_bCorked;
+	bool m_bCloseQueued;
+	volatile LONG m_nShutdownState;				// 0:未关闭 1:最后的响应已投递 2:已关闭写端
+	EngineLock m_lock;
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOHTTP_H_
@@ -0,0 +1,563 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOLOCK_H_
+#define _TINY_IOCP_IOCPCOMMON_IOLOCK_H_
+
+#include <Windows.h>
+#include <intrin.h>
+#include <stdio.h>
+
+#pragma comment(lib, "Synchronization.lib")
+
+#define LOCK_SPIN_COUNT			(4000)	// 自旋锁/自适应锁进入等待前的自旋次数
+#define MAX_LOCK_PROFILE_SITES	(64)	// 锁竞争剖析最多记录的加锁位置数
+#define LOCK_PROFILE_STRIPES	(16)	// 剖析锁加锁次数的计数分片数，各线程轮流分配到不同分片
+
+// 所有锁策略需提供Lock/UnLock/TryLock，构造时可传入加锁位置名称(仅剖析锁使用)
+
+// 关键段包装锁
+class CriticalSectionLock
+{
+public:
+
+	explicit CriticalSectionLock(const char * /*szSiteName*/ = nullptr)
+	{
+		::InitializeCriticalSection(&m_csLock);
+	}
+
+	~CriticalSectionLock()
+	{
+		::DeleteCriticalSection(&m_csLock);
+	}
+
+	void Lock()
+	{
+		::EnterCriticalSection(&m_csLock);
+	}
+
+	void UnLock()
+	{
+		::LeaveCriticalSection(&m_csLock);
+	}
+
+	bool TryLock()
+	{
+		return (FALSE != ::TryEnterCriticalSection(&m_csLock));
+	}
+
+private:
+
+	CriticalSectionLock(const CriticalSectionLock&) = delete;
+	CriticalSectionLock& operator= (const CriticalSectionLock&) = delete;
+
+private:
+
+	CRITICAL_SECTION m_csLock;
+};
+
+// 自动锁模板类
+template<typename Lock>
+class AutoLock
+{
+public:
+
+	explicit AutoLock(Lock& lock) : m_lock(lock)
+	{
+		m_lock.Lock();
+	}
+
+	~AutoLock()
+	{
+		m_lock.UnLock();
+	}
+
+private:
+
+	Lock& m_lock;
+};
+
+// 自旋锁，适用于临界区极短的场景(如池的出入队)，自旋超限后让出时间片
+class SpinLock
+{
+public:
+
+	explicit SpinLock(const char * /*szSiteName*/ = nullptr)
+		: m_nLocked(0)
+	{
+	}
+
+	void Lock()
+	{
+		unsigned int nSpin = 0;
+		while (!TryLock())
+		{
+			// 只读等待，避免在竞争时反复写缓存行
+			while (m_nLocked)
+			{
+				if (++nSpin < LOCK_SPIN_COUNT)
+				{
+					_mm_pause();
+				}
+				else
+				{
+					::SwitchToThread();
+					nSpin = 0;
+				}
+			}
+		}
+	}
+
+	void UnLock()
+	{
+		::InterlockedExchange(&m_nLocked, 0);
+	}
+
+	bool TryLock()
+	{
+		return (0 == m_nLocked) && (0 == ::InterlockedExchange(&m_nLocked, 1));
+	}
+
+private:
+
+	SpinLock(const SpinLock&) = delete;
+	SpinLock& operator= (const SpinLock&) = delete;
+
+private:
+
+	volatile LONG m_nLocked;
+};
+
+// 自适应锁：先自旋，仍未获得则通过WaitOnAddress(futex语义)挂起等待
+// 状态 0:未加锁 1:已加锁且无等待者 2:已加锁且可能有等待者
+class FutexLock
+{
+public:
+
+	explicit FutexLock(const char * /*szSiteName*/ = nullptr)
+		: m_nState(0)
+	{
+	}
+
+	void Lock()
+	{
+		for (unsigned int nSpin = 0; nSpin < LOCK_SPIN_COUNT; ++nSpin)
+		{
+			if (TryLock())
+			{
+				return;
+			}
+			_mm_pause();
+		}
+
+		// 标记存在等待者后挂起，直到锁被释放
+		LONG nUnLocked = 2;
+		while (0 != ::InterlockedExchange(&m_nState, 2))
+		{
+			::WaitOnAddress(&m_nState, &nUnLocked, sizeof(m_nState), INFINITE);
+		}
+	}
+
+	void UnLock()
+	{
+		if (2 == ::InterlockedExchange(&m_nState, 0))
+		{
+			::WakeByAddressSingle((PVOID)&m_nState);
+		}
+	}
+
+	bool TryLock()
+	{
+		return (0 == m_nState) && (0 == ::InterlockedCompareExchange(&m_nState, 1, 0));
+	}
+
+private:
+
+	FutexLock(const FutexLock&) = delete;
+	FutexLock& operator= (const FutexLock&) = delete;
+
+private:
+
+	volatile LONG m_nState;
+};
+
+// 空锁，不提供任何互斥，仅用于只有一个工作者线程、且所有调用(Send(pSocketContext)/Send(connId)/IHttpServer::Respond等)都发生在该线程回调中的场景
+// Send等接口本可在任意线程调用，引擎无法在运行时保证这一点，作为引擎锁策略时须同时定义IO_ENGINE_SINGLE_THREAD_ONLY确认此限制
+class NullLock
+{
+public:
+
+	explicit NullLock(const char * /*szSiteName*/ = nullptr)
+	{
+	}
+
+	void Lock()
+	{
+	}
+
+	void UnLock()
+	{
+	}
+
+	bool TryLock()
+	{
+		return true;
+	}
+};
+
+// 锁策略特性，空锁不具备线程安全性，引擎据此限制工作线程数量
+template<typename Lock>
+struct LockPolicyTraits
+{
+	static const bool bThreadSafe = true;
+};
+
+template<>
+struct LockPolicyTraits<NullLock>
+{
+	static const bool bThreadSafe = false;
+};
+
+// 当前线程等待引擎锁的累计统计，工作者线程据此把锁等待从回调耗时中分离出来
+struct LockWaitCounter
+{
+	ULONGLONG ullWaitTsc;	// 竞争时等待的总时长(TSC计数)
+	ULONGLONG ullWaits;		// 发生竞争的次数
+
+	static LockWaitCounter& GetThreadInstance()
+	{
+		static thread_local LockWaitCounter t_lockWaitCounter = { 0, 0 };
+		return t_lockWaitCounter;
+	}
+
+	void Add(ULONGLONG ullTsc)
+	{
+		ullWaitTsc += ullTsc;
+		++ullWaits;
+	}
+};
+
+// 计时锁：包装任意锁策略，竞争时以TSC计量等待时长并计入当前线程的LockWaitCounter
+// 无竞争时只多一次TryLock，不读取时钟
+template<typename InnerLock>
+class WaitTimedLock
+{
+public:
+
+	explicit WaitTimedLock(const char *szSiteName = nullptr)
+		: m_lock(szSiteName)
+	{
+	}
+
+	void Lock()
+	{
+		if (m_lock.TryLock())
+		{
+			return;
+		}
+
+		ULONGLONG ullBegin = __rdtsc();
+		m_lock.Lock();
+		LockWaitCounter::GetThreadInstance().Add(__rdtsc() - ullBegin);
+	}
+
+	void UnLock()
+	{
+		m_lock.UnLock();
+	}
+
+	bool TryLock()
+	{
+		return m_lock.TryLock();
+	}
+
+private:
+
+	WaitTimedLock(const WaitTimedLock&) = delete;
+	WaitTimedLock& operator= (const WaitTimedLock&) = delete;
+
+private:
+
+	InnerLock m_lock;
+};
+
+template<typename InnerLock>
+struct LockPolicyTraits<WaitTimedLock<InnerLock> >
+{
+	static const bool bThreadSafe = LockPolicyTraits<InnerLock>::bThreadSafe;
+};
+
+// 每个加锁位置的竞争统计(LockProfiler::Snapshot的结果)
+struct LockSiteStats
+{
+	const char *szSiteName;				// 加锁位置名称
+	volatile LONG64 nAcquisitions;		// 加锁次数
+	volatile LONG64 nContentions;		// 发生竞争(首次尝试未获得)的次数
+	volatile LONG64 nWaitTicks;			// 竞争时等待的总时长(QPC计数)
+	volatile LONG64 nMaxWaitTicks;		// 单次最长等待时长(QPC计数)
+};
+
+// 独占一个缓存行的计数
+struct alignas(64) LockCounterStripe
+{
+	volatile LONG64 nCount;
+};
+
+// 加锁位置的内部统计：每次加锁都要计数，加锁次数分散到各线程所在分片的缓存行上，
+// 避免所有线程在同一缓存行上争抢；竞争相关的计数只在竞争时更新，直接记在stats中
+struct LockSiteCounters
+{
+	LockSiteStats stats;	// 其中的nAcquisitions不使用，Snapshot时由各分片求和
+	LockCounterStripe acquisitions[LOCK_PROFILE_STRIPES];
+};
+
+// 锁竞争剖析器，按加锁位置名称汇总所有剖析锁的统计数据
+class LockProfiler
+{
+public:
+
+	static LockProfiler& GetInstance()
+	{
+		static LockProfiler s_lockProfiler;
+		return s_lockProfiler;
+	}
+
+	// 获取加锁位置的统计项，相同名称的位置共享同一统计项，位置数超限时返回nullptr
+	LockSiteCounters* RegisterSite(const char *szSiteName)
+	{
+		if (!szSiteName)
+		{
+			szSiteName = "unnamed";
+		}
+
+		// 注册仅在锁构造时发生，使用自旋锁保护即可
+		AutoLock<SpinLock> lock(m_registerLock);
+		for (LONG index = 0; index < m_nSiteCount; ++index)
+		{
+			if (0 == ::strcmp(m_sites[index].stats.szSiteName, szSiteName))
+			{
+				return &m_sites[index];
+			}
+		}
+
+		if (m_nSiteCount >= MAX_LOCK_PROFILE_SITES)
+		{
+			return nullptr;
+		}
+
+		LockSiteCounters *pCounters = &m_sites[m_nSiteCount];
+		pCounters->stats.szSiteName = szSiteName;
+		::InterlockedExchange(&m_nSiteCount, m_nSiteCount + 1);
+		return pCounters;
+	}
+
+	// 当前线程使用的加锁次数分片，首次调用时轮流分配
+	static unsigned int GetThreadStripe()
+	{
+		static volatile LONG s_nNextStripe = 0;
+		static thread_local unsigned int t_nStripe = (unsigned int)::InterlockedIncrement(&s_nNextStripe) % LOCK_PROFILE_STRIPES;
+		return t_nStripe;
+	}
+
+	// 拷贝当前所有加锁位置的统计数据，返回位置数
+	unsigned int Snapshot(LockSiteStats *pStats, unsigned int nMaxCount) const
+	{
+		unsigned int nCount = (unsigned int)m_nSiteCount;
+		if (nCount > nMaxCount)
+		{
+			nCount = nMaxCount;
+		}
+
+		for (unsigned int index = 0; index < nCount; ++index)
+		{
+			pStats[index].szSiteName = m_sites[index].stats.szSiteName;
+			pStats[index].nAcquisitions = SumAcquisitions(m_sites[index]);
+			pStats[index].nContentions = m_sites[index].stats.nContentions;
+			pStats[index].nWaitTicks = m_sites[index].stats.nWaitTicks;
+			pStats[index].nMaxWaitTicks = m_sites[index].stats.nMaxWaitTicks;
+		}
+		return nCount;
+	}
+
+	// 将统计结果按微秒输出
+	void Dump(FILE *pFile) const
+	{
+		LARGE_INTEGER frequency;
+		::QueryPerformanceFrequency(&frequency);
+		double dTickUs = 1000000.0 / (double)frequency.QuadPart;
+
+		::fprintf(pFile, "%-32s %16s %16s %16s %16s\n",
+			"lock site", "acquisitions", "contentions", "wait(us)", "max wait(us)");
+		for (LONG index = 0; index < m_nSiteCount; ++index)
+		{
+			const LockSiteStats &stats = m_sites[index].stats;
+			::fprintf(pFile, "%-32s %16lld %16lld %16.1f %16.1f\n",
+				stats.szSiteName,
+				(long long)SumAcquisitions(m_sites[index]),
+				(long long)stats.nContentions,
+				stats.nWaitTicks * dTickUs,
+				stats.nMaxWaitTicks * dTickUs);
+		}
+	}
+
+	void Reset()
+	{
+		for (LONG index = 0; index < m_nSiteCount; ++index)
+		{
+			for (unsigned int nStripe = 0; nStripe < LOCK_PROFILE_STRIPES; ++nStripe)
+			{
+				::InterlockedExchange64(&m_sites[index].acquisitions[nStripe].nCount, 0);
+			}
+			::InterlockedExchange64(&m_sites[index].stats.nContentions, 0);
+			::InterlockedExchange64(&m_sites[index].stats.nWaitTicks, 0);
+			::InterlockedExchange64(&m_sites[index].stats.nMaxWaitTicks, 0);
+		}
+	}
+
+private:
+
+	LockProfiler()
+		: m_nSiteCount(0)
+	{
+		::memset(m_sites, 0, sizeof(m_sites));
+	}
+
+	static LONG64 SumAcquisitions(const LockSiteCounters &counters)
+	{
+		LONG64 nAcquisitions = 0;
+		for (unsigned int nStripe = 0; nStripe < LOCK_PROFILE_STRIPES; ++nStripe)
+		{
+			nAcquisitions += counters.acquisitions[nStripe].nCount;
+		}
+		return nAcquisitions;
+	}
+
+	LockProfiler(const LockProfiler&) = delete;
+	LockProfiler& operator= (const LockProfiler&) = delete;
+
+private:
+
+	LockSiteCounters m_sites[MAX_LOCK_PROFILE_SITES];
+	volatile LONG m_nSiteCount;
+	SpinLock m_registerLock;
+};
+
+// 剖析锁：包装任意锁策略，记录加锁次数与竞争等待时长
+// 无竞争时只在当前线程的计数分片上增加一次计数，仅在竞争时读取时钟，开销可用于生产环境
+template<typename InnerLock>
+class ProfiledLock
+{
+public:
+
+	explicit ProfiledLock(const char *szSiteName = nullptr)
+		: m_lock(szSiteName)
+		, m_pCounters(LockProfiler::GetInstance().RegisterSite(szSiteName))
+	{
+	}
+
+	void Lock()
+	{
+		if (m_lock.TryLock())
+		{
+			Record(false, 0);
+			return;
+		}
+
+		LARGE_INTEGER begin, end;
+		ULONGLONG ullBeginTsc = __rdtsc();
+		::QueryPerformanceCounter(&begin);
+		m_lock.Lock();
+		::QueryPerformanceCounter(&end);
+		LockWaitCounter::GetThreadInstance().Add(__rdtsc() - ullBeginTsc);
+
+		Record(true, end.QuadPart - begin.QuadPart);
+	}
+
+	void UnLock()
+	{
+		m_lock.UnLock();
+	}
+
+	bool TryLock()
+	{
+		if (!m_lock.TryLock())
+		{
+			return false;
+		}
+
+		Record(false, 0);
+		return true;
+	}
+
+private:
+
+	void Record(bool bContended, LONG64 nWaitTicks)
+	{
+		if (!m_pCounters)
+		{
+			return;
+		}
+
+		::InterlockedIncrement64(&m_pCounters->acquisitions[LockProfiler::GetThreadStripe()].nCount);
+		if (!bContended)
+		{
+			return;
+		}
+
+		LockSiteStats &stats = m_pCounters->stats;
+		::InterlockedIncrement64(&stats.nContentions);
+		::InterlockedExchangeAdd64(&stats.nWaitTicks, nWaitTicks);
+
+		LONG64 nMaxWaitTicks = stats.nMaxWaitTicks;
+		while (nWaitTicks > nMaxWaitTicks)
+		{
+			LONG64 nPrev = ::InterlockedCompareExchange64(&stats.nMaxWaitTicks, nWaitTicks, nMaxWaitTicks);
+			if (nPrev == nMaxWaitTicks)
+			{
+				break;
+			}
+			nMaxWaitTicks = nPrev;
+		}
+	}
+
+	ProfiledLock(const ProfiledLock&) = delete;
+	ProfiledLock& operator= (const ProfiledLock&) = delete;
+
+private:
+
+	InnerLock m_lock;
+	LockSiteCounters *m_pCounters;
+};
+
+template<typename InnerLock>
+struct LockPolicyTraits<ProfiledLock<InnerLock> >
+{
+	static const bool bThreadSafe = LockPolicyTraits<InnerLock>::bThreadSafe;
+};
+
+// 引擎内部使用的锁策略，可通过预处理器定义替换，例如
+// IO_ENGINE_LOCK_POLICY=SpinLock、IO_ENGINE_LOCK_POLICY=NullLock(单工作者线程，须同时定义IO_ENGINE_SINGLE_THREAD_ONLY)
+// 定义IO_ENGINE_LOCK_PROFILE后引擎锁均包装为剖析锁，统计结果通过LockProfiler获取
+// 两种情况下竞争等待均计入当前线程的LockWaitCounter，供工作者线程的时间统计使用
+#ifndef IO_ENGINE_LOCK_POLICY
+#define IO_ENGINE_LOCK_POLICY CriticalSectionLock
+#endif
+
+// 不具备线程安全性的锁策略只有在使用者确认所有调用都在唯一的工作者线程上发生时才允许编译
+#ifdef IO_ENGINE_SINGLE_THREAD_ONLY
+#define IO_ENGINE_SINGLE_THREAD_CONFIRMED	true
+#else
+#define IO_ENGINE_SINGLE_THREAD_CONFIRMED	false
+#endif
+
+static_assert(LockPolicyTraits<IO_ENGINE_LOCK_POLICY>::bThreadSafe || IO_ENGINE_SINGLE_THREAD_CONFIRMED,
+	"IO_ENGINE_LOCK_POLICY is not thread safe: define IO_ENGINE_SINGLE_THREAD_ONLY and call Send/Respond only from worker callbacks");
+
+// 引擎锁策略是否线程安全；不安全时自带线程的功能会访问连接与池，均被拒绝：
+// 分片负载检查线程(IOEngine不创建)、共享内存监听的接受线程(IServer::SetConfig拒绝shmName)、客户端的定时器线程(IClient的Connect失败)
+#define IO_ENGINE_LOCK_THREAD_SAFE	(LockPolicyTraits<IO_ENGINE_LOCK_POLICY>::bThreadSafe)
+
+#ifdef IO_ENGINE_LOCK_PROFILE
+typedef ProfiledLock<IO_ENGINE_LOCK_POLICY> EngineLock;
+#else
+typedef WaitTimedLock<IO_ENGINE_LOCK_POLICY> EngineLock;
+#endif
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOLOCK_H_
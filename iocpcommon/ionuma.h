@@ -0,0 +1,218 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IONUMA_H_
+#define _TINY_IOCP_IOCPCOMMON_IONUMA_H_
+
+#include <WinSock2.h>
+#include <Windows.h>
+#include <mstcpip.h>
+#include <vector>
+#include "iolock.h"
+
+#define MAX_NUMA_NODES		(64)			// 支持的最大NUMA节点数
+#define NUMA_SLAB_SIZE		(1024 * 256)	// 每次从节点本地内存申请的块大小(256K)
+#define NUMA_NODE_UNBOUND	(0xFFFF)		// 线程未绑定到节点
+
+// NUMA拓扑查询及线程绑定
+class IONuma
+{
+public:
+
+	// 节点数量(最大节点号+1)，单节点机器上为1
+	static USHORT GetNodeCount()
+	{
+		ULONG ulHighestNode = 0;
+		if (!::GetNumaHighestNodeNumber(&ulHighestNode))
+		{
+			return 1;
+		}
+		return (USHORT)((ulHighestNode + 1 < MAX_NUMA_NODES) ? (ulHighestNode + 1) : MAX_NUMA_NODES);
+	}
+
+	// 节点上的处理器集合，节点上没有处理器(仅有内存)时返回false
+	static bool GetNodeAffinity(USHORT nNode, GROUP_AFFINITY &affinity)
+	{
+		::memset(&affinity, 0, sizeof(affinity));
+		return ::GetNumaNodeProcessorMaskEx(nNode, &affinity) && 0 != affinity.Mask;
+	}
+
+	// 节点上的处理器数量，节点上没有处理器时返回0
+	static DWORD GetNodeProcessorCount(USHORT nNode)
+	{
+		GROUP_AFFINITY affinity;
+		if (!GetNodeAffinity(nNode, affinity))
+		{
+			return 0;
+		}
+
+		DWORD dwCount = 0;
+		for (KAFFINITY mask = affinity.Mask; mask; mask &= mask - 1)
+		{
+			++dwCount;
+		}
+		return dwCount;
+	}
+
+	// 将当前线程绑定到节点的处理器上，之后该线程的分配均来自此节点
+	static bool BindCurrentThread(USHORT nNode)
+	{
+		GROUP_AFFINITY affinity;
+		if (!GetNodeAffinity(nNode, affinity) || !::SetThreadGroupAffinity(::GetCurrentThread(), &affinity, nullptr))
+		{
+			return false;
+		}
+
+		ThreadNode() = nNode;
+		return true;
+	}
+
+	// 当前线程所在的节点，已绑定的工作线程直接返回绑定的节点
+	static USHORT GetCurrentNode()
+	{
+		USHORT nNode = ThreadNode();
+		if (NUMA_NODE_UNBOUND != nNode)
+		{
+			return nNode;
+		}
+
+		PROCESSOR_NUMBER processor;
+		::GetCurrentProcessorNumberEx(&processor);
+		return GetProcessorNode(processor);
+	}
+
+	// 处理socket接收中断(RSS)的处理器所在的节点，查询失败时返回false
+	static bool GetSocketNode(SOCKET sock, USHORT &nNode)
+	{
+		PROCESSOR_NUMBER processor;
+		DWORD dwBytes = 0;
+		if (SOCKET_ERROR == ::WSAIoctl(
+			sock,
+			SIO_QUERY_RSS_PROCESSOR_INFO,
+			nullptr,
+			0,
+			&processor,
+			sizeof(processor),
+			&dwBytes,
+			nullptr,
+			nullptr))
+		{
+			return false;
+		}
+
+		nNode = GetProcessorNode(processor);
+		return true;
+	}
+
+private:
+
+	static USHORT& ThreadNode()
+	{
+		static thread_local USHORT t_nNode = NUMA_NODE_UNBOUND;
+		return t_nNode;
+	}
+
+	static USHORT GetProcessorNode(PROCESSOR_NUMBER &processor)
+	{
+		USHORT nNode = 0;
+		if (!::GetNumaProcessorNodeEx(&processor, &nNode) || nNode >= MAX_NUMA_NODES)
+		{
+			nNode = 0;
+		}
+		return nNode;
+	}
+};
+
+// 按节点分配固定大小的缓冲区：从节点本地内存申请整块后切分，释放后回到所属节点的空闲链表
+// 缓冲区在进程退出前不归还系统
+template<DWORD BufferSize>
+class IONumaBufferAllocator
+{
+public:
+
+	static IONumaBufferAllocator& GetInstance()
+	{
+		static IONumaBufferAllocator s_allocator;
+		return s_allocator;
+	}
+
+	char* Alloc(USHORT nNode)
+	{
+		NodeHeap &heap = m_heaps[(nNode < MAX_NUMA_NODES) ? nNode : 0];
+		AutoLock<EngineLock> lock(heap.lock);
+
+		if (!heap.freeList.empty())
+		{
+			char *pBuffer = heap.freeList.back();
+			heap.freeList.pop_back();
+			return pBuffer;
+		}
+
+		if (heap.pSlabCur + BufferSize > heap.pSlabEnd)
+		{
+			// 优先使用节点本地内存，节点内存不足时退回任意节点
+			char *pSlab = static_cast<char *>(::VirtualAllocExNuma(
+				::GetCurrentProcess(), nullptr, NUMA_SLAB_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, nNode));
+			if (!pSlab)
+			{
+				pSlab = static_cast<char *>(::VirtualAlloc(nullptr, NUMA_SLAB_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+			}
+			if (!pSlab)
+			{
+				return nullptr;
+			}
+
+			heap.slabs.push_back(pSlab);
+			heap.pSlabCur = pSlab;
+			heap.pSlabEnd = pSlab + NUMA_SLAB_SIZE;
+		}
+
+		char *pBuffer = heap.pSlabCur;
+		heap.pSlabCur += BufferSize;
+		return pBuffer;
+	}
+
+	void Free(USHORT nNode, char *pBuffer)
+	{
+		if (!pBuffer)
+		{
+			return;
+		}
+
+		NodeHeap &heap = m_heaps[(nNode < MAX_NUMA_NODES) ? nNode : 0];
+		AutoLock<EngineLock> lock(heap.lock);
+		heap.freeList.push_back(pBuffer);
+	}
+
+private:
+
+	IONumaBufferAllocator() = default;
+
+	~IONumaBufferAllocator()
+	{
+		for (unsigned int nNode = 0; nNode < MAX_NUMA_NODES; ++nNode)
+		{
+			for (size_t index = 0; index < m_heaps[nNode].slabs.size(); ++index)
+			{
+				::VirtualFree(m_heaps[nNode].slabs[index], 0, MEM_RELEASE);
+			}
+		}
+	}
+
+	IONumaBufferAllocator(const IONumaBufferAllocator&) = delete;
+	IONumaBufferAllocator& operator= (const IONumaBufferAllocator&) = delete;
+
+private:
+
+	struct NodeHeap
+	{
+		EngineLock lock;
+		std::vector<char *> freeList;	// 已释放的缓冲区
+		std::vector<void *> slabs;		// 已申请的内存块
+		char *pSlabCur;					// 当前内存块中未切分部分的起始位置
+		char *pSlabEnd;					// 当前内存块的结束位置
+
+		NodeHeap() : lock("IONumaBufferAllocator"), pSlabCur(nullptr), pSlabEnd(nullptr) {}
+	};
+
+	NodeHeap m_heaps[MAX_NUMA_NODES];
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IONUMA_H_
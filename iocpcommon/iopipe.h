@@ -0,0 +1,212 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOPIPE_H_
+#define _TINY_IOCP_IOCPCOMMON_IOPIPE_H_
+
+#include <Windows.h>
+#include <sddl.h>
+#include <stdio.h>
+#include <string>
+
+// 本机命名管道的辅助函数，热重启交接与共享内存连接的握手均经此传递句柄
+// 管道只允许当前用户访问并拒绝远程客户端；对端进程ID取自系统(GetNamedPipeClientProcessId/GetNamedPipeServerProcessId)，不采信对端发来的数据
+// 所有操作均为带超时的重叠IO，对端不响应时不会无限阻塞调用线程
+class IOPipe
+{
+public:
+
+	// 服务端创建管道(单实例)：同名管道已存在(其他进程抢先创建)时失败，失败返回INVALID_HANDLE_VALUE
+	static HANDLE Create(const std::string &pipeName, DWORD dwOpenMode, DWORD dwBufferSize)
+	{
+		SECURITY_ATTRIBUTES securityAttributes;
+		securityAttributes.nLength = sizeof(securityAttributes);
+		securityAttributes.bInheritHandle = FALSE;
+		securityAttributes.lpSecurityDescriptor = CreateCurrentUserDescriptor();
+		if (!securityAttributes.lpSecurityDescriptor)
+		{
+			return INVALID_HANDLE_VALUE;
+		}
+
+		HANDLE hPipe = ::CreateNamedPipeA(
+			pipeName.c_str(),
+			dwOpenMode | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			1,
+			dwBufferSize,
+			dwBufferSize,
+			0,
+			&securityAttributes);
+		::LocalFree(securityAttributes.lpSecurityDescriptor);
+		return hPipe;
+	}
+
+	// 客户端打开管道，管道尚未创建或正忙时在dwTimeout内重试
+	static HANDLE Open(const std::string &pipeName, DWORD dwDesiredAccess, DWORD dwTimeout)
+	{
+		ULONGLONG ullDeadline = ::GetTickCount64() + dwTimeout;
+		for (;;)
+		{
+			HANDLE hPipe = ::CreateFileA(pipeName.c_str(), dwDesiredAccess, 0, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+			if (INVALID_HANDLE_VALUE != hPipe)
+			{
+				return hPipe;
+			}
+
+			DWORD dwError = ::GetLastError();
+			if (ERROR_FILE_NOT_FOUND != dwError && ERROR_PIPE_BUSY != dwError)
+			{
+				return INVALID_HANDLE_VALUE;
+			}
+
+			ULONGLONG ullNow = ::GetTickCount64();
+			if (ullNow >= ullDeadline)
+			{
+				::SetLastError(ERROR_TIMEOUT);
+				return INVALID_HANDLE_VALUE;
+			}
+
+			// 管道尚未创建时WaitNamedPipe立即返回，稍后重试
+			DWORD dwWait = (ullDeadline - ullNow < 100) ? (DWORD)(ullDeadline - ullNow) : 100;
+			if (!::WaitNamedPipeA(pipeName.c_str(), dwWait))
+			{
+				::Sleep(10);
+			}
+		}
+	}
+
+	// 等待客户端连接，超时或hCancelEvent有信号时返回false；管道在超时后仍保持监听，可再次调用
+	static bool Accept(HANDLE hPipe, DWORD dwTimeout, HANDLE hCancelEvent = NULL)
+	{
+		OVERLAPPED overlapped;
+		if (!BeginOverlapped(overlapped))
+		{
+			return false;
+		}
+
+		bool result = false;
+		if (::ConnectNamedPipe(hPipe, &overlapped) || ERROR_PIPE_CONNECTED == ::GetLastError())
+		{
+			result = true;
+		}
+		else if (ERROR_IO_PENDING == ::GetLastError())
+		{
+			DWORD dwBytes = 0;
+			result = EndOverlapped(hPipe, overlapped, dwTimeout, hCancelEvent, dwBytes);
+		}
+
+		::CloseHandle(overlapped.hEvent);
+		return result;
+	}
+
+	// 读满dwLen字节，超时、对端关闭或hCancelEvent有信号时返回false
+	static bool Read(HANDLE hPipe, void *buffer, DWORD dwLen, DWORD dwTimeout, HANDLE hCancelEvent = NULL)
+	{
+		return Transfer(hPipe, static_cast<char *>(buffer), dwLen, dwTimeout, hCancelEvent, false);
+	}
+
+	static bool Write(HANDLE hPipe, const void *buffer, DWORD dwLen, DWORD dwTimeout, HANDLE hCancelEvent = NULL)
+	{
+		return Transfer(hPipe, const_cast<char *>(static_cast<const char *>(buffer)), dwLen, dwTimeout, hCancelEvent, true);
+	}
+
+private:
+
+	// 只允许当前用户访问的安全描述符，由调用者LocalFree
+	static PSECURITY_DESCRIPTOR CreateCurrentUserDescriptor()
+	{
+		HANDLE hToken = NULL;
+		if (!::OpenProcessToken(::GetCurrentProcess(), TOKEN_QUERY, &hToken))
+		{
+			return nullptr;
+		}
+
+		char tokenUser[256];
+		DWORD dwLen = 0;
+		char *szSid = nullptr;
+		BOOL bRet = ::GetTokenInformation(hToken, TokenUser, tokenUser, sizeof(tokenUser), &dwLen) &&
+			::ConvertSidToStringSidA(reinterpret_cast<TOKEN_USER *>(tokenUser)->User.Sid, &szSid);
+		::CloseHandle(hToken);
+		if (!bRet)
+		{
+			return nullptr;
+		}
+
+		// 受保护的DACL，只有一条授予当前用户完全访问的ACE
+		char sddl[256];
+		::sprintf_s(sddl, sizeof(sddl), "D:P(A;;GA;;;%s)", szSid);
+		::LocalFree(szSid);
+
+		PSECURITY_DESCRIPTOR pDescriptor = nullptr;
+		if (!::ConvertStringSecurityDescriptorToSecurityDescriptorA(sddl, SDDL_REVISION_1, &pDescriptor, nullptr))
+		{
+			return nullptr;
+		}
+		return pDescriptor;
+	}
+
+	static bool BeginOverlapped(OVERLAPPED &overlapped)
+	{
+		::memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.hEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+		return (NULL != overlapped.hEvent);
+	}
+
+	// 等待在途的重叠IO；超时或被取消时先取消再等待其结束，overlapped此后才可释放
+	static bool EndOverlapped(HANDLE hPipe, OVERLAPPED &overlapped, DWORD dwTimeout, HANDLE hCancelEvent, DWORD &dwBytes)
+	{
+		HANDLE handles[2] = { overlapped.hEvent, hCancelEvent };
+		DWORD dwRet = ::WaitForMultipleObjects(hCancelEvent ? 2 : 1, handles, FALSE, dwTimeout);
+		if (WAIT_OBJECT_0 != dwRet)
+		{
+			::CancelIoEx(hPipe, &overlapped);
+		}
+
+		// 取消前恰好完成的IO按成功处理
+		if (!::GetOverlappedResult(hPipe, &overlapped, &dwBytes, TRUE))
+		{
+			if (WAIT_TIMEOUT == dwRet)
+			{
+				::SetLastError(ERROR_TIMEOUT);
+			}
+			return false;
+		}
+		return true;
+	}
+
+	static bool Transfer(HANDLE hPipe, char *buffer, DWORD dwLen, DWORD dwTimeout, HANDLE hCancelEvent, bool bWrite)
+	{
+		OVERLAPPED overlapped;
+		if (!BeginOverlapped(overlapped))
+		{
+			return false;
+		}
+
+		// 超时针对整个消息，对端逐字节发送也不能延长
+		ULONGLONG ullDeadline = ::GetTickCount64() + dwTimeout;
+		bool result = true;
+		while (result && dwLen > 0)
+		{
+			DWORD dwBytes = 0;
+			::ResetEvent(overlapped.hEvent);
+			BOOL bRet = bWrite ? ::WriteFile(hPipe, buffer, dwLen, &dwBytes, &overlapped) :
+				::ReadFile(hPipe, buffer, dwLen, &dwBytes, &overlapped);
+			if (!bRet)
+			{
+				ULONGLONG ullNow = ::GetTickCount64();
+				result = (ERROR_IO_PENDING == ::GetLastError()) &&
+					EndOverlapped(hPipe, overlapped, (ullNow < ullDeadline) ? (DWORD)(ullDeadline - ullNow) : 0, hCancelEvent, dwBytes);
+			}
+			else
+			{
+				::GetOverlappedResult(hPipe, &overlapped, &dwBytes, FALSE);
+			}
+
+			result = result && (dwBytes > 0);
+			buffer += dwBytes;
+			dwLen -= dwBytes;
+		}
+
+		::CloseHandle(overlapped.hEvent);
+		return result;
+	}
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOPIPE_H_
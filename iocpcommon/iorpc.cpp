@@ -0,0 +1,294 @@
+#include "iorpc.h"
+#include <string.h>
+
+#define RPC_SLOT_FREE		(0)
+#define RPC_SLOT_RESERVED	(-1)
+#define RPC_NO_DEADLINE		((ULONGLONG)-1)	// 没有会超时的在途请求
+
+IORpcFrameDecoder::IORpcFrameDecoder()
+	: m_bBuffered(false)
+	, m_pData(nullptr)
+	, m_dwDataLen(0)
+	, m_dwOffset(0)
+	, m_bStopped(false)
+{
+	m_frame.nCorrelationId = RPC_INVALID_ID;
+	m_frame.pData = nullptr;
+	m_frame.dwLen = 0;
+}
+
+DWORD IORpcFrameDecoder::WriteHeader(char *pOutBuffer, ULONGLONG nCorrelationId, DWORD dwPayloadLen)
+{
+	IORpcFrameHeader header;
+	header.dwMagic = RPC_FRAME_MAGIC;
+	header.dwPayloadLen = dwPayloadLen;
+	header.nCorrelationId = nCorrelationId;
+	::memcpy(pOutBuffer, &header, sizeof(header));
+	return sizeof(header);
+}
+
+void IORpcFrameDecoder::Feed(const char *buffer, DWORD dwLen)
+{
+	m_dwOffset = 0;
+
+	if (m_bStopped)
+	{
+		m_bBuffered = false;
+		m_pData = nullptr;
+		m_dwDataLen = 0;
+		return;
+	}
+
+	if (m_buffer.empty())
+	{
+		m_bBuffered = false;
+		m_pData = buffer;
+		m_dwDataLen = dwLen;
+	}
+	else
+	{
+		m_buffer.insert(m_buffer.end(), buffer, buffer + dwLen);
+		m_bBuffered = true;
+		m_pData = m_buffer.data();
+		m_dwDataLen = (DWORD)m_buffer.size();
+	}
+}
+
+RPC_PARSE_RESULT IORpcFrameDecoder::Next()
+{
+	if (m_bStopped)
+	{
+		return RPC_PARSE_RESULT::RPC_PARSE_INCOMPLETE;
+	}
+
+	DWORD dwAvailable = m_dwDataLen - m_dwOffset;
+	if (dwAvailable < sizeof(IORpcFrameHeader))
+	{
+		return RPC_PARSE_RESULT::RPC_PARSE_INCOMPLETE;
+	}
+
+	IORpcFrameHeader header;
+	::memcpy(&header, m_pData + m_dwOffset, sizeof(header));
+	if (RPC_FRAME_MAGIC != header.dwMagic || header.dwPayloadLen > RPC_MAX_PAYLOAD_SIZE)
+	{
+		m_bStopped = true;
+		return RPC_PARSE_RESULT::RPC_PARSE_ERROR;
+	}
+
+	if (dwAvailable - sizeof(header) < header.dwPayloadLen)
+	{
+		return RPC_PARSE_RESULT::RPC_PARSE_INCOMPLETE;
+	}
+
+	m_frame.nCorrelationId = header.nCorrelationId;
+	m_frame.pData = m_pData + m_dwOffset + sizeof(header);
+	m_frame.dwLen = header.dwPayloadLen;
+	m_dwOffset += sizeof(header) + header.dwPayloadLen;
+
+	return RPC_PARSE_RESULT::RPC_PARSE_FRAME;
+}
+
+void IORpcFrameDecoder::EndFeed()
+{
+	if (m_bStopped)
+	{
+		std::vector<char>().swap(m_buffer);
+	}
+	else if (m_bBuffered)
+	{
+		m_buffer.erase(m_buffer.begin(), m_buffer.begin() + m_dwOffset);
+	}
+	else if (m_dwOffset < m_dwDataLen)
+	{
+		m_buffer.assign(m_pData + m_dwOffset, m_pData + m_dwDataLen);
+	}
+
+	m_bBuffered = false;
+	m_pData = nullptr;
+	m_dwDataLen = 0;
+	m_dwOffset = 0;
+}
+
+void IORpcFrameDecoder::Reset()
+{
+	std::vector<char>().swap(m_buffer);
+	m_bBuffered = false;
+	m_pData = nullptr;
+	m_dwDataLen = 0;
+	m_dwOffset = 0;
+	m_bStopped = false;
+}
+
+IORpcPendingTable::IORpcPendingTable(DWORD dwCapacity)
+	: m_pSlots(nullptr)
+	, m_dwCapacity(1)
+	, m_ullMask(0)
+	, m_nNextId(RPC_INVALID_ID)
+	, m_nPendingCount(0)
+	, m_ullNextDeadline(RPC_NO_DEADLINE)
+{
+	while (m_dwCapacity < dwCapacity)
+	{
+		m_dwCapacity <<= 1;
+	}
+	m_ullMask = m_dwCapacity - 1;
+
+	m_pSlots = new IORpcSlot[m_dwCapacity];
+	for (DWORD index = 0; index < m_dwCapacity; ++index)
+	{
+		m_pSlots[index].nId = RPC_SLOT_FREE;
+		m_pSlots[index].ullDeadline = 0;
+		m_pSlots[index].ullStartCounter = 0;
+		m_pSlots[index].pPromise = nullptr;
+	}
+}
+
+IORpcPendingTable::~IORpcPendingTable()
+{
+	if (m_pSlots)
+	{
+		delete []m_pSlots;
+		m_pSlots = nullptr;
+	}
+}
+
+ULONGLONG IORpcPendingTable::Add(ULONGLONG ullDeadline, ULONGLONG ullStartCounter, std::promise<IORpcResponse> *pPromise)
+{
+	if ((DWORD)::InterlockedIncrement(&m_nPendingCount) > m_dwCapacity)
+	{
+		::InterlockedDecrement(&m_nPendingCount);
+		return RPC_INVALID_ID;
+	}
+
+	// 计数已为本请求预留了一个空闲槽位，但对应的槽位可能仍被占用(正在被取出，或其他线程刚抢先占用)，换下一个ID继续尝试
+	// 最多尝试一整轮，仍未找到时放弃，不会在表满时无限自旋
+	for (DWORD dwTries = 0; dwTries < m_dwCapacity; ++dwTries)
+	{
+		LONG64 nId = ::InterlockedIncrement64(&m_nNextId);
+		IORpcSlot &slot = m_pSlots[(ULONGLONG)nId & m_ullMask];
+		if (RPC_SLOT_FREE != ::InterlockedCompareExchange64(&slot.nId, RPC_SLOT_RESERVED, RPC_SLOT_FREE))
+		{
+			continue;
+		}
+
+		// 先写入内容再发布ID，其他线程只会取出已发布的槽位
+		slot.ullDeadline = ullDeadline;
+		slot.ullStartCounter = ullStartCounter;
+		slot.pPromise = pPromise;
+		::InterlockedExchange64(&slot.nId, nId);
+
+		// 发布之后再更新最早期限：Expire重置期限后才开始扫描，此前发布的槽位会被扫描到，此后的更新不会被覆盖
+		if (ullDeadline)
+		{
+			LowerNextDeadline(ullDeadline);
+		}
+		return (ULONGLONG)nId;
+	}
+
+	::InterlockedDecrement(&m_nPendingCount);
+	return RPC_INVALID_ID;
+}
+
+bool IORpcPendingTable::Remove(ULONGLONG nCorrelationId, IORpcPendingEntry &entry)
+{
+	if (RPC_INVALID_ID == nCorrelationId || (LONG64)nCorrelationId <= 0)
+	{
+		return false;
+	}
+
+	return Claim(m_pSlots[nCorrelationId & m_ullMask], (LONG64)nCorrelationId, entry);
+}
+
+void IORpcPendingTable::Expire(ULONGLONG ullNow, std::vector<IORpcPendingEntry> &expired)
+{
+	// 最早的期限未到时无需扫描；已取出的请求不会抬高m_ullNextDeadline，最多多扫描一次
+	if (ullNow < m_ullNextDeadline)
+	{
+		return;
+	}
+
+	// 先重置再扫描，扫描期间新登记的请求自行降低期限，不会被扫描结果覆盖
+	::InterlockedExchange64((volatile LONG64 *)&m_ullNextDeadline, (LONG64)RPC_NO_DEADLINE);
+	ULONGLONG ullNextDeadline = RPC_NO_DEADLINE;
+	for (DWORD index = 0; index < m_dwCapacity; ++index)
+	{
+		IORpcSlot &slot = m_pSlots[index];
+		LONG64 nId = slot.nId;
+		if (RPC_SLOT_FREE == nId || RPC_SLOT_RESERVED == nId)
+		{
+			continue;
+		}
+
+		// 槽位可能在读取期限后被复用，此时Claim的CAS失败，不会误取新请求
+		ULONGLONG ullDeadline = slot.ullDeadline;
+		if (!ullDeadline)
+		{
+			continue;
+		}
+
+		IORpcPendingEntry entry;
+		if (ullNow >= ullDeadline)
+		{
+			if (Claim(slot, nId, entry))
+			{
+				expired.push_back(entry);
+			}
+		}
+		else if (ullDeadline < ullNextDeadline)
+		{
+			ullNextDeadline = ullDeadline;
+		}
+	}
+
+	if (RPC_NO_DEADLINE != ullNextDeadline)
+	{
+		LowerNextDeadline(ullNextDeadline);
+	}
+}
+
+void IORpcPendingTable::LowerNextDeadline(ULONGLONG ullDeadline)
+{
+	ULONGLONG ullCurrent = m_ullNextDeadline;
+	while (ullDeadline < ullCurrent)
+	{
+		ULONGLONG ullPrev = (ULONGLONG)::InterlockedCompareExchange64(
+			(volatile LONG64 *)&m_ullNextDeadline, (LONG64)ullDeadline, (LONG64)ullCurrent);
+		if (ullPrev == ullCurrent)
+		{
+			break;
+		}
+		ullCurrent = ullPrev;
+	}
+}
+
+void IORpcPendingTable::RemoveAll(std::vector<IORpcPendingEntry> &removed)
+{
+	for (DWORD index = 0; index < m_dwCapacity; ++index)
+	{
+		IORpcSlot &slot = m_pSlots[index];
+		LONG64 nId = slot.nId;
+		IORpcPendingEntry entry;
+		if (RPC_SLOT_FREE != nId && RPC_SLOT_RESERVED != nId && Claim(slot, nId, entry))
+		{
+			removed.push_back(entry);
+		}
+	}
+}
+
+bool IORpcPendingTable::Claim(IORpcSlot &slot, LONG64 nId, IORpcPendingEntry &entry)
+{
+	if (nId != ::InterlockedCompareExchange64(&slot.nId, RPC_SLOT_RESERVED, nId))
+	{
+		return false;
+	}
+
+	entry.nCorrelationId = (ULONGLONG)nId;
+	entry.ullStartCounter = slot.ullStartCounter;
+	entry.pPromise = slot.pPromise;
+	slot.pPromise = nullptr;
+	slot.ullDeadline = 0;
+	::InterlockedExchange64(&slot.nId, RPC_SLOT_FREE);
+	::InterlockedDecrement(&m_nPendingCount);
+
+	return true;
+}
@@ -0,0 +1,174 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IORPC_H_
+#define _TINY_IOCP_IOCPCOMMON_IORPC_H_
+
+#include <Windows.h>
+#include <future>
+#include <string>
+#include <vector>
+
+#define RPC_FRAME_MAGIC				(0x43505254)		// RPC帧头魔数('TRPC')
+#define RPC_MAX_PAYLOAD_SIZE		(1024 * 1024 * 4)	// 单个请求/响应的最大长度(4M)
+#define RPC_INVALID_ID				(0)					// 无效的关联ID
+#define RPC_DEFAULT_MAX_PENDING		(4096)				// 每个连接默认的最大在途请求数
+#define RPC_DEFAULT_TIMEOUT_MS		(5000)				// 默认的请求超时(毫秒)
+#define RPC_TIMER_PERIOD_MS			(10)				// 超时检查的周期(毫秒)
+
+// RPC帧头，载荷紧随其后
+// 请求与响应格式相同，响应携带对应请求的关联ID
+#pragma pack(push, 1)
+struct IORpcFrameHeader
+{
+	DWORD dwMagic;				// RPC_FRAME_MAGIC
+	DWORD dwPayloadLen;			// 载荷长度
+	ULONGLONG nCorrelationId;	// 关联ID，由客户端分配
+};
+#pragma pack(pop)
+
+//	请求的完成状态
+enum class RPC_STATUS
+{
+	RPC_STATUS_OK = 0,			// 收到响应
+	RPC_STATUS_TIMEOUT,			// 超过期限未收到响应
+	RPC_STATUS_CLOSED,			// 连接已关闭
+	RPC_STATUS_SEND_FAILED,		// 请求未能发出(连接不可用、在途请求已满或载荷过长)
+};
+
+//	帧解析结果
+enum class RPC_PARSE_RESULT
+{
+	RPC_PARSE_FRAME = 0,		// 取出了一个完整的帧
+	RPC_PARSE_INCOMPLETE,		// 数据不足，等待下一次recv
+	RPC_PARSE_ERROR,			// 帧头非法，应关闭连接
+};
+
+// CallAsync返回的结果
+struct IORpcResponse
+{
+	RPC_STATUS status;
+	std::string data;
+};
+
+// 解析出的帧，载荷指向接收缓冲区或解析器内部的缓冲区，只在下次Next之前有效
+struct IORpcFrame
+{
+	ULONGLONG nCorrelationId;
+	const char *pData;
+	DWORD dwLen;
+};
+
+// 从连接的字节流中切分RPC帧，只在持有recv的工作线程上使用，不需要加锁
+// 帧完整位于本次数据中时直接指向接收缓冲区，只有跨越recv边界的帧才拷贝到内部缓冲区
+class IORpcFrameDecoder
+{
+public:
+
+	IORpcFrameDecoder();
+	~IORpcFrameDecoder() = default;
+
+public:
+
+	// 写入帧头，返回帧头长度
+	static DWORD WriteHeader(char *pOutBuffer, ULONGLONG nCorrelationId, DWORD dwPayloadLen);
+
+	// 开始处理本次收到的数据
+	void Feed(const char *buffer, DWORD dwLen);
+
+	// 取出下一个完整的帧，结果通过GetFrame获取
+	RPC_PARSE_RESULT Next();
+
+	// 本次数据处理完毕，未解析完的部分保留到内部缓冲区
+	void EndFeed();
+
+	// 丢弃未解析完的数据并清除错误状态，用于重新连接
+	void Reset();
+
+	const IORpcFrame& GetFrame() const
+	{
+		return m_frame;
+	}
+
+private:
+
+	IORpcFrameDecoder(const IORpcFrameDecoder&) = delete;
+	IORpcFrameDecoder& operator= (const IORpcFrameDecoder&) = delete;
+
+private:
+
+	std::vector<char> m_buffer;		// 跨越recv边界的不完整帧
+	bool m_bBuffered;				// 本次解析的数据位于m_buffer中
+	const char *m_pData;			// 本次解析的数据：接收缓冲区或m_buffer
+	DWORD m_dwDataLen;
+	DWORD m_dwOffset;				// 已解析到的位置
+	bool m_bStopped;				// 出错后不再解析
+	IORpcFrame m_frame;
+};
+
+// 一个在途请求，pPromise为nullptr时通过IRpcClient::OnResponse通知
+struct IORpcPendingEntry
+{
+	ULONGLONG nCorrelationId;
+	ULONGLONG ullStartCounter;				// 发出时的QueryPerformanceCounter计数，未发出的请求为0
+	std::promise<IORpcResponse> *pPromise;
+};
+
+// 在途请求表：固定容量的槽位数组，关联ID对容量取模即为槽位，增删与超时扫描均为无锁的CAS操作
+// 槽位状态：0为空闲，RPC_SLOT_RESERVED为正在写入或正在被取出，其余为已发布的关联ID
+// 发送请求的线程、收到响应的工作线程与超时扫描的工作线程之间只有CAS成功的一方能取出同一请求
+class IORpcPendingTable
+{
+public:
+
+	// dwCapacity向上取整为2的幂
+	explicit IORpcPendingTable(DWORD dwCapacity = RPC_DEFAULT_MAX_PENDING);
+	~IORpcPendingTable();
+
+public:
+
+	// 登记一个请求并分配关联ID，ullDeadline为GetTickCount64的期限(0为不超时)，表满或一整轮都找不到空闲槽位时返回RPC_INVALID_ID
+	// ullStartCounter原样保存到取出的IORpcPendingEntry中，用于统计请求延迟
+	ULONGLONG Add(ULONGLONG ullDeadline, ULONGLONG ullStartCounter, std::promise<IORpcResponse> *pPromise);
+
+	// 取出关联ID对应的请求，已超时或已取出时返回false
+	bool Remove(ULONGLONG nCorrelationId, IORpcPendingEntry &entry);
+
+	// 取出所有到期的请求，追加到expired；最早的期限未到时直接返回，不扫描槽位
+	void Expire(ULONGLONG ullNow, std::vector<IORpcPendingEntry> &expired);
+
+	// 取出所有请求，追加到removed
+	void RemoveAll(std::vector<IORpcPendingEntry> &removed);
+
+	LONG GetPendingCount() const
+	{
+		return m_nPendingCount;
+	}
+
+private:
+
+	struct IORpcSlot
+	{
+		volatile LONG64 nId;
+		ULONGLONG ullDeadline;
+		ULONGLONG ullStartCounter;
+		std::promise<IORpcResponse> *pPromise;
+	};
+
+	// 取出已发布的槽位，nId须为该槽位当前的关联ID
+	bool Claim(IORpcSlot &slot, LONG64 nId, IORpcPendingEntry &entry);
+
+	// 把m_ullNextDeadline降到ullDeadline(已更早时不变)
+	void LowerNextDeadline(ULONGLONG ullDeadline);
+
+	IORpcPendingTable(const IORpcPendingTable&) = delete;
+	IORpcPendingTable& operator= (const IORpcPendingTable&) = delete;
+
+private:
+
+	IORpcSlot *m_pSlots;
+	DWORD m_dwCapacity;
+	ULONGLONG m_ullMask;
+	volatile LONG64 m_nNextId;			// 最近分配的关联ID
+	volatile LONG m_nPendingCount;		// 在途请求数
+	volatile ULONGLONG m_ullNextDeadline;	// 在途请求中最早期限的下界，超时扫描据此跳过
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IORPC_H_
@@ -0,0 +1,658 @@
+#include "ioshm.h"
+#include "iopipe.h"
+
+bool IOShmRing::TryWrite(const char *buffer, DWORD dwLen)
+{
+	if (m_bCorrupt)
+	{
+		return false;
+	}
+
+	// 读取位置由对端发布，超出已写入的范围说明对端改写了头部
+	DWORD dwWritePos = m_dwPos;
+	DWORD dwUsed = dwWritePos - (DWORD)m_pHeader->nReadPos;
+	if (dwUsed > m_dwCapacity)
+	{
+		Corrupt();
+		return false;
+	}
+
+	DWORD dwFree = m_dwCapacity - dwUsed;
+	DWORD dwRecordSize = GetRecordSize(dwLen);
+	DWORD dwIndex = dwWritePos & (m_dwCapacity - 1);
+	DWORD dwTail = m_dwCapacity - dwIndex;
+
+	// 队列末尾放不下时跳过末尾剩余的空间，消息整体从头部开始，消费者可直接在共享内存中读取
+	DWORD dwNeed = (dwRecordSize <= dwTail) ? dwRecordSize : (dwTail + dwRecordSize);
+	if (dwNeed > dwFree)
+	{
+		return false;
+	}
+
+	if (dwRecordSize > dwTail)
+	{
+		*(DWORD *)(m_pData + dwIndex) = SHM_RECORD_WRAP;
+		dwWritePos += dwTail;
+		dwIndex = 0;
+	}
+
+	*(DWORD *)(m_pData + dwIndex) = dwLen;
+	::memcpy(m_pData + dwIndex + sizeof(DWORD), buffer, dwLen);
+
+	// 发布写入位置(全屏障)后再检查消费者是否已登记等待，与消费者先登记再检查队列相对，不会漏掉唤醒
+	m_dwPos = dwWritePos + dwRecordSize;
+	::InterlockedExchange(&m_pHeader->nWritePos, (LONG)m_dwPos);
+	if (m_pHeader->nReaderSleeping)
+	{
+		::SetEvent(m_hDataEvent);
+	}
+
+	return true;
+}
+
+DWORD IOShmRing::Read(char *buffer, DWORD dwSize)
+{
+	if (m_bCorrupt)
+	{
+		return 0;
+	}
+
+	DWORD dwReadPos = m_dwPos;
+	DWORD dwWritePos = (DWORD)m_pHeader->nWritePos;
+	DWORD dwCopied = 0;
+
+	// 写入位置由对端发布，已发布的数据不可能超过队列大小
+	if (dwWritePos - dwReadPos > m_dwCapacity)
+	{
+		return Corrupt();
+	}
+
+	while (dwReadPos != dwWritePos && dwCopied < dwSize)
+	{
+		DWORD dwIndex = dwReadPos & (m_dwCapacity - 1);
+		DWORD dwTail = m_dwCapacity - dwIndex;
+		DWORD dwAvailable = dwWritePos - dwReadPos;
+
+		// 长度只从共享内存读取一次，对端此后再改写也不影响下面的校验与拷贝
+		DWORD dwLen = *(volatile DWORD *)(m_pData + dwIndex);
+		if (SHM_RECORD_WRAP == dwLen)
+		{
+			if (dwTail > dwAvailable || 0 != m_dwPartialOffset)
+			{
+				return Corrupt();
+			}
+			dwReadPos += dwTail;
+			continue;
+		}
+
+		// 记录须完整位于已发布的数据之内且不跨越队列末尾，读了一部分的消息长度不能改变
+		DWORD dwRecordSize = GetRecordSize(dwLen);
+		if (dwLen > GetMaxMessageSize() || dwRecordSize > dwTail || dwRecordSize > dwAvailable || dwLen < m_dwPartialOffset)
+		{
+			return Corrupt();
+		}
+
+		DWORD dwChunk = dwLen - m_dwPartialOffset;
+		if (dwChunk > dwSize - dwCopied)
+		{
+			dwChunk = dwSize - dwCopied;
+		}
+		::memcpy(buffer + dwCopied, m_pData + dwIndex + sizeof(DWORD) + m_dwPartialOffset, dwChunk);
+		dwCopied += dwChunk;
+		m_dwPartialOffset += dwChunk;
+
+		if (m_dwPartialOffset < dwLen)
+		{
+			break;
+		}
+		m_dwPartialOffset = 0;
+		dwReadPos += dwRecordSize;
+	}
+
+	// 一批消息读完后才发布读取位置，生产者因空间不足登记等待时唤醒
+	if (dwReadPos != m_dwPos)
+	{
+		m_dwPos = dwReadPos;
+		::InterlockedExchange(&m_pHeader->nReadPos, (LONG)dwReadPos);
+		if (m_pHeader->nWriterSleeping)
+		{
+			::SetEvent(m_hSpaceEvent);
+		}
+	}
+
+	return dwCopied;
+}
+
+IOShmChannel::IOShmChannel()
+	: m_pHeader(nullptr)
+	, m_bServerSide(false)
+	, m_hPeerProcess(NULL)
+	, m_hPeerWait(NULL)
+	, m_hReceiveWait(NULL)
+	, m_waitLock("IOShmChannel::wait")
+	, m_hMapping(NULL)
+	, m_pView(nullptr)
+	, m_sendLock("IOShmChannel")
+	, m_nPendingOffset(0)
+	, m_nClosed(0)
+	, m_llSpinTicks(0)
+	, m_pConnections(nullptr)
+{
+	for (int index = 0; index < _countof(m_hEvents); ++index)
+	{
+		m_hEvents[index] = NULL;
+	}
+
+	SetSpinTime(SHM_DEFAULT_SPIN_US);
+}
+
+IOShmChannel::~IOShmChannel()
+{
+	if (m_pHeader)
+	{
+		Close();
+	}
+
+	// 登记的接收等待已由Receive注销；析构可能发生在接收等待的回调中(回调投递失败时释放连接)，只能非阻塞注销
+	EndWait();
+
+	// 对端进程的等待回调访问本端的数据事件，须等其结束后才能关闭事件
+	if (m_hPeerWait)
+	{
+		::UnregisterWaitEx(m_hPeerWait, INVALID_HANDLE_VALUE);
+		m_hPeerWait = NULL;
+	}
+
+	for (int index = 0; index < _countof(m_hEvents); ++index)
+	{
+		if (m_hEvents[index])
+		{
+			::CloseHandle(m_hEvents[index]);
+			m_hEvents[index] = NULL;
+		}
+	}
+
+	if (m_hPeerProcess)
+	{
+		::CloseHandle(m_hPeerProcess);
+		m_hPeerProcess = NULL;
+	}
+
+	if (m_pView)
+	{
+		::UnmapViewOfFile(m_pView);
+		m_pView = nullptr;
+		m_pHeader = nullptr;
+	}
+
+	if (m_hMapping)
+	{
+		::CloseHandle(m_hMapping);
+		m_hMapping = NULL;
+	}
+
+	if (m_pConnections)
+	{
+		::InterlockedDecrement(m_pConnections);
+		m_pConnections = nullptr;
+	}
+}
+
+IOShmChannel* IOShmChannel::Connect(const std::string &name, DWORD dwTimeout)
+{
+	ULONGLONG ullDeadline = ::GetTickCount64() + dwTimeout;
+	HANDLE hPipe = IOPipe::Open(IOShmListener::MakePipeName(name), GENERIC_READ | GENERIC_WRITE, dwTimeout);
+	if (INVALID_HANDLE_VALUE == hPipe)
+	{
+		return nullptr;
+	}
+
+	// 服务端忙于其他连接或过载暂停接受时，在剩余的超时时间内等待握手消息
+	IOShmHandshake handshake;
+	ULONG ulServerPid = 0;
+	ULONGLONG ullNow = ::GetTickCount64();
+	bool result = IOPipe::Read(hPipe, &handshake, sizeof(handshake), (ullNow < ullDeadline) ? (DWORD)(ullDeadline - ullNow) : 0) &&
+		SHM_MAGIC == handshake.dwMagic && SHM_VERSION == handshake.dwVersion &&
+		IOShmListener::IsValidRingSize(handshake.dwRingSize) &&
+		::GetNamedPipeServerProcessId(hPipe, &ulServerPid);
+
+	IOShmChannel *pChannel = nullptr;
+	if (result)
+	{
+		// 服务端进程ID取自系统；打开失败时仍可通信，只是无法感知服务端异常退出
+		HANDLE hEvents[2] = { (HANDLE)(ULONG_PTR)handshake.ullEvents[0], (HANDLE)(ULONG_PTR)handshake.ullEvents[1] };
+		pChannel = new IOShmChannel();
+		result = pChannel->Open((HANDLE)(ULONG_PTR)handshake.ullMapping, hEvents,
+			::OpenProcess(SYNCHRONIZE, FALSE, ulServerPid), handshake.dwRingSize, false);
+
+		// 确认后服务端才建立连接；确认未送达时服务端关闭复制给本进程的句柄，本端随即视为对端已关闭
+		DWORD dwAck = SHM_MAGIC;
+		result = result && IOPipe::Write(hPipe, &dwAck, sizeof(dwAck), SHM_HANDSHAKE_TIMEOUT);
+	}
+
+	DWORD dwError = ::GetLastError();
+	::CloseHandle(hPipe);
+
+	if (!result)
+	{
+		delete pChannel;
+		::SetLastError((ERROR_TIMEOUT == dwError) ? ERROR_TIMEOUT : ERROR_CONNECTION_REFUSED);
+		return nullptr;
+	}
+
+	return pChannel;
+}
+
+bool IOShmChannel::Open(HANDLE hMapping, HANDLE hEvents[2], HANDLE hPeerProcess, DWORD dwRingSize, bool bServerSide)
+{
+	m_hMapping = hMapping;
+	m_hEvents[0] = hEvents[0];
+	m_hEvents[1] = hEvents[1];
+	m_hPeerProcess = hPeerProcess;
+	m_bServerSide = bServerSide;
+	if (!m_hMapping || !m_hEvents[0] || !m_hEvents[1])
+	{
+		return false;
+	}
+
+	m_pView = (char *)::MapViewOfFile(m_hMapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+	if (!m_pView)
+	{
+		return false;
+	}
+
+	// 客户端校验服务端填写的头部；服务端此后只以本地的dwRingSize为准
+	m_pHeader = (IOShmConnHeader *)m_pView;
+	if (!bServerSide && (SHM_MAGIC != m_pHeader->dwMagic || dwRingSize != m_pHeader->dwRingSize))
+	{
+		return false;
+	}
+
+	// 每端一个数据事件：本端发送队列的数据事件唤醒对端，本端接收队列的空间事件也唤醒对端
+	DWORD dwSendRing = bServerSide ? SHM_RING_TO_CLIENT : SHM_RING_TO_SERVER;
+	DWORD dwRecvRing = bServerSide ? SHM_RING_TO_SERVER : SHM_RING_TO_CLIENT;
+	m_sendRing.Attach(&m_pHeader->rings[dwSendRing], IOShmListener::GetRingData(m_pView, dwRingSize, dwSendRing),
+		dwRingSize, m_hEvents[dwSendRing], m_hEvents[dwRecvRing]);
+	m_recvRing.Attach(&m_pHeader->rings[dwRecvRing], IOShmListener::GetRingData(m_pView, dwRingSize, dwRecvRing),
+		dwRingSize, m_hEvents[dwRecvRing], m_hEvents[dwSendRing]);
+
+	// 对端进程退出时唤醒本端接收方，由其读完剩余数据后关闭
+	if (m_hPeerProcess && !::RegisterWaitForSingleObject(
+		&m_hPeerWait, m_hPeerProcess, PeerDeadCallback, this, INFINITE, WT_EXECUTEONLYONCE))
+	{
+		m_hPeerWait = NULL;
+	}
+
+	return true;
+}
+
+void IOShmChannel::SetSpinTime(DWORD dwSpinUs)
+{
+	LARGE_INTEGER frequency;
+	::QueryPerformanceFrequency(&frequency);
+	m_llSpinTicks = (LONGLONG)dwSpinUs * frequency.QuadPart / 1000000;
+}
+
+bool IOShmChannel::Send(const char *buffer, DWORD dwLen)
+{
+	if (!buffer || 0 == dwLen || dwLen > m_sendRing.GetMaxMessageSize())
+	{
+		::SetLastError(ERROR_INVALID_PARAMETER);
+		return false;
+	}
+
+	AutoLock<EngineLock> lock(m_sendLock);
+	if (m_nClosed || IsPeerClosed())
+	{
+		::SetLastError(ERROR_BROKEN_PIPE);
+		return false;
+	}
+
+	// 没有暂存的数据时直接写入队列；否则排在暂存数据之后，保持消息顺序
+	if (m_nPendingOffset == m_pending.size() && m_sendRing.TryWrite(buffer, dwLen))
+	{
+		return true;
+	}
+
+	if (m_sendRing.IsCorrupt())
+	{
+		::SetLastError(ERROR_INVALID_DATA);
+		return false;
+	}
+
+	// 暂存的数据以队列大小为限，对端长时间不消费时发送失败而不是无限占用内存
+	if (m_pending.size() - m_nPendingOffset + sizeof(DWORD) + dwLen > m_sendRing.GetCapacity())
+	{
+		::SetLastError(ERROR_NOT_ENOUGH_QUOTA);
+		return false;
+	}
+
+	m_pending.insert(m_pending.end(), (const char *)&dwLen, (const char *)&dwLen + sizeof(DWORD));
+	m_pending.insert(m_pending.end(), buffer, buffer + dwLen);
+	return Flush();
+}
+
+bool IOShmChannel::Flush()
+{
+	IOShmRingHeader *pHeader = m_sendRing.GetHeader();
+	while (m_nPendingOffset < m_pending.size())
+	{
+		DWORD dwLen = *(const DWORD *)&m_pending[m_nPendingOffset];
+		const char *pData = &m_pending[m_nPendingOffset + sizeof(DWORD)];
+		if (!m_sendRing.TryWrite(pData, dwLen))
+		{
+			// 队列已满：先登记等待再重试一次，消费者释放空间后检查登记并唤醒本端的接收方，由Receive继续写入
+			::InterlockedExchange(&pHeader->nWriterSleeping, 1);
+			if (!m_sendRing.TryWrite(pData, dwLen))
+			{
+				if (m_sendRing.IsCorrupt())
+				{
+					::SetLastError(ERROR_INVALID_DATA);
+					return false;
+				}
+				return true;
+			}
+		}
+		m_nPendingOffset += sizeof(DWORD) + dwLen;
+	}
+
+	// 暂存区保留容量，再次写不下时不必重新分配
+	m_pending.clear();
+	m_nPendingOffset = 0;
+	::InterlockedExchange(&pHeader->nWriterSleeping, 0);
+	return true;
+}
+
+SHM_WAIT_RESULT IOShmChannel::Receive(char *buffer, DWORD dwSize, DWORD &dwBytes)
+{
+	dwBytes = 0;
+	EndWait();
+	::InterlockedExchange(&m_recvRing.GetHeader()->nReaderSleeping, 0);
+
+	// 唤醒也可能来自对端释放了发送空间
+	bool bFlushed = true;
+	{
+		AutoLock<EngineLock> lock(m_sendLock);
+		bFlushed = m_nClosed || Flush();
+	}
+	if (!bFlushed)
+	{
+		Close();
+		return SHM_WAIT_RESULT::SHM_WAIT_INVALID_DATA;
+	}
+
+	SHM_WAIT_RESULT result = SHM_WAIT_RESULT::SHM_WAIT_NONE;
+	if (!Poll(result) || SHM_WAIT_RESULT::SHM_WAIT_DATA != result)
+	{
+		return result;
+	}
+
+	dwBytes = m_recvRing.Read(buffer, dwSize);
+	if (m_recvRing.IsCorrupt())
+	{
+		dwBytes = 0;
+		Close();
+		return SHM_WAIT_RESULT::SHM_WAIT_INVALID_DATA;
+	}
+
+	return dwBytes ? SHM_WAIT_RESULT::SHM_WAIT_DATA : SHM_WAIT_RESULT::SHM_WAIT_NONE;
+}
+
+bool IOShmChannel::ArmReceive(WAITORTIMERCALLBACK pfnCallback, PVOID pContext, bool &bReady)
+{
+	bReady = true;
+	SHM_WAIT_RESULT result = SHM_WAIT_RESULT::SHM_WAIT_NONE;
+
+	// 忙轮询期间对端写入的数据不经过内核即可被看到，轮询时长有上限，不会长期占用工作者线程
+	if (m_llSpinTicks > 0)
+	{
+		LARGE_INTEGER start, now;
+		::QueryPerformanceCounter(&start);
+		do
+		{
+			if (Poll(result))
+			{
+				return true;
+			}
+			YieldProcessor();
+			::QueryPerformanceCounter(&now);
+		} while (now.QuadPart - start.QuadPart < m_llSpinTicks);
+	}
+
+	// 先登记等待再检查队列(均为全屏障)，生产者先发布数据再检查登记，两者至少一方能看到对方
+	IOShmRingHeader *pHeader = m_recvRing.GetHeader();
+	::InterlockedExchange(&pHeader->nReaderSleeping, 1);
+	if (Poll(result))
+	{
+		::InterlockedExchange(&pHeader->nReaderSleeping, 0);
+		return true;
+	}
+
+	// 等待可能在登记返回前就触发，持锁登记使Receive注销时一定能看到等待句柄
+	AutoLock<EngineLock> lock(m_waitLock);
+	bReady = false;
+	if (!::RegisterWaitForSingleObject(&m_hReceiveWait, m_hEvents[m_bServerSide ? SHM_RING_TO_SERVER : SHM_RING_TO_CLIENT],
+		pfnCallback, pContext, INFINITE, WT_EXECUTEONLYONCE))
+	{
+		m_hReceiveWait = NULL;
+		::InterlockedExchange(&pHeader->nReaderSleeping, 0);
+		return false;
+	}
+
+	return true;
+}
+
+void IOShmChannel::EndWait()
+{
+	// 一次性等待触发后仍须注销；回调可能尚未返回，只能非阻塞注销
+	AutoLock<EngineLock> lock(m_waitLock);
+	if (m_hReceiveWait)
+	{
+		::UnregisterWait(m_hReceiveWait);
+		m_hReceiveWait = NULL;
+	}
+}
+
+bool IOShmChannel::Poll(SHM_WAIT_RESULT &result) const
+{
+	if (m_nClosed)
+	{
+		result = SHM_WAIT_RESULT::SHM_WAIT_CLOSED;
+		return true;
+	}
+
+	if (!m_recvRing.IsEmpty())
+	{
+		result = SHM_WAIT_RESULT::SHM_WAIT_DATA;
+		return true;
+	}
+
+	// 对端关闭前写入的数据已全部读完(关闭标记在最后一次写入之后设置)
+	if (IsPeerClosed())
+	{
+		result = SHM_WAIT_RESULT::SHM_WAIT_PEER_CLOSED;
+		return true;
+	}
+
+	if (IsPeerDead())
+	{
+		result = SHM_WAIT_RESULT::SHM_WAIT_PEER_DEAD;
+		return true;
+	}
+
+	return false;
+}
+
+bool IOShmChannel::IsPeerClosed() const
+{
+	return 0 != (m_bServerSide ? m_pHeader->nClientClosed : m_pHeader->nServerClosed);
+}
+
+bool IOShmChannel::IsPeerDead() const
+{
+	return m_hPeerProcess && WAIT_OBJECT_0 == ::WaitForSingleObject(m_hPeerProcess, 0);
+}
+
+VOID CALLBACK IOShmChannel::PeerDeadCallback(PVOID lpParam, BOOLEAN bTimerOrWaitFired)
+{
+	IOShmChannel *pThis = reinterpret_cast<IOShmChannel*>(lpParam);
+	::SetEvent(pThis->m_hEvents[pThis->m_bServerSide ? SHM_RING_TO_SERVER : SHM_RING_TO_CLIENT]);
+}
+
+void IOShmChannel::Close()
+{
+	if (!m_pHeader || 0 != ::InterlockedExchange(&m_nClosed, 1))
+	{
+		return;
+	}
+
+	::InterlockedExchange(m_bServerSide ? &m_pHeader->nServerClosed : &m_pHeader->nClientClosed, 1);
+
+	// 两端的数据事件都置位：唤醒对端接收方，也唤醒本端已登记的接收等待，使其随关闭释放连接
+	::SetEvent(m_hEvents[SHM_RING_TO_SERVER]);
+	::SetEvent(m_hEvents[SHM_RING_TO_CLIENT]);
+}
+
+IOShmListener::IOShmListener()
+	: m_hPipe(INVALID_HANDLE_VALUE)
+	, m_dwMaxConnections(0)
+	, m_dwRingSize(0)
+	, m_nConnections(0)
+{
+}
+
+IOShmListener::~IOShmListener()
+{
+	Destroy();
+}
+
+bool IOShmListener::Create(const std::string &name, DWORD dwMaxConnections, DWORD dwRingSize)
+{
+	Destroy();
+
+	if (name.empty() || 0 == dwMaxConnections || dwMaxConnections > SHM_MAX_SLOTS || !IsValidRingSize(dwRingSize))
+	{
+		return false;
+	}
+
+	m_hPipe = IOPipe::Create(MakePipeName(name), PIPE_ACCESS_DUPLEX, SHM_PIPE_BUFFER_SIZE);
+	if (INVALID_HANDLE_VALUE == m_hPipe)
+	{
+		return false;
+	}
+
+	m_name = name;
+	m_dwMaxConnections = dwMaxConnections;
+	m_dwRingSize = dwRingSize;
+	return true;
+}
+
+void IOShmListener::Destroy()
+{
+	if (INVALID_HANDLE_VALUE != m_hPipe)
+	{
+		::CloseHandle(m_hPipe);
+		m_hPipe = INVALID_HANDLE_VALUE;
+	}
+
+	m_name.clear();
+}
+
+IOShmChannel* IOShmListener::Accept(DWORD dwTimeout, HANDLE hCancelEvent)
+{
+	if (!IOPipe::Accept(m_hPipe, dwTimeout, hCancelEvent))
+	{
+		return nullptr;
+	}
+
+	// 握手结束(客户端已确认或已放弃)后断开，等待下一个客户端
+	IOShmChannel *pChannel = Handshake();
+	::DisconnectNamedPipe(m_hPipe);
+	return pChannel;
+}
+
+IOShmChannel* IOShmListener::Handshake()
+{
+	// 客户端进程ID取自系统而非客户端写入的数据，对端退出检测不会被冒用
+	ULONG ulClientPid = 0;
+	if (!::GetNamedPipeClientProcessId(m_hPipe, &ulClientPid))
+	{
+		return nullptr;
+	}
+
+	HANDLE hClientProcess = ::OpenProcess(PROCESS_DUP_HANDLE | SYNCHRONIZE, FALSE, ulClientPid);
+	if (!hClientProcess)
+	{
+		return nullptr;
+	}
+
+	// 无名映射与事件只能经复制的句柄访问
+	ULONGLONG ullSize = sizeof(IOShmConnHeader) + (ULONGLONG)m_dwRingSize * 2;
+	HANDLE hEvents[2] = { ::CreateEvent(NULL, FALSE, FALSE, NULL), ::CreateEvent(NULL, FALSE, FALSE, NULL) };
+	IOShmChannel *pChannel = new IOShmChannel();
+	if (!pChannel->Open(::CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		(DWORD)(ullSize >> 32), (DWORD)(ullSize & 0xFFFFFFFF), NULL), hEvents, hClientProcess, m_dwRingSize, true))
+	{
+		delete pChannel;
+		return nullptr;
+	}
+
+	IOShmConnHeader *pHeader = pChannel->m_pHeader;
+	pHeader->dwMagic = SHM_MAGIC;
+	pHeader->dwVersion = SHM_VERSION;
+	pHeader->dwRingSize = m_dwRingSize;
+
+	IOShmHandshake handshake;
+	::memset(&handshake, 0, sizeof(handshake));
+	handshake.dwMagic = SHM_MAGIC;
+	handshake.dwVersion = SHM_VERSION;
+	handshake.dwRingSize = m_dwRingSize;
+
+	// 依次复制映射与两个事件，客户端只获得读写与等待所需的权限
+	HANDLE hSources[3] = { pChannel->m_hMapping, pChannel->m_hEvents[0], pChannel->m_hEvents[1] };
+	DWORD dwAccess[3] = { FILE_MAP_READ | FILE_MAP_WRITE, EVENT_MODIFY_STATE | SYNCHRONIZE, EVENT_MODIFY_STATE | SYNCHRONIZE };
+	HANDLE hTargets[3] = { NULL, NULL, NULL };
+	bool result = true;
+	for (int index = 0; result && index < _countof(hSources); ++index)
+	{
+		result = (FALSE != ::DuplicateHandle(::GetCurrentProcess(), hSources[index], hClientProcess, &hTargets[index], dwAccess[index], FALSE, 0));
+	}
+
+	DWORD dwAck = 0;
+	if (result)
+	{
+		handshake.ullMapping = (ULONGLONG)(ULONG_PTR)hTargets[0];
+		handshake.ullEvents[0] = (ULONGLONG)(ULONG_PTR)hTargets[1];
+		handshake.ullEvents[1] = (ULONGLONG)(ULONG_PTR)hTargets[2];
+		result = IOPipe::Write(m_hPipe, &handshake, sizeof(handshake), SHM_HANDSHAKE_TIMEOUT) &&
+			IOPipe::Read(m_hPipe, &dwAck, sizeof(dwAck), SHM_HANDSHAKE_TIMEOUT) && SHM_MAGIC == dwAck;
+	}
+
+	// 客户端未确认(已超时放弃)：关闭复制到客户端进程中的句柄
+	if (!result)
+	{
+		for (int index = 0; index < _countof(hTargets); ++index)
+		{
+			if (hTargets[index])
+			{
+				::DuplicateHandle(hClientProcess, hTargets[index], NULL, NULL, 0, FALSE, DUPLICATE_CLOSE_SOURCE);
+			}
+		}
+		delete pChannel;
+		return nullptr;
+	}
+
+	pChannel->m_pConnections = &m_nConnections;
+	::InterlockedIncrement(&m_nConnections);
+	return pChannel;
+}
+
+std::string IOShmListener::MakePipeName(const std::string &name)
+{
+	return "\\\\.\\pipe\\tinyiocp_shm_" + name;
+}
+
+char* IOShmListener::GetRingData(char *pView, DWORD dwRingSize, DWORD dwRing)
+{
+	return pView + sizeof(IOShmConnHeader) + (size_t)dwRing * dwRingSize;
+}
@@ -0,0 +1,298 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOSHM_H_
+#define _TINY_IOCP_IOCPCOMMON_IOSHM_H_
+
+#include <Windows.h>
+#include "iolock.h"
+#include <string>
+#include <vector>
+
+#define SHM_MAGIC				(0x4D485354)		// 共享内存连接的魔数('TSHM')
+#define SHM_VERSION				(2)
+#define SHM_CACHE_LINE			(64)				// 生产者与消费者各自修改的字段按缓存行隔开
+#define SHM_DEFAULT_SLOTS		(8)					// 默认的同时存在的连接数上限
+#define SHM_MAX_SLOTS			(64)				// 同时存在的连接数上限的最大值
+#define SHM_DEFAULT_RING_SIZE	(1024 * 1024)		// 每个方向环形队列的默认大小(1M)
+#define SHM_MIN_RING_SIZE		(1024 * 64)			// 环形队列的最小大小，大小须为2的幂
+#define SHM_MAX_RING_SIZE		(1024 * 1024 * 64)	// 环形队列的最大大小
+#define SHM_DEFAULT_SPIN_US		(50)				// 接收方登记等待前默认的轮询时长(微秒)
+#define SHM_CONNECT_TIMEOUT		(5 * 1000)			// 客户端等待服务端接受连接的超时时间(ms)
+#define SHM_HANDSHAKE_TIMEOUT	(1000)				// 服务端等待客户端读取握手消息并确认的超时时间(ms)
+#define SHM_MAINTAIN_PERIOD		(1000)				// 服务端暂停接受(过载或连接数已满)时重新检查的周期(ms)
+#define SHM_PIPE_BUFFER_SIZE	(4096)				// 握手管道的缓冲区大小
+#define SHM_RECORD_ALIGN		(8)					// 环形队列中的消息按8字节对齐
+#define SHM_RECORD_WRAP			(0xFFFFFFFF)		// 回绕标记：队列末尾放不下消息时从队列头部继续
+
+#define SHM_RING_TO_SERVER		(0)					// 客户端发往服务端的环形队列，其数据事件唤醒服务端
+#define SHM_RING_TO_CLIENT		(1)					// 服务端发往客户端的环形队列，其数据事件唤醒客户端
+
+//	接收的结果
+enum class SHM_WAIT_RESULT
+{
+	SHM_WAIT_NONE = 0,		// 没有可处理的数据，需重新登记等待
+	SHM_WAIT_DATA,			// 读到了数据
+	SHM_WAIT_CLOSED,		// 本端已关闭
+	SHM_WAIT_PEER_CLOSED,	// 对端已关闭且数据已读完
+	SHM_WAIT_PEER_DEAD,		// 对端进程已退出且数据已读完
+	SHM_WAIT_INVALID_DATA,	// 对端写入了不合法的数据，本端已关闭
+};
+
+// 单生产者/单消费者环形队列的共享头部，读写位置按2^32回绕
+struct IOShmRingHeader
+{
+	volatile LONG nWritePos;		// 生产者已发布的写入位置(字节)
+	char padding1[SHM_CACHE_LINE - sizeof(LONG)];
+	volatile LONG nReadPos;			// 消费者已释放的读取位置(字节)
+	char padding2[SHM_CACHE_LINE - sizeof(LONG)];
+	volatile LONG nReaderSleeping;	// 消费者已登记等待数据事件
+	volatile LONG nWriterSleeping;	// 生产者因空间不足已登记等待空间
+	char padding3[SHM_CACHE_LINE - sizeof(LONG) * 2];
+};
+
+// 一个连接的共享头部，其后依次为SHM_RING_TO_SERVER与SHM_RING_TO_CLIENT两个环形队列的数据区
+// 每个连接一个无名映射，只经DuplicateHandle交给该连接的客户端进程，其他进程无从打开
+struct IOShmConnHeader
+{
+	DWORD dwMagic;
+	DWORD dwVersion;
+	DWORD dwRingSize;
+	volatile LONG nClientClosed;	// 客户端已关闭，不再发送
+	volatile LONG nServerClosed;	// 服务端已关闭，不再发送
+	char padding[SHM_CACHE_LINE - sizeof(DWORD) * 5];
+	IOShmRingHeader rings[2];		// 按SHM_RING_TO_SERVER/SHM_RING_TO_CLIENT索引
+};
+
+// 服务端经握手管道发给客户端的消息，句柄均已复制到客户端进程中
+// 客户端读取后回复一个SHM_MAGIC确认，服务端收到确认才建立连接
+struct IOShmHandshake
+{
+	DWORD dwMagic;
+	DWORD dwVersion;
+	DWORD dwRingSize;
+	DWORD dwReserved;
+	ULONGLONG ullMapping;			// 连接的映射
+	ULONGLONG ullEvents[2];			// 按SHM_RING_TO_SERVER/SHM_RING_TO_CLIENT索引的数据事件
+};
+
+// 映射在共享内存中的单生产者/单消费者环形队列，消息按(长度,数据)依次存放
+// 生产者写入数据后发布写入位置，消费者读取后发布读取位置，两端均不加锁
+// 对端已登记等待时才SetEvent唤醒，对端忙轮询期间的交接不经过内核
+// 共享内存对端可任意改写：本端的位置只以本地副本为准，对端写入的位置与消息长度逐一校验，越界即标记为损坏
+class IOShmRing
+{
+public:
+
+	IOShmRing()
+		: m_pHeader(nullptr)
+		, m_pData(nullptr)
+		, m_dwCapacity(0)
+		, m_hDataEvent(NULL)
+		, m_hSpaceEvent(NULL)
+		, m_dwPos(0)
+		, m_dwPartialOffset(0)
+		, m_bCorrupt(false)
+	{
+	}
+
+	~IOShmRing() = default;
+
+public:
+
+	// 新建的映射内容为0，两端的位置均从0开始
+	void Attach(IOShmRingHeader *pHeader, char *pData, DWORD dwCapacity, HANDLE hDataEvent, HANDLE hSpaceEvent)
+	{
+		m_pHeader = pHeader;
+		m_pData = pData;
+		m_dwCapacity = dwCapacity;
+		m_hDataEvent = hDataEvent;
+		m_hSpaceEvent = hSpaceEvent;
+		m_dwPos = 0;
+		m_dwPartialOffset = 0;
+		m_bCorrupt = false;
+	}
+
+	// 生产者：写入一条消息，空间不足或队列已损坏时返回false
+	bool TryWrite(const char *buffer, DWORD dwLen);
+
+	// 消费者：读取不超过dwSize字节，返回读取的字节数；缓冲区放不下的消息留待下次继续读取(与TCP相同的字节流语义)
+	// 遇到不合法的记录时返回0并标记为损坏，此后不再读取
+	DWORD Read(char *buffer, DWORD dwSize);
+
+	// 消费者：是否没有待读取的数据
+	bool IsEmpty() const
+	{
+		return (DWORD)m_pHeader->nWritePos == m_dwPos;
+	}
+
+	bool IsCorrupt() const
+	{
+		return m_bCorrupt;
+	}
+
+	DWORD GetCapacity() const
+	{
+		return m_dwCapacity;
+	}
+
+	// 单条消息的长度上限，保证任意位置的消息连同回绕都能放入空队列
+	DWORD GetMaxMessageSize() const
+	{
+		return m_dwCapacity / 2 - sizeof(DWORD);
+	}
+
+	IOShmRingHeader* GetHeader() const
+	{
+		return m_pHeader;
+	}
+
+	static DWORD GetRecordSize(DWORD dwLen)
+	{
+		return (DWORD)((sizeof(DWORD) + dwLen + SHM_RECORD_ALIGN - 1) & ~(SHM_RECORD_ALIGN - 1));
+	}
+
+private:
+
+	DWORD Corrupt()
+	{
+		m_bCorrupt = true;
+		m_dwPartialOffset = 0;
+		return 0;
+	}
+
+	IOShmRing(const IOShmRing&) = delete;
+	IOShmRing& operator= (const IOShmRing&) = delete;
+
+private:
+
+	IOShmRingHeader *m_pHeader;
+	char *m_pData;
+	DWORD m_dwCapacity;
+	HANDLE m_hDataEvent;			// 唤醒消费者
+	HANDLE m_hSpaceEvent;			// 唤醒生产者
+	DWORD m_dwPos;					// 本端的位置：生产者为写入位置，消费者为读取位置
+	DWORD m_dwPartialOffset;		// 消费者：当前消息已读取的字节数
+	bool m_bCorrupt;				// 对端写入了不合法的位置或记录
+};
+
+// 共享内存连接的一端：各持有发送与接收两个环形队列，每端一个数据事件，数据到达与发送空间释放均以它唤醒
+// 接收由引擎驱动：ArmReceive以线程池登记一次性等待，事件到达后回调方向完成端口投递唤醒包，工作者线程调用Receive非阻塞地读取
+// 发送可在任意线程调用且不阻塞，队列已满时暂存在本端，接收方被唤醒时(Receive)继续写入
+// 对端进程退出时同样唤醒接收方，接收方读完剩余数据后得到SHM_WAIT_PEER_DEAD
+class IOShmChannel
+{
+public:
+
+	~IOShmChannel();
+
+	// 客户端：经握手管道连接名为name的共享内存监听，返回的通道由调用者delete；失败时返回nullptr
+	static IOShmChannel* Connect(const std::string &name, DWORD dwTimeout = SHM_CONNECT_TIMEOUT);
+
+	// 发送一条消息，不阻塞；暂存的数据超过队列大小(对端长时间不消费)或任一端已关闭时返回false(GetLastError为原因)
+	bool Send(const char *buffer, DWORD dwLen);
+
+	// 非阻塞地接收：读到数据时返回SHM_WAIT_DATA及读取的字节数；同时继续写入暂存的待发送数据
+	SHM_WAIT_RESULT Receive(char *buffer, DWORD dwSize, DWORD &dwBytes);
+
+	// 登记下一次接收：先按SetSpinTime忙轮询，仍无事可做时以线程池一次性等待数据事件，事件到达后回调pfnCallback(pContext)
+	// 已有数据或关闭待处理时不登记并置bReady，由调用者直接处理；每次回调或bReady之后须先调用Receive再登记
+	bool ArmReceive(WAITORTIMERCALLBACK pfnCallback, PVOID pContext, bool &bReady);
+
+	void SetSpinTime(DWORD dwSpinUs);
+
+	// 关闭本端：通知对端，并唤醒两端的接收方；可重复调用
+	void Close();
+
+	bool IsClosed() const
+	{
+		return (0 != m_nClosed);
+	}
+
+private:
+
+	friend class IOShmListener;
+
+	IOShmChannel();
+
+	// 接管映射、两个数据事件与对端进程句柄(失败时同样由析构关闭)，映射视图并关联两个环形队列
+	bool Open(HANDLE hMapping, HANDLE hEvents[2], HANDLE hPeerProcess, DWORD dwRingSize, bool bServerSide);
+	bool IsPeerClosed() const;
+	bool IsPeerDead() const;
+	bool Poll(SHM_WAIT_RESULT &result) const;
+	bool Flush();
+	void EndWait();
+
+	static VOID CALLBACK PeerDeadCallback(PVOID lpParam, BOOLEAN bTimerOrWaitFired);
+
+	IOShmChannel(const IOShmChannel&) = delete;
+	IOShmChannel& operator= (const IOShmChannel&) = delete;
+
+private:
+
+	IOShmConnHeader *m_pHeader;
+	bool m_bServerSide;
+	IOShmRing m_sendRing;
+	IOShmRing m_recvRing;
+	HANDLE m_hEvents[2];			// 两端各自的数据事件，按SHM_RING_TO_SERVER/SHM_RING_TO_CLIENT索引
+	HANDLE m_hPeerProcess;			// 对端进程，退出时变为有信号
+	HANDLE m_hPeerWait;				// 对端进程退出时唤醒本端接收方的一次性等待
+	HANDLE m_hReceiveWait;			// ArmReceive登记的一次性等待
+	EngineLock m_waitLock;			// 登记完成前回调已触发时，Receive等待登记返回后再注销
+	HANDLE m_hMapping;
+	char *m_pView;
+	EngineLock m_sendLock;			// 多个线程发送时保证单生产者，并保护暂存的待发送数据
+	std::vector<char> m_pending;	// 队列已满时暂存的消息，按(长度,数据)依次存放
+	size_t m_nPendingOffset;		// 已写入队列的暂存数据
+	volatile LONG m_nClosed;
+	LONGLONG m_llSpinTicks;			// 接收方登记等待前忙轮询的QPC计数
+	volatile LONG *m_pConnections;	// 服务端：所属监听的连接计数，通道销毁时减一
+};
+
+// 服务端的共享内存监听：只允许当前用户访问的握手管道
+// 客户端连接管道后，服务端从系统取得客户端进程ID，为连接新建无名映射与事件并复制到客户端进程，经管道告知句柄值
+class IOShmListener
+{
+public:
+
+	IOShmListener();
+	~IOShmListener();
+
+public:
+
+	// 同名管道已存在(另一个服务端正在监听)时返回false
+	bool Create(const std::string &name, DWORD dwMaxConnections, DWORD dwRingSize);
+	void Destroy();
+
+	// 等待并接受一个连接，超时、hCancelEvent有信号或握手失败时返回nullptr
+	IOShmChannel* Accept(DWORD dwTimeout, HANDLE hCancelEvent);
+
+	// 连接数已达上限，暂停接受直到有连接销毁
+	bool IsFull() const
+	{
+		return m_nConnections >= (LONG)m_dwMaxConnections;
+	}
+
+	static bool IsValidRingSize(DWORD dwRingSize)
+	{
+		return dwRingSize >= SHM_MIN_RING_SIZE && dwRingSize <= SHM_MAX_RING_SIZE && 0 == (dwRingSize & (dwRingSize - 1));
+	}
+
+	static std::string MakePipeName(const std::string &name);
+	static char* GetRingData(char *pView, DWORD dwRingSize, DWORD dwRing);
+
+private:
+
+	// 管道已连接：建立通道并完成握手
+	IOShmChannel* Handshake();
+
+	IOShmListener(const IOShmListener&) = delete;
+	IOShmListener& operator= (const IOShmListener&) = delete;
+
+private:
+
+	std::string m_name;
+	HANDLE m_hPipe;
+	DWORD m_dwMaxConnections;
+	DWORD m_dwRingSize;
+	volatile LONG m_nConnections;	// 已建立且尚未销毁的连接数
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOSHM_H_
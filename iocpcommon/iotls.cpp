@@ -0,0 +1,337 @@
+#include "iotls.h"
+
+#pragma comment(lib, "Secur32.lib")
+#pragma comment(lib, "Crypt32.lib")
+
+#define TLS_ASC_REQ_FLAGS (ASC_REQ_SEQUENCE_DETECT | ASC_REQ_REPLAY_DETECT | ASC_REQ_CONFIDENTIALITY | \
+	ASC_REQ_EXTENDED_ERROR | ASC_REQ_ALLOCATE_MEMORY | ASC_REQ_STREAM)
+
+IOTlsCredentials::IOTlsCredentials()
+	: m_bValid(false)
+	, m_hCertStore(NULL)
+	, m_pCertContext(nullptr)
+{
+	::memset(&m_hCredentials, 0, sizeof(m_hCredentials));
+}
+
+IOTlsCredentials::~IOTlsCredentials()
+{
+	UnInit();
+}
+
+bool IOTlsCredentials::Init(const std::string &certSubject)
+{
+	UnInit();
+
+	m_hCertStore = ::CertOpenStore(
+		CERT_STORE_PROV_SYSTEM_W,
+		0,
+		NULL,
+		CERT_SYSTEM_STORE_LOCAL_MACHINE | CERT_STORE_READONLY_FLAG,
+		L"MY");
+	if (!m_hCertStore)
+	{
+		return false;
+	}
+
+	m_pCertContext = ::CertFindCertificateInStore(
+		m_hCertStore,
+		X509_ASN_ENCODING | PKCS_7_ASN_ENCODING,
+		0,
+		CERT_FIND_SUBJECT_STR_A,
+		certSubject.c_str(),
+		nullptr);
+	if (!m_pCertContext)
+	{
+		UnInit();
+		return false;
+	}
+
+	SCHANNEL_CRED schannelCred;
+	::memset(&schannelCred, 0, sizeof(schannelCred));
+	schannelCred.dwVersion = SCHANNEL_CRED_VERSION;
+	schannelCred.cCreds = 1;
+	schannelCred.paCred = &m_pCertContext;
+	schannelCred.grbitEnabledProtocols = SP_PROT_TLS1_2_SERVER;
+	schannelCred.dwFlags = SCH_USE_STRONG_CRYPTO;
+
+	TimeStamp tsExpiry;
+	if (SEC_E_OK != ::AcquireCredentialsHandleW(
+		nullptr,
+		const_cast<LPWSTR>(UNISP_NAME_W),
+		SECPKG_CRED_INBOUND,
+		nullptr,
+		&schannelCred,
+		nullptr,
+		nullptr,
+		&m_hCredentials,
+		&tsExpiry))
+	{
+		UnInit();
+		return false;
+	}
+
+	m_bValid = true;
+	return true;
+}
+
+void IOTlsCredentials::UnInit()
+{
+	if (m_bValid)
+	{
+		::FreeCredentialsHandle(&m_hCredentials);
+		::memset(&m_hCredentials, 0, sizeof(m_hCredentials));
+		m_bValid = false;
+	}
+
+	if (m_pCertContext)
+	{
+		::CertFreeCertificateContext(m_pCertContext);
+		m_pCertContext = nullptr;
+	}
+
+	if (m_hCertStore)
+	{
+		::CertCloseStore(m_hCertStore, 0);
+		m_hCertStore = NULL;
+	}
+}
+
+IOTlsSession::IOTlsSession(IOTlsCredentials *pCredentials)
+	: m_pCredentials(pCredentials)
+	, m_bHasContext(false)
+	, m_state(TLS_SESSION_STATE::TLS_STATE_HANDSHAKE)
+	, m_lastStatus(SEC_E_OK)
+	, m_lock("IOTlsSession")
+{
+	::memset(&m_hContext, 0, sizeof(m_hContext));
+	::memset(&m_streamSizes, 0, sizeof(m_streamSizes));
+}
+
+IOTlsSession::~IOTlsSession()
+{
+	if (m_bHasContext)
+	{
+		::DeleteSecurityContext(&m_hContext);
+		m_bHasContext = false;
+	}
+}
+
+bool IOTlsSession::Feed(const char *buffer, DWORD dwLen, std::vector<char> &handshakeOut, std::vector<char> &plainText)
+{
+	if (IsClosed())
+	{
+		return false;
+	}
+
+	m_inBuffer.insert(m_inBuffer.end(), buffer, buffer + dwLen);
+
+	if (TLS_SESSION_STATE::TLS_STATE_HANDSHAKE == m_state)
+	{
+		if (!DoHandshake(handshakeOut))
+		{
+			m_state = TLS_SESSION_STATE::TLS_STATE_CLOSED;
+			return false;
+		}
+	}
+
+	// 握手完成后，与最后一个握手消息一同到达的应用数据也需要解密
+	if (TLS_SESSION_STATE::TLS_STATE_ESTABLISHED == m_state && !m_inBuffer.empty())
+	{
+		if (!DoDecrypt(plainText))
+		{
+			m_state = TLS_SESSION_STATE::TLS_STATE_CLOSED;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool IOTlsSession::DoHandshake(std::vector<char> &handshakeOut)
+{
+	CredHandle *pCredentials = m_pCredentials ? m_pCredentials->GetHandle() : nullptr;
+	if (!pCredentials)
+	{
+		m_lastStatus = SEC_E_NO_CREDENTIALS;
+		return false;
+	}
+
+	while (!m_inBuffer.empty())
+	{
+		SecBuffer inBuffers[2];
+		inBuffers[0].BufferType = SECBUFFER_TOKEN;
+		inBuffers[0].cbBuffer = (ULONG)m_inBuffer.size();
+		inBuffers[0].pvBuffer = m_inBuffer.data();
+		inBuffers[1].BufferType = SECBUFFER_EMPTY;
+		inBuffers[1].cbBuffer = 0;
+		inBuffers[1].pvBuffer = nullptr;
+
+		SecBuffer outBuffers[1];
+		outBuffers[0].BufferType = SECBUFFER_TOKEN;
+		outBuffers[0].cbBuffer = 0;
+		outBuffers[0].pvBuffer = nullptr;
+
+		SecBufferDesc inBufferDesc = { SECBUFFER_VERSION, 2, inBuffers };
+		SecBufferDesc outBufferDesc = { SECBUFFER_VERSION, 1, outBuffers };
+
+		ULONG ulContextAttr = 0;
+		TimeStamp tsExpiry;
+		m_lastStatus = ::AcceptSecurityContext(
+			pCredentials,
+			m_bHasContext ? &m_hContext : nullptr,
+			&inBufferDesc,
+			TLS_ASC_REQ_FLAGS,
+			0,
+			m_bHasContext ? nullptr : &m_hContext,
+			&outBufferDesc,
+			&ulContextAttr,
+			&tsExpiry);
+
+		// 记录不完整，等待更多数据到达
+		if (SEC_E_INCOMPLETE_MESSAGE == m_lastStatus)
+		{
+			return true;
+		}
+
+		if (SEC_E_OK == m_lastStatus || SEC_I_CONTINUE_NEEDED == m_lastStatus)
+		{
+			m_bHasContext = true;
+		}
+
+		if (outBuffers[0].pvBuffer)
+		{
+			const char *pToken = static_cast<const char *>(outBuffers[0].pvBuffer);
+			handshakeOut.insert(handshakeOut.end(), pToken, pToken + outBuffers[0].cbBuffer);
+			::FreeContextBuffer(outBuffers[0].pvBuffer);
+		}
+
+		if (SEC_E_OK != m_lastStatus && SEC_I_CONTINUE_NEEDED != m_lastStatus)
+		{
+			return false;
+		}
+
+		KeepExtra(SECBUFFER_EXTRA == inBuffers[1].BufferType ? inBuffers[1].cbBuffer : 0);
+
+		if (SEC_E_OK == m_lastStatus)
+		{
+			m_lastStatus = ::QueryContextAttributesW(&m_hContext, SECPKG_ATTR_STREAM_SIZES, &m_streamSizes);
+			if (SEC_E_OK != m_lastStatus)
+			{
+				return false;
+			}
+
+			m_state = TLS_SESSION_STATE::TLS_STATE_ESTABLISHED;
+			return true;
+		}
+	}
+
+	return true;
+}
+
+bool IOTlsSession::DoDecrypt(std::vector<char> &plainText)
+{
+	while (!m_inBuffer.empty())
+	{
+		SecBuffer buffers[4];
+		buffers[0].BufferType = SECBUFFER_DATA;
+		buffers[0].cbBuffer = (ULONG)m_inBuffer.size();
+		buffers[0].pvBuffer = m_inBuffer.data();
+		for (int index = 1; index < 4; ++index)
+		{
+			buffers[index].BufferType = SECBUFFER_EMPTY;
+			buffers[index].cbBuffer = 0;
+			buffers[index].pvBuffer = nullptr;
+		}
+
+		SecBufferDesc bufferDesc = { SECBUFFER_VERSION, 4, buffers };
+
+		// 原地解密，明文位于m_inBuffer内部
+		m_lastStatus = ::DecryptMessage(&m_hContext, &bufferDesc, 0, nullptr);
+		if (SEC_E_INCOMPLETE_MESSAGE == m_lastStatus)
+		{
+			return true;
+		}
+
+		// 对端发送close_notify，或请求重新协商(不支持)
+		if (SEC_E_OK != m_lastStatus)
+		{
+			return false;
+		}
+
+		DWORD dwExtraLen = 0;
+		for (int index = 1; index < 4; ++index)
+		{
+			if (SECBUFFER_DATA == buffers[index].BufferType && buffers[index].cbBuffer)
+			{
+				const char *pData = static_cast<const char *>(buffers[index].pvBuffer);
+				plainText.insert(plainText.end(), pData, pData + buffers[index].cbBuffer);
+			}
+			else if (SECBUFFER_EXTRA == buffers[index].BufferType)
+			{
+				dwExtraLen = buffers[index].cbBuffer;
+			}
+		}
+
+		KeepExtra(dwExtraLen);
+	}
+
+	return true;
+}
+
+void IOTlsSession::KeepExtra(DWORD dwExtraLen)
+{
+	// SECBUFFER_EXTRA总是位于输入数据的末尾
+	if (dwExtraLen > 0 && dwExtraLen < m_inBuffer.size())
+	{
+		::memmove(m_inBuffer.data(), m_inBuffer.data() + m_inBuffer.size() - dwExtraLen, dwExtraLen);
+	}
+	m_inBuffer.resize(dwExtraLen);
+}
+
+bool IOTlsSession::Encrypt(const char *buffer, DWORD dwLen, char *pOutBuffer, DWORD dwOutSize, DWORD &dwOutLen)
+{
+	dwOutLen = 0;
+	if (!IsEstablished() || dwLen > GetMaxPlainChunk(dwOutSize))
+	{
+		return false;
+	}
+
+	::memcpy_s(pOutBuffer + m_streamSizes.cbHeader, dwOutSize - m_streamSizes.cbHeader, buffer, dwLen);
+
+	SecBuffer buffers[4];
+	buffers[0].BufferType = SECBUFFER_STREAM_HEADER;
+	buffers[0].cbBuffer = m_streamSizes.cbHeader;
+	buffers[0].pvBuffer = pOutBuffer;
+	buffers[1].BufferType = SECBUFFER_DATA;
+	buffers[1].cbBuffer = dwLen;
+	buffers[1].pvBuffer = pOutBuffer + m_streamSizes.cbHeader;
+	buffers[2].BufferType = SECBUFFER_STREAM_TRAILER;
+	buffers[2].cbBuffer = m_streamSizes.cbTrailer;
+	buffers[2].pvBuffer = pOutBuffer + m_streamSizes.cbHeader + dwLen;
+	buffers[3].BufferType = SECBUFFER_EMPTY;
+	buffers[3].cbBuffer = 0;
+	buffers[3].pvBuffer = nullptr;
+
+	SecBufferDesc bufferDesc = { SECBUFFER_VERSION, 4, buffers };
+	m_lastStatus = ::EncryptMessage(&m_hContext, 0, &bufferDesc, 0);
+	if (SEC_E_OK != m_lastStatus)
+	{
+		return false;
+	}
+
+	dwOutLen = buffers[0].cbBuffer + buffers[1].cbBuffer + buffers[2].cbBuffer;
+	return true;
+}
+
+DWORD IOTlsSession::GetMaxPlainChunk(DWORD dwBufferSize) const
+{
+	DWORD dwOverhead = m_streamSizes.cbHeader + m_streamSizes.cbTrailer;
+	if (!IsEstablished() || dwBufferSize <= dwOverhead)
+	{
+		return 0;
+	}
+
+	DWORD dwChunk = dwBufferSize - dwOverhead;
+	return (dwChunk < m_streamSizes.cbMaximumMessage) ? dwChunk : m_streamSizes.cbMaximumMessage;
+}
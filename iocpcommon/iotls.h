@@ -0,0 +1,118 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOTLS_H_
+#define _TINY_IOCP_IOCPCOMMON_IOTLS_H_
+
+#ifndef SECURITY_WIN32
+#define SECURITY_WIN32
+#endif
+
+#include <Windows.h>
+#include <wincrypt.h>
+#include <sspi.h>
+#include <schannel.h>
+#include <string>
+#include <vector>
+#include "iolock.h"
+
+//	TLS会话状态
+enum class TLS_SESSION_STATE
+{
+	TLS_STATE_HANDSHAKE = 0,	// 握手中
+	TLS_STATE_ESTABLISHED,		// 握手完成，可以收发应用数据
+	TLS_STATE_CLOSED,			// 对端发送close_notify或发生错误
+};
+
+// 服务端TLS凭据，从本机证书库(LocalMachine\MY)中按主题名加载证书
+// 所有连接共享同一份凭据
+class IOTlsCredentials
+{
+public:
+
+	IOTlsCredentials();
+	~IOTlsCredentials();
+
+public:
+
+	bool Init(const std::string &certSubject);
+	void UnInit();
+
+	CredHandle* GetHandle()
+	{
+		return m_bValid ? &m_hCredentials : nullptr;
+	}
+
+private:
+
+	IOTlsCredentials(const IOTlsCredentials&) = delete;
+	IOTlsCredentials& operator= (const IOTlsCredentials&) = delete;
+
+private:
+
+	CredHandle m_hCredentials;		// Schannel凭据句柄
+	bool m_bValid;					// 凭据句柄是否有效
+	HCERTSTORE m_hCertStore;		// 证书库
+	PCCERT_CONTEXT m_pCertContext;	// 服务端证书
+};
+
+// 每个连接的TLS会话，位于recv/send路径与上层回调之间
+// 收到的密文通过Feed解出明文(握手阶段产生需原样发给对端的握手数据)，发送的明文通过Encrypt加密
+// 会话本身不是线程安全的，调用者需持有GetLock返回的锁，以保证记录序号与发送顺序一致
+class IOTlsSession
+{
+public:
+
+	explicit IOTlsSession(IOTlsCredentials *pCredentials);
+	~IOTlsSession();
+
+public:
+
+	// 处理收到的密文，返回false表示会话已关闭或出错，需关闭连接
+	bool Feed(const char *buffer, DWORD dwLen, std::vector<char> &handshakeOut, std::vector<char> &plainText);
+
+	// 将明文加密为一条TLS记录写入pOutBuffer，dwLen不能超过GetMaxPlainChunk
+	bool Encrypt(const char *buffer, DWORD dwLen, char *pOutBuffer, DWORD dwOutSize, DWORD &dwOutLen);
+
+	// 在大小为dwBufferSize的输出缓冲区中可以容纳的最大明文长度
+	DWORD GetMaxPlainChunk(DWORD dwBufferSize) const;
+
+	bool IsEstablished() const
+	{
+		return TLS_SESSION_STATE::TLS_STATE_ESTABLISHED == m_state;
+	}
+
+	bool IsClosed() const
+	{
+		return TLS_SESSION_STATE::TLS_STATE_CLOSED == m_state;
+	}
+
+	SECURITY_STATUS GetLastStatus() const
+	{
+		return m_lastStatus;
+	}
+
+	EngineLock& GetLock()
+	{
+		return m_lock;
+	}
+
+private:
+
+	bool DoHandshake(std::vector<char> &handshakeOut);
+	bool DoDecrypt(std::vector<char> &plainText);
+	void KeepExtra(DWORD dwExtraLen);
+
+	IOTlsSession(const IOTlsSession&) = delete;
+	IOTlsSession& operator= (const IOTlsSession&) = delete;
+
+private:
+
+	IOTlsCredentials *m_pCredentials;
+	CtxtHandle m_hContext;					// Schannel安全上下文
+	bool m_bHasContext;						// 安全上下文是否已建立
+	TLS_SESSION_STATE m_state;				// 会话状态
+	SECURITY_STATUS m_lastStatus;			// 最近一次SSPI调用的返回值
+	SecPkgContext_StreamSizes m_streamSizes;// 记录头/尾及最大记录长度
+	std::vector<char> m_inBuffer;			// 尚未处理完的密文(TLS记录可能跨越多次recv)
+	EngineLock m_lock;
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOTLS_H_
@@ -0,0 +1,194 @@
+#include "iotrace.h"
+
+// 事件在Chrome trace中的名称与阶段(B/E为区间的开始/结束，i为瞬时事件)
+struct IOTraceEventInfo
+{
+	const char *szName;
+	char chPhase;
+};
+
+static const IOTraceEventInfo s_traceEventInfo[(int)TRACE_EVENT_TYPE::TRACE_EVENT_TYPE_NUM] =
+{
+	{ "none",			'i' },
+	{ "post accept",	'i' },
+	{ "post recv",		'i' },
+	{ "post send",		'i' },
+	{ "wait",			'B' },
+	{ "wait",			'E' },
+	{ "OnRecv",			'B' },
+	{ "OnRecv",			'E' },
+	{ "OnSend",			'B' },
+	{ "OnSend",			'E' },
+	{ "pool alloc",		'B' },
+	{ "pool alloc",		'E' },
+	{ "close",			'i' },
+};
+
+// 线程退出时归还环形缓冲区，其中的事件在被新线程复用前仍可导出
+struct IOTraceThreadRing
+{
+	IOTraceRing *pRing;
+	bool bAcquired;
+
+	~IOTraceThreadRing()
+	{
+		if (pRing)
+		{
+			::InterlockedExchange(&pRing->nInUse, 0);
+		}
+	}
+};
+
+static thread_local IOTraceThreadRing t_traceRing = { nullptr, false };
+
+IOTracer::IOTracer()
+	: m_nEnabled(1)
+	, m_nRingCount(0)
+{
+	for (int index = 0; index < MAX_TRACE_RINGS; ++index)
+	{
+		m_rings[index] = nullptr;
+	}
+
+	LARGE_INTEGER now;
+	::QueryPerformanceCounter(&now);
+	m_llBaseQpc = now.QuadPart;
+	m_ullBaseTsc = __rdtsc();
+}
+
+IOTracer::~IOTracer()
+{
+	for (int index = 0; index < MAX_TRACE_RINGS; ++index)
+	{
+		if (m_rings[index])
+		{
+			::VirtualFree(m_rings[index], 0, MEM_RELEASE);
+			m_rings[index] = nullptr;
+		}
+	}
+}
+
+IOTraceRing* IOTracer::GetThreadRing()
+{
+	IOTraceThreadRing &threadRing = t_traceRing;
+	if (!threadRing.bAcquired)
+	{
+		threadRing.bAcquired = true;
+		threadRing.pRing = AcquireRing();
+	}
+	return threadRing.pRing;
+}
+
+IOTraceRing* IOTracer::AcquireRing()
+{
+	// 优先复用已退出线程的环形缓冲区
+	LONG nRingCount = (m_nRingCount < MAX_TRACE_RINGS) ? m_nRingCount : MAX_TRACE_RINGS;
+	for (LONG index = 0; index < nRingCount; ++index)
+	{
+		IOTraceRing *pRing = m_rings[index];
+		if (pRing && 0 == ::InterlockedCompareExchange(&pRing->nInUse, 1, 0))
+		{
+			pRing->dwThreadId = ::GetCurrentThreadId();
+			pRing->nHead = 0;
+			return pRing;
+		}
+	}
+
+	LONG nIndex = ::InterlockedIncrement(&m_nRingCount) - 1;
+	if (nIndex >= MAX_TRACE_RINGS)
+	{
+		return nullptr;
+	}
+
+	IOTraceRing *pRing = static_cast<IOTraceRing *>(
+		::VirtualAlloc(nullptr, sizeof(IOTraceRing), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+	if (!pRing)
+	{
+		return nullptr;
+	}
+
+	pRing->dwThreadId = ::GetCurrentThreadId();
+	pRing->nInUse = 1;
+	pRing->nHead = 0;
+	m_rings[nIndex] = pRing;
+	return pRing;
+}
+
+bool IOTracer::Dump(FILE *pFile)
+{
+	if (!pFile)
+	{
+		return false;
+	}
+
+	// 以QPC校准TSC频率
+	LARGE_INTEGER frequency, now;
+	::QueryPerformanceFrequency(&frequency);
+	::QueryPerformanceCounter(&now);
+	ULONGLONG ullNowTsc = __rdtsc();
+
+	double dElapsedUs = (double)(now.QuadPart - m_llBaseQpc) * 1000000.0 / (double)frequency.QuadPart;
+	double dTscPerUs = (dElapsedUs > 0.0) ? (double)(ullNowTsc - m_ullBaseTsc) / dElapsedUs : 1.0;
+	if (dTscPerUs <= 0.0)
+	{
+		dTscPerUs = 1.0;
+	}
+
+	DWORD dwProcessId = ::GetCurrentProcessId();
+	bool bFirst = true;
+
+	::fprintf(pFile, "{\"traceEvents\":[\n");
+
+	LONG nRingCount = (m_nRingCount < MAX_TRACE_RINGS) ? m_nRingCount : MAX_TRACE_RINGS;
+	for (LONG nRing = 0; nRing < nRingCount; ++nRing)
+	{
+		const IOTraceRing *pRing = m_rings[nRing];
+		if (!pRing)
+		{
+			continue;
+		}
+
+		LONG64 nHead = pRing->nHead;
+		LONG64 nBegin = (nHead > TRACE_RING_SIZE) ? (nHead - TRACE_RING_SIZE) : 0;
+		for (LONG64 index = nBegin; index < nHead; ++index)
+		{
+			const IOTraceEvent &event = pRing->events[index & TRACE_RING_MASK];
+			if (event.wType >= (WORD)TRACE_EVENT_TYPE::TRACE_EVENT_TYPE_NUM)
+			{
+				continue;
+			}
+
+			const IOTraceEventInfo &info = s_traceEventInfo[event.wType];
+			double dTimestampUs = (double)(LONGLONG)(event.ullTimestamp - m_ullBaseTsc) / dTscPerUs;
+
+			::fprintf(pFile,
+				"%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%lu,\"tid\":%lu%s,\"args\":{\"conn\":%llu,\"value\":%lu}}",
+				bFirst ? "" : ",\n",
+				info.szName,
+				info.chPhase,
+				dTimestampUs,
+				dwProcessId,
+				pRing->dwThreadId,
+				('i' == info.chPhase) ? ",\"s\":\"t\"" : "",
+				event.ullConnId,
+				event.dwValue);
+			bFirst = false;
+		}
+	}
+
+	::fprintf(pFile, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	return true;
+}
+
+bool IOTracer::Dump(const char *szPath)
+{
+	FILE *pFile = nullptr;
+	if (0 != ::fopen_s(&pFile, szPath, "w") || !pFile)
+	{
+		return false;
+	}
+
+	bool result = Dump(pFile);
+	::fclose(pFile);
+	return result;
+}
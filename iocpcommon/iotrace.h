@@ -0,0 +1,115 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOTRACE_H_
+#define _TINY_IOCP_IOCPCOMMON_IOTRACE_H_
+
+#include <Windows.h>
+#include <intrin.h>
+#include <stdio.h>
+
+#define TRACE_RING_SIZE		(8192)					// 每个线程环形缓冲区的事件数，必须为2的幂
+#define TRACE_RING_MASK		(TRACE_RING_SIZE - 1)
+#define MAX_TRACE_RINGS		(256)					// 最多同时跟踪的线程数
+
+//	跟踪事件类型
+enum class TRACE_EVENT_TYPE
+{
+	TRACE_EVENT_NONE = 0,
+	TRACE_EVENT_POST_ACCEPT,	// 投递AcceptEx
+	TRACE_EVENT_POST_RECV,		// 投递WSARecv
+	TRACE_EVENT_POST_SEND,		// 投递WSASend
+	TRACE_EVENT_WAIT_BEGIN,		// 开始等待完成端口
+	TRACE_EVENT_WAIT_END,		// 取得完成包(dwValue为传输字节数)
+	TRACE_EVENT_RECV_BEGIN,		// OnRecv回调开始
+	TRACE_EVENT_RECV_END,		// OnRecv回调结束
+	TRACE_EVENT_SEND_BEGIN,		// OnSend回调开始
+	TRACE_EVENT_SEND_END,		// OnSend回调结束
+	TRACE_EVENT_POOL_BEGIN,		// 开始从重叠结构池分配(含等锁)
+	TRACE_EVENT_POOL_END,		// 重叠结构池分配结束
+	TRACE_EVENT_CLOSE,			// 关闭连接(dwValue为错误码)
+	TRACE_EVENT_TYPE_NUM,
+};
+
+// 紧凑的二进制事件，时间戳为TSC计数，导出时换算为微秒
+struct IOTraceEvent
+{
+	ULONGLONG ullTimestamp;
+	ULONGLONG ullConnId;
+	DWORD dwValue;
+	WORD wType;
+	WORD wReserved;
+};
+
+// 单个线程的无锁环形缓冲区，只有所属线程写入，写满后覆盖最旧的事件
+// 导出时其他线程并发读取，正在被覆盖的少量事件可能不一致，仅用于诊断
+struct IOTraceRing
+{
+	DWORD dwThreadId;				// 所属线程
+	volatile LONG nInUse;			// 所属线程是否仍存活，线程退出后可被新线程复用
+	volatile LONG64 nHead;			// 已写入的事件总数
+	IOTraceEvent events[TRACE_RING_SIZE];
+};
+
+// 常开的事件跟踪器，每个事件的开销为一次rdtsc与一次24字节写入
+// 通过Enable在运行时开关，Dump导出Chrome trace/Perfetto可直接加载的JSON
+class IOTracer
+{
+public:
+
+	static IOTracer& GetInstance()
+	{
+		static IOTracer s_tracer;
+		return s_tracer;
+	}
+
+	static void Record(TRACE_EVENT_TYPE type, ULONGLONG ullConnId = 0, DWORD dwValue = 0)
+	{
+		IOTracer &tracer = GetInstance();
+		if (!tracer.m_nEnabled)
+		{
+			return;
+		}
+
+		IOTraceRing *pRing = tracer.GetThreadRing();
+		if (!pRing)
+		{
+			return;
+		}
+
+		LONG64 nHead = pRing->nHead;
+		IOTraceEvent &event = pRing->events[nHead & TRACE_RING_MASK];
+		event.ullTimestamp = __rdtsc();
+		event.ullConnId = ullConnId;
+		event.dwValue = dwValue;
+		event.wType = (WORD)type;
+		pRing->nHead = nHead + 1;
+	}
+
+	void Enable(bool bEnable)
+	{
+		::InterlockedExchange(&m_nEnabled, bEnable ? 1 : 0);
+	}
+
+	// 导出所有线程的事件，格式为Chrome trace event JSON
+	bool Dump(FILE *pFile);
+	bool Dump(const char *szPath);
+
+private:
+
+	IOTracer();
+	~IOTracer();
+
+	IOTraceRing* GetThreadRing();
+	IOTraceRing* AcquireRing();
+
+	IOTracer(const IOTracer&) = delete;
+	IOTracer& operator= (const IOTracer&) = delete;
+
+private:
+
+	volatile LONG m_nEnabled;					// 是否记录事件
+	IOTraceRing * volatile m_rings[MAX_TRACE_RINGS];	// 已分配的环形缓冲区，进程退出前不释放
+	volatile LONG m_nRingCount;					// 已分配的环形缓冲区数量
+	LONGLONG m_llBaseQpc;						// 校准基准：QPC计数
+	ULONGLONG m_ullBaseTsc;						// 校准基准：TSC计数
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOTRACE_H_
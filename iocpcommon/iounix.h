@@ -0,0 +1,107 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOUNIX_H_
+#define _TINY_IOCP_IOCPCOMMON_IOUNIX_H_
+
+#include <WinSock2.h>
+#include <Windows.h>
+#include <afunix.h>
+#include <string>
+
+#define UNIX_ACCEPT_ADDR_SIZE	(sizeof(SOCKADDR_UN) + 16)	// AcceptEx为AF_UNIX地址预留的长度
+#define UNIX_PATH_SIZE			(sizeof(SOCKADDR_UN::sun_path))	// 路径名(含结尾0)的最大长度
+
+// AF_UNIX流式socket(Windows 10 1803起支持)的辅助函数
+// 同机对端经AF_UNIX通信不经过TCP/IP协议栈，绑定到完成端口后与TCP连接走同一套AcceptEx/WSARecv/WSASend流程
+// Windows的AF_UNIX不支持SCM_RIGHTS辅助数据：传递句柄时先按对端进程ID用DuplicateHandle复制到对端进程，
+// 再把复制得到的句柄值作为普通数据发送给对端
+class IOUnixSocket
+{
+public:
+
+	// 当前系统是否支持AF_UNIX
+	static bool IsSupported()
+	{
+		SOCKET sock = ::WSASocket(AF_UNIX, SOCK_STREAM, 0, NULL, 0, WSA_FLAG_OVERLAPPED);
+		if (INVALID_SOCKET == sock)
+		{
+			return false;
+		}
+		::closesocket(sock);
+		return true;
+	}
+
+	// 填充路径名地址，路径为空或超出sun_path长度时返回false
+	static bool FillAddress(const std::string &path, SOCKADDR_UN &addr, int &nAddrLen)
+	{
+		if (path.empty() || path.size() >= sizeof(addr.sun_path))
+		{
+			return false;
+		}
+
+		::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		::memcpy(addr.sun_path, path.c_str(), path.size());
+		nAddrLen = (int)sizeof(addr);
+		return true;
+	}
+
+	// 路径名socket在监听socket关闭后仍留在文件系统中，bind前与停止监听后需删除
+	// AF_UNIX的socket文件是重解析点，路径上是普通文件或目录时(配置错误)不删除，返回false，随后的bind会因路径已存在而失败
+	static bool RemoveSocketFile(const std::string &path)
+	{
+		if (path.empty())
+		{
+			return false;
+		}
+
+		DWORD dwAttributes = ::GetFileAttributesA(path.c_str());
+		if (INVALID_FILE_ATTRIBUTES == dwAttributes)
+		{
+			return (ERROR_FILE_NOT_FOUND == ::GetLastError());
+		}
+		if (!(dwAttributes & FILE_ATTRIBUTE_REPARSE_POINT) || (dwAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			return false;
+		}
+		return (FALSE != ::DeleteFileA(path.c_str()));
+	}
+
+	// 已连接socket的对端进程ID
+	static bool GetPeerProcessId(SOCKET sock, DWORD &dwProcessId)
+	{
+		ULONG ulProcessId = 0;
+		DWORD dwBytes = 0;
+		if (SOCKET_ERROR == ::WSAIoctl(
+			sock, SIO_AF_UNIX_GETPEERPID, nullptr, 0, &ulProcessId, sizeof(ulProcessId), &dwBytes, nullptr, nullptr))
+		{
+			return false;
+		}
+
+		dwProcessId = (DWORD)ulProcessId;
+		return true;
+	}
+
+	// 将本进程的句柄复制到对端进程，hPeerHandle只在对端进程中有效，由对端负责关闭
+	// 对端进程需允许本进程以PROCESS_DUP_HANDLE权限打开(同一用户下通常满足)
+	static bool DuplicateHandleToPeer(SOCKET sock, HANDLE hSource, HANDLE &hPeerHandle)
+	{
+		DWORD dwProcessId = 0;
+		if (!GetPeerProcessId(sock, dwProcessId))
+		{
+			return false;
+		}
+
+		HANDLE hPeerProcess = ::OpenProcess(PROCESS_DUP_HANDLE, FALSE, dwProcessId);
+		if (!hPeerProcess)
+		{
+			return false;
+		}
+
+		BOOL bRet = ::DuplicateHandle(
+			::GetCurrentProcess(), hSource, hPeerProcess, &hPeerHandle, 0, FALSE, DUPLICATE_SAME_ACCESS);
+		::CloseHandle(hPeerProcess);
+
+		return (FALSE != bRet);
+	}
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOUNIX_H_
@@ -0,0 +1,616 @@
+#include "iows.h"
+#include <bcrypt.h>
+#include <intrin.h>
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#define WS_CODEC_SSE2
+#endif
+
+#pragma comment(lib, "Bcrypt.lib")
+
+#define WS_HANDSHAKE_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+namespace
+{
+	inline bool IsControlOpcode(WS_OPCODE opcode)
+	{
+		return ((BYTE)opcode & 0x08) != 0;
+	}
+
+	inline bool IsValidCloseCode(WORD wCode)
+	{
+		return (wCode >= 1000 && wCode <= 1003) || (wCode >= 1007 && wCode <= 1011) || (wCode >= 3000 && wCode <= 4999);
+	}
+
+	// SHA-1算法句柄只打开一次，各线程共享(BCrypt算法句柄可并发使用)
+	BCRYPT_ALG_HANDLE GetSha1Algorithm()
+	{
+		static BCRYPT_ALG_HANDLE s_hAlgorithm = []() -> BCRYPT_ALG_HANDLE
+		{
+			BCRYPT_ALG_HANDLE hAlgorithm = NULL;
+			if (!BCRYPT_SUCCESS(::BCryptOpenAlgorithmProvider(&hAlgorithm, BCRYPT_SHA1_ALGORITHM, nullptr, 0)))
+			{
+				return NULL;
+			}
+			return hAlgorithm;
+		}();
+		return s_hAlgorithm;
+	}
+
+	void EncodeBase64(const BYTE *pData, DWORD dwLen, char *pOut)
+	{
+		static const char s_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+		DWORD index = 0;
+		for (; index + 3 <= dwLen; index += 3)
+		{
+			DWORD dwGroup = ((DWORD)pData[index] << 16) | ((DWORD)pData[index + 1] << 8) | pData[index + 2];
+			*pOut++ = s_alphabet[(dwGroup >> 18) & 0x3F];
+			*pOut++ = s_alphabet[(dwGroup >> 12) & 0x3F];
+			*pOut++ = s_alphabet[(dwGroup >> 6) & 0x3F];
+			*pOut++ = s_alphabet[dwGroup & 0x3F];
+		}
+
+		if (index < dwLen)
+		{
+			DWORD dwGroup = (DWORD)pData[index] << 16;
+			if (index + 1 < dwLen)
+			{
+				dwGroup |= (DWORD)pData[index + 1] << 8;
+			}
+			*pOut++ = s_alphabet[(dwGroup >> 18) & 0x3F];
+			*pOut++ = s_alphabet[(dwGroup >> 12) & 0x3F];
+			*pOut++ = (index + 1 < dwLen) ? s_alphabet[(dwGroup >> 6) & 0x3F] : '=';
+			*pOut++ = '=';
+		}
+		*pOut = '\0';
+	}
+}
+
+void IOWebSocketCodec::Unmask(char *pData, DWORD dwLen, const BYTE mask[4], DWORD dwMaskOffset)
+{
+	// 按偏移旋转掩码，使pData[0]对应mask[dwMaskOffset]，之后每4字节的相位相同
+	BYTE rotated[4];
+	for (DWORD index = 0; index < 4; ++index)
+	{
+		rotated[index] = mask[(dwMaskOffset + index) & 3];
+	}
+	UINT32 nMask32 = 0;
+	::memcpy(&nMask32, rotated, sizeof(nMask32));
+
+	DWORD index = 0;
+#ifdef WS_CODEC_SSE2
+	__m128i key = _mm_set1_epi32((int)nMask32);
+	for (; index + 64 <= dwLen; index += 64)
+	{
+		__m128i *p = (__m128i *)(pData + index);
+		__m128i v0 = _mm_loadu_si128(p);
+		__m128i v1 = _mm_loadu_si128(p + 1);
+		__m128i v2 = _mm_loadu_si128(p + 2);
+		__m128i v3 = _mm_loadu_si128(p + 3);
+		_mm_storeu_si128(p, _mm_xor_si128(v0, key));
+		_mm_storeu_si128(p + 1, _mm_xor_si128(v1, key));
+		_mm_storeu_si128(p + 2, _mm_xor_si128(v2, key));
+		_mm_storeu_si128(p + 3, _mm_xor_si128(v3, key));
+	}
+	for (; index + 16 <= dwLen; index += 16)
+	{
+		__m128i *p = (__m128i *)(pData + index);
+		_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), key));
+	}
+#endif
+	for (; index + 4 <= dwLen; index += 4)
+	{
+		UINT32 nValue = 0;
+		::memcpy(&nValue, pData + index, sizeof(nValue));
+		nValue ^= nMask32;
+		::memcpy(pData + index, &nValue, sizeof(nValue));
+	}
+	for (; index < dwLen; ++index)
+	{
+		pData[index] ^= rotated[index & 3];
+	}
+}
+
+void IOWebSocketCodec::UnmaskScalar(char *pData, DWORD dwLen, const BYTE mask[4], DWORD dwMaskOffset)
+{
+	for (DWORD index = 0; index < dwLen; ++index)
+	{
+		pData[index] ^= mask[(dwMaskOffset + index) & 3];
+	}
+}
+
+bool IOWebSocketCodec::IsValidUtf8(const char *pData, DWORD dwLen)
+{
+	const BYTE *p = (const BYTE *)pData;
+	const BYTE *pEnd = p + dwLen;
+	while (p < pEnd)
+	{
+#ifdef WS_CODEC_SSE2
+		// 文本消息绝大多数为ASCII，每次跳过16个最高位均为0的字节
+		while (pEnd - p >= 16 && 0 == _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p)))
+		{
+			p += 16;
+		}
+		if (p >= pEnd)
+		{
+			break;
+		}
+#endif
+		BYTE c = *p;
+		if (c < 0x80)
+		{
+			++p;
+			continue;
+		}
+
+		DWORD dwFollow = 0;
+		DWORD dwCodePoint = 0;
+		if (c >= 0xC2 && c <= 0xDF)
+		{
+			dwFollow = 1;
+			dwCodePoint = c & 0x1F;
+		}
+		else if ((c & 0xF0) == 0xE0)
+		{
+			dwFollow = 2;
+			dwCodePoint = c & 0x0F;
+		}
+		else if (c >= 0xF0 && c <= 0xF4)
+		{
+			dwFollow = 3;
+			dwCodePoint = c & 0x07;
+		}
+		else
+		{
+			return false;
+		}
+
+		if ((DWORD)(pEnd - p) <= dwFollow)
+		{
+			return false;
+		}
+		for (DWORD index = 1; index <= dwFollow; ++index)
+		{
+			if ((p[index] & 0xC0) != 0x80)
+			{
+				return false;
+			}
+			dwCodePoint = (dwCodePoint << 6) | (p[index] & 0x3F);
+		}
+
+		// 过长编码、代理区及超出Unicode范围的码点均为非法
+		if ((2 == dwFollow && (dwCodePoint < 0x800 || (dwCodePoint >= 0xD800 && dwCodePoint <= 0xDFFF))) ||
+			(3 == dwFollow && (dwCodePoint < 0x10000 || dwCodePoint > 0x10FFFF)))
+		{
+			return false;
+		}
+		p += dwFollow + 1;
+	}
+	return true;
+}
+
+DWORD IOWebSocketCodec::WriteFrameHeader(char *pOutBuffer, WS_OPCODE opcode, ULONGLONG ullPayloadLen)
+{
+	BYTE *pHeader = (BYTE *)pOutBuffer;
+	pHeader[0] = (BYTE)(0x80 | (BYTE)opcode);
+	if (ullPayloadLen < 126)
+	{
+		pHeader[1] = (BYTE)ullPayloadLen;
+		return 2;
+	}
+
+	if (ullPayloadLen <= 0xFFFF)
+	{
+		pHeader[1] = 126;
+		pHeader[2] = (BYTE)(ullPayloadLen >> 8);
+		pHeader[3] = (BYTE)ullPayloadLen;
+		return 4;
+	}
+
+	pHeader[1] = 127;
+	for (DWORD index = 0; index < 8; ++index)
+	{
+		pHeader[2 + index] = (BYTE)(ullPayloadLen >> (8 * (7 - index)));
+	}
+	return 10;
+}
+
+bool IOWebSocketCodec::ComputeAccept(const char *pKey, DWORD dwKeyLen, char *pAccept)
+{
+	BCRYPT_ALG_HANDLE hAlgorithm = GetSha1Algorithm();
+	if (!hAlgorithm)
+	{
+		return false;
+	}
+
+	BCRYPT_HASH_HANDLE hHash = NULL;
+	if (!BCRYPT_SUCCESS(::BCryptCreateHash(hAlgorithm, &hHash, nullptr, 0, nullptr, 0, 0)))
+	{
+		return false;
+	}
+
+	BYTE digest[20];
+	bool result =
+		BCRYPT_SUCCESS(::BCryptHashData(hHash, (PUCHAR)pKey, dwKeyLen, 0)) &&
+		BCRYPT_SUCCESS(::BCryptHashData(hHash, (PUCHAR)WS_HANDSHAKE_GUID, sizeof(WS_HANDSHAKE_GUID) - 1, 0)) &&
+		BCRYPT_SUCCESS(::BCryptFinishHash(hHash, digest, sizeof(digest), 0));
+	::BCryptDestroyHash(hHash);
+
+	if (result)
+	{
+		EncodeBase64(digest, sizeof(digest), pAccept);
+	}
+	return result;
+}
+
+void IOWebSocketCodec::Benchmark(FILE *pFile)
+{
+	if (!pFile)
+	{
+		return;
+	}
+
+	static const DWORD s_payloadSizes[] = { 16, 125, 1024, 4096, 65536, 1024 * 1024 };
+	static const ULONGLONG s_ullBytesPerRun = 256ULL * 1024 * 1024;
+	const BYTE mask[4] = { 0x37, 0xFA, 0x21, 0x3D };
+
+	LARGE_INTEGER frequency;
+	::QueryPerformanceFrequency(&frequency);
+
+	// 帧载荷从非对齐的位置开始(帧头长度为2/4/10字节加4字节掩码)
+	std::vector<char> buffer(s_payloadSizes[sizeof(s_payloadSizes) / sizeof(s_payloadSizes[0]) - 1] + 16, 'x');
+	char *pPayload = buffer.data() + 6;
+
+	::fprintf(pFile, "websocket unmask: payload bytes, scalar MB/s, simd MB/s, speedup\n");
+	for (size_t nSize = 0; nSize < sizeof(s_payloadSizes) / sizeof(s_payloadSizes[0]); ++nSize)
+	{
+		DWORD dwLen = s_payloadSizes[nSize];
+		ULONGLONG ullRuns = s_ullBytesPerRun / dwLen;
+		double dMBps[2] = { 0.0, 0.0 };
+
+		for (int nImpl = 0; nImpl < 2; ++nImpl)
+		{
+			LARGE_INTEGER start, end;
+			::QueryPerformanceCounter(&start);
+			for (ULONGLONG ullRun = 0; ullRun < ullRuns; ++ullRun)
+			{
+				if (0 == nImpl)
+				{
+					UnmaskScalar(pPayload, dwLen, mask, (DWORD)ullRun);
+				}
+				else
+				{
+					Unmask(pPayload, dwLen, mask, (DWORD)ullRun);
+				}
+			}
+			::QueryPerformanceCounter(&end);
+
+			double dSeconds = (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+			dMBps[nImpl] = dSeconds > 0.0 ? (double)(ullRuns * dwLen) / (1024.0 * 1024.0) / dSeconds : 0.0;
+		}
+
+		::fprintf(pFile, "websocket unmask: %8lu, %10.1f, %10.1f, %6.2fx\n",
+			dwLen, dMBps[0], dMBps[1], dMBps[0] > 0.0 ? dMBps[1] / dMBps[0] : 0.0);
+	}
+
+	// 防止去掩码的结果被视为无用而优化掉
+	::fprintf(pFile, "websocket unmask: checksum %d\n", (int)pPayload[0]);
+}
+
+IOWebSocketSession::IOWebSocketSession()
+	: m_bBuffered(false)
+	, m_pData(nullptr)
+	, m_dwDataLen(0)
+	, m_dwOffset(0)
+	, m_state(WS_FRAME_STATE::WS_FRAME_HEADER)
+	, m_frameOpcode(WS_OPCODE::WS_OPCODE_CONTINUATION)
+	, m_bFin(false)
+	, m_ullRemaining(0)
+	, m_dwMaskOffset(0)
+	, m_bFragmented(false)
+	, m_messageOpcode(WS_OPCODE::WS_OPCODE_BINARY)
+	, m_bDelivered(false)
+	, m_bStopped(false)
+	, m_wCloseCode(WS_CLOSE_NORMAL)
+	, m_bOpen(false)
+	, m_bCloseSent(false)
+	, m_sendLock("IOWebSocketSession")
+{
+	::memset(m_mask, 0, sizeof(m_mask));
+	m_payload.opcode = WS_OPCODE::WS_OPCODE_BINARY;
+	m_payload.pData = nullptr;
+	m_payload.dwLen = 0;
+}
+
+void IOWebSocketSession::Feed(char *buffer, DWORD dwLen)
+{
+	m_dwOffset = 0;
+
+	// 已收到关闭帧，之后的数据直接丢弃
+	if (m_bStopped)
+	{
+		m_bBuffered = false;
+		m_pData = nullptr;
+		m_dwDataLen = 0;
+		return;
+	}
+
+	if (m_buffer.empty())
+	{
+		m_bBuffered = false;
+		m_pData = buffer;
+		m_dwDataLen = dwLen;
+	}
+	else
+	{
+		m_buffer.insert(m_buffer.end(), buffer, buffer + dwLen);
+		m_bBuffered = true;
+		m_pData = m_buffer.data();
+		m_dwDataLen = (DWORD)m_buffer.size();
+	}
+}
+
+void IOWebSocketSession::EndFeed()
+{
+	if (m_bStopped)
+	{
+		std::vector<char>().swap(m_buffer);
+		std::vector<char>().swap(m_message);
+	}
+	else if (m_bBuffered)
+	{
+		m_buffer.erase(m_buffer.begin(), m_buffer.begin() + m_dwOffset);
+	}
+	else if (m_dwOffset < m_dwDataLen)
+	{
+		m_buffer.assign(m_pData + m_dwOffset, m_pData + m_dwDataLen);
+	}
+
+	m_bBuffered = false;
+	m_pData = nullptr;
+	m_dwDataLen = 0;
+	m_dwOffset = 0;
+}
+
+WS_PARSE_RESULT IOWebSocketSession::Next()
+{
+	if (m_bDelivered)
+	{
+		m_message.clear();
+		m_bDelivered = false;
+	}
+
+	while (!m_bStopped)
+	{
+		char *pCursor = m_pData + m_dwOffset;
+		DWORD dwAvailable = m_dwDataLen - m_dwOffset;
+
+		if (WS_FRAME_STATE::WS_FRAME_HEADER == m_state)
+		{
+			WS_PARSE_RESULT result = ParseHeader((const BYTE *)pCursor, dwAvailable);
+			if (WS_PARSE_RESULT::WS_PARSE_MESSAGE != result)
+			{
+				return result;
+			}
+			continue;
+		}
+
+		// 控制帧载荷很短，收齐后一次处理
+		if (IsControlOpcode(m_frameOpcode))
+		{
+			if (dwAvailable < m_ullRemaining)
+			{
+				return WS_PARSE_RESULT::WS_PARSE_INCOMPLETE;
+			}
+
+			m_dwOffset += (DWORD)m_ullRemaining;
+			m_state = WS_FRAME_STATE::WS_FRAME_HEADER;
+			WS_PARSE_RESULT result = DeliverControl(pCursor);
+			if (WS_PARSE_RESULT::WS_PARSE_INCOMPLETE == result)
+			{
+				continue;
+			}
+			return result;
+		}
+
+		// 未分片且载荷完整位于本次数据中：在接收缓冲区上原地去掩码后直接交给上层
+		if (m_bFin && !m_bFragmented && m_message.empty() && dwAvailable >= m_ullRemaining)
+		{
+			DWORD dwLen = (DWORD)m_ullRemaining;
+			IOWebSocketCodec::Unmask(pCursor, dwLen, m_mask, 0);
+			m_dwOffset += dwLen;
+			m_ullRemaining = 0;
+			m_state = WS_FRAME_STATE::WS_FRAME_HEADER;
+			m_messageOpcode = m_frameOpcode;
+			return DeliverMessage(pCursor, dwLen);
+		}
+
+		// 分片或跨越recv边界的载荷：已收到的部分去掩码后追加到消息缓冲区
+		DWORD dwChunk = (dwAvailable < m_ullRemaining) ? dwAvailable : (DWORD)m_ullRemaining;
+		if (0 == dwChunk && m_ullRemaining)
+		{
+			return WS_PARSE_RESULT::WS_PARSE_INCOMPLETE;
+		}
+
+		IOWebSocketCodec::Unmask(pCursor, dwChunk, m_mask, m_dwMaskOffset);
+		m_message.insert(m_message.end(), pCursor, pCursor + dwChunk);
+		m_dwOffset += dwChunk;
+		m_ullRemaining -= dwChunk;
+		m_dwMaskOffset = (m_dwMaskOffset + dwChunk) & 3;
+		if (m_ullRemaining)
+		{
+			return WS_PARSE_RESULT::WS_PARSE_INCOMPLETE;
+		}
+
+		m_state = WS_FRAME_STATE::WS_FRAME_HEADER;
+		if (!m_bFin)
+		{
+			m_bFragmented = true;
+			continue;
+		}
+
+		m_bFragmented = false;
+		m_bDelivered = true;
+		return DeliverMessage(m_message.data(), (DWORD)m_message.size());
+	}
+
+	return WS_PARSE_RESULT::WS_PARSE_INCOMPLETE;
+}
+
+WS_PARSE_RESULT IOWebSocketSession::ParseHeader(const BYTE *pHeader, DWORD dwAvailable)
+{
+	if (dwAvailable < 2)
+	{
+		return WS_PARSE_RESULT::WS_PARSE_INCOMPLETE;
+	}
+
+	bool bMasked = (pHeader[1] & 0x80) != 0;
+	BYTE nLen7 = pHeader[1] & 0x7F;
+	DWORD dwHeaderLen = 2 + ((126 == nLen7) ? 2 : ((127 == nLen7) ? 8 : 0)) + (bMasked ? 4 : 0);
+	if (dwAvailable < dwHeaderLen)
+	{
+		return WS_PARSE_RESULT::WS_PARSE_INCOMPLETE;
+	}
+
+	// 客户端发送的帧必须带掩码，未协商扩展时RSV位必须为0
+	if (!bMasked || (pHeader[0] & 0x70))
+	{
+		return Fail(WS_CLOSE_PROTOCOL_ERROR);
+	}
+
+	ULONGLONG ullPayloadLen = nLen7;
+	const BYTE *p = pHeader + 2;
+	if (126 == nLen7)
+	{
+		ullPayloadLen = ((ULONGLONG)p[0] << 8) | p[1];
+		p += 2;
+	}
+	else if (127 == nLen7)
+	{
+		ullPayloadLen = 0;
+		for (DWORD index = 0; index < 8; ++index)
+		{
+			ullPayloadLen = (ullPayloadLen << 8) | p[index];
+		}
+		p += 8;
+
+		// 64位长度的最高位必须为0
+		if (ullPayloadLen >> 63)
+		{
+			return Fail(WS_CLOSE_PROTOCOL_ERROR);
+		}
+	}
+
+	bool bFin = (pHeader[0] & 0x80) != 0;
+	WS_OPCODE opcode = (WS_OPCODE)(pHeader[0] & 0x0F);
+	switch (opcode)
+	{
+	case WS_OPCODE::WS_OPCODE_CLOSE:
+	case WS_OPCODE::WS_OPCODE_PING:
+	case WS_OPCODE::WS_OPCODE_PONG:
+		// 控制帧不能分片，可以插在分片消息之间
+		if (!bFin || ullPayloadLen > WS_MAX_CONTROL_PAYLOAD)
+		{
+			return Fail(WS_CLOSE_PROTOCOL_ERROR);
+		}
+		break;
+	case WS_OPCODE::WS_OPCODE_CONTINUATION:
+		if (!m_bFragmented)
+		{
+			return Fail(WS_CLOSE_PROTOCOL_ERROR);
+		}
+		break;
+	case WS_OPCODE::WS_OPCODE_TEXT:
+	case WS_OPCODE::WS_OPCODE_BINARY:
+		if (m_bFragmented)
+		{
+			return Fail(WS_CLOSE_PROTOCOL_ERROR);
+		}
+		m_messageOpcode = opcode;
+		break;
+	default:
+		return Fail(WS_CLOSE_PROTOCOL_ERROR);
+	}
+
+	if (!IsControlOpcode(opcode) && ullPayloadLen > WS_MAX_MESSAGE_SIZE - m_message.size())
+	{
+		return Fail(WS_CLOSE_TOO_BIG);
+	}
+
+	::memcpy(m_mask, p, sizeof(m_mask));
+	m_frameOpcode = opcode;
+	m_bFin = bFin;
+	m_ullRemaining = ullPayloadLen;
+	m_dwMaskOffset = 0;
+	m_dwOffset += dwHeaderLen;
+	m_state = WS_FRAME_STATE::WS_FRAME_PAYLOAD;
+
+	return WS_PARSE_RESULT::WS_PARSE_MESSAGE;
+}
+
+WS_PARSE_RESULT IOWebSocketSession::DeliverControl(char *pPayload)
+{
+	DWORD dwLen = (DWORD)m_ullRemaining;
+	IOWebSocketCodec::Unmask(pPayload, dwLen, m_mask, 0);
+	m_ullRemaining = 0;
+
+	m_payload.opcode = m_frameOpcode;
+	m_payload.pData = pPayload;
+	m_payload.dwLen = dwLen;
+
+	switch (m_frameOpcode)
+	{
+	case WS_OPCODE::WS_OPCODE_PING:
+		return WS_PARSE_RESULT::WS_PARSE_PING;
+	case WS_OPCODE::WS_OPCODE_CLOSE:
+		// 载荷为2字节状态码加UTF-8原因
+		if (1 == dwLen)
+		{
+			return Fail(WS_CLOSE_PROTOCOL_ERROR);
+		}
+		if (0 == dwLen)
+		{
+			m_wCloseCode = WS_CLOSE_NO_STATUS;
+		}
+		else
+		{
+			m_wCloseCode = (WORD)(((BYTE)pPayload[0] << 8) | (BYTE)pPayload[1]);
+			if (!IsValidCloseCode(m_wCloseCode))
+			{
+				return Fail(WS_CLOSE_PROTOCOL_ERROR);
+			}
+			if (!IOWebSocketCodec::IsValidUtf8(pPayload + 2, dwLen - 2))
+			{
+				return Fail(WS_CLOSE_INVALID_DATA);
+			}
+		}
+		m_bStopped = true;
+		return WS_PARSE_RESULT::WS_PARSE_CLOSE;
+	default:
+		// 未主动发送ping，pong直接忽略
+		return WS_PARSE_RESULT::WS_PARSE_INCOMPLETE;
+	}
+}
+
+WS_PARSE_RESULT IOWebSocketSession::DeliverMessage(const char *pData, DWORD dwLen)
+{
+	if (WS_OPCODE::WS_OPCODE_TEXT == m_messageOpcode && !IOWebSocketCodec::IsValidUtf8(pData, dwLen))
+	{
+		return Fail(WS_CLOSE_INVALID_DATA);
+	}
+
+	m_payload.opcode = m_messageOpcode;
+	m_payload.pData = pData;
+	m_payload.dwLen = dwLen;
+	return WS_PARSE_RESULT::WS_PARSE_MESSAGE;
+}
+
+WS_PARSE_RESULT IOWebSocketSession::Fail(WORD wCloseCode)
+{
+	m_bStopped = true;
+	m_wCloseCode = wCloseCode;
+	return WS_PARSE_RESULT::WS_PARSE_ERROR;
+}
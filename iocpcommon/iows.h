@@ -0,0 +1,177 @@
+#ifndef _TINY_IOCP_IOCPCOMMON_IOWS_H_
+#define _TINY_IOCP_IOCPCOMMON_IOWS_H_
+
+#include <Windows.h>
+#include "iolock.h"
+#include <stdio.h>
+#include <vector>
+
+#define WS_MAX_MESSAGE_SIZE		(1024 * 1024 * 4)	// 单条消息(含所有分片)的最大长度(4M)
+#define WS_MAX_CONTROL_PAYLOAD	(125)				// 控制帧载荷的最大长度
+#define WS_MAX_FRAME_HEADER		(14)				// 帧头的最大长度(含掩码)
+#define WS_ACCEPT_KEY_SIZE		(29)				// Sec-WebSocket-Accept的长度(含结尾的'\0')
+
+// 关闭帧状态码(RFC 6455 7.4.1)
+#define WS_CLOSE_NORMAL			(1000)
+#define WS_CLOSE_GOING_AWAY		(1001)
+#define WS_CLOSE_PROTOCOL_ERROR	(1002)
+#define WS_CLOSE_NO_STATUS		(1005)	// 对端的关闭帧未携带状态码，不能出现在发送的关闭帧中
+#define WS_CLOSE_INVALID_DATA	(1007)
+#define WS_CLOSE_TOO_BIG		(1009)
+
+//	帧操作码
+enum class WS_OPCODE
+{
+	WS_OPCODE_CONTINUATION = 0x0,
+	WS_OPCODE_TEXT = 0x1,
+	WS_OPCODE_BINARY = 0x2,
+	WS_OPCODE_CLOSE = 0x8,
+	WS_OPCODE_PING = 0x9,
+	WS_OPCODE_PONG = 0xA,
+};
+
+//	帧解析结果
+enum class WS_PARSE_RESULT
+{
+	WS_PARSE_MESSAGE = 0,	// 取出了一条完整的数据消息
+	WS_PARSE_PING,			// 收到ping，应以相同载荷回复pong
+	WS_PARSE_CLOSE,			// 收到关闭帧，应回复关闭帧后关闭连接
+	WS_PARSE_INCOMPLETE,	// 数据不足，等待下一次recv
+	WS_PARSE_ERROR,			// 协议错误，应以GetCloseCode发送关闭帧后关闭连接
+};
+
+//	帧解析状态
+enum class WS_FRAME_STATE
+{
+	WS_FRAME_HEADER = 0,	// 等待帧头
+	WS_FRAME_PAYLOAD,		// 等待载荷
+};
+
+// 解析出的消息或控制帧载荷，指向已去掩码的接收缓冲区或会话内部的缓冲区，只在回调期间有效
+struct IOWebSocketMessage
+{
+	WS_OPCODE opcode;
+	const char *pData;
+	DWORD dwLen;
+};
+
+// 帧编解码：去掩码与UTF-8校验在x86/x64上以SSE2处理，同时保留逐字节的实现作为性能对比的基准
+class IOWebSocketCodec
+{
+public:
+
+	// 原地去掩码，dwMaskOffset为该帧已去掩码的载荷字节数，用于跨越recv边界的载荷
+	static void Unmask(char *pData, DWORD dwLen, const BYTE mask[4], DWORD dwMaskOffset);
+	static void UnmaskScalar(char *pData, DWORD dwLen, const BYTE mask[4], DWORD dwMaskOffset);
+
+	static bool IsValidUtf8(const char *pData, DWORD dwLen);
+
+	// 写入服务端帧头(不带掩码)，返回帧头长度
+	static DWORD WriteFrameHeader(char *pOutBuffer, WS_OPCODE opcode, ULONGLONG ullPayloadLen);
+
+	// 根据Sec-WebSocket-Key计算Sec-WebSocket-Accept，pAccept至少WS_ACCEPT_KEY_SIZE字节
+	static bool ComputeAccept(const char *pKey, DWORD dwKeyLen, char *pAccept);
+
+	// 对比不同载荷长度下SIMD与逐字节去掩码的吞吐
+	static void Benchmark(FILE *pFile);
+};
+
+// 每个连接的WebSocket会话
+// 收数据只在持有recv的工作线程上进行，不需要加锁：载荷在接收缓冲区上原地去掩码，
+// 完整位于本次数据中的未分片消息直接交给上层，分片消息及跨越recv边界的载荷去掩码后追加到消息缓冲区
+// 发送时调用者需持有GetSendLock返回的锁，保证超过一个缓冲区的帧不会与其他帧交错
+class IOWebSocketSession
+{
+public:
+
+	IOWebSocketSession();
+	~IOWebSocketSession() = default;
+
+public:
+
+	// 开始处理本次收到的数据，数据会被原地去掩码
+	void Feed(char *buffer, DWORD dwLen);
+
+	// 取出下一条消息或需要应答的控制帧，载荷通过GetPayload获取
+	WS_PARSE_RESULT Next();
+
+	// 本次数据处理完毕，未解析完的帧头及控制帧保留到会话缓冲区
+	void EndFeed();
+
+	const IOWebSocketMessage& GetPayload() const
+	{
+		return m_payload;
+	}
+
+	// 收到关闭帧时为对端的状态码，出错时为应发送的状态码
+	WORD GetCloseCode() const
+	{
+		return m_wCloseCode;
+	}
+
+	// 101响应已发出，之后才允许发送数据帧，调用者需持有GetSendLock返回的锁
+	void Open()
+	{
+		m_bOpen = true;
+	}
+
+	bool IsOpen() const
+	{
+		return m_bOpen;
+	}
+
+	// 关闭帧已发送，之后不再发送任何帧，调用者需持有GetSendLock返回的锁
+	void SetCloseSent()
+	{
+		m_bCloseSent = true;
+	}
+
+	bool IsCloseSent() const
+	{
+		return m_bCloseSent;
+	}
+
+	EngineLock& GetSendLock()
+	{
+		return m_sendLock;
+	}
+
+private:
+
+	WS_PARSE_RESULT ParseHeader(const BYTE *pHeader, DWORD dwAvailable);
+	WS_PARSE_RESULT DeliverControl(char *pPayload);
+	WS_PARSE_RESULT DeliverMessage(const char *pData, DWORD dwLen);
+	WS_PARSE_RESULT Fail(WORD wCloseCode);
+
+	IOWebSocketSession(const IOWebSocketSession&) = delete;
+	IOWebSocketSession& operator= (const IOWebSocketSession&) = delete;
+
+private:
+
+	// 收数据状态，只在持有recv的工作线程上访问
+	std::vector<char> m_buffer;			// 跨越recv边界的帧头或控制帧
+	bool m_bBuffered;					// 本次解析的数据位于m_buffer中
+	char *m_pData;						// 本次解析的数据：接收缓冲区或m_buffer
+	DWORD m_dwDataLen;
+	DWORD m_dwOffset;					// 已解析到的位置
+	WS_FRAME_STATE m_state;
+	WS_OPCODE m_frameOpcode;			// 当前帧的操作码
+	bool m_bFin;						// 当前帧是否为消息的最后一个分片
+	BYTE m_mask[4];						// 当前帧的掩码
+	ULONGLONG m_ullRemaining;			// 当前帧尚未收到的载荷长度
+	DWORD m_dwMaskOffset;				// 当前帧已去掩码的载荷长度(模4)
+	bool m_bFragmented;					// 正在接收分片消息
+	WS_OPCODE m_messageOpcode;			// 分片消息的操作码(首个分片的)
+	std::vector<char> m_message;		// 分片消息及跨越recv边界的载荷
+	bool m_bDelivered;					// m_message已交给上层，下次解析前清空
+	bool m_bStopped;					// 已收到关闭帧或出错，之后的数据丢弃
+	WORD m_wCloseCode;
+	IOWebSocketMessage m_payload;
+
+	// 发送状态，由m_sendLock保护
+	bool m_bOpen;
+	bool m_bCloseSent;
+	EngineLock m_sendLock;
+};
+
+#endif	// _TINY_IOCP_IOCPCOMMON_IOWS_H_
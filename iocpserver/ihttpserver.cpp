@@ -0,0 +1,198 @@
+#include "pch.h"
+#include "ihttpserver.h"
+
+IHttpServer::IHttpServer()
+	: IServer()
+{
+}
+
+IHttpServer::IHttpServer(IOEngine *pEngine)
+	: IServer(pEngine)
+{
+}
+
+IHttpServer::~IHttpServer()
+{
+}
+
+bool IHttpServer::Respond(IOSocketContext *pSocketContext, ULONGLONG nSequence, WORD wStatus, const char *pContentType,
+	const char *pBody, DWORD dwBodyLen, const char *pExtraHeaders)
+{
+	IOInlineSendScope inlineSendScope;
+	IOHttpSession *pHttpSession = pSocketContext ? GetHttpSession(pSocketContext) : nullptr;
+	if (!pHttpSession || pSocketContext->IsClosed())
+	{
+		return false;
+	}
+
+	bool result = true;
+	bool bUpgradeSent = false;
+	DWORD dwError = NO_ERROR;
+	{
+		AutoLock<EngineLock> lock(pHttpSession->GetLock());
+		if (!pHttpSession->AppendResponse(nSequence, wStatus, pContentType, pBody, dwBodyLen, pExtraHeaders))
+		{
+			return false;
+		}
+
+		// 正在处理recv时由OnRecv在解析完本批请求后统一发送
+		if (pHttpSession->IsCorked())
+		{
+			return true;
+		}
+
+		result = Flush(pSocketContext, pHttpSession, dwError);
+		bUpgradeSent = pHttpSession->TakeUpgradeSent();
+	}
+
+	// 发送失败在会话锁外关闭：OnError中可能再对同一连接调用Respond，不可重入的锁会自锁
+	if (NO_ERROR != dwError)
+	{
+		CloseWithError(pSocketContext, dwError);
+	}
+
+	// 升级请求的响应可能要等前序请求在其他线程响应后才发出
+	if (bUpgradeSent && !pSocketContext->IsClosed())
+	{
+		OnUpgradeSent(pSocketContext);
+	}
+
+	return result;
+}
+
+bool IHttpServer::Respond(CONN_ID connId, ULONGLONG nSequence, WORD wStatus, const char *pContentType,
+	const char *pBody, DWORD dwBodyLen, const char *pExtraHeaders)
+{
+	// 通过注册表获取连接时已持有其引用，响应期间连接不会被销毁
+	IOSocketContext *pSocketContext = AcquireConnection(connId);
+	if (!pSocketContext)
+	{
+		return false;
+	}
+
+	bool result = Respond(pSocketContext, nSequence, wStatus, pContentType, pBody, dwBodyLen, pExtraHeaders);
+	pSocketContext->Release();
+
+	return result;
+}
+
+void IHttpServer::OnEstablished(IOSocketContext *pSocketContext)
+{
+	// 首个recv投递之前创建会话，会话随连接上下文一起销毁
+	pSocketContext->pProtocolSession = NewHttpSession();
+}
+
+void IHttpServer::OnContextDestroyed(IOSocketContext *pSocketContext)
+{
+	DeleteHttpSession(GetHttpSession(pSocketContext));
+}
+
+void IHttpServer::OnShed(IOSocketContext *pSocketContext, const IOHttpRequest &request)
+{
+	static const char s_body[] = "Service Unavailable";
+	Respond(pSocketContext, request.nSequence, 503, "text/plain", s_body, (DWORD)(sizeof(s_body) - 1), "Retry-After: 1\r\n");
+}
+
+void IHttpServer::OnRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+{
+	IOInlineSendScope inlineSendScope;
+	IOHttpSession *pHttpSession = GetHttpSession(pSocketContext);
+	if (!pHttpSession)
+	{
+		return;
+	}
+
+	{
+		AutoLock<EngineLock> lock(pHttpSession->GetLock());
+		pHttpSession->Cork();
+	}
+
+	// 逐个取出本次数据中的完整请求，请求视图直接指向接收缓冲区
+	pHttpSession->Feed(pOverlappedContext->wsaBuffer.buf, pOverlappedContext->wsaBuffer.len);
+
+	HTTP_PARSE_RESULT result = HTTP_PARSE_RESULT::HTTP_PARSE_INCOMPLETE;
+	while (!pSocketContext->IsClosed() &&
+		HTTP_PARSE_RESULT::HTTP_PARSE_COMPLETE == (result = pHttpSession->NextRequest()))
+	{
+		// 过载期间新请求不交给业务处理，快速拒绝以保住已接纳请求的时延
+		if (IsOverloaded())
+		{
+			OnShed(pSocketContext, pHttpSession->GetRequest());
+		}
+		else
+		{
+			OnRequest(pSocketContext, pHttpSession->GetRequest());
+		}
+	}
+
+	// 格式错误的请求以错误状态码响应，之后关闭连接
+	if (HTTP_PARSE_RESULT::HTTP_PARSE_ERROR == result)
+	{
+		Respond(pSocketContext, pHttpSession->GetErrorSequence(), pHttpSession->GetErrorStatus(), nullptr, nullptr, 0);
+	}
+
+	pHttpSession->EndFeed();
+
+	bool bUpgradeSent = false;
+	DWORD dwError = NO_ERROR;
+	{
+		AutoLock<EngineLock> lock(pHttpSession->GetLock());
+		pHttpSession->Uncork();
+		Flush(pSocketContext, pHttpSession, dwError);
+		bUpgradeSent = pHttpSession->TakeUpgradeSent();
+	}
+
+	if (NO_ERROR != dwError)
+	{
+		CloseWithError(pSocketContext, dwError);
+	}
+
+	if (bUpgradeSent && !pSocketContext->IsClosed())
+	{
+		OnUpgradeSent(pSocketContext);
+	}
+}
+
+void IHttpServer::OnSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+{
+	IOHttpSession *pHttpSession = GetHttpSession(pSocketContext);
+	if (pHttpSession)
+	{
+		TryShutdown(pSocketContext, pHttpSession);
+	}
+}
+
+bool IHttpServer::Flush(IOSocketContext *pSocketContext, IOHttpSession *pHttpSession, DWORD &dwError)
+{
+	// 持有会话的锁投递，保证不同线程提交的响应按序进入socket的发送队列
+	std::string &output = pHttpSession->GetOutput();
+	bool result = true;
+	for (size_t nOffset = 0; result && nOffset < output.size(); nOffset += MAX_BUFFER_SIZE)
+	{
+		size_t nChunk = output.size() - nOffset;
+		if (nChunk > MAX_BUFFER_SIZE)
+		{
+			nChunk = MAX_BUFFER_SIZE;
+		}
+
+		result = SendNoClose(pSocketContext, output.data() + nOffset, (int)nChunk, dwError);
+	}
+	output.clear();
+
+	if (pHttpSession->IsCloseQueued())
+	{
+		pHttpSession->BeginShutdown();
+		TryShutdown(pSocketContext, pHttpSession);
+	}
+
+	return result;
+}
+
+void IHttpServer::TryShutdown(IOSocketContext *pSocketContext, IOHttpSession *pHttpSession)
+{
+	// 投递方先标记再检查在途send，完成方先减计数再检查标记，两者至少有一方看到全部条件成立
+	if (0 == pSocketContext->GetPendingSends() && pHttpSession->TakeShutdown())
+	{
+		::shutdown(pSocketContext->connSocket, SD_SEND);
+	}
+}
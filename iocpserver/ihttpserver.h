@@ -0,0 +1,81 @@
+#ifndef _TINY_IOCP_IOCPSERVER_IHTTPSERVER_H_
+#define _TINY_IOCP_IOCPSERVER_IHTTPSERVER_H_
+
+#include "iserver.h"
+#include "iohttp.h"
+
+// HTTP/1.1服务端抽象基类：在IServer之上解析请求，子类实现OnRequest并调用Respond响应
+// 支持keep-alive、流水线请求(响应按请求顺序发出)及chunked请求体；TLS与压缩位于其下层，同样适用
+// 一次recv中解析出的多个流水线请求的响应合并为一次发送
+class IHttpServer : public IServer
+{
+public:
+
+	// 响应序号为nSequence(即IOHttpRequest::nSequence)的请求，可在OnRequest中同步调用，
+	// 也可记下连接ID与序号后在任意线程调用；先提交的后续请求的响应会等待前序请求响应后再发出
+	// pExtraHeaders为附加的头部字段，每个字段以"\r\n"结尾；Content-Length与Date由此处生成
+	bool Respond(IOSocketContext *pSocketContext, ULONGLONG nSequence, WORD wStatus, const char *pContentType,
+		const char *pBody, DWORD dwBodyLen, const char *pExtraHeaders = nullptr);
+	bool Respond(CONN_ID connId, ULONGLONG nSequence, WORD wStatus, const char *pContentType,
+		const char *pBody, DWORD dwBodyLen, const char *pExtraHeaders = nullptr);
+
+public:
+
+	// 收到一个完整的请求，request中的视图只在回调期间有效
+	virtual void OnRequest(IOSocketContext *pSocketContext, const IOHttpRequest &request) = 0;
+
+	// 引擎过载(见EnableAdmissionControl)期间收到的请求交由此处而非OnRequest，默认以503及Retry-After响应
+	// 子类可重写以放行健康检查等少量请求，但须为每个请求响应
+	virtual void OnShed(IOSocketContext *pSocketContext, const IOHttpRequest &request);
+
+	// 连接的建立与关闭，子类可按需重写
+	virtual void OnEstablished(IOSocketContext *pSocketContext);
+	virtual void OnClosed(IOSocketContext *pSocketContext) {}
+	virtual void OnError(IOSocketContext *pSocketContext, DWORD dwError) {}
+
+protected:
+
+	// 子类(如IWebSocketServer)在连接升级前交由此处按HTTP处理
+	virtual void OnRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
+	virtual void OnSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
+
+	// 连接的HTTP会话挂在连接上下文的pProtocolSession上，OnEstablished中创建，连接上下文销毁时释放
+	static IOHttpSession* GetHttpSession(IOSocketContext *pSocketContext)
+	{
+		return static_cast<IOHttpSession *>(pSocketContext->pProtocolSession);
+	}
+
+	// 创建与释放连接的HTTP会话，升级到其他协议的子类(如IWebSocketServer)重写以在会话中附带自身的状态
+	virtual IOHttpSession* NewHttpSession()
+	{
+		return new IOHttpSession();
+	}
+
+	virtual void DeleteHttpSession(IOHttpSession *pHttpSession)
+	{
+		delete pHttpSession;
+	}
+
+	virtual void OnContextDestroyed(IOSocketContext *pSocketContext);
+
+	// 升级请求(见IOHttpSession::Upgrade)的响应及其前序的流水线响应均已投递发送，此后才可发送新协议的数据
+	// 在会话锁之外调用，可能位于OnRecv的工作者线程，也可能位于提交前序响应的任意线程
+	virtual void OnUpgradeSent(IOSocketContext *pSocketContext)
+	{
+	}
+
+	// 发送输出缓冲区中已排好序的响应，调用者需持有会话的锁
+	// 发送失败时不关闭连接，dwError不为NO_ERROR时由调用者释放锁后调用CloseWithError
+	bool Flush(IOSocketContext *pSocketContext, IOHttpSession *pHttpSession, DWORD &dwError);
+
+	// 最后的响应全部发送完成后关闭写端，由对端关闭连接
+	void TryShutdown(IOSocketContext *pSocketContext, IOHttpSession *pHttpSession);
+
+protected:
+
+	IHttpServer();
+	explicit IHttpServer(IOEngine *pEngine);
+	virtual ~IHttpServer();
+};
+
+#endif	// _TINY_IOCP_IOCPSERVER_IHTTPSERVER_H_
@@ -1,34 +1,48 @@
 #include "pch.h"
 #include "iserver.h"
+#include "iopipe.h"
 #include <mstcpip.h>
+#include <WS2tcpip.h>
+#include <algorithm>
+#include <assert.h>
 
 #pragma comment(lib, "WS2_32.lib")
 
 IServer::IServer()
-	: m_nPort(0)
-	, m_nMaxAcceptConn(0)
-	, m_completionPort(NULL)
-	, m_pWorkerThreads(nullptr)
-	, m_workerThreadNum(0)
+	: IServer(nullptr)
+{
+}
+
+IServer::IServer(IOEngine *pEngine)
+	: m_pEngine(pEngine ? pEngine : &m_ownEngine)
+	, m_nAddressFamily(AF_INET)
+	, m_bOwnsSocketFile(false)
 	, m_pListenSocketContext(nullptr)
+	, m_pShmListener(nullptr)
+	, m_hShmStopEvent(NULL)
+	, m_hShmAcceptThread(NULL)
 	, m_nConnectCounts(0)
+	, m_nAccepting(0)
+	, m_pausedAcceptLock("IServerPausedAccepts")
+	, m_pTlsCredentials(nullptr)
+	, m_bCompressEnabled(false)
+	, m_dwCompressThreshold(COMPRESS_DEFAULT_THRESHOLD)
 	, m_fnAcceptEx(nullptr)
 	, m_fnGetAcceptExSockAddrs(nullptr)
 {
 	WSADATA wsaData;
 	::WSAStartup(MAKEWORD(2, 2), &wsaData);
-
-	m_stopEvent = ::CreateEvent(nullptr, TRUE, FALSE, nullptr);
 }
 
 IServer::~IServer()
 {
-	Stop();
-	
-	if (m_stopEvent)
+	// 此时子类已析构，不能再调用Stop：关闭连接会回调子类的OnClose等虚函数
+	assert(!HasContexts() && "IServer::Stop must be called before destruction");
+
+	if (m_pTlsCredentials)
 	{
-		::CloseHandle(m_stopEvent);
-		m_stopEvent = NULL;
+		delete m_pTlsCredentials;
+		m_pTlsCredentials = nullptr;
 	}
 
 	::WSACleanup();
@@ -36,8 +50,18 @@ IServer::~IServer()
 
 bool IServer::Start(USHORT nPort, unsigned int nMaxAcceptConn)
 {
-	m_nPort = nPort;
-	m_nMaxAcceptConn = nMaxAcceptConn;
+	IOListenerConfig config;
+	config.nPort = nPort;
+	config.nMaxAcceptConn = nMaxAcceptConn;
+	return Start(config);
+}
+
+bool IServer::Start(const IOListenerConfig &config)
+{
+	if (!SetConfig(config))
+	{
+		return false;
+	}
 
 	bool result = Init();
 	if (!result)
@@ -49,87 +73,207 @@ bool IServer::Start(USHORT nPort, unsigned int nMaxAcceptConn)
 
 bool IServer::Stop()
 {
-	if (m_stopEvent)
+	// 停止接受新连接并关闭所有连接，在途IO随之取消
+	StopAccept();
+	CloseAllConnections();
+	UnInit();
+
+	// 等待名下所有连接上下文(含监听socket)销毁，之后引擎不会再向本服务端分发完成包
+	// 超时或在工作者线程上调用时返回false，引擎、共享内存监听及抓包文件均保持不动，可在其他线程上再次调用
+	if (m_pEngine->IsRunning() && !WaitForContexts())
 	{
-		::SetEvent(m_stopEvent);
+		return false;
 	}
 
-	for (unsigned int index = 0; index < m_workerThreadNum; ++index)
+	if (m_pEngine == &m_ownEngine)
 	{
-		::PostQueuedCompletionStatus(m_completionPort, 0, EXIT_SERVER_CODE, nullptr);
+		m_ownEngine.Stop();
 	}
 
-	if (m_pWorkerThreads && m_workerThreadNum)
+	// 共享内存连接均已销毁，不再有通道访问映射
+	if (m_pShmListener)
 	{
-		::WaitForMultipleObjects(m_workerThreadNum, m_pWorkerThreads, TRUE, INFINITE);
+		delete m_pShmListener;
+		m_pShmListener = nullptr;
 	}
 
-	UnInit();
+	// 用户线程上的Send(connId)/Send(pSocketContext)失败时仍可能经DoClose写入关闭记录(共享引擎的工作者线程也可能仍在DispatchRecv中写入)
+	// Close拒绝之后的写入并等在途的写完
+	m_captureWriter.Close();
 
 	return true;
 }
 
-bool IServer::Send(IOSocketContext *pSocketContext, const char *buffer, int nLen)
+void IServer::CloseAllConnections()
 {
-	IOOverlappedContext *pNewOverlappedContext = pSocketContext->NewIOOverlappedContext();
-	pNewOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_SEND;
-	pNewOverlappedContext->ioSocket = pSocketContext->connSocket;
-	::memcpy_s(pNewOverlappedContext->wsaBuffer.buf, MAX_BUFFER_SIZE, buffer, nLen);
-	pNewOverlappedContext->wsaBuffer.len = (ULONG)nLen;
+	std::vector<CONN_ID> connIds;
+	m_connectionRegistry.Snapshot(connIds);
 
-	if (false == PostSend(pSocketContext, pNewOverlappedContext))
+	for (size_t index = 0; index < connIds.size(); ++index)
 	{
-		DoClose(pSocketContext);
+		IOSocketContext *pSocketContext = m_connectionRegistry.Acquire(connIds[index]);
+		if (pSocketContext)
+		{
+			DoClose(pSocketContext);
+			pSocketContext->Release();
+		}
+	}
+}
+
+bool IServer::Send(IOSocketContext *pSocketContext, const char *buffer, int nLen)
+{
+	IOInlineSendScope inlineSendScope;
+	DWORD dwError = NO_ERROR;
+	if (!SendNoClose(pSocketContext, buffer, nLen, dwError))
+	{
+		if (NO_ERROR != dwError)
+		{
+			DoClose(pSocketContext, dwError);
+		}
 		return false;
 	}
 
 	return true;
 }
 
+bool IServer::SendNoClose(IOSocketContext *pSocketContext, const char *buffer, int nLen, DWORD &dwError)
+{
+	IOInlineSendScope inlineSendScope;
+	if (!pSocketContext || !buffer || nLen <= 0 || nLen > MAX_BUFFER_SIZE)
+	{
+		return false;
+	}
+
+	// 已关闭或正在交接给新进程的连接不再接受发送
+	if (pSocketContext->IsClosed() || pSocketContext->IsHandingOff())
+	{
+		return false;
+	}
+
+	if (pSocketContext->pCompressStream && pSocketContext->pCompressStream->IsActive())
+	{
+		return SendCompressed(pSocketContext, buffer, nLen, dwError);
+	}
+
+	return SendPlain(pSocketContext, buffer, nLen, dwError);
+}
+
+void IServer::CloseWithError(IOSocketContext *pSocketContext, DWORD dwError)
+{
+	DoClose(pSocketContext, dwError);
+}
+
+bool IServer::Send(CONN_ID connId, const char *buffer, int nLen)
+{
+	// 通过注册表获取连接时已持有其引用，发送期间连接不会被销毁
+	IOSocketContext *pSocketContext = m_connectionRegistry.Acquire(connId);
+	if (!pSocketContext)
+	{
+		return false;
+	}
+
+	bool result = Send(pSocketContext, buffer, nLen);
+	pSocketContext->Release();
+
+	return result;
+}
+
+IOSocketContext* IServer::AcquireConnection(CONN_ID connId)
+{
+	return m_connectionRegistry.Acquire(connId);
+}
+
 ULONG IServer::GetConnectCounts() const
 {
 	return m_nConnectCounts;
 }
 
-bool IServer::Init()
+bool IServer::EnableTls(const std::string &certSubject)
 {
-	if (m_stopEvent)
+	IOTlsCredentials *pTlsCredentials = new IOTlsCredentials();
+	if (!pTlsCredentials->Init(certSubject))
 	{
-		::ResetEvent(m_stopEvent);
+		delete pTlsCredentials;
+		return false;
 	}
 
-	if (!(InitIOCP() && InitListenSocket()))
+	if (m_pTlsCredentials)
+	{
+		delete m_pTlsCredentials;
+	}
+	m_pTlsCredentials = pTlsCredentials;
+	return true;
+}
+
+void IServer::EnableCompression(DWORD dwThreshold)
+{
+	m_bCompressEnabled = true;
+	m_dwCompressThreshold = dwThreshold;
+}
+
+bool IServer::StartCapture(const std::string &path, DWORD dwMaxSizeMB)
+{
+	DWORD dwSegmentNum = (DWORD)(((ULONGLONG)dwMaxSizeMB * 1024 * 1024) / CAPTURE_SEGMENT_SIZE);
+	return m_captureWriter.Open(path, dwSegmentNum);
+}
+
+bool IServer::SetConfig(const IOListenerConfig &config)
+{
+	if (0 == config.dwRecvBufferSize || config.dwRecvBufferSize > RECV_BUFFER_SIZE_MAX)
+	{
+		return false;
+	}
+
+	if (!config.shmName.empty() && (0 == config.dwShmSlots || config.dwShmSlots > SHM_MAX_SLOTS ||
+		!IOShmListener::IsValidRingSize(config.dwShmRingSize)))
 	{
-		UnInit();
 		return false;
 	}
 
+	// 共享内存监听由独立的接受线程挂接连接，引擎锁不是线程安全的时不可用
+	if (!config.shmName.empty() && !IO_ENGINE_LOCK_THREAD_SAFE)
+	{
+		return false;
+	}
+
+	m_config = config;
 	return true;
 }
 
-bool IServer::UnInit()
+void IServer::ApplySocketOptions(SOCKET sock)
 {
-	if (m_pWorkerThreads)
+	// 缓冲区大小须在连接建立前设置，窗口扩大选项在握手时协商
+	if (m_config.nSocketRecvBuf > 0)
 	{
-		for (unsigned int index = 0; index < m_workerThreadNum; ++index)
-		{
-			if (m_pWorkerThreads[index] != INVALID_HANDLE_VALUE)
-			{
-				::CloseHandle(m_pWorkerThreads[index]);
-				m_pWorkerThreads[index] = INVALID_HANDLE_VALUE;
-			}
-		}
-
-		delete []m_pWorkerThreads;
-		m_pWorkerThreads = nullptr;
+		::setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&m_config.nSocketRecvBuf, sizeof(m_config.nSocketRecvBuf));
+	}
+	if (m_config.nSocketSendBuf > 0)
+	{
+		::setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char *)&m_config.nSocketSendBuf, sizeof(m_config.nSocketSendBuf));
 	}
+}
+
+bool IServer::Init()
+{
+	::InterlockedExchange(&m_nAccepting, 1);
 
-	if (m_completionPort)
+	if (!(m_pEngine->Start(m_config.nWorkerThreadNum) &&
+		(m_config.shmName.empty() ? InitListenSocket() : InitShmListener())))
 	{
-		::CloseHandle(m_completionPort);
-		m_completionPort = NULL;
+		UnInit();
+		return false;
 	}
 
+	m_pEngine->RegisterHandler(this);
+	return true;
+}
+
+bool IServer::UnInit()
+{
+	m_pEngine->UnregisterHandler(this);
+	StopShmListener();
+
+	// 关闭监听socket以取消在途的AcceptEx，上下文在最后一个在途AcceptEx完成后销毁
 	if (m_pListenSocketContext)
 	{
 		if (m_pListenSocketContext->connSocket != INVALID_SOCKET)
@@ -138,57 +282,61 @@ bool IServer::UnInit()
 			m_pListenSocketContext->connSocket = INVALID_SOCKET;
 		}
 
-		delete m_pListenSocketContext;
+		m_pListenSocketContext->Release();
 		m_pListenSocketContext = nullptr;
 	}
 
-	return true;
-}
-
-bool IServer::InitIOCP()
-{
-	// 初始化完成端口及工作线程集
-	m_completionPort = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
-	if (!m_completionPort)
+	// 监听socket已交接给新进程时socket文件仍在使用，由新进程负责删除
+	if (m_bOwnsSocketFile)
 	{
-		return false;
+		IOUnixSocket::RemoveSocketFile(m_config.unixPath);
+		m_bOwnsSocketFile = false;
 	}
 
-	m_workerThreadNum = 2 * GetNumOfProcessors() + 2;
-	m_pWorkerThreads = new HANDLE[m_workerThreadNum];
-
-	for (DWORD index = 0; index < m_workerThreadNum; ++index)
-	{
-		m_pWorkerThreads[index] = ::CreateThread(0, 0, &IServer::WorkerThreadProc, (void *)this, 0, 0);
-	}
 	return true;
 }
 
 bool IServer::InitListenSocket()
 {
 	// 生成用于监听的socket的Context
-	m_pListenSocketContext = new IOSocketContext();
-	m_pListenSocketContext->connSocket = ::WSASocket(AF_INET, SOCK_STREAM, 0, NULL, 0, WSA_FLAG_OVERLAPPED);
+	m_nAddressFamily = m_config.unixPath.empty() ? AF_INET : AF_UNIX;
+	m_pListenSocketContext = new IOSocketContext(this);
+	m_pListenSocketContext->connSocket = ::WSASocket(m_nAddressFamily, SOCK_STREAM, 0, NULL, 0, WSA_FLAG_OVERLAPPED);
 	if (INVALID_SOCKET == m_pListenSocketContext->connSocket)
 	{
 		return false;
 	}
 
 	// 将监听socket绑定到完成端口中
-	if (NULL == ::CreateIoCompletionPort(
-		(HANDLE)m_pListenSocketContext->connSocket, m_completionPort, (ULONG_PTR)m_pListenSocketContext, 0))
+	if (!m_pEngine->Attach(m_pListenSocketContext, m_pListenSocketContext->connSocket, true))
 	{
 		::closesocket(m_pListenSocketContext->connSocket);
 		m_pListenSocketContext->connSocket = INVALID_SOCKET;
 		return false;
 	}
 
+	if (AF_UNIX == m_nAddressFamily)
+	{
+		return InitUnixListenSocket();
+	}
+
+	// 环回快速路径须在listen之前设置，接受的连接随之生效
+	if (m_pEngine->GetBusyPoller().IsEnabled())
+	{
+		IOBusyPoller::EnableLoopbackFastPath(m_pListenSocketContext->connSocket);
+	}
+
 	//服务器地址信息，用于绑定socket
 	sockaddr_in serverAddr;
 	::memset(&serverAddr, 0, sizeof(serverAddr));
 	serverAddr.sin_family = AF_INET;
 	serverAddr.sin_addr.s_addr = ::htonl(INADDR_ANY);
-	serverAddr.sin_port = ::htons(m_nPort);
+	serverAddr.sin_port = ::htons(m_config.nPort);
+	if (!m_config.bindAddress.empty() &&
+		1 != ::inet_pton(AF_INET, m_config.bindAddress.c_str(), (PVOID)&serverAddr.sin_addr.s_addr))
+	{
+		return false;
+	}
 
 	// 绑定地址和端口
 	if (SOCKET_ERROR == ::bind(m_pListenSocketContext->connSocket, (sockaddr *)&serverAddr, sizeof(serverAddr)))
@@ -197,11 +345,158 @@ bool IServer::InitListenSocket()
 	}
 
 	// 开始监听
-	if (SOCKET_ERROR == ::listen(m_pListenSocketContext->connSocket, SOMAXCONN))
+	if (SOCKET_ERROR == ::listen(m_pListenSocketContext->connSocket, m_config.nBacklog))
+	{
+		return false;
+	}
+
+	return InitAcceptEx();
+}
+
+bool IServer::InitUnixListenSocket()
+{
+	SOCKADDR_UN serverAddr;
+	int nAddrLen = 0;
+	if (!IOUnixSocket::FillAddress(m_config.unixPath, serverAddr, nAddrLen))
 	{
 		return false;
 	}
 
+	// 上次运行残留的socket文件会使bind失败
+	IOUnixSocket::RemoveSocketFile(m_config.unixPath);
+	if (SOCKET_ERROR == ::bind(m_pListenSocketContext->connSocket, (sockaddr *)&serverAddr, nAddrLen))
+	{
+		return false;
+	}
+	m_bOwnsSocketFile = true;
+
+	if (SOCKET_ERROR == ::listen(m_pListenSocketContext->connSocket, m_config.nBacklog))
+	{
+		return false;
+	}
+
+	return InitAcceptEx();
+}
+
+bool IServer::InitShmListener()
+{
+	if (!m_pShmListener)
+	{
+		m_pShmListener = new IOShmListener();
+	}
+
+	if (!m_pShmListener->Create(m_config.shmName, m_config.dwShmSlots, m_config.dwShmRingSize))
+	{
+		return false;
+	}
+
+	m_hShmStopEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!m_hShmStopEvent)
+	{
+		return false;
+	}
+
+	m_hShmAcceptThread = ::CreateThread(NULL, 0, ShmAcceptThreadProc, this, 0, NULL);
+	return (NULL != m_hShmAcceptThread);
+}
+
+void IServer::StopShmListener()
+{
+	// 停止接受线程并关闭握手管道；监听对象持有连接计数，在所有共享内存连接销毁后才释放(见Stop)
+	if (m_hShmAcceptThread)
+	{
+		::SetEvent(m_hShmStopEvent);
+		::WaitForSingleObject(m_hShmAcceptThread, INFINITE);
+		::CloseHandle(m_hShmAcceptThread);
+		m_hShmAcceptThread = NULL;
+	}
+
+	if (m_pShmListener)
+	{
+		m_pShmListener->Destroy();
+	}
+
+	if (m_hShmStopEvent)
+	{
+		::CloseHandle(m_hShmStopEvent);
+		m_hShmStopEvent = NULL;
+	}
+}
+
+DWORD WINAPI IServer::ShmAcceptThreadProc(LPVOID lpParam)
+{
+	IServer *pThis = reinterpret_cast<IServer*>(lpParam);
+
+	for (;;)
+	{
+		// 过载期间或连接数已满时不接受，已连上管道的客户端在其连接超时内等待
+		if (!pThis->m_nAccepting || pThis->m_pEngine->IsOverloaded() || pThis->m_pShmListener->IsFull())
+		{
+			if (WAIT_TIMEOUT != ::WaitForSingleObject(pThis->m_hShmStopEvent, SHM_MAINTAIN_PERIOD))
+			{
+				break;
+			}
+			continue;
+		}
+
+		IOShmChannel *pChannel = pThis->m_pShmListener->Accept(SHM_MAINTAIN_PERIOD, pThis->m_hShmStopEvent);
+		if (pChannel)
+		{
+			pThis->AcceptShmConnection(pChannel);
+		}
+		else if (WAIT_TIMEOUT != ::WaitForSingleObject(pThis->m_hShmStopEvent, 0))
+		{
+			break;
+		}
+	}
+
+	return 0;
+}
+
+void IServer::AcceptShmConnection(IOShmChannel *pChannel)
+{
+	pChannel->SetSpinTime(m_config.dwShmSpinUs);
+
+	// 共享内存连接没有socket，不绑定完成端口，收发均不经过内核；接收的唤醒包经引擎的完成端口分发
+	IOSocketContext *pNewSockContext = new IOSocketContext(this);
+	pNewSockContext->pShmChannel = pChannel;
+	m_pEngine->AttachPostOnly(pNewSockContext);
+	m_connectionRegistry.Register(pNewSockContext);
+	InterlockedIncrement(&m_nConnectCounts);
+	if (m_bCompressEnabled)
+	{
+		pNewSockContext->pCompressStream =
+			new IOCompressStream(COMPRESS_STREAM_STATE::COMPRESS_STATE_PROBING, m_dwCompressThreshold);
+	}
+	if (m_captureWriter.IsOpen())
+	{
+		m_captureWriter.Append(CAPTURE_RECORD_TYPE::CAPTURE_RECORD_OPEN, pNewSockContext->connId, nullptr, 0);
+	}
+
+	{
+		IOCallbackScope callbackScope;
+		OnEstablished(pNewSockContext);
+	}
+
+	IOOverlappedContext *pNewOverlappedContext = pNewSockContext->NewIOOverlappedContext(m_config.dwRecvBufferSize);
+	if (!pNewOverlappedContext)
+	{
+		DoClose(pNewSockContext, ERROR_NOT_ENOUGH_MEMORY);
+		return;
+	}
+	if (!pNewSockContext->StartShmReader(pNewOverlappedContext))
+	{
+		DoClose(pNewSockContext, ::GetLastError());
+	}
+}
+
+int IServer::GetAcceptAddrLen() const
+{
+	return (AF_UNIX == m_nAddressFamily) ? (int)UNIX_ACCEPT_ADDR_SIZE : (int)(sizeof(sockaddr_in) + 16);
+}
+
+bool IServer::InitAcceptEx()
+{
 	GUID guidAcceptEx = WSAID_ACCEPTEX;
 	GUID guidGetAcceptSockAddrs = WSAID_GETACCEPTEXSOCKADDRS;
 	DWORD dwBytes = 0;
@@ -235,9 +530,13 @@ bool IServer::InitListenSocket()
 		return false;
 	}
 
-	for (unsigned int index = 0; index < m_nMaxAcceptConn; ++index)
+	for (unsigned int index = 0; index < m_config.nMaxAcceptConn; ++index)
 	{
 		IOOverlappedContext *pOverlappedContext = m_pListenSocketContext->NewIOOverlappedContext();
+		if (!pOverlappedContext)
+		{
+			return false;
+		}
 		if (false == PostAccept(m_pListenSocketContext, pOverlappedContext))
 		{
 			m_pListenSocketContext->ReleaseIOOverlappedContext(pOverlappedContext);
@@ -247,13 +546,6 @@ bool IServer::InitListenSocket()
 	return true;
 }
 
-DWORD IServer::GetNumOfProcessors()
-{
-	SYSTEM_INFO si;
-	::GetSystemInfo(&si);
-	return si.dwNumberOfProcessors;
-}
-
 bool IServer::IsSocketAlive(SOCKET sock)
 {
 	return (::send(sock, "", 0, 0) >= 0);
@@ -262,26 +554,33 @@ bool IServer::IsSocketAlive(SOCKET sock)
 bool IServer::PostAccept(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
 {
 	DWORD dwBytes = 0;
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_POST_ACCEPT);
 	pOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_ACCPEPT;
-	pOverlappedContext->ioSocket = ::WSASocket(AF_INET, SOCK_STREAM, 0, NULL, 0, WSA_FLAG_OVERLAPPED);
+	pOverlappedContext->ioSocket = ::WSASocket(m_nAddressFamily, SOCK_STREAM, 0, NULL, 0, WSA_FLAG_OVERLAPPED);
 	if (INVALID_SOCKET == pOverlappedContext->ioSocket)
 	{
 		return false;
 	}
+	ApplySocketOptions(pOverlappedContext->ioSocket);
+
+	// 在途的AcceptEx持有监听socket上下文的引用，完成后由工作线程释放
+	pSocketContext->AddRef();
 
 	// 将接收缓冲置为0,令AcceptEx直接返回，而不是等待接收数据
 	if (false == m_fnAcceptEx(
-		m_pListenSocketContext->connSocket,
+		pSocketContext->connSocket,
 		pOverlappedContext->ioSocket,
 		pOverlappedContext->wsaBuffer.buf,
 		0,
-		sizeof(sockaddr_in) + 16,
-		sizeof(sockaddr_in) + 16,
+		GetAcceptAddrLen(),
+		GetAcceptAddrLen(),
 		&dwBytes,
 		&pOverlappedContext->wsaOverlapped))
 	{
 		if (WSA_IO_PENDING != ::WSAGetLastError())
 		{
+			::closesocket(pOverlappedContext->ioSocket);
+			pSocketContext->Release();
 			return false;
 		}
 	}
@@ -291,11 +590,20 @@ bool IServer::PostAccept(IOSocketContext *pSocketContext, IOOverlappedContext *p
 
 bool IServer::PostRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
 {
+	if (pSocketContext->pRecvIntoBuffer)
+	{
+		return PostRecvInto(pSocketContext, pOverlappedContext);
+	}
+
 	DWORD dwFlags = 0, dwBytes = 0;
 	pOverlappedContext->ResetBufferAndOptType();
 	pOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_RECV;
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_POST_RECV, pSocketContext->connId);
 
-	if ((::WSARecv(
+	// 在途IO持有连接的引用，完成后由工作线程释放
+	pSocketContext->AddRef();
+	pSocketContext->BeginRecv(pOverlappedContext);
+	int nRet = ::WSARecv(
 		pOverlappedContext->ioSocket,
 		&pOverlappedContext->wsaBuffer,
 		1,
@@ -303,22 +611,89 @@ bool IServer::PostRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOv
 		&dwFlags,
 		&pOverlappedContext->wsaOverlapped,
 		NULL
-		) == SOCKET_ERROR) && (WSA_IO_PENDING != ::WSAGetLastError()))
+		);
+	if ((SOCKET_ERROR == nRet) && (WSA_IO_PENDING != ::WSAGetLastError()))
 	{
-		DoClose(pSocketContext);
+		DoClose(pSocketContext, ::WSAGetLastError());
+		pSocketContext->Release();
+		return false;
+	}
+
+	pSocketContext->CancelIfClosed(pOverlappedContext);
+
+	// 同步完成的recv没有完成包，补投一个交给工作线程处理，避免在此递归并保持读取的调度顺序
+	if ((NO_ERROR == nRet) && pSocketContext->bSkipCompletionOnSuccess &&
+		!m_pEngine->Post(pSocketContext, pOverlappedContext, dwBytes))
+	{
+		DoClose(pSocketContext, ::GetLastError());
+		pSocketContext->Release();
+		return false;
+	}
+
+	return true;
+}
+
+bool IServer::PostRecvInto(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+{
+	DWORD dwFlags = 0, dwBytes = 0;
+	pOverlappedContext->ResetBufferAndOptType();
+	pOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_RECV_INTO;
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_POST_RECV, pSocketContext->connId);
+
+	// 读入应用缓冲区的剩余部分；WSARecv返回前已取得WSABUF的内容，可使用栈上的WSABUF
+	WSABUF wsaBuffer;
+	wsaBuffer.buf = pSocketContext->pRecvIntoBuffer + pSocketContext->dwRecvIntoDone;
+	wsaBuffer.len = pSocketContext->dwRecvIntoLen - pSocketContext->dwRecvIntoDone;
+
+	pSocketContext->AddRef();
+	pSocketContext->BeginRecv(pOverlappedContext);
+	int nRet = ::WSARecv(
+		pOverlappedContext->ioSocket,
+		&wsaBuffer,
+		1,
+		&dwBytes,
+		&dwFlags,
+		&pOverlappedContext->wsaOverlapped,
+		NULL
+		);
+	if ((SOCKET_ERROR == nRet) && (WSA_IO_PENDING != ::WSAGetLastError()))
+	{
+		DoClose(pSocketContext, ::WSAGetLastError());
+		FinishRecvInto(pSocketContext);
+		pSocketContext->Release();
+		return false;
+	}
+
+	pSocketContext->CancelIfClosed(pOverlappedContext);
+
+	// 同步完成时同样补投完成包，由工作线程继续
+	if ((NO_ERROR == nRet) && pSocketContext->bSkipCompletionOnSuccess &&
+		!m_pEngine->Post(pSocketContext, pOverlappedContext, dwBytes))
+	{
+		DoClose(pSocketContext, ::GetLastError());
+		FinishRecvInto(pSocketContext);
+		pSocketContext->Release();
 		return false;
 	}
 
 	return true;
 }
 
-bool IServer::PostSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+bool IServer::PostSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD &dwError)
 {
+	if (pSocketContext->pShmChannel)
+	{
+		return PostShmSend(pSocketContext, pOverlappedContext, dwError);
+	}
+
 	pOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_SEND;
 	DWORD dwBytes = 0;
 	DWORD dwFlags = 0;
 
-	if ((::WSASend(
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_POST_SEND, pSocketContext->connId, pOverlappedContext->wsaBuffer.len);
+	pSocketContext->AddRef();
+	pSocketContext->BeginSend();
+	int nRet = ::WSASend(
 		pOverlappedContext->ioSocket,
 		&pOverlappedContext->wsaBuffer,
 		1,
@@ -326,28 +701,58 @@ bool IServer::PostSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOv
 		dwFlags,
 		&pOverlappedContext->wsaOverlapped,
 		NULL
-	) != NO_ERROR) && (::WSAGetLastError() != WSA_IO_PENDING))
+	);
+	if ((nRet != NO_ERROR) && (::WSAGetLastError() != WSA_IO_PENDING))
 	{
-		DoClose(pSocketContext);
+		dwError = ::WSAGetLastError();
+		pSocketContext->EndSend();
+		pSocketContext->Release();
 		return false;
 	}
 
+	pSocketContext->CancelIfClosed(pOverlappedContext);
+
+	// 数据已全部进入socket发送缓冲区且不会再有完成包，由当前线程完成本次send(OnSend在最外层的Send返回前回调)
+	if ((NO_ERROR == nRet) && pSocketContext->bSkipCompletionOnSuccess)
+	{
+		IOInlineSendScope::Complete(pSocketContext, pOverlappedContext, dwBytes);
+	}
+
 	return true;
 }
 
-bool IServer::DoAccpet(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+bool IServer::PostShmSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD &dwError)
 {
-	SOCKADDR_IN *pClientAddr = nullptr;
-	SOCKADDR_IN *pLocalAddr = nullptr;
-	int clientAddrLen = sizeof(SOCKADDR_IN);
-	int localAddrLen = clientAddrLen;
+	pOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_SEND;
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_POST_SEND, pSocketContext->connId, pOverlappedContext->wsaBuffer.len);
+
+	if (!pSocketContext->pShmChannel->Send(pOverlappedContext->wsaBuffer.buf, pOverlappedContext->wsaBuffer.len))
+	{
+		dwError = ::GetLastError();
+		return false;
+	}
+
+	// 写入环形队列即完成发送，没有完成包，由当前线程完成本次send(OnSend在最外层的Send返回前回调)
+	pSocketContext->AddRef();
+	pSocketContext->BeginSend();
+	IOInlineSendScope::Complete(pSocketContext, pOverlappedContext, pOverlappedContext->wsaBuffer.len);
+
+	return true;
+}
+
+bool IServer::DoAccpet(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+{
+	SOCKADDR_IN *pClientAddr = nullptr;
+	SOCKADDR_IN *pLocalAddr = nullptr;
+	int clientAddrLen = 0;
+	int localAddrLen = 0;
 
-	// 获取地址信息
+	// 获取地址信息，地址长度须与AcceptEx投递时一致
 	m_fnGetAcceptExSockAddrs(
 		pOverlappedContext->wsaBuffer.buf,
 		0,
-		localAddrLen,
-		clientAddrLen,
+		GetAcceptAddrLen(),
+		GetAcceptAddrLen(),
 		(LPSOCKADDR *)&pLocalAddr,
 		&localAddrLen,
 		(LPSOCKADDR *)&pClientAddr,
@@ -355,41 +760,101 @@ bool IServer::DoAccpet(IOSocketContext *pSocketContext, IOOverlappedContext *pOv
 	);
 
 	// 为新连接建立一个SocketContext 
-	IOSocketContext *pNewSockContext = new IOSocketContext();
+	IOSocketContext *pNewSockContext = new IOSocketContext(this);
 	pNewSockContext->connSocket = pOverlappedContext->ioSocket;
-	memcpy_s(&(pNewSockContext->clientAddr), sizeof(SOCKADDR_IN), pClientAddr, sizeof(SOCKADDR_IN));
+	// AF_UNIX连接没有IP地址，clientAddr保持为0
+	if (AF_INET == m_nAddressFamily)
+	{
+		memcpy_s(&(pNewSockContext->clientAddr), sizeof(SOCKADDR_IN), pClientAddr, sizeof(SOCKADDR_IN));
+	}
+	m_connectionRegistry.Register(pNewSockContext);
+	if (m_pTlsCredentials)
+	{
+		pNewSockContext->pTlsSession = new IOTlsSession(m_pTlsCredentials);
+	}
+	if (m_bCompressEnabled)
+	{
+		pNewSockContext->pCompressStream =
+			new IOCompressStream(COMPRESS_STREAM_STATE::COMPRESS_STATE_PROBING, m_dwCompressThreshold);
+	}
+	if (m_captureWriter.IsOpen())
+	{
+		m_captureWriter.Append(CAPTURE_RECORD_TYPE::CAPTURE_RECORD_OPEN, pNewSockContext->connId, nullptr, 0);
+	}
+
+	// 继承监听socket的属性，使getpeername/shutdown以及热重启时的WSADuplicateSocket可用
+	::setsockopt(
+		pNewSockContext->connSocket,
+		SOL_SOCKET,
+		SO_UPDATE_ACCEPT_CONTEXT,
+		(char *)&pSocketContext->connSocket,
+		sizeof(pSocketContext->connSocket));
 
-	// 将listenSocketContext的IOContext 重置后继续投递AcceptEx
+	// 将listenSocketContext的IOContext 重置后继续投递AcceptEx，已交接监听socket时不再投递
+	// 过载时暂不投递，新连接留在内核的监听队列中(队列满后对端的连接请求被拒绝)
 	pOverlappedContext->ResetBufferAndOptType();
-	if (false == PostAccept(m_pListenSocketContext, pOverlappedContext))
+	if (m_nAccepting && m_pEngine->IsOverloaded())
 	{
-		m_pListenSocketContext->ReleaseIOOverlappedContext(pOverlappedContext);
+		PauseAccept(pSocketContext, pOverlappedContext);
+	}
+	else if (!m_nAccepting || false == PostAccept(pSocketContext, pOverlappedContext))
+	{
+		pSocketContext->ReleaseIOOverlappedContext(pOverlappedContext);
 	}
 
 	// 将新socket和完成端口绑定
-	if (NULL == ::CreateIoCompletionPort(
-		(HANDLE)pNewSockContext->connSocket,
-		m_completionPort,
-		(ULONG_PTR)pNewSockContext,
-		0
-	))
+	if (!m_pEngine->Attach(pNewSockContext, pNewSockContext->connSocket))
 	{
 		if (::WSAGetLastError() != ERROR_INVALID_PARAMETER)
 		{
-			DoClose(pNewSockContext);
+			DoClose(pNewSockContext, ::WSAGetLastError());
 			return false;
 		}
 	}
 
+	// 以下为TCP选项，AF_UNIX连接不需要
+	if (AF_INET == m_nAddressFamily)
+	{
+		SetTcpOptions(pNewSockContext->connSocket);
+	}
+
+	// TLS连接在握手完成后才通知上层
+	if (!pNewSockContext->pTlsSession)
+	{
+		IOCallbackScope callbackScope;
+		OnEstablished(pNewSockContext);
+	}
+
+	// 建立recv操作所需的ioContext，在新连接的socket上投递recv请求
+	IOOverlappedContext *pNewOverlappedContext = pNewSockContext->NewIOOverlappedContext(m_config.dwRecvBufferSize);
+	if (!pNewOverlappedContext)
+	{
+		DoClose(pNewSockContext, ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+	pNewOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_RECV;
+	pNewOverlappedContext->ioSocket = pNewSockContext->connSocket;
+
+	// 投递recv请求，失败时PostRecv内部已关闭连接
+	if (false == PostRecv(pNewSockContext, pNewOverlappedContext))
+	{
+		return false;
+	}
+
+	return true;
+}
+
+void IServer::SetTcpOptions(SOCKET sock)
+{
 	// 设置tcp_keepalive
 	tcp_keepalive alive_in;
 	tcp_keepalive alive_out;
-	alive_in.onoff = TRUE;
-	alive_in.keepalivetime = 1000 * 60;
-	alive_in.keepaliveinterval = 1000 * 10;
+	alive_in.onoff = m_config.dwKeepAliveTime ? TRUE : FALSE;
+	alive_in.keepalivetime = m_config.dwKeepAliveTime;
+	alive_in.keepaliveinterval = m_config.dwKeepAliveInterval;
 	unsigned long ulBytesReturn = 0;
 	if (SOCKET_ERROR == ::WSAIoctl(
-		pNewSockContext->connSocket,
+		sock,
 		SIO_KEEPALIVE_VALS,
 		&alive_in,
 		sizeof(alive_in),
@@ -403,155 +868,1167 @@ bool IServer::DoAccpet(IOSocketContext *pSocketContext, IOOverlappedContext *pOv
 		
 	}
 
-	OnEstablished(pNewSockContext);
+	// 按监听配置或低延迟模式关闭Nagle算法，小消息立即发出
+	if (m_config.bNoDelay || m_pEngine->GetBusyPoller().IsEnabled())
+	{
+		BOOL bNoDelay = TRUE;
+		::setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&bNoDelay, sizeof(bNoDelay));
+	}
+}
 
-	// 建立recv操作所需的ioContext，在新连接的socket上投递recv请求
-	IOOverlappedContext *pNewOverlappedContext = pNewSockContext->NewIOOverlappedContext();
-	pNewOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_RECV;
-	pNewOverlappedContext->ioSocket = pNewSockContext->connSocket;
+bool IServer::DoRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD dwBytes)
+{
+	pSocketContext->AddRecvBytes(dwBytes, m_pEngine->GetRebalanceEpoch());
 
-	// 投递recv请求
-	if (false == PostRecv(pNewSockContext, pNewOverlappedContext))
+	if (pSocketContext->pTlsSession)
+	{
+		if (!DoTlsRecv(pSocketContext, pOverlappedContext, dwBytes))
+		{
+			return false;
+		}
+	}
+	else if (!DeliverRecv(pSocketContext, pOverlappedContext, pOverlappedContext->wsaBuffer.buf, dwBytes))
 	{
-		DoClose(pSocketContext);
 		return false;
 	}
 
-	return true;
+	// 回调中连接可能已被关闭，此时不再继续投递，回调中请求的直接接收随之结束
+	if (pSocketContext->IsClosed())
+	{
+		FinishRecvInto(pSocketContext);
+		return false;
+	}
+
+	return ContinueRecv(pSocketContext, pOverlappedContext, dwBytes);
 }
 
-bool IServer::DoRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+bool IServer::ContinueRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD dwBytes)
 {
-	OnRecv(pSocketContext, pOverlappedContext);
+	// 连接正在交接给新进程，停止投递recv
+	if (pSocketContext->IsHandingOff())
+	{
+		ParkForHandOff(pSocketContext, pOverlappedContext);
+		return false;
+	}
+
 	pOverlappedContext->ResetBufferAndOptType();
-	if (false == PostRecv(pSocketContext, pOverlappedContext))
+
+	// 迁移的安全点：recv刚完成尚未再次投递，且没有在途的send；此后的recv及恢复通知均由目标分片处理
+	// 有在途send时留待下次recv完成再迁移；此刻其他线程新发起的send即使在原分片完成也不影响正确性
+	if (pSocketContext->IsMigratePending() && 0 == pSocketContext->GetPendingSends())
+	{
+		m_pEngine->Migrate(pSocketContext);
+	}
+
+	// 本轮读取预算已用完，推迟到轮转队列末尾，恢复通知排在已到达的完成包之后
+	if (m_recvScheduler.Charge(pSocketContext, dwBytes))
+	{
+		m_recvScheduler.Defer(pSocketContext);
+		pOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_RESUME;
+		if (!m_pEngine->Post(pSocketContext, pOverlappedContext))
+		{
+			m_recvScheduler.Resume(pSocketContext);
+			pSocketContext->Release();
+			return PostRecv(pSocketContext, pOverlappedContext);
+		}
+		return true;
+	}
+
+	return PostRecv(pSocketContext, pOverlappedContext);
+}
+
+bool IServer::DoShmRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+{
+	// 本端已关闭时唤醒包只用于释放登记的等待所持有的引用
+	DWORD dwBytes = 0;
+	SHM_WAIT_RESULT result = pSocketContext->ReceiveShm(dwBytes);
+	if (pSocketContext->IsClosed() || SHM_WAIT_RESULT::SHM_WAIT_CLOSED == result)
+	{
+		return false;
+	}
+
+	switch (result)
 	{
+	case SHM_WAIT_RESULT::SHM_WAIT_PEER_CLOSED:
 		DoClose(pSocketContext);
 		return false;
+	case SHM_WAIT_RESULT::SHM_WAIT_PEER_DEAD:
+		DoClose(pSocketContext, ERROR_BROKEN_PIPE);
+		return false;
+	case SHM_WAIT_RESULT::SHM_WAIT_INVALID_DATA:
+		DoClose(pSocketContext, ERROR_INVALID_DATA);
+		return false;
+	case SHM_WAIT_RESULT::SHM_WAIT_DATA:
+		// 不参与读取预算的调度，每次唤醒最多读一个接收缓冲区，其余留待下一个唤醒包
+		if (!DeliverRecv(pSocketContext, pOverlappedContext, pOverlappedContext->wsaBuffer.buf, dwBytes))
+		{
+			return false;
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (pSocketContext->IsClosed())
+	{
+		return false;
+	}
+
+	// 登记下一次接收，由新的等待或唤醒包持有引用
+	pSocketContext->AddRef();
+	if (!pSocketContext->ArmShmReader())
+	{
+		pSocketContext->Release();
+		DoClose(pSocketContext, ::GetLastError());
+		return false;
 	}
 
 	return true;
 }
 
-bool IServer::DoSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+void IServer::ResumeDeferredRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
 {
-	OnSend(pSocketContext, pOverlappedContext);
-	return true;
+	m_recvScheduler.Resume(pSocketContext);
+
+	// 推迟期间连接可能已关闭或开始交接
+	if (pSocketContext->IsClosed())
+	{
+		FinishRecvInto(pSocketContext);
+	}
+	else if (pSocketContext->IsHandingOff())
+	{
+		ParkForHandOff(pSocketContext, pOverlappedContext);
+	}
+	else
+	{
+		PostRecv(pSocketContext, pOverlappedContext);
+	}
+}
+
+void IServer::ParkForHandOff(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+{
+	// 直接接收中途的连接已有半条消息读入应用缓冲区，剩余数据无法由新进程接续，只能关闭
+	if (pSocketContext->pRecvIntoBuffer && pSocketContext->dwRecvIntoDone > 0)
+	{
+		DoClose(pSocketContext);
+		FinishRecvInto(pSocketContext);
+		return;
+	}
+
+	// 尚未读入任何数据的直接接收以0字节结束，之后的数据由新进程按OnRecv接收
+	FinishRecvInto(pSocketContext);
+	pSocketContext->Park(pOverlappedContext, 0);
 }
 
-bool IServer::DoClose(IOSocketContext *pSocketContext)
+bool IServer::RecvInto(IOSocketContext *pSocketContext, char *pBuffer, DWORD dwLen)
 {
-	if (pSocketContext)
+	if (!pSocketContext || !pBuffer || 0 == dwLen || pSocketContext->pRecvIntoBuffer ||
+		pSocketContext->IsClosed() || pSocketContext->IsHandingOff())
+	{
+		return false;
+	}
+
+	// 读到的须是应用数据本身
+	if (pSocketContext->pTlsSession || pSocketContext->pShmChannel ||
+		(pSocketContext->pCompressStream && !pSocketContext->pCompressStream->IsPassThrough()))
 	{
-		delete pSocketContext;
+		return false;
 	}
 
+	// 当前回调返回后，下一次投递的recv直接读入pBuffer
+	pSocketContext->pRecvIntoBuffer = pBuffer;
+	pSocketContext->dwRecvIntoLen = dwLen;
+	pSocketContext->dwRecvIntoDone = 0;
 	return true;
 }
 
-DWORD WINAPI IServer::WorkerThreadProc(LPVOID lpParam)
+void IServer::DoRecvInto(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, BOOL bRet, DWORD dwBytes, DWORD dwError)
 {
-	IServer *pThis = reinterpret_cast<IServer*>(lpParam);
-	if (!pThis)
+	// 失败(含连接关闭时被取消)或对端关闭，已读入的部分交还上层
+	if (!bRet || 0 == dwBytes)
 	{
-		return 0;
+		DoClose(pSocketContext, bRet ? NO_ERROR : dwError);
+		FinishRecvInto(pSocketContext);
+		return;
 	}
 
-	OVERLAPPED *pOverlapped = nullptr;
-	IOSocketContext *pSocketContext = nullptr;
-	DWORD dwBytes = 0;
-	IOOverlappedContext *pOverlappedContext = nullptr;
+	pSocketContext->AddRecvBytes(dwBytes, m_pEngine->GetRebalanceEpoch());
+	pSocketContext->dwRecvIntoDone += dwBytes;
+	if (pSocketContext->IsClosed())
+	{
+		FinishRecvInto(pSocketContext);
+		return;
+	}
 
-	// 采用退出信号及退出事件的双保险方式，以确保退出所有工作者线程
-	while (WAIT_OBJECT_0 != ::WaitForSingleObject(pThis->m_stopEvent, 0))
+	// 全部到达后交给上层，回调中可能再次请求直接接收
+	if (pSocketContext->dwRecvIntoDone >= pSocketContext->dwRecvIntoLen)
 	{
-		BOOL bRet = ::GetQueuedCompletionStatus(
-			pThis->m_completionPort,
-			&dwBytes,
-			(PULONG_PTR)&pSocketContext,
-			&pOverlapped,
-			INFINITE
-		);
+		FinishRecvInto(pSocketContext);
 
-		if (EXIT_SERVER_CODE == (ULONG_PTR)pSocketContext)
+		// 回调中关闭了连接，其中请求的下一段直接接收同样结束
+		if (pSocketContext->IsClosed())
 		{
-			break;
+			FinishRecvInto(pSocketContext);
+			return;
 		}
+	}
 
-		// 获取到传入的重叠结构参数IOOverlappedContext
-		pOverlappedContext = CONTAINING_RECORD(pOverlapped, IOOverlappedContext, wsaOverlapped);
+	// 与普通recv相同：迁移安全点、读取预算及交接检查，之后继续直接接收或恢复普通recv
+	ContinueRecv(pSocketContext, pOverlappedContext, dwBytes);
+}
 
-		if (!bRet)
+void IServer::FinishRecvInto(IOSocketContext *pSocketContext)
+{
+	char *pBuffer = pSocketContext->pRecvIntoBuffer;
+	if (!pBuffer)
+	{
+		return;
+	}
+
+	DWORD dwBytes = pSocketContext->dwRecvIntoDone;
+	pSocketContext->pRecvIntoBuffer = nullptr;
+	pSocketContext->dwRecvIntoLen = 0;
+	pSocketContext->dwRecvIntoDone = 0;
+
+	// 直接读入的数据未经过DispatchRecv，在此抓包
+	if (m_captureWriter.IsOpen() && dwBytes)
+	{
+		m_captureWriter.Append(CAPTURE_RECORD_TYPE::CAPTURE_RECORD_DATA, pSocketContext->connId, pBuffer, dwBytes);
+	}
+
+	IOCallbackScope callbackScope;
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_RECV_BEGIN, pSocketContext->connId, dwBytes);
+	OnRecvInto(pSocketContext, pBuffer, dwBytes);
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_RECV_END, pSocketContext->connId);
+}
+
+void IServer::SetRecvBudget(DWORD dwBytesPerRound)
+{
+	m_recvScheduler.SetBudget(dwBytesPerRound);
+}
+
+void IServer::EnableBusyPoll(DWORD dwSpinUs, LONG nMaxSpinners)
+{
+	m_pEngine->EnableBusyPoll(dwSpinUs, nMaxSpinners);
+}
+
+void IServer::EnableAdmissionControl(DWORD dwTargetUs, DWORD dwIntervalMs)
+{
+	m_pEngine->EnableAdmissionControl(dwTargetUs, dwIntervalMs);
+}
+
+void IServer::PauseAccept(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+{
+	pSocketContext->AddRef();
+	{
+		AutoLock<EngineLock> lock(m_pausedAcceptLock);
+		m_pausedAccepts.push_back(std::make_pair(pSocketContext, pOverlappedContext));
+	}
+
+	// 加入前可能已解除过载或已停止接受，此时不会再有人来取，由自身立即处理
+	if (!m_nAccepting || !m_pEngine->IsOverloaded())
+	{
+		ResumeAccepts();
+	}
+}
+
+void IServer::ResumeAccepts()
+{
+	std::vector<std::pair<IOSocketContext*, IOOverlappedContext*>> pausedAccepts;
+	{
+		AutoLock<EngineLock> lock(m_pausedAcceptLock);
+		pausedAccepts.swap(m_pausedAccepts);
+	}
+
+	// 已停止接受时只归还重叠结构
+	for (size_t index = 0; index < pausedAccepts.size(); ++index)
+	{
+		IOSocketContext *pSocketContext = pausedAccepts[index].first;
+		IOOverlappedContext *pOverlappedContext = pausedAccepts[index].second;
+		if (!m_nAccepting || false == PostAccept(pSocketContext, pOverlappedContext))
 		{
-			DWORD dwErr = ::WSAGetLastError();
-			if (WAIT_TIMEOUT == dwErr)
-			{
-				if (!pThis->IsSocketAlive(pSocketContext->connSocket))
-				{
-					InterlockedDecrement(&pThis->m_nConnectCounts);
+			pSocketContext->ReleaseIOOverlappedContext(pOverlappedContext);
+		}
+		pSocketContext->Release();
+	}
+}
 
-					pThis->OnClosed(pSocketContext);
-					pThis->DoClose(pSocketContext);
-				}
-				continue;
-			}
-			else if (ERROR_NETNAME_DELETED == dwErr)
-			{
-				InterlockedDecrement(&pThis->m_nConnectCounts);
+void IServer::OnOverloadChanged(bool bOverloaded)
+{
+	if (!bOverloaded)
+	{
+		ResumeAccepts();
+	}
+}
 
-				pThis->OnError(pSocketContext, dwErr);
-				pThis->DoClose(pSocketContext);
-				continue;
-			}
-			else // others error
-			{
-				InterlockedDecrement(&pThis->m_nConnectCounts);
+void IServer::EnableRebalance(DWORD dwIntervalMs, DWORD dwImbalancePercent)
+{
+	m_pEngine->EnableRebalance(dwIntervalMs, dwImbalancePercent);
+}
 
-				pThis->OnError(pSocketContext, dwErr);
-				pThis->DoClose(pSocketContext);
-				continue;
-			}
+void IServer::OnRebalance(HANDLE fromPort, HANDLE toPort, double dFraction)
+{
+	std::vector<CONN_ID> connIds;
+	m_connectionRegistry.Snapshot(connIds);
+
+	// 收集位于fromPort分片上的连接及其上一个检查周期的读取量；共享内存连接没有socket可改绑，不参与迁移
+	// 在引擎的检查线程上进行，不占用工作者线程
+	LONG64 nEpoch = m_pEngine->GetRebalanceEpoch();
+	std::vector<std::pair<ULONGLONG, CONN_ID>> candidates;
+	ULONGLONG ullTotalBytes = 0;
+	for (size_t index = 0; index < connIds.size(); ++index)
+	{
+		IOSocketContext *pSocketContext = m_connectionRegistry.Acquire(connIds[index]);
+		if (!pSocketContext)
+		{
+			continue;
+		}
+
+		ULONGLONG ullDelta = pSocketContext->GetLastEpochRecvBytes(nEpoch);
+		if (fromPort == pSocketContext->completionPort && !pSocketContext->pShmChannel &&
+			!pSocketContext->IsClosed() && !pSocketContext->IsHandingOff() && ullDelta)
+		{
+			candidates.push_back(std::make_pair(ullDelta, connIds[index]));
+			ullTotalBytes += ullDelta;
+		}
+		pSocketContext->Release();
+	}
+
+	// 从负载最重的连接开始，迁移量达到分片负载的dFraction即止
+	std::sort(candidates.begin(), candidates.end(),
+		[](const std::pair<ULONGLONG, CONN_ID> &a, const std::pair<ULONGLONG, CONN_ID> &b) { return a.first > b.first; });
+
+	ULONGLONG ullTargetBytes = (ULONGLONG)(ullTotalBytes * dFraction);
+	DWORD dwMoves = 0;
+	for (size_t index = 0; index < candidates.size() && dwMoves < REBALANCE_MAX_MOVES && ullTargetBytes; ++index)
+	{
+		// 单个连接超过剩余差额的两倍时，迁过去只会使失衡反向
+		if (candidates[index].first > 2 * ullTargetBytes)
+		{
+			continue;
+		}
+
+		IOSocketContext *pSocketContext = m_connectionRegistry.Acquire(candidates[index].second);
+		if (!pSocketContext)
+		{
+			continue;
+		}
+		pSocketContext->RequestMigrate(toPort);
+		pSocketContext->Release();
+
+		ullTargetBytes -= (candidates[index].first < ullTargetBytes) ? candidates[index].first : ullTargetBytes;
+		++dwMoves;
+	}
+}
+
+bool IServer::DoSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+{
+	IOCallbackScope callbackScope;
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_SEND_BEGIN, pSocketContext->connId, pOverlappedContext->wsaBuffer.len);
+	OnSend(pSocketContext, pOverlappedContext);
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_SEND_END, pSocketContext->connId);
+	return true;
+}
+
+bool IServer::DoClose(IOSocketContext *pSocketContext, DWORD dwError)
+{
+	// 同一连接上的多个IO可能同时失败，只有第一次关闭生效
+	if (!pSocketContext || !pSocketContext->MarkClosed())
+	{
+		return false;
+	}
+
+	InterlockedDecrement(&m_nConnectCounts);
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_CLOSE, pSocketContext->connId, dwError);
+
+	{
+		IOCallbackScope callbackScope;
+		if (NO_ERROR == dwError)
+		{
+			OnClosed(pSocketContext);
 		}
 		else
 		{
-			// 若客户端断开，则关闭连接
-			if ((0 == dwBytes) && 
-				(IOCP_OPERATOR_TYPE::IOCP_OPT_RECV == pOverlappedContext->optType ||
-				IOCP_OPERATOR_TYPE::IOCP_OPT_SEND == pOverlappedContext->optType))
-			{
-				InterlockedDecrement(&pThis->m_nConnectCounts);
+			OnError(pSocketContext, dwError);
+		}
+	}
 
-				pThis->OnClosed(pSocketContext);
-				pThis->DoClose(pSocketContext);
-				continue;
-			}
-			else
-			{
-				switch (pOverlappedContext->optType)
-				{
-				case IOCP_OPERATOR_TYPE::IOCP_OPT_ACCPEPT:
-				{
-					InterlockedIncrement(&pThis->m_nConnectCounts);
+	if (m_captureWriter.IsOpen())
+	{
+		m_captureWriter.Append(CAPTURE_RECORD_TYPE::CAPTURE_RECORD_CLOSE, pSocketContext->connId, nullptr, 0);
+	}
 
-					pThis->DoAccpet(pSocketContext, pOverlappedContext);
-				}
-				break;
-				case IOCP_OPERATOR_TYPE::IOCP_OPT_RECV:
-				{
-					pThis->DoRecv(pSocketContext, pOverlappedContext);
-				}
-				break;
-				case IOCP_OPERATOR_TYPE::IOCP_OPT_SEND:
-				{
-					pThis->DoSend(pSocketContext, pOverlappedContext);
-				}
-				break;
-				default:
-					break;
-				}
-			}
+	// 先注销使连接ID失效，再取消在途IO，最后释放连接自身持有的引用
+	// 在途IO完成时各自释放引用，最后一个引用释放时上下文才被销毁
+	m_connectionRegistry.Unregister(pSocketContext->connId);
+	pSocketContext->CancelIO();
+	pSocketContext->Release();
+
+	return true;
+}
+
+bool IServer::SendCompressed(IOSocketContext *pSocketContext, const char *buffer, int nLen, DWORD &dwError)
+{
+	// 每块消息编码为一帧，帧长度不超过一个缓冲区
+	char frame[MAX_BUFFER_SIZE];
+	DWORD dwMaxChunk = IOCompressStream::GetMaxRawChunk(MAX_BUFFER_SIZE);
+
+	DWORD dwOffset = 0;
+	while (dwOffset < (DWORD)nLen)
+	{
+		DWORD dwChunk = ((DWORD)nLen - dwOffset < dwMaxChunk) ? ((DWORD)nLen - dwOffset) : dwMaxChunk;
+		DWORD dwFrameLen = 0;
+		if (!pSocketContext->pCompressStream->Encode(buffer + dwOffset, dwChunk, frame, MAX_BUFFER_SIZE, dwFrameLen) ||
+			!SendPlain(pSocketContext, frame, (int)dwFrameLen, dwError))
+		{
+			return false;
 		}
+		dwOffset += dwChunk;
 	}
 
-	return 0;
+	return true;
+}
+
+bool IServer::SendPlain(IOSocketContext *pSocketContext, const char *buffer, int nLen, DWORD &dwError)
+{
+	if (pSocketContext->pTlsSession)
+	{
+		return SendTls(pSocketContext, buffer, nLen, dwError);
+	}
+
+	return PostRawSend(pSocketContext, buffer, nLen, dwError);
+}
+
+bool IServer::PostRawSend(IOSocketContext *pSocketContext, const char *buffer, int nLen, DWORD &dwError)
+{
+	IOOverlappedContext *pNewOverlappedContext = pSocketContext->NewIOOverlappedContext();
+	if (!pNewOverlappedContext)
+	{
+		dwError = ERROR_NOT_ENOUGH_MEMORY;
+		return false;
+	}
+	pNewOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_SEND;
+	pNewOverlappedContext->ioSocket = pSocketContext->connSocket;
+	::memcpy_s(pNewOverlappedContext->wsaBuffer.buf, MAX_BUFFER_SIZE, buffer, nLen);
+	pNewOverlappedContext->wsaBuffer.len = (ULONG)nLen;
+
+	return PostSend(pSocketContext, pNewOverlappedContext, dwError);
+}
+
+bool IServer::SendTls(IOSocketContext *pSocketContext, const char *buffer, int nLen, DWORD &dwError)
+{
+	IOTlsSession *pTlsSession = pSocketContext->pTlsSession;
+
+	// 加密与投递在同一把锁内完成，保证TLS记录序号与发送顺序一致
+	// 锁内只记录失败，由调用者在锁外关闭：OnError中可能再对同一连接调用Send，不可重入的锁会自锁
+	AutoLock<EngineLock> lock(pTlsSession->GetLock());
+	DWORD dwMaxChunk = pTlsSession->GetMaxPlainChunk(MAX_BUFFER_SIZE);
+	if (0 == dwMaxChunk)
+	{
+		return false;
+	}
+
+	// 明文直接加密到重叠结构的缓冲区中，不再额外拷贝
+	DWORD dwOffset = 0;
+	while (dwOffset < (DWORD)nLen)
+	{
+		DWORD dwChunk = ((DWORD)nLen - dwOffset < dwMaxChunk) ? ((DWORD)nLen - dwOffset) : dwMaxChunk;
+		DWORD dwOutLen = 0;
+
+		IOOverlappedContext *pNewOverlappedContext = pSocketContext->NewIOOverlappedContext();
+		if (!pNewOverlappedContext)
+		{
+			dwError = ERROR_NOT_ENOUGH_MEMORY;
+			return false;
+		}
+		pNewOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_SEND;
+		pNewOverlappedContext->ioSocket = pSocketContext->connSocket;
+		if (!pTlsSession->Encrypt(buffer + dwOffset, dwChunk, pNewOverlappedContext->wsaBuffer.buf, MAX_BUFFER_SIZE, dwOutLen))
+		{
+			pSocketContext->ReleaseIOOverlappedContext(pNewOverlappedContext);
+			dwError = (DWORD)pTlsSession->GetLastStatus();
+			return false;
+		}
+		pNewOverlappedContext->wsaBuffer.len = dwOutLen;
+
+		if (false == PostSend(pSocketContext, pNewOverlappedContext, dwError))
+		{
+			return false;
+		}
+		dwOffset += dwChunk;
+	}
+
+	return true;
+}
+
+bool IServer::DoTlsRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD dwBytes)
+{
+	// 握手数据分多块发送，同步完成的send在全部投递后再处理
+	IOInlineSendScope inlineSendScope;
+	IOTlsSession *pTlsSession = pSocketContext->pTlsSession;
+	std::vector<char> handshakeOut, plainText;
+	bool bHandshaking = false, result = false, bSendFailed = false;
+	DWORD dwSendError = NO_ERROR;
+
+	{
+		AutoLock<EngineLock> lock(pTlsSession->GetLock());
+		bHandshaking = !pTlsSession->IsEstablished();
+		result = pTlsSession->Feed(pOverlappedContext->wsaBuffer.buf, dwBytes, handshakeOut, plainText);
+
+		// 握手数据(包括失败时的alert)原样发送给对端
+		for (size_t nOffset = 0; nOffset < handshakeOut.size(); nOffset += MAX_BUFFER_SIZE)
+		{
+			size_t nChunk = handshakeOut.size() - nOffset;
+			if (nChunk > MAX_BUFFER_SIZE)
+			{
+				nChunk = MAX_BUFFER_SIZE;
+			}
+
+			if (!PostRawSend(pSocketContext, handshakeOut.data() + nOffset, (int)nChunk, dwSendError))
+			{
+				bSendFailed = true;
+				break;
+			}
+		}
+	}
+
+	// 握手数据发送失败时与下面解密失败的情况一样在锁外关闭
+	if (bSendFailed)
+	{
+		DoClose(pSocketContext, dwSendError);
+		return false;
+	}
+
+	// 对端发送close_notify时按正常关闭处理
+	if (!result)
+	{
+		SECURITY_STATUS status = pTlsSession->GetLastStatus();
+		DoClose(pSocketContext, (SEC_I_CONTEXT_EXPIRED == status) ? NO_ERROR : (DWORD)status);
+		return false;
+	}
+
+	if (bHandshaking && pTlsSession->IsEstablished())
+	{
+		IOCallbackScope callbackScope;
+		OnEstablished(pSocketContext);
+	}
+
+	if (plainText.empty())
+	{
+		return true;
+	}
+
+	return DeliverRecv(pSocketContext, pOverlappedContext, plainText.data(), (DWORD)plainText.size());
+}
+
+bool IServer::DeliverRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, const char *buffer, DWORD dwBytes)
+{
+	IOCompressStream *pCompressStream = pSocketContext->pCompressStream;
+
+	// 未分帧的数据已在重叠结构的缓冲区中时直接交给上层，否则按缓冲区大小分块拷贝
+	if (!pCompressStream || pCompressStream->IsPassThrough())
+	{
+		if (buffer == pOverlappedContext->wsaBuffer.buf)
+		{
+			pOverlappedContext->wsaBuffer.len = dwBytes;
+			DispatchRecv(pSocketContext, pOverlappedContext);
+			return true;
+		}
+
+		for (DWORD dwOffset = 0; dwOffset < dwBytes && !pSocketContext->IsClosed(); dwOffset += MAX_BUFFER_SIZE)
+		{
+			DWORD dwChunk = (dwBytes - dwOffset < MAX_BUFFER_SIZE) ? (dwBytes - dwOffset) : MAX_BUFFER_SIZE;
+			pOverlappedContext->ResetBufferAndOptType();
+			::memcpy_s(pOverlappedContext->wsaBuffer.buf, MAX_BUFFER_SIZE, buffer + dwOffset, dwChunk);
+			pOverlappedContext->wsaBuffer.len = dwChunk;
+			DispatchRecv(pSocketContext, pOverlappedContext);
+		}
+		return true;
+	}
+
+	if (!pCompressStream->Feed(buffer, dwBytes))
+	{
+		DoClose(pSocketContext, ERROR_INVALID_DATA);
+		return false;
+	}
+
+	// 应答客户端的压缩协商
+	if (pCompressStream->TakeHello())
+	{
+		char hello[sizeof(IOCompressFrameHeader)];
+		DWORD dwHelloLen = IOCompressStream::WriteHello(hello, sizeof(hello));
+		DWORD dwError = NO_ERROR;
+		if (!SendPlain(pSocketContext, hello, (int)dwHelloLen, dwError))
+		{
+			DoClose(pSocketContext, dwError);
+			return false;
+		}
+	}
+
+	// 完整的帧逐条解压到重叠结构的缓冲区中交给上层
+	while (!pSocketContext->IsClosed())
+	{
+		DWORD dwMessageLen = 0;
+		pOverlappedContext->ResetBufferAndOptType();
+		if (!pCompressStream->NextMessage(pOverlappedContext->wsaBuffer.buf, MAX_BUFFER_SIZE, dwMessageLen))
+		{
+			DoClose(pSocketContext, ERROR_INVALID_DATA);
+			return false;
+		}
+
+		if (0 == dwMessageLen)
+		{
+			break;
+		}
+
+		pOverlappedContext->wsaBuffer.len = dwMessageLen;
+		DispatchRecv(pSocketContext, pOverlappedContext);
+	}
+
+	return true;
+}
+
+void IServer::DispatchRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+{
+	// 在交给上层前抓包，记录的是解密/解压后的应用数据，可直接对明文服务端回放
+	if (m_captureWriter.IsOpen())
+	{
+		m_captureWriter.Append(CAPTURE_RECORD_TYPE::CAPTURE_RECORD_DATA, pSocketContext->connId,
+			pOverlappedContext->wsaBuffer.buf, pOverlappedContext->wsaBuffer.len);
+	}
+
+	IOCallbackScope callbackScope;
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_RECV_BEGIN, pSocketContext->connId, pOverlappedContext->wsaBuffer.len);
+	OnRecv(pSocketContext, pOverlappedContext);
+	IOTracer::Record(TRACE_EVENT_TYPE::TRACE_EVENT_RECV_END, pSocketContext->connId);
+}
+
+// 热重启交接管道上传递的消息
+enum class HANDOFF_MESSAGE_TYPE
+{
+	HANDOFF_MSG_LISTENER = 1,	// 监听socket
+	HANDOFF_MSG_CONNECTION,		// 已建立的连接，消息后紧跟dwDataLen字节尚未处理的数据
+	HANDOFF_MSG_END,			// 交接结束
+};
+
+struct HandOffMessage
+{
+	HANDOFF_MESSAGE_TYPE msgType;
+	DWORD dwDataLen;
+	SOCKADDR_IN clientAddr;
+	WSAPROTOCOL_INFOW protocolInfo;
+	char unixPath[UNIX_PATH_SIZE];		// HANDOFF_MSG_LISTENER：AF_UNIX监听socket的路径，新进程停止时据此删除socket文件
+};
+
+bool IServer::StartFromHandOff(const std::string &pipeName, unsigned int nMaxAcceptConn)
+{
+	IOListenerConfig config;
+	config.nMaxAcceptConn = nMaxAcceptConn;
+	return StartFromHandOff(pipeName, config);
+}
+
+bool IServer::StartFromHandOff(const std::string &pipeName, const IOListenerConfig &config)
+{
+	if (!SetConfig(config))
+	{
+		return false;
+	}
+
+	::InterlockedExchange(&m_nAccepting, 1);
+
+	if (!m_pEngine->Start(m_config.nWorkerThreadNum))
+	{
+		UnInit();
+		return false;
+	}
+	m_pEngine->RegisterHandler(this);
+
+	if (!ReceiveHandOff(pipeName))
+	{
+		Stop();
+		return false;
+	}
+
+	return true;
+}
+
+bool IServer::HandOff(const std::string &pipeName, bool bHandOffConnections, DWORD dwDrainTimeout)
+{
+	if (!m_pListenSocketContext || INVALID_SOCKET == m_pListenSocketContext->connSocket)
+	{
+		return false;
+	}
+
+	// 交接管道只允许当前用户连接，同名管道已被其他进程抢先创建时失败
+	HANDLE hPipe = IOPipe::Create(pipeName, PIPE_ACCESS_DUPLEX, HANDOFF_PIPE_BUFFER_SIZE);
+	if (INVALID_HANDLE_VALUE == hPipe)
+	{
+		return false;
+	}
+
+	// 在超时时间内等待新进程连接到交接管道
+	bool result = false;
+	if (IOPipe::Accept(hPipe, HANDOFF_CONNECT_TIMEOUT))
+	{
+		result = SendHandOff(hPipe, bHandOffConnections);
+
+		// DisconnectNamedPipe会丢弃未读取的数据：等待新进程读完后关闭管道(读取因管道断开而失败)，最长等待HANDOFF_IO_TIMEOUT
+		char cByte = 0;
+		IOPipe::Read(hPipe, &cByte, sizeof(cByte), HANDOFF_IO_TIMEOUT);
+		::DisconnectNamedPipe(hPipe);
+	}
+	::CloseHandle(hPipe);
+
+	// 交接成功后旧进程不再接受新连接，等待剩余连接自然结束
+	if (result)
+	{
+		WaitForDrain(dwDrainTimeout);
+	}
+
+	return result;
+}
+
+void IServer::StopAccept()
+{
+	// 取消监听socket上所有在途的AcceptEx，完成后不再重新投递
+	::InterlockedExchange(&m_nAccepting, 0);
+	if (m_pListenSocketContext)
+	{
+		m_pListenSocketContext->CancelIO();
+	}
+
+	// 归还过载期间暂停的AcceptEx
+	ResumeAccepts();
+
+	// 等待共享内存接受线程退出，之后不会再有新的共享内存连接
+	StopShmListener();
+}
+
+bool IServer::SendHandOff(HANDLE hPipe, bool bHandOffConnections)
+{
+	// 复制socket的目标进程取自系统记录的管道客户端，而非对端发来的数据
+	ULONG ulTargetProcessId = 0;
+	if (!::GetNamedPipeClientProcessId(hPipe, &ulTargetProcessId))
+	{
+		return false;
+	}
+	DWORD dwTargetProcessId = (DWORD)ulTargetProcessId;
+
+	HandOffMessage msg;
+	::memset(&msg, 0, sizeof(msg));
+	msg.msgType = HANDOFF_MESSAGE_TYPE::HANDOFF_MSG_LISTENER;
+	if (SOCKET_ERROR == ::WSADuplicateSocketW(m_pListenSocketContext->connSocket, dwTargetProcessId, &msg.protocolInfo))
+	{
+		return false;
+	}
+	if (m_bOwnsSocketFile && m_config.unixPath.size() < sizeof(msg.unixPath))
+	{
+		::memcpy(msg.unixPath, m_config.unixPath.c_str(), m_config.unixPath.size());
+	}
+
+	if (!IOPipe::Write(hPipe, &msg, sizeof(msg), HANDOFF_IO_TIMEOUT))
+	{
+		return false;
+	}
+
+	// 新进程已开始在同一监听socket上接受连接，旧进程停止接受
+	StopAccept();
+	m_bOwnsSocketFile = false;
+
+	if (bHandOffConnections)
+	{
+		SendHandOffConnections(hPipe, dwTargetProcessId);
+	}
+
+	::memset(&msg, 0, sizeof(msg));
+	msg.msgType = HANDOFF_MESSAGE_TYPE::HANDOFF_MSG_END;
+	return IOPipe::Write(hPipe, &msg, sizeof(msg), HANDOFF_IO_TIMEOUT);
+}
+
+bool IServer::SendHandOffConnections(HANDLE hPipe, DWORD dwTargetProcessId)
+{
+	std::vector<CONN_ID> connIds;
+	m_connectionRegistry.Snapshot(connIds);
+
+	std::vector<IOSocketContext *> socketContexts;
+	for (size_t index = 0; index < connIds.size(); ++index)
+	{
+		IOSocketContext *pSocketContext = m_connectionRegistry.Acquire(connIds[index]);
+		if (pSocketContext && pSocketContext->pShmChannel)
+		{
+			// 共享内存连接没有socket，不参与交接，留在本进程中随WaitForDrain自然结束
+			pSocketContext->Release();
+		}
+		else if (pSocketContext && (pSocketContext->pTlsSession ||
+			(pSocketContext->pCompressStream && !pSocketContext->pCompressStream->IsPassThrough())))
+		{
+			// TLS会话及压缩分帧状态无法跨进程传递，直接关闭，由客户端重连到新进程
+			DoClose(pSocketContext);
+			pSocketContext->Release();
+		}
+		else if (pSocketContext)
+		{
+			pSocketContext->BeginHandOff();
+			socketContexts.push_back(pSocketContext);
+		}
+	}
+
+	// 等待连接停止收数据且在途的send全部完成，即连接上没有任何在途IO
+	ULONGLONG ullDeadline = ::GetTickCount64() + HANDOFF_PARK_TIMEOUT;
+	for (;;)
+	{
+		bool bAllParked = true;
+		for (size_t index = 0; index < socketContexts.size(); ++index)
+		{
+			IOSocketContext *pSocketContext = socketContexts[index];
+			if (pSocketContext->IsClosed())
+			{
+				continue;
+			}
+
+			if (!pSocketContext->IsParked() || pSocketContext->GetPendingSends() > 0)
+			{
+				// recv可能在取消之后才投递，需要再次取消
+				pSocketContext->CancelRecv();
+				bAllParked = false;
+			}
+		}
+
+		if (bAllParked || ::GetTickCount64() >= ullDeadline)
+		{
+			break;
+		}
+		::Sleep(1);
+	}
+
+	bool result = true;
+	for (size_t index = 0; index < socketContexts.size(); ++index)
+	{
+		IOSocketContext *pSocketContext = socketContexts[index];
+		if (!pSocketContext->IsClosed() && pSocketContext->IsParked() && 0 == pSocketContext->GetPendingSends())
+		{
+			DWORD dwBytes = 0;
+			IOOverlappedContext *pParkedOverlappedContext = pSocketContext->GetParkedOverlappedContext(dwBytes);
+
+			HandOffMessage msg;
+			::memset(&msg, 0, sizeof(msg));
+			msg.msgType = HANDOFF_MESSAGE_TYPE::HANDOFF_MSG_CONNECTION;
+			msg.dwDataLen = pParkedOverlappedContext ? dwBytes : 0;
+			msg.clientAddr = pSocketContext->clientAddr;
+
+			if (result &&
+				SOCKET_ERROR != ::WSADuplicateSocketW(pSocketContext->connSocket, dwTargetProcessId, &msg.protocolInfo))
+			{
+				result = IOPipe::Write(hPipe, &msg, sizeof(msg), HANDOFF_IO_TIMEOUT) && (0 == msg.dwDataLen ||
+					IOPipe::Write(hPipe, pParkedOverlappedContext->wsaBuffer.buf, msg.dwDataLen, HANDOFF_IO_TIMEOUT));
+			}
+		}
+
+		// 已交接的连接在本进程中关闭，底层连接由新进程的socket句柄继续持有
+		// 未能在超时时间内交接的连接也一并关闭
+		DoClose(pSocketContext);
+		pSocketContext->Release();
+	}
+
+	return result;
+}
+
+bool IServer::ReceiveHandOff(const std::string &pipeName)
+{
+	// 旧进程可能尚未创建交接管道，在超时时间内重试；旧进程从系统取得本进程的ID
+	HANDLE hPipe = IOPipe::Open(pipeName, GENERIC_READ | GENERIC_WRITE, HANDOFF_CONNECT_TIMEOUT);
+	if (INVALID_HANDLE_VALUE == hPipe)
+	{
+		return false;
+	}
+
+	bool bListenerReceived = false;
+	std::vector<char> buffer;
+	HandOffMessage msg;
+	while (IOPipe::Read(hPipe, &msg, sizeof(msg), HANDOFF_IO_TIMEOUT))
+	{
+		if (HANDOFF_MESSAGE_TYPE::HANDOFF_MSG_LISTENER == msg.msgType)
+		{
+			bListenerReceived = AttachHandOffListenSocket(msg.protocolInfo, msg.unixPath);
+			if (!bListenerReceived)
+			{
+				break;
+			}
+		}
+		else if (HANDOFF_MESSAGE_TYPE::HANDOFF_MSG_CONNECTION == msg.msgType)
+		{
+			// 数据长度超出recv缓冲区的上限时只放弃这一个连接：读掉其数据使管道上的消息保持对齐，继续接收后面的连接
+			if (msg.dwDataLen > RECV_BUFFER_SIZE_MAX)
+			{
+				if (!SkipHandOffConnection(hPipe, msg.protocolInfo, msg.dwDataLen))
+				{
+					break;
+				}
+				continue;
+			}
+
+			buffer.resize(msg.dwDataLen);
+			if (msg.dwDataLen && !IOPipe::Read(hPipe, buffer.data(), msg.dwDataLen, HANDOFF_IO_TIMEOUT))
+			{
+				break;
+			}
+			AttachHandOffConnection(msg.protocolInfo, msg.clientAddr, buffer.data(), msg.dwDataLen);
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	::CloseHandle(hPipe);
+	return bListenerReceived;
+}
+
+bool IServer::SkipHandOffConnection(HANDLE hPipe, WSAPROTOCOL_INFOW &protocolInfo, DWORD dwDataLen)
+{
+	// 旧进程交出连接后即关闭自己的句柄，接管后立即关闭，连接不会悬空
+	SOCKET connSocket = ::WSASocketW(
+		FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &protocolInfo, 0, WSA_FLAG_OVERLAPPED);
+	if (INVALID_SOCKET != connSocket)
+	{
+		::closesocket(connSocket);
+	}
+
+	char drain[MAX_BUFFER_SIZE];
+	while (dwDataLen > 0)
+	{
+		DWORD dwLen = (dwDataLen > sizeof(drain)) ? (DWORD)sizeof(drain) : dwDataLen;
+		if (!IOPipe::Read(hPipe, drain, dwLen, HANDOFF_IO_TIMEOUT))
+		{
+			return false;
+		}
+		dwDataLen -= dwLen;
+	}
+	return true;
+}
+
+bool IServer::AttachHandOffListenSocket(WSAPROTOCOL_INFOW &protocolInfo, const char *unixPath)
+{
+	m_pListenSocketContext = new IOSocketContext(this);
+	m_pListenSocketContext->connSocket = ::WSASocketW(
+		FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &protocolInfo, 0, WSA_FLAG_OVERLAPPED);
+	if (INVALID_SOCKET == m_pListenSocketContext->connSocket)
+	{
+		return false;
+	}
+
+	if (!m_pEngine->Attach(m_pListenSocketContext, m_pListenSocketContext->connSocket, true))
+	{
+		return false;
+	}
+
+	// 接受的socket须与监听socket的地址族一致，AF_UNIX监听停止时按配置的路径删除socket文件
+	m_nAddressFamily = protocolInfo.iAddressFamily;
+
+	// 端口以接管的监听socket实际绑定的为准，而不是配置中的默认值
+	SOCKADDR_STORAGE localAddr;
+	int nLocalAddrLen = sizeof(localAddr);
+	if (SOCKET_ERROR != ::getsockname(m_pListenSocketContext->connSocket, (SOCKADDR *)&localAddr, &nLocalAddrLen))
+	{
+		if (AF_INET == localAddr.ss_family)
+		{
+			m_config.nPort = ::ntohs(((SOCKADDR_IN *)&localAddr)->sin_port);
+		}
+		else if (AF_INET6 == localAddr.ss_family)
+		{
+			m_config.nPort = ::ntohs(((SOCKADDR_IN6 *)&localAddr)->sin6_port);
+		}
+	}
+
+	// socket文件的路径以旧进程交来的为准，新进程可能未配置unixPath；路径不完整(无结尾0)时不接管删除
+	if (AF_UNIX == m_nAddressFamily && ::memchr(unixPath, 0, UNIX_PATH_SIZE) && unixPath[0])
+	{
+		m_config.unixPath = unixPath;
+	}
+	m_bOwnsSocketFile = (AF_UNIX == m_nAddressFamily) && !m_config.unixPath.empty();
+
+	// 交接的监听socket已处于监听状态，直接投递AcceptEx
+	return InitAcceptEx();
+}
+
+bool IServer::AttachHandOffConnection(
+	WSAPROTOCOL_INFOW &protocolInfo, const SOCKADDR_IN &clientAddr, const char *buffer, DWORD dwBytes)
+{
+	SOCKET connSocket = ::WSASocketW(
+		FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &protocolInfo, 0, WSA_FLAG_OVERLAPPED);
+	if (INVALID_SOCKET == connSocket)
+	{
+		return false;
+	}
+
+	IOSocketContext *pNewSockContext = new IOSocketContext(this);
+	pNewSockContext->connSocket = connSocket;
+	pNewSockContext->clientAddr = clientAddr;
+	m_connectionRegistry.Register(pNewSockContext);
+	InterlockedIncrement(&m_nConnectCounts);
+	if (m_captureWriter.IsOpen())
+	{
+		m_captureWriter.Append(CAPTURE_RECORD_TYPE::CAPTURE_RECORD_OPEN, pNewSockContext->connId, nullptr, 0);
+	}
+
+	if (!m_pEngine->Attach(pNewSockContext, connSocket))
+	{
+		DoClose(pNewSockContext, ::GetLastError());
+		return false;
+	}
+
+	{
+		IOCallbackScope callbackScope;
+		OnEstablished(pNewSockContext);
+	}
+
+	// 旧进程的recv缓冲区可能大于本进程的配置，按两者中较大的分配，保证未处理的数据能完整放下
+	IOOverlappedContext *pNewOverlappedContext =
+		pNewSockContext->NewIOOverlappedContext((dwBytes > m_config.dwRecvBufferSize) ? dwBytes : m_config.dwRecvBufferSize);
+	if (!pNewOverlappedContext)
+	{
+		DoClose(pNewSockContext, ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+	pNewOverlappedContext->optType = IOCP_OPERATOR_TYPE::IOCP_OPT_RECV;
+	pNewOverlappedContext->ioSocket = connSocket;
+
+	// 旧进程已收到但未交给上层的数据，先交给上层处理再继续投递recv
+	if (dwBytes > 0)
+	{
+		::memcpy_s(pNewOverlappedContext->wsaBuffer.buf, pNewOverlappedContext->dwBufferSize, buffer, dwBytes);
+		return DoRecv(pNewSockContext, pNewOverlappedContext, dwBytes);
+	}
+
+	return PostRecv(pNewSockContext, pNewOverlappedContext);
+}
+
+void IServer::WaitForDrain(DWORD dwTimeout)
+{
+	ULONGLONG ullDeadline = ::GetTickCount64() + dwTimeout;
+	while (m_nConnectCounts > 0 && ::GetTickCount64() < ullDeadline)
+	{
+		::Sleep(100);
+	}
+}
+
+void IServer::OnCompletion(
+	IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, BOOL bRet, DWORD dwBytes, DWORD dwError)
+{
+	IOCP_OPERATOR_TYPE optType = pOverlappedContext->optType;
+
+	if (IOCP_OPERATOR_TYPE::IOCP_OPT_ACCPEPT == optType)
+	{
+		// AcceptEx失败时仅丢弃本次接入并重新投递，不能关闭监听socket
+		if (!bRet)
+		{
+			::closesocket(pOverlappedContext->ioSocket);
+			pOverlappedContext->ResetBufferAndOptType();
+			if (!m_nAccepting || false == PostAccept(pSocketContext, pOverlappedContext))
+			{
+				pSocketContext->ReleaseIOOverlappedContext(pOverlappedContext);
+			}
+		}
+		else
+		{
+			InterlockedIncrement(&m_nConnectCounts);
+
+			DoAccpet(pSocketContext, pOverlappedContext);
+		}
+
+		// 释放本次AcceptEx所持有的监听socket引用
+		pSocketContext->Release();
+		return;
+	}
+
+	// 被推迟的recv轮到恢复，释放恢复通知所持有的连接引用
+	if (IOCP_OPERATOR_TYPE::IOCP_OPT_RESUME == optType)
+	{
+		ResumeDeferredRecv(pSocketContext, pOverlappedContext);
+		pSocketContext->Release();
+		return;
+	}
+
+	// 共享内存连接的接收唤醒包
+	if (IOCP_OPERATOR_TYPE::IOCP_OPT_SHM_RECV == optType)
+	{
+		DoShmRecv(pSocketContext, pOverlappedContext);
+		pSocketContext->Release();
+		return;
+	}
+
+	// 直接读入应用缓冲区的recv
+	if (IOCP_OPERATOR_TYPE::IOCP_OPT_RECV_INTO == optType)
+	{
+		DoRecvInto(pSocketContext, pOverlappedContext, bRet, dwBytes, dwError);
+		pSocketContext->Release();
+		return;
+	}
+
+	// 正在交接的连接，recv完成(或被取消)后不再交给上层，数据随连接交接给新进程
+	if (IOCP_OPERATOR_TYPE::IOCP_OPT_RECV == optType && pSocketContext->IsHandingOff() &&
+		(bRet ? (0 != dwBytes) : (ERROR_OPERATION_ABORTED == dwError)))
+	{
+		pSocketContext->Park(pOverlappedContext, bRet ? dwBytes : 0);
+		pSocketContext->Release();
+		return;
+	}
+
+	// 完成的send不再计入在途，OnSend中可据此判断之前投递的send是否均已完成
+	if (IOCP_OPERATOR_TYPE::IOCP_OPT_SEND == optType)
+	{
+		pSocketContext->EndSend();
+	}
+
+	if (!bRet)
+	{
+		if (WAIT_TIMEOUT == dwError)
+		{
+			if (!IsSocketAlive(pSocketContext->connSocket))
+			{
+				DoClose(pSocketContext);
+			}
+		}
+		else // ERROR_NETNAME_DELETED and others error
+		{
+			DoClose(pSocketContext, dwError);
+		}
+	}
+	else
+	{
+		// 若客户端断开，则关闭连接
+		if ((0 == dwBytes) && 
+			(IOCP_OPERATOR_TYPE::IOCP_OPT_RECV == optType ||
+			IOCP_OPERATOR_TYPE::IOCP_OPT_SEND == optType))
+		{
+			DoClose(pSocketContext);
+		}
+		else
+		{
+			switch (optType)
+			{
+			case IOCP_OPERATOR_TYPE::IOCP_OPT_RECV:
+			{
+				DoRecv(pSocketContext, pOverlappedContext, dwBytes);
+			}
+			break;
+			case IOCP_OPERATOR_TYPE::IOCP_OPT_SEND:
+			{
+				DoSend(pSocketContext, pOverlappedContext);
+			}
+			break;
+			default:
+				break;
+			}
+		}
+	}
+
+	// send的重叠结构用完即归还到池中，长连接上持续发送时连接持有的重叠结构不会累积
+	if (IOCP_OPERATOR_TYPE::IOCP_OPT_SEND == optType)
+	{
+		pSocketContext->ReleaseIOOverlappedContext(pOverlappedContext);
+	}
+
+	// 释放本次完成的IO所持有的连接引用
+	pSocketContext->Release();
 }
@@ -4,323 +4,505 @@
 #include <WinSock2.h>
 #include <Windows.h>
 #include <MSWSock.h>
-#include <list>
-
-#define MAX_BUFFER_SIZE  (1024 * 4)	// 完成端口操作的数据缓冲区大小(4K)
-#define EXIT_SERVER_CODE (-1)		// 传递给Worker线程的退出信号
-
-//	完成端口投递操作类型
-enum class IOCP_OPERATOR_TYPE
+#include "iocontext.h"
+#include "ioengine.h"
+#include "iocapture.h"
+#include "iounix.h"
+#include <vector>
+#include <string>
+
+#define RECV_BUDGET_DEFAULT		 (MAX_BUFFER_SIZE * 16)	// 每个连接每轮默认的读取预算(64K)
+#define REBALANCE_MAX_MOVES		(8)		// 每次分片负载检查最多迁移的连接数
+
+#define CONN_REGISTRY_SHARD_BITS (6)							// 连接注册表分片数的位数
+#define CONN_REGISTRY_SHARD_NUM  (1 << CONN_REGISTRY_SHARD_BITS)	// 连接注册表分片数(64个分片锁)
+
+#define HANDOFF_PIPE_BUFFER_SIZE (1024 * 64)	// 热重启交接管道的缓冲区大小
+#define HANDOFF_CONNECT_TIMEOUT	 (30 * 1000)	// 新进程等待交接管道就绪的超时时间(ms)
+#define HANDOFF_PARK_TIMEOUT	 (5 * 1000)		// 旧进程等待连接进入可交接状态的超时时间(ms)
+#define HANDOFF_IO_TIMEOUT		 (HANDOFF_PARK_TIMEOUT + 10 * 1000)	// 交接管道上单条消息读写的超时时间(ms)，须长于旧进程等待连接的时间
+
+#define LISTEN_DEFAULT_ACCEPT_NUM		(10)			// 默认同时投递的AcceptEx数量
+#define LISTEN_DEFAULT_KEEPALIVE_TIME	(1000 * 60)		// 默认的tcp_keepalive空闲时间(ms)
+#define LISTEN_DEFAULT_KEEPALIVE_INTERVAL (1000 * 10)	// 默认的tcp_keepalive探测间隔(ms)
+
+// 监听配置：一个服务端实例对应一个监听
+// 多个服务端实例共享同一个引擎，即可在一组工作线程上服务多个地址/端口，每个监听有各自的配置与回调
+struct IOListenerConfig
 {
-	IOCP_OPT_NONE = 0,	
-	IOCP_OPT_ACCPEPT,	// 接受连接
-	IOCP_OPT_SEND,		// 发送数据
-	IOCP_OPT_RECV,		// 接受数据
+	std::string unixPath;			// 非空时监听该路径的AF_UNIX流式socket，地址、端口及TCP选项不生效
+	std::string shmName;			// 非空时以该名称的共享内存环形队列接受同机连接(见IOShmListener)，优先于unixPath；引擎锁为NullLock时不可用
+	std::string bindAddress;		// 绑定的IPv4地址，为空时绑定INADDR_ANY
+	USHORT nPort;					// 监听端口号
+	int nBacklog;					// listen的等待队列长度
+	unsigned int nMaxAcceptConn;	// 同时投递的AcceptEx数量
+	DWORD dwRecvBufferSize;			// 每次recv的缓冲区大小，不超过RECV_BUFFER_SIZE_MAX；交给OnRecv的数据随之可超过MAX_BUFFER_SIZE
+	bool bNoDelay;					// 为新连接关闭Nagle算法
+	int nSocketRecvBuf;				// 新连接的SO_RCVBUF(字节)，0为系统默认
+	int nSocketSendBuf;				// 新连接的SO_SNDBUF(字节)，0为系统默认
+	DWORD dwKeepAliveTime;			// tcp_keepalive空闲时间(ms)，0为不启用
+	DWORD dwKeepAliveInterval;		// tcp_keepalive探测间隔(ms)
+	unsigned int nWorkerThreadNum;	// 启动引擎时的工作者线程数，0为按处理器数决定；引擎已启动时不生效
+	DWORD dwShmSlots;				// 共享内存监听同时存在的连接数上限
+	DWORD dwShmRingSize;			// 共享内存连接每个方向的环形队列大小(字节，2的幂)
+	DWORD dwShmSpinUs;				// 共享内存连接登记接收等待前在工作者线程上忙轮询的时长(微秒)
+
+	IOListenerConfig()
+		: nPort(9988)
+		, nBacklog(SOMAXCONN)
+		, nMaxAcceptConn(LISTEN_DEFAULT_ACCEPT_NUM)
+		, dwRecvBufferSize(MAX_BUFFER_SIZE)
+		, bNoDelay(false)
+		, nSocketRecvBuf(0)
+		, nSocketSendBuf(0)
+		, dwKeepAliveTime(LISTEN_DEFAULT_KEEPALIVE_TIME)
+		, dwKeepAliveInterval(LISTEN_DEFAULT_KEEPALIVE_INTERVAL)
+		, nWorkerThreadNum(0)
+		, dwShmSlots(SHM_DEFAULT_SLOTS)
+		, dwShmRingSize(SHM_DEFAULT_RING_SIZE)
+		, dwShmSpinUs(SHM_DEFAULT_SPIN_US)
+	{
+	}
 };
 
-//	完成端口OVERLAPPED的重叠结构
-struct IOOverlappedContext 
+// 接收调度：每个连接每轮最多读取预算内的字节数，超出预算的连接暂停投递recv
+// 被推迟的连接以恢复通知的形式投递到完成端口，完成端口按先进先出出队，即为轮转队列：
+// 恢复通知排在已到达的其他完成包之后，大流量连接让出工作线程，交互式小连接的完成包得以先被处理
+// 被推迟的连接全部恢复过一次即为一轮，轮次变化后各连接的预算重新计算
+class IORecvScheduler
 {
-	WSAOVERLAPPED wsaOverlapped;	// 重叠结构必须的成员且放置在第一个位置
-	SOCKET ioSocket;
-	WSABUF wsaBuffer;
-	IOCP_OPERATOR_TYPE optType;
-	// TODO: 也可以附加其他需要的数据成员
-
-	IOOverlappedContext()
-		: ioSocket(NULL)
-		, optType(IOCP_OPERATOR_TYPE::IOCP_OPT_NONE)
+public:
+
+	IORecvScheduler()
+		: m_dwBudget(RECV_BUDGET_DEFAULT)
+		, m_nDeferred(0)
+		, m_nRound(0)
 	{
-		::memset(&wsaOverlapped, 0, sizeof(wsaOverlapped));
-		MallocWsaBuffer(wsaBuffer);
 	}
 
-	~IOOverlappedContext()
+	~IORecvScheduler() = default;
+
+public:
+
+	// 每轮读取预算，0表示不限制
+	void SetBudget(DWORD dwBudget)
 	{
-		if (wsaBuffer.buf)
-		{
-			::HeapFree(::GetProcessHeap(), 0, wsaBuffer.buf);
-			wsaBuffer.buf = nullptr;
-		}
+		m_dwBudget = dwBudget;
 	}
 
-	void ResetBufferAndOptType()
+	// 记录本次读取的字节数，返回true表示本轮预算已用完，应推迟下一次recv
+	bool Charge(IOSocketContext *pSocketContext, DWORD dwBytes)
 	{
-		if (wsaBuffer.buf)
+		if (!m_dwBudget)
 		{
-			::memset(wsaBuffer.buf, 0, MAX_BUFFER_SIZE);
+			return false;
 		}
-		else
+
+		LONG64 nRound = m_nRound;
+		if (pSocketContext->nRecvRound != nRound)
 		{
-			MallocWsaBuffer(wsaBuffer);
+			pSocketContext->nRecvRound = nRound;
+			pSocketContext->dwRoundRecvBytes = 0;
 		}
 
-		::memset(&wsaOverlapped, 0, sizeof(wsaOverlapped));
-		optType = IOCP_OPERATOR_TYPE::IOCP_OPT_NONE;
+		pSocketContext->dwRoundRecvBytes += dwBytes;
+		return pSocketContext->dwRoundRecvBytes >= m_dwBudget;
 	}
 
-	void MallocWsaBuffer(WSABUF &wsaBuffer)
+	// 推迟连接的recv，恢复通知在途期间持有连接的一个引用(由处理恢复通知的工作线程释放)
+	void Defer(IOSocketContext *pSocketContext)
 	{
-		wsaBuffer.buf = (CHAR *)::HeapAlloc(::GetProcessHeap(), HEAP_ZERO_MEMORY, MAX_BUFFER_SIZE);
-		wsaBuffer.len = MAX_BUFFER_SIZE;
+		pSocketContext->AddRef();
+		::InterlockedIncrement(&m_nDeferred);
 	}
-};
-
-// 关键段包装锁
-class CriticalSectionLock
-{
-public:
 
-	CriticalSectionLock()
+	// 恢复的连接重新开始计算预算
+	void Resume(IOSocketContext *pSocketContext)
 	{
-		::InitializeCriticalSection(&m_csLock);
+		pSocketContext->dwRoundRecvBytes = 0;
+		if (0 == ::InterlockedDecrement(&m_nDeferred))
+		{
+			::InterlockedIncrement64(&m_nRound);
+		}
 	}
 
-	~CriticalSectionLock()
-	{
-		::DeleteCriticalSection(&m_csLock);
-	}
+private:
 
-	void Lock()
-	{
-		::EnterCriticalSection(&m_csLock);
-	}
-
-	void UnLock()
-	{
-		::LeaveCriticalSection(&m_csLock);
-	}
+	IORecvScheduler(const IORecvScheduler&) = delete;
+	IORecvScheduler& operator= (const IORecvScheduler&) = delete;
 
 private:
 
-	CRITICAL_SECTION m_csLock;
+	volatile DWORD m_dwBudget;		// 每轮读取预算
+	volatile LONG m_nDeferred;		// 恢复通知尚未处理的连接数
+	volatile LONG64 m_nRound;		// 当前调度轮次
 };
 
-
-// 自动锁模板类
-template<typename Lock>
-class AutoLock
+// 连接注册表：按分片划分槽位，每个分片一把锁(锁条带)
+// 通过连接ID可在O(1)时间内从任意线程定位连接，不需要全局锁
+class IOConnectionRegistry
 {
 public:
 
-	explicit AutoLock(Lock& lock) : m_lock(lock)
-	{
-		m_lock.Lock();
-	}
-
-	~AutoLock()
+	IOConnectionRegistry()
+		: m_nNextShard(0)
 	{
-		m_lock.UnLock();
 	}
 
-private:
-
-	Lock& m_lock;
-};
+	~IOConnectionRegistry() = default;
 
-// OverlappedContext重叠结构共享池，避免频繁创建/释放IOOverlappedContext的操作
-class IOOverlappedContextPool
-{
 public:
 
-	explicit IOOverlappedContextPool(unsigned int nOverlappedContextNum)
+	// 登记连接并分配连接ID
+	CONN_ID Register(IOSocketContext *pSocketContext)
 	{
-		for (size_t i = 0; i < nOverlappedContextNum; i++)
+		if (!pSocketContext)
 		{
-			IOOverlappedContext *pOverlappedContext = new IOOverlappedContext();
-			m_overlappedContextList.push_back(pOverlappedContext);
+			return INVALID_CONN_ID;
 		}
-	}
 
-	~IOOverlappedContextPool()
-	{
-		while (!m_overlappedContextList.empty())
+		DWORD dwShard = (DWORD)::InterlockedIncrement(&m_nNextShard) & (CONN_REGISTRY_SHARD_NUM - 1);
+		Shard &shard = m_shards[dwShard];
+		AutoLock<EngineLock> lock(shard.lock);
+
+		DWORD dwSlot = 0;
+		if (shard.dwFreeHead != INVALID_SLOT)
 		{
-			std::list<IOOverlappedContext*>::iterator iter = 
-				m_overlappedContextList.begin();
-			delete (*iter);
-			m_overlappedContextList.erase(iter);
+			dwSlot = shard.dwFreeHead;
+			shard.dwFreeHead = shard.slots[dwSlot].dwNextFree;
+		}
+		else
+		{
+			dwSlot = (DWORD)shard.slots.size();
+			shard.slots.push_back(Slot());
 		}
-	}
 
-public:
+		Slot &slot = shard.slots[dwSlot];
+		slot.pSocketContext = pSocketContext;
+		slot.dwNextFree = INVALID_SLOT;
 
-	static IOOverlappedContextPool& GetInstance()
-	{
-		static IOOverlappedContextPool s_overlappedContextPool;
-		return s_overlappedContextPool;
+		pSocketContext->connId = MakeConnId(slot.dwGeneration, dwSlot, dwShard);
+		return pSocketContext->connId;
 	}
 
-	IOOverlappedContext* AllocIOOverlappedContext()
+	// 注销连接，槽位代数递增使旧的连接ID失效
+	void Unregister(CONN_ID connId)
 	{
-		IOOverlappedContext* pOverlappedContext = nullptr;
-		AutoLock<CriticalSectionLock> lock(m_criticalSectionLock);
+		DWORD dwGeneration = 0, dwSlot = 0, dwShard = 0;
+		SplitConnId(connId, dwGeneration, dwSlot, dwShard);
+
+		Shard &shard = m_shards[dwShard];
+		AutoLock<EngineLock> lock(shard.lock);
 
-		if (m_overlappedContextList.size())
+		if (dwSlot >= shard.slots.size() || shard.slots[dwSlot].dwGeneration != dwGeneration)
 		{
-			pOverlappedContext = m_overlappedContextList.back();
-			m_overlappedContextList.pop_back();
+			return;
 		}
-		else
+
+		Slot &slot = shard.slots[dwSlot];
+		slot.pSocketContext = nullptr;
+		if (0 == ++slot.dwGeneration)
 		{
-			pOverlappedContext = new IOOverlappedContext();
+			slot.dwGeneration = 1;
 		}
-		return pOverlappedContext;
+		slot.dwNextFree = shard.dwFreeHead;
+		shard.dwFreeHead = dwSlot;
 	}
 
-	void ReleaseIOOverlappedContext(IOOverlappedContext* overlappedContext)
+	// 根据连接ID获取连接并增加其引用计数，ID已失效时返回nullptr
+	// 调用者使用完毕后必须调用IOSocketContext::Release
+	IOSocketContext* Acquire(CONN_ID connId)
 	{
-		if (!overlappedContext)
+		DWORD dwGeneration = 0, dwSlot = 0, dwShard = 0;
+		SplitConnId(connId, dwGeneration, dwSlot, dwShard);
+
+		Shard &shard = m_shards[dwShard];
+		AutoLock<EngineLock> lock(shard.lock);
+
+		if (dwSlot >= shard.slots.size())
 		{
-			return;
+			return nullptr;
+		}
+
+		Slot &slot = shard.slots[dwSlot];
+		if (slot.dwGeneration != dwGeneration || !slot.pSocketContext)
+		{
+			return nullptr;
 		}
 
-		AutoLock<CriticalSectionLock> lock(m_criticalSectionLock);
-		m_overlappedContextList.push_front(overlappedContext);
+		slot.pSocketContext->AddRef();
+		return slot.pSocketContext;
 	}
 
-private:
+	// 获取当前所有存活连接的ID
+	void Snapshot(std::vector<CONN_ID> &connIds)
+	{
+		for (DWORD dwShard = 0; dwShard < CONN_REGISTRY_SHARD_NUM; ++dwShard)
+		{
+			Shard &shard = m_shards[dwShard];
+			AutoLock<EngineLock> lock(shard.lock);
 
-	IOOverlappedContextPool() = default;
-	IOOverlappedContextPool(const IOOverlappedContextPool&) = delete;
-	IOOverlappedContextPool& operator= (const IOOverlappedContextPool&) = delete;
+			for (DWORD dwSlot = 0; dwSlot < (DWORD)shard.slots.size(); ++dwSlot)
+			{
+				if (shard.slots[dwSlot].pSocketContext)
+				{
+					connIds.push_back(MakeConnId(shard.slots[dwSlot].dwGeneration, dwSlot, dwShard));
+				}
+			}
+		}
+	}
 
 private:
 
-	std::list<IOOverlappedContext*> m_overlappedContextList;
-	CriticalSectionLock m_criticalSectionLock;
-};
-
-
-// 每个连接对应的套接字上下文结构对象
-class IOSocketContext
-{
-public:
-
-	SOCKET connSocket;		// 连接的socket
-	SOCKADDR_IN clientAddr;	// 连接的客户端地址
+	static const DWORD INVALID_SLOT = 0xFFFFFFFF;
 
-public:
-
-	IOSocketContext()
-		: connSocket(INVALID_SOCKET)
+	static CONN_ID MakeConnId(DWORD dwGeneration, DWORD dwSlot, DWORD dwShard)
 	{
-		::memset(&clientAddr, 0, sizeof(clientAddr));
+		return ((CONN_ID)dwGeneration << 32) | ((CONN_ID)dwSlot << CONN_REGISTRY_SHARD_BITS) | dwShard;
 	}
 
-	~IOSocketContext()
+	static void SplitConnId(CONN_ID connId, DWORD &dwGeneration, DWORD &dwSlot, DWORD &dwShard)
 	{
-		if (connSocket != INVALID_SOCKET)
-		{
-			::closesocket(connSocket);
-			connSocket = INVALID_SOCKET;
-		}
-
-		while (!m_overlappedContextList.empty())
-		{
-			std::list<IOOverlappedContext*>::iterator iter =
-				m_overlappedContextList.begin();
-			IOOverlappedContextPool::GetInstance().ReleaseIOOverlappedContext(*iter);
-			m_overlappedContextList.erase(iter);
-		}
+		dwGeneration = (DWORD)(connId >> 32);
+		dwSlot = (DWORD)(connId & 0xFFFFFFFF) >> CONN_REGISTRY_SHARD_BITS;
+		dwShard = (DWORD)connId & (CONN_REGISTRY_SHARD_NUM - 1);
 	}
 
-	IOOverlappedContext* NewIOOverlappedContext()
-	{
-		IOOverlappedContext *pOverlappedContext =
-			IOOverlappedContextPool::GetInstance().AllocIOOverlappedContext();
-		if (pOverlappedContext)
-		{
-			AutoLock<CriticalSectionLock> lock(m_criticalSectionLock);
-			m_overlappedContextList.push_back(pOverlappedContext);
-		}
-		return pOverlappedContext;
-	}
+	IOConnectionRegistry(const IOConnectionRegistry&) = delete;
+	IOConnectionRegistry& operator= (const IOConnectionRegistry&) = delete;
+
+private:
 
-	void ReleaseIOOverlappedContext(IOOverlappedContext* pOverlappedContext)
+	// 代数从1开始，保证有效的连接ID不为INVALID_CONN_ID
+	struct Slot
 	{
-		for (auto iter = m_overlappedContextList.begin();
-			 iter != m_overlappedContextList.end();
-			 ++iter)
-		{
-			if (*iter == pOverlappedContext)
-			{
-				IOOverlappedContextPool::GetInstance().ReleaseIOOverlappedContext(*iter);
+		IOSocketContext *pSocketContext;
+		DWORD dwGeneration;
+		DWORD dwNextFree;
 
-				AutoLock<CriticalSectionLock> lock(m_criticalSectionLock);
-				m_overlappedContextList.erase(iter);
-				break;
-			}
-		}
-	}
+		Slot() : pSocketContext(nullptr), dwGeneration(1), dwNextFree(INVALID_SLOT) {}
+	};
 
-private:
+	struct Shard
+	{
+		EngineLock lock;
+		std::vector<Slot> slots;
+		DWORD dwFreeHead;
+
+		Shard() : lock("IOConnectionRegistry"), dwFreeHead(INVALID_SLOT) {}
+	};
 
-	// 同一socket上的多个IO重叠请求上下文且管理此些上下文生命周期
-	std::list<IOOverlappedContext*> m_overlappedContextList; 
-	CriticalSectionLock m_criticalSectionLock;
+	Shard m_shards[CONN_REGISTRY_SHARD_NUM];
+	volatile LONG m_nNextShard;
 };
 
 // IOCP完成端口服务端抽象基类
 // 子类可实现抽象接口实现自定义业务处理逻辑
-class IServer
+// 默认使用自身私有的IO引擎；构造时传入共享引擎则与同一进程中的其他服务端/客户端共用工作者线程
+class IServer : public IOCompletionHandler
 {
 public:
 
-	bool Start(USHORT nPort = 9988, unsigned int nMaxAcceptConn = 10);
+	bool Start(USHORT nPort = 9988, unsigned int nMaxAcceptConn = LISTEN_DEFAULT_ACCEPT_NUM);
+
+	// 按监听配置启动，配置非法(如recv缓冲区过大、地址无法解析)时返回false
+	bool Start(const IOListenerConfig &config);
+	const IOListenerConfig& GetListenerConfig() const { return m_config; }
+
+	// 停止接受新连接并关闭所有连接，等待在途IO结束后返回；私有引擎随之停止，共享引擎继续运行
+	// 必须在析构前调用(析构时不再代为停止)，不能在工作者线程(回调)中调用；在途IO未在CONTEXT_DRAIN_TIMEOUT内结束时返回false
 	bool Stop();
 	bool Send(IOSocketContext *pSocketContext, const char *buffer, int nLen);
+	bool Send(CONN_ID connId, const char *buffer, int nLen);	// 可在任意线程调用，连接已失效时返回false
 	ULONG GetConnectCounts() const;
 
+	// 零停机热重启：
+	// 新进程调用StartFromHandOff，通过命名管道从旧进程接收监听socket(以及可选的已建立连接)
+	// 旧进程调用HandOff，交接完成后停止接受新连接，等待剩余连接排空后返回，随后可调用Stop退出
+	// 已交接的连接在旧进程中以OnClosed通知上层，在新进程中以OnEstablished通知上层
+	// 交接管道只允许当前用户连接，旧进程从系统取得新进程的进程ID；等待连接与每次读写均有超时
+	bool StartFromHandOff(const std::string &pipeName, unsigned int nMaxAcceptConn = LISTEN_DEFAULT_ACCEPT_NUM);
+
+	// 接管的监听socket已绑定并处于监听状态，配置中的地址与等待队列长度不生效，端口取自接管的监听socket
+	bool StartFromHandOff(const std::string &pipeName, const IOListenerConfig &config);
+	bool HandOff(const std::string &pipeName, bool bHandOffConnections = false, DWORD dwDrainTimeout = 30 * 1000);
+
+	// 启用TLS(Schannel)，需在Start之前调用，证书按主题名从LocalMachine\MY证书库加载
+	// 启用后握手完成时才通知OnEstablished，OnRecv收到的与Send发送的均为明文
+	// TLS连接不参与热重启交接(会话状态无法跨进程传递)，交接时直接关闭
+	bool EnableTls(const std::string &certSubject);
+
+	// 共享内存连接(IOListenerConfig::shmName)：消息经映射在两个进程中的环形队列传递，对端空闲等待时才以事件唤醒
+	// 连接经只允许当前用户访问的管道握手，每个连接一个无名映射；接收由引擎的工作者线程驱动，OnRecv与TCP连接一样在工作者线程上回调
+	// Send写入环形队列(队列已满时暂存在本端)即完成，不阻塞，OnSend在发送线程上回调
+	// 共享内存连接不启用TLS，不参与热重启交接(交接时留在旧进程中自然结束)
+
+	// 启用消息压缩，需在Start之前调用，由客户端在连接建立后发送协商帧请求
+	// 未请求压缩的连接数据原样透传；小于dwThreshold的消息不压缩
+	// 已协商压缩的连接不参与热重启交接，交接时直接关闭
+	void EnableCompression(DWORD dwThreshold = COMPRESS_DEFAULT_THRESHOLD);
+
+	// 抓包：将连接建立/关闭及交给OnRecv的数据按(时间戳,连接ID,数据)写入内存映射文件
+	// 需在Start之前调用，文件大小为dwMaxSizeMB，写满后丢弃后续记录，Stop时关闭文件
+	// 抓包文件可由iocpclient的回放工具按原始时序重放
+	bool StartCapture(const std::string &path, DWORD dwMaxSizeMB = 256);
+
+	// 每个连接每轮的读取预算(字节)，超出预算的连接让出工作线程，避免大流量连接饿死其他连接
+	// 默认RECV_BUDGET_DEFAULT，0表示不限制，可在任意时刻调用
+	void SetRecvBudget(DWORD dwBytesPerRound);
+
+	// 直接接收：接下来的dwLen字节直接读入pBuffer，全部到达后回调一次OnRecvInto，期间不回调OnRecv，之后恢复按OnRecv接收
+	// 只能在该连接的OnRecv/OnRecvInto回调中调用，本次OnRecv中已收到的数据(如消息体的开头)由调用者自行拷贝，dwLen只计剩余部分
+	// pBuffer须保持有效直到OnRecvInto回调；TLS、压缩及共享内存连接的数据需经解密/解帧，不支持直接接收，返回false；交接开始后同样返回false
+	bool RecvInto(IOSocketContext *pSocketContext, char *pBuffer, DWORD dwLen);
+
+	// 低延迟模式：工作线程阻塞等待前先忙轮询完成端口dwSpinUs微秒，需在Start之前调用
+	// 同时为监听socket开启环回快速路径、为新连接关闭Nagle算法；使用共享引擎时作用于整个引擎
+	// Start之后调用只切换工作线程的轮询(dwSpinUs为0时关闭)，监听socket的环回快速路径保持Start时的设置
+	void EnableBusyPoll(DWORD dwSpinUs, LONG nMaxSpinners = 0);
+	const IOBusyPoller& GetBusyPoller() const { return m_pEngine->GetBusyPoller(); }
+
+	// 准入控制：完成包的排队时延持续超过dwTargetUs达dwIntervalMs时判定为过载，过载期间暂停投递AcceptEx，
+	// 新连接留在内核的监听队列中，解除过载后恢复；使用共享引擎时作用于整个引擎，dwTargetUs为0时关闭
+	void EnableAdmissionControl(DWORD dwTargetUs = ADMISSION_DEFAULT_TARGET_US, DWORD dwIntervalMs = ADMISSION_DEFAULT_INTERVAL_MS);
+	bool IsOverloaded() const { return m_pEngine->IsOverloaded(); }
+	const IOAdmissionController& GetAdmissionController() const { return m_pEngine->GetAdmissionController(); }
+
+	// 连接迁移：分片间负载失衡时把负载重的连接迁往空闲分片，在连接没有在途IO的安全点改绑完成端口，客户端无需重连
+	// 分片数由IOEngine::SetShardCount决定；使用共享引擎时作用于整个引擎，dwIntervalMs为0时关闭
+	void EnableRebalance(DWORD dwIntervalMs = REBALANCE_DEFAULT_INTERVAL_MS, DWORD dwImbalancePercent = REBALANCE_DEFAULT_IMBALANCE);
+
 public:
 
 	// 处理结果回调函数，子类可继承重写此类函数，以实现相应的业务处理逻辑
+	// 回调中的临时内存可从IOBumpArena::GetThreadArena()或其GetResource()(供std::pmr容器使用)分配，回调返回后自动回收，不得跨回调保留
 	virtual void OnEstablished(IOSocketContext *pSocketContext) = 0;
 	virtual void OnClosed(IOSocketContext *pSocketContext) = 0;
 	virtual void OnError(IOSocketContext *pSocketContext, DWORD dwError) = 0;
 	virtual void OnRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext) = 0;
+
+	// 直接接收结束，pBuffer为RecvInto传入的缓冲区，此后引擎不再访问；dwBytes小于请求的长度表示连接已关闭(在OnClosed之后回调)，
+	// 或dwBytes为0且连接正在交接(尚未读入数据的直接接收被撤销，之后的数据由新进程按OnRecv接收)
+	// 回调中可再次调用RecvInto接收下一段，连接交接开始后RecvInto返回false
+	virtual void OnRecvInto(IOSocketContext *pSocketContext, char *pBuffer, DWORD dwBytes) {}
+
+	// 同步完成的send不经过完成端口(见IOEngine::SetInlineCompletion)，此时OnSend在发起发送的线程上、最外层的Send返回之前回调
 	virtual void OnSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext) = 0;
 
 private:
 
 	bool Init();
 	bool UnInit();
-	bool InitIOCP();
 	bool InitListenSocket();
-	DWORD GetNumOfProcessors();
+	bool InitUnixListenSocket();
+	bool InitShmListener();
+	void StopShmListener();
+	void AcceptShmConnection(IOShmChannel *pChannel);
+	static DWORD WINAPI ShmAcceptThreadProc(LPVOID lpParam);
+	int GetAcceptAddrLen() const;
+	void SetTcpOptions(SOCKET sock);
+	bool InitAcceptEx();
 	bool IsSocketAlive(SOCKET sock);
+	void CloseAllConnections();
+	bool SetConfig(const IOListenerConfig &config);
+	void ApplySocketOptions(SOCKET sock);
 
 private:
 
 	// 投递IO请求
 	bool PostAccept(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
 	bool PostRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
-	bool PostSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
+	bool PostRecvInto(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
+	// send投递失败时不关闭连接，由调用者以dwError关闭：TLS连接的投递在会话锁内，关闭回调的OnError须在锁外
+	bool PostSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD &dwError);
+	bool PostShmSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD &dwError);
 
 	// IO处理函数
 	bool DoAccpet(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
-	bool DoRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
+	bool DoRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD dwBytes);
+	void DoRecvInto(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, BOOL bRet, DWORD dwBytes, DWORD dwError);
+	void FinishRecvInto(IOSocketContext *pSocketContext);
+	// recv的数据交给上层后继续接收：交接检查、迁移安全点及读取预算，之后投递下一个recv(或直接接收)
+	bool ContinueRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD dwBytes);
+	bool DoShmRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
 	bool DoSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
-	bool DoClose(IOSocketContext *pSocketContext);
-
-	// 工作中线程函数
-	static DWORD WINAPI WorkerThreadProc(LPVOID lpParam);
+	bool DoClose(IOSocketContext *pSocketContext, DWORD dwError = NO_ERROR);
+
+	// 发送处理：压缩连接先分帧，TLS连接再加密后投递
+	// 各层失败时均不关闭连接，dwError为关闭应使用的错误码，由最外层在锁外关闭
+	bool SendCompressed(IOSocketContext *pSocketContext, const char *buffer, int nLen, DWORD &dwError);
+	bool SendPlain(IOSocketContext *pSocketContext, const char *buffer, int nLen, DWORD &dwError);
+	bool PostRawSend(IOSocketContext *pSocketContext, const char *buffer, int nLen, DWORD &dwError);
+	bool SendTls(IOSocketContext *pSocketContext, const char *buffer, int nLen, DWORD &dwError);
+	bool DoTlsRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, DWORD dwBytes);
+	bool DeliverRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, const char *buffer, DWORD dwBytes);
+	void DispatchRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
+	void ResumeDeferredRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
+	// 交接中的连接在recv的安全点停放，直接接收已读入部分数据时只能关闭
+	void ParkForHandOff(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
+
+	// 过载时暂停的AcceptEx：重叠结构连同监听socket上下文的引用一起保留，恢复或停止时归还
+	void PauseAccept(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
+	void ResumeAccepts();
+
+	// 热重启交接
+	void StopAccept();
+	bool SendHandOff(HANDLE hPipe, bool bHandOffConnections);
+	bool SendHandOffConnections(HANDLE hPipe, DWORD dwTargetProcessId);
+	bool ReceiveHandOff(const std::string &pipeName);
+	bool AttachHandOffListenSocket(WSAPROTOCOL_INFOW &protocolInfo, const char *unixPath);
+	bool AttachHandOffConnection(WSAPROTOCOL_INFOW &protocolInfo, const SOCKADDR_IN &clientAddr, const char *buffer, DWORD dwBytes);
+	// 放弃一个无法接管的连接：关闭其socket并读掉管道上随后的dwDataLen字节
+	bool SkipHandOffConnection(HANDLE hPipe, WSAPROTOCOL_INFOW &protocolInfo, DWORD dwDataLen);
+	void WaitForDrain(DWORD dwTimeout);
+
+	// 由引擎的工作者线程调用，处理本服务端名下连接的完成包
+	virtual void OnCompletion(
+		IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext, BOOL bRet, DWORD dwBytes, DWORD dwError);
+
+	// 引擎解除过载后恢复暂停的AcceptEx
+	virtual void OnOverloadChanged(bool bOverloaded);
+
+	// 按上次检查以来的读取量挑选fromPort分片上负载重的连接，请求迁往toPort分片
+	virtual void OnRebalance(HANDLE fromPort, HANDLE toPort, double dFraction);
 
 protected:
 
+	// 与Send相同，但失败时不关闭连接，dwError为NO_ERROR以外的值时需由调用者在释放自身的锁后调用CloseWithError
+	// 供持有自身锁发送的派生类使用，避免OnError在锁内回调
+	bool SendNoClose(IOSocketContext *pSocketContext, const char *buffer, int nLen, DWORD &dwError);
+
+	// 以dwError关闭连接并触发OnError，连接已关闭时不做任何事
+	void CloseWithError(IOSocketContext *pSocketContext, DWORD dwError);
+
+	// 根据连接ID获取连接并增加其引用计数，ID已失效时返回nullptr，使用完毕后必须调用Release
+	IOSocketContext* AcquireConnection(CONN_ID connId);
+
 	IServer();
+	explicit IServer(IOEngine *pEngine);
 	virtual ~IServer();
 
 private:
 
-	USHORT m_nPort;							// 监听端口号
-	unsigned int m_nMaxAcceptConn;			// 最大投递Accpet连接数
-	HANDLE m_stopEvent;						// 通知工作者线程退出的事件
-	HANDLE m_completionPort;				// 完成端口
-	HANDLE *m_pWorkerThreads;				// 工作者线程的句柄指针
-	unsigned int m_workerThreadNum;			// 工作者线程的数量
+	IOListenerConfig m_config;				// 监听配置
+	IOEngine m_ownEngine;					// 私有引擎，未传入共享引擎时使用
+	IOEngine *m_pEngine;					// 当前使用的引擎
+	int m_nAddressFamily;					// 监听socket的地址族：AF_INET或AF_UNIX
+	bool m_bOwnsSocketFile;					// 停止时是否删除AF_UNIX的socket文件
 	IOSocketContext *m_pListenSocketContext;// 监听socket的Context上下文
+	IOShmListener *m_pShmListener;			// 共享内存监听，所有共享内存连接销毁后才释放
+	HANDLE m_hShmStopEvent;					// 通知共享内存接受线程退出的事件
+	HANDLE m_hShmAcceptThread;				// 共享内存接受线程：经握手管道接受新连接
 	ULONG m_nConnectCounts;					// 当前的连接数量
+	volatile LONG m_nAccepting;				// 是否继续接受新连接，热重启交接后置0
+	std::vector<std::pair<IOSocketContext*, IOOverlappedContext*>> m_pausedAccepts;	// 过载期间暂停的AcceptEx
+	EngineLock m_pausedAcceptLock;
+	IOConnectionRegistry m_connectionRegistry;	// 当前存活连接的注册表
+	IORecvScheduler m_recvScheduler;		// 按读取预算调度各连接的recv
+	IOTlsCredentials *m_pTlsCredentials;	// TLS凭据，未启用TLS时为nullptr
+	bool m_bCompressEnabled;				// 是否接受客户端的压缩协商
+	DWORD m_dwCompressThreshold;			// 压缩阈值
+	IOCaptureWriter m_captureWriter;		// 抓包写入器
 
 	LPFN_ACCEPTEX			  m_fnAcceptEx;	// AcceptEx函数指针地址
 	LPFN_GETACCEPTEXSOCKADDRS m_fnGetAcceptExSockAddrs; // GetAcceptExSockAddrs函数指针地址
@@ -0,0 +1,271 @@
+#include "pch.h"
+#include "iwsserver.h"
+
+IWebSocketServer::IWebSocketServer()
+	: IHttpServer()
+{
+}
+
+IWebSocketServer::IWebSocketServer(IOEngine *pEngine)
+	: IHttpServer(pEngine)
+{
+}
+
+IWebSocketServer::~IWebSocketServer()
+{
+}
+
+bool IWebSocketServer::SendWebSocket(IOSocketContext *pSocketContext, WS_OPCODE opcode, const char *pData, DWORD dwLen)
+{
+	IOInlineSendScope inlineSendScope;
+	IOWebSocketSession *pWebSocketSession = pSocketContext ? GetWebSocketSession(pSocketContext) : nullptr;
+	if (!pWebSocketSession || pSocketContext->IsClosed())
+	{
+		return false;
+	}
+
+	if (WS_OPCODE::WS_OPCODE_TEXT != opcode && WS_OPCODE::WS_OPCODE_BINARY != opcode)
+	{
+		return false;
+	}
+
+	bool result = true;
+	DWORD dwError = NO_ERROR;
+	{
+		AutoLock<EngineLock> lock(pWebSocketSession->GetSendLock());
+		result = SendFrame(pSocketContext, opcode, pData, dwLen, dwError);
+	}
+
+	// 发送失败在发送锁外关闭：OnError中可能再对同一连接调用SendWebSocket，不可重入的锁会自锁
+	if (NO_ERROR != dwError)
+	{
+		CloseWithError(pSocketContext, dwError);
+	}
+
+	return result;
+}
+
+bool IWebSocketServer::SendWebSocket(CONN_ID connId, WS_OPCODE opcode, const char *pData, DWORD dwLen)
+{
+	IOSocketContext *pSocketContext = AcquireConnection(connId);
+	if (!pSocketContext)
+	{
+		return false;
+	}
+
+	bool result = SendWebSocket(pSocketContext, opcode, pData, dwLen);
+	pSocketContext->Release();
+
+	return result;
+}
+
+bool IWebSocketServer::CloseWebSocket(IOSocketContext *pSocketContext, WORD wCloseCode)
+{
+	IOInlineSendScope inlineSendScope;
+	IOWebSocketSession *pWebSocketSession = pSocketContext ? GetWebSocketSession(pSocketContext) : nullptr;
+	if (!pWebSocketSession || pSocketContext->IsClosed())
+	{
+		return false;
+	}
+
+	bool result = true;
+	DWORD dwError = NO_ERROR;
+	{
+		AutoLock<EngineLock> lock(pWebSocketSession->GetSendLock());
+		result = SendClose(pSocketContext, pWebSocketSession, wCloseCode, dwError);
+	}
+
+	if (NO_ERROR != dwError)
+	{
+		CloseWithError(pSocketContext, dwError);
+	}
+
+	return result;
+}
+
+void IWebSocketServer::OnHttpRequest(IOSocketContext *pSocketContext, const IOHttpRequest &request)
+{
+	Respond(pSocketContext, request.nSequence, 426, nullptr, nullptr, 0, "Upgrade: websocket\r\n");
+}
+
+void IWebSocketServer::OnRequest(IOSocketContext *pSocketContext, const IOHttpRequest &request)
+{
+	const IOHttpStringView *pUpgrade = request.FindHeader("Upgrade");
+	const IOHttpStringView *pConnection = request.FindHeader("Connection");
+	if (!pUpgrade || !pUpgrade->ContainsToken("websocket") || !pConnection || !pConnection->ContainsToken("upgrade"))
+	{
+		OnHttpRequest(pSocketContext, request);
+		return;
+	}
+
+	// 升级请求必须是HTTP/1.1的GET，且不能同时要求关闭连接
+	if (!request.method.Equals("GET") || request.wVersionMinor < 1 || !request.bKeepAlive)
+	{
+		Respond(pSocketContext, request.nSequence, 400, nullptr, nullptr, 0);
+		return;
+	}
+
+	const IOHttpStringView *pVersion = request.FindHeader("Sec-WebSocket-Version");
+	if (!pVersion || !pVersion->Equals("13"))
+	{
+		Respond(pSocketContext, request.nSequence, 426, nullptr, nullptr, 0, "Sec-WebSocket-Version: 13\r\n");
+		return;
+	}
+
+	// 密钥为16字节随机数的base64编码
+	const IOHttpStringView *pKey = request.FindHeader("Sec-WebSocket-Key");
+	if (!pKey || 24 != pKey->dwLen)
+	{
+		Respond(pSocketContext, request.nSequence, 400, nullptr, nullptr, 0);
+		return;
+	}
+
+	if (!OnUpgrade(pSocketContext, request))
+	{
+		Respond(pSocketContext, request.nSequence, 403, nullptr, nullptr, 0);
+		return;
+	}
+
+	char accept[WS_ACCEPT_KEY_SIZE];
+	if (!IOWebSocketCodec::ComputeAccept(pKey->pData, pKey->dwLen, accept))
+	{
+		Respond(pSocketContext, request.nSequence, 500, nullptr, nullptr, 0);
+		return;
+	}
+
+	// 会话在此创建，但要等101响应及其前序的流水线响应都发出后(OnUpgradeSent)才允许发送数据帧
+	IWebSocketConnSession *pConnSession = static_cast<IWebSocketConnSession *>(GetHttpSession(pSocketContext));
+	pConnSession->pWebSocketSession = new IOWebSocketSession();
+	pConnSession->Upgrade();
+
+	std::string extraHeaders("Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ");
+	extraHeaders.append(accept);
+	extraHeaders.append("\r\n");
+	Respond(pSocketContext, request.nSequence, 101, nullptr, nullptr, 0, extraHeaders.c_str());
+}
+
+void IWebSocketServer::OnRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
+{
+	IOInlineSendScope inlineSendScope;
+	IOWebSocketSession *pWebSocketSession = GetWebSocketSession(pSocketContext);
+	if (!pWebSocketSession)
+	{
+		IHttpServer::OnRecv(pSocketContext, pOverlappedContext);
+		return;
+	}
+
+	pWebSocketSession->Feed(pOverlappedContext->wsaBuffer.buf, pOverlappedContext->wsaBuffer.len);
+
+	WS_PARSE_RESULT result = WS_PARSE_RESULT::WS_PARSE_INCOMPLETE;
+	while (!pSocketContext->IsClosed() &&
+		WS_PARSE_RESULT::WS_PARSE_INCOMPLETE != (result = pWebSocketSession->Next()))
+	{
+		const IOWebSocketMessage &payload = pWebSocketSession->GetPayload();
+		if (WS_PARSE_RESULT::WS_PARSE_MESSAGE == result)
+		{
+			OnMessage(pSocketContext, payload);
+			continue;
+		}
+
+		DWORD dwError = NO_ERROR;
+		{
+			AutoLock<EngineLock> lock(pWebSocketSession->GetSendLock());
+			if (WS_PARSE_RESULT::WS_PARSE_PING == result)
+			{
+				SendFrame(pSocketContext, WS_OPCODE::WS_OPCODE_PONG, payload.pData, payload.dwLen, dwError);
+			}
+			else if (WS_PARSE_RESULT::WS_PARSE_CLOSE == result)
+			{
+				// 回复对端的状态码，对端未携带状态码时以正常关闭回复
+				WORD wCloseCode = pWebSocketSession->GetCloseCode();
+				SendClose(pSocketContext, pWebSocketSession, WS_CLOSE_NO_STATUS == wCloseCode ? WS_CLOSE_NORMAL : wCloseCode, dwError);
+			}
+			else
+			{
+				SendClose(pSocketContext, pWebSocketSession, pWebSocketSession->GetCloseCode(), dwError);
+			}
+		}
+
+		if (NO_ERROR != dwError)
+		{
+			CloseWithError(pSocketContext, dwError);
+		}
+	}
+
+	pWebSocketSession->EndFeed();
+}
+
+void IWebSocketServer::OnUpgradeSent(IOSocketContext *pSocketContext)
+{
+	IOWebSocketSession *pWebSocketSession = GetWebSocketSession(pSocketContext);
+	if (!pWebSocketSession)
+	{
+		return;
+	}
+
+	{
+		AutoLock<EngineLock> lock(pWebSocketSession->GetSendLock());
+		pWebSocketSession->Open();
+	}
+	OnOpen(pSocketContext);
+}
+
+bool IWebSocketServer::SendFrame(IOSocketContext *pSocketContext, WS_OPCODE opcode, const char *pData, DWORD dwLen, DWORD &dwError)
+{
+	IOWebSocketSession *pWebSocketSession = GetWebSocketSession(pSocketContext);
+	if (!pWebSocketSession->IsOpen() || pWebSocketSession->IsCloseSent())
+	{
+		return false;
+	}
+
+	// 帧头与载荷的开头合并为一次投递，其余载荷按缓冲区大小依次投递
+	char buffer[MAX_BUFFER_SIZE];
+	DWORD dwHeaderLen = IOWebSocketCodec::WriteFrameHeader(buffer, opcode, dwLen);
+	DWORD dwFirst = dwLen;
+	if (dwFirst > MAX_BUFFER_SIZE - dwHeaderLen)
+	{
+		dwFirst = MAX_BUFFER_SIZE - dwHeaderLen;
+	}
+	if (dwFirst)
+	{
+		::memcpy(buffer + dwHeaderLen, pData, dwFirst);
+	}
+
+	if (!SendNoClose(pSocketContext, buffer, (int)(dwHeaderLen + dwFirst), dwError))
+	{
+		return false;
+	}
+
+	for (DWORD dwOffset = dwFirst; dwOffset < dwLen; dwOffset += MAX_BUFFER_SIZE)
+	{
+		DWORD dwChunk = dwLen - dwOffset;
+		if (dwChunk > MAX_BUFFER_SIZE)
+		{
+			dwChunk = MAX_BUFFER_SIZE;
+		}
+
+		if (!SendNoClose(pSocketContext, pData + dwOffset, (int)dwChunk, dwError))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool IWebSocketServer::SendClose(IOSocketContext *pSocketContext, IOWebSocketSession *pWebSocketSession, WORD wCloseCode, DWORD &dwError)
+{
+	char payload[2] = { (char)(wCloseCode >> 8), (char)(wCloseCode & 0xFF) };
+	if (!SendFrame(pSocketContext, WS_OPCODE::WS_OPCODE_CLOSE, payload, sizeof(payload), dwError))
+	{
+		return false;
+	}
+	pWebSocketSession->SetCloseSent();
+
+	// 关闭帧发送完成后关闭写端，沿用HTTP会话的关闭流程
+	IOHttpSession *pHttpSession = GetHttpSession(pSocketContext);
+	pHttpSession->BeginShutdown();
+	TryShutdown(pSocketContext, pHttpSession);
+
+	return true;
+}
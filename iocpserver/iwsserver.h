@@ -0,0 +1,88 @@
+#ifndef _TINY_IOCP_IOCPSERVER_IWSSERVER_H_
+#define _TINY_IOCP_IOCPSERVER_IWSSERVER_H_
+
+#include "ihttpserver.h"
+#include "iows.h"
+
+// IWebSocketServer连接上的会话：在HTTP会话之外附带升级成功后创建的WebSocket会话
+struct IWebSocketConnSession : public IOHttpSession
+{
+	IOWebSocketSession *pWebSocketSession;	// 升级成功前为nullptr
+
+	IWebSocketConnSession()
+		: pWebSocketSession(nullptr)
+	{
+	}
+
+	~IWebSocketConnSession()
+	{
+		delete pWebSocketSession;
+	}
+};
+
+// WebSocket服务端抽象基类：在IHttpServer之上完成升级握手，之后按RFC 6455收发帧，子类实现OnMessage
+// 收到的帧在接收缓冲区上原地去掩码，未分片的消息不经拷贝直接交给OnMessage；分片消息在会话中重组
+// ping/pong及关闭握手在此处处理，不会通知子类；未请求升级的HTTP请求交给OnHttpRequest
+class IWebSocketServer : public IHttpServer
+{
+public:
+
+	// 发送一条完整的消息(不分片)，可在任意线程调用；超过一个缓冲区的消息分多次投递，但不会与其他帧交错
+	bool SendWebSocket(IOSocketContext *pSocketContext, WS_OPCODE opcode, const char *pData, DWORD dwLen);
+	bool SendWebSocket(CONN_ID connId, WS_OPCODE opcode, const char *pData, DWORD dwLen);
+
+	// 发送关闭帧，之后不再发送任何帧，已投递的帧发送完成后关闭写端
+	bool CloseWebSocket(IOSocketContext *pSocketContext, WORD wCloseCode = WS_CLOSE_NORMAL);
+
+public:
+
+	// 收到升级请求，返回false时以403拒绝
+	virtual bool OnUpgrade(IOSocketContext *pSocketContext, const IOHttpRequest &request) { return true; }
+
+	// 101响应及其之前的流水线响应均已发出，可以开始发送消息；前序请求在其他线程响应时也在该线程上回调
+	virtual void OnOpen(IOSocketContext *pSocketContext) {}
+
+	// 收到一条完整的文本或二进制消息，message中的数据只在回调期间有效
+	virtual void OnMessage(IOSocketContext *pSocketContext, const IOWebSocketMessage &message) = 0;
+
+	// 未请求升级的普通HTTP请求，默认以426响应
+	virtual void OnHttpRequest(IOSocketContext *pSocketContext, const IOHttpRequest &request);
+
+private:
+
+	virtual void OnRequest(IOSocketContext *pSocketContext, const IOHttpRequest &request);
+	virtual void OnRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext);
+	virtual void OnUpgradeSent(IOSocketContext *pSocketContext);
+
+	virtual IOHttpSession* NewHttpSession()
+	{
+		return new IWebSocketConnSession();
+	}
+
+	virtual void DeleteHttpSession(IOHttpSession *pHttpSession)
+	{
+		delete static_cast<IWebSocketConnSession *>(pHttpSession);
+	}
+
+	// 连接的WebSocket会话，尚未升级时为nullptr
+	static IOWebSocketSession* GetWebSocketSession(IOSocketContext *pSocketContext)
+	{
+		IWebSocketConnSession *pConnSession = static_cast<IWebSocketConnSession *>(GetHttpSession(pSocketContext));
+		return pConnSession ? pConnSession->pWebSocketSession : nullptr;
+	}
+
+	// 发送一帧，调用者需持有会话的发送锁
+	// 发送失败时不关闭连接，dwError不为NO_ERROR时由调用者释放锁后调用CloseWithError
+	bool SendFrame(IOSocketContext *pSocketContext, WS_OPCODE opcode, const char *pData, DWORD dwLen, DWORD &dwError);
+
+	// 发送关闭帧并在其发送完成后关闭写端，调用者需持有会话的发送锁，失败的处理同SendFrame
+	bool SendClose(IOSocketContext *pSocketContext, IOWebSocketSession *pWebSocketSession, WORD wCloseCode, DWORD &dwError);
+
+protected:
+
+	IWebSocketServer();
+	explicit IWebSocketServer(IOEngine *pEngine);
+	virtual ~IWebSocketServer();
+};
+
+#endif	// _TINY_IOCP_IOCPSERVER_IWSSERVER_H_
@@ -3,15 +3,28 @@
 
 #include "pch.h"
 #include <iostream>
+#include <WS2tcpip.h>
 #include "iserver.h"
+#include "ihttpserver.h"
+#include "iwsserver.h"
+#include <vector>
+#include <deque>
+#include <string>
+#include <algorithm>
 
 class ConcreteServer : public IServer
 {
 public:
 
-	ConcreteServer() {}
+	explicit ConcreteServer(IOEngine *pEngine = nullptr) : IServer(pEngine), m_bQuiet(false), m_nSentBytes(0) {}
 	~ConcreteServer() {}
 
+	// 不打印每条消息，测量延迟时避免控制台输出的开销
+	void SetQuiet(bool bQuiet) { m_bQuiet = bQuiet; }
+
+	// 已完成发送的字节数，OnSend回调返回后才计入
+	LONG64 GetSentBytes() const { return m_nSentBytes; }
+
 public:
 
 	virtual void OnEstablished(IOSocketContext *pSocketContext)
@@ -31,31 +44,714 @@ public:
 
 	virtual void OnRecv(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
 	{
-		printf("Received data: %s\n", pOverlappedContext->wsaBuffer.buf);
+		if (!m_bQuiet)
+		{
+			printf("Received data: %.*s\n", (int)pOverlappedContext->wsaBuffer.len, pOverlappedContext->wsaBuffer.buf);
+		}
 
-		// Echo
-		Send(pSocketContext, pOverlappedContext->wsaBuffer.buf, pOverlappedContext->wsaBuffer.len);
+		// Echo，加大了recv缓冲区的监听收到的数据可能超过单次Send的上限，分块发送
+		for (DWORD dwOffset = 0; dwOffset < pOverlappedContext->wsaBuffer.len; dwOffset += MAX_BUFFER_SIZE)
+		{
+			DWORD dwChunk = pOverlappedContext->wsaBuffer.len - dwOffset;
+			Send(pSocketContext, pOverlappedContext->wsaBuffer.buf + dwOffset, (int)(dwChunk < MAX_BUFFER_SIZE ? dwChunk : MAX_BUFFER_SIZE));
+		}
 	}
 
 	virtual void OnSend(IOSocketContext *pSocketContext, IOOverlappedContext *pOverlappedContext)
 	{
-		printf("Send data succeeded!\n");
+		if (!m_bQuiet)
+		{
+			printf("Send data succeeded!\n");
+		}
+		::InterlockedExchangeAdd64(&m_nSentBytes, (LONG64)pOverlappedContext->wsaBuffer.len);
 	}
 
+private:
+
+	bool m_bQuiet;
+	volatile LONG64 m_nSentBytes;
 };
 
-int main()
+// 对任意请求返回固定的响应，POST请求回显请求体，用于wrk等HTTP压测工具
+class ConcreteHttpServer : public IHttpServer
 {
-    std::cout << "start server ......." << std::endl;
+public:
+
+	explicit ConcreteHttpServer(IOEngine *pEngine = nullptr) : IHttpServer(pEngine) {}
+	~ConcreteHttpServer() {}
+
+public:
+
+	virtual void OnRequest(IOSocketContext *pSocketContext, const IOHttpRequest &request)
+	{
+		if (request.method.Equals("POST"))
+		{
+			Respond(pSocketContext, request.nSequence, 200, "application/octet-stream", request.body.pData, request.body.dwLen);
+			return;
+		}
+
+		static const char s_body[] = "Hello, World!";
+		Respond(pSocketContext, request.nSequence, 200, "text/plain", s_body, sizeof(s_body) - 1);
+	}
+};
+
+// 原样回显收到的文本或二进制消息，用于WebSocket压测工具
+class ConcreteWebSocketServer : public IWebSocketServer
+{
+public:
+
+	explicit ConcreteWebSocketServer(IOEngine *pEngine = nullptr) : IWebSocketServer(pEngine) {}
+	~ConcreteWebSocketServer() {}
+
+public:
+
+	virtual void OnMessage(IOSocketContext *pSocketContext, const IOWebSocketMessage &message)
+	{
+		SendWebSocket(pSocketContext, message.opcode, message.pData, message.dwLen);
+	}
+};
+
+#define HOT_RESTART_PIPE_NAME "\\\\.\\pipe\\tinyiocp_hot_restart"
+
+#define ALLOC_CHECK_PORT		(9987)		// 分配检查使用的回显端口
+#define ALLOC_CHECK_WARMUP		(1000)		// 预热的往返次数，之后的往返不应再有堆分配
+#define ALLOC_CHECK_ROUNDS		(10000)		// 统计的往返次数
+#define ALLOC_CHECK_MSG_SIZE	(64)
+#define ALLOC_CHECK_DRAIN_MS	(5000)		// 等待预热的send完成通知处理完的上限(毫秒)
+
+// 经环回连接驱动回显流量，预热后清零分配统计，再统计稳态下每类完成通知的堆分配次数
+// 需定义IOCP_ALLOC_TRACKING编译(msbuild /p:IocpAllocTracking=true)；稳态下recv/send有分配时返回1
+static int RunAllocCheck()
+{
+	if (!IOAllocTracker::IsEnabled())
+	{
+		std::cout << "allocation tracking is not compiled in (define IOCP_ALLOC_TRACKING) ......" << std::endl;
+		return 1;
+	}
+
 	ConcreteServer server;
-	server.Start();
+	server.SetQuiet(true);
+	if (!server.Start(ALLOC_CHECK_PORT))
+	{
+		std::cout << "start server failed ......" << std::endl;
+		return 1;
+	}
 
-	HANDLE hEvent = ::CreateEvent(nullptr, FALSE, FALSE, L"ShutdownEvent");
-	::WaitForSingleObject(hEvent, INFINITE);
-	::CloseHandle(hEvent);
+	SOCKET sock = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sockaddr_in addr;
+	::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = ::htons(ALLOC_CHECK_PORT);
+	::inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+	if (INVALID_SOCKET == sock || SOCKET_ERROR == ::connect(sock, (sockaddr*)&addr, sizeof(addr)))
+	{
+		std::cout << "connect failed ......" << std::endl;
+		server.Stop();
+		return 1;
+	}
+	BOOL bNoDelay = TRUE;
+	::setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&bNoDelay, sizeof(bNoDelay));
+
+	char message[ALLOC_CHECK_MSG_SIZE];
+	::memset(message, 'a', sizeof(message));
+	bool bOk = true;
+	for (int nRound = 0; bOk && nRound < ALLOC_CHECK_WARMUP + ALLOC_CHECK_ROUNDS; ++nRound)
+	{
+		// 客户端收到回显时服务端的send完成通知未必已处理，等预热的最后一次OnSend返回后再清零，以免其计入稳态
+		if (ALLOC_CHECK_WARMUP == nRound)
+		{
+			ULONGLONG ullDeadline = ::GetTickCount64() + ALLOC_CHECK_DRAIN_MS;
+			while (server.GetSentBytes() < (LONG64)ALLOC_CHECK_WARMUP * ALLOC_CHECK_MSG_SIZE && ::GetTickCount64() < ullDeadline)
+			{
+				::Sleep(1);
+			}
+			bOk = (server.GetSentBytes() >= (LONG64)ALLOC_CHECK_WARMUP * ALLOC_CHECK_MSG_SIZE);
+			IOAllocTracker::GetInstance().Reset();
+		}
 
+		char echo[ALLOC_CHECK_MSG_SIZE];
+		int nReceived = 0;
+		bOk = (sizeof(message) == ::send(sock, message, sizeof(message), 0));
+		while (bOk && nReceived < (int)sizeof(echo))
+		{
+			int nRet = ::recv(sock, echo + nReceived, (int)sizeof(echo) - nReceived, 0);
+			bOk = (nRet > 0);
+			nReceived += bOk ? nRet : 0;
+		}
+	}
+	::closesocket(sock);
 	server.Stop();
 
+	if (!bOk)
+	{
+		std::cout << "echo failed ......" << std::endl;
+		return 1;
+	}
+
+	static const char *s_opNames[] = { "none", "accept", "send", "recv", "resume", "timer", "shm_recv", "recv_into" };
+	IOAllocTracker &tracker = IOAllocTracker::GetInstance();
+	for (DWORD dwOp = 0; dwOp < sizeof(s_opNames) / sizeof(s_opNames[0]); ++dwOp)
+	{
+		if (tracker.GetOpCount(dwOp))
+		{
+			printf("alloc-check: %-8s %8llu ops, %8llu allocations\n",
+				s_opNames[dwOp], tracker.GetOpCount(dwOp), tracker.GetAllocCount(dwOp));
+		}
+	}
+
+	ULONGLONG ullHotAllocs = tracker.GetAllocCount((DWORD)IOCP_OPERATOR_TYPE::IOCP_OPT_RECV) +
+		tracker.GetAllocCount((DWORD)IOCP_OPERATOR_TYPE::IOCP_OPT_SEND);
+	std::cout << (ullHotAllocs ? "alloc-check failed ......" : "alloc-check passed ......") << std::endl;
+	return ullHotAllocs ? 1 : 0;
+}
+
+#define OVERLOAD_BENCH_PORT			(9986)		// 过载测试使用的HTTP端口
+#define OVERLOAD_BENCH_WORKERS		(2)			// 过载测试引擎的工作者线程数，服务能力=线程数*1000000/单请求耗时
+#define OVERLOAD_BENCH_CONNS		(64)		// 压测连接数，每个连接同一时刻最多一个recv在途，连接数足够多完成端口才会排队
+#define OVERLOAD_BENCH_SECONDS		(3)			// 施压时长
+#define OVERLOAD_BENCH_FACTOR		(2)			// 施加的负载为服务能力的倍数
+#define OVERLOAD_BENCH_DRAIN_MS		(20000)		// 施压结束后等待积压响应的上限(毫秒)
+#define OVERLOAD_BENCH_TARGET_US	(1000)		// 开启准入控制时的排队时延目标(微秒)
+#define OVERLOAD_BENCH_WORK_US		(200)		// 默认的单请求处理耗时(微秒)
+
+// 每个请求在工作者线程上忙等dwWorkUs微秒后响应，模拟CPU密集的业务处理
+class SlowHttpServer : public IHttpServer
+{
+public:
+
+	SlowHttpServer(IOEngine *pEngine, DWORD dwWorkUs) : IHttpServer(pEngine), m_dwWorkUs(dwWorkUs) {}
+	~SlowHttpServer() {}
+
+public:
+
+	virtual void OnRequest(IOSocketContext *pSocketContext, const IOHttpRequest &request)
+	{
+		LARGE_INTEGER frequency, begin, now;
+		::QueryPerformanceFrequency(&frequency);
+		::QueryPerformanceCounter(&begin);
+		LONGLONG llWorkTicks = (LONGLONG)m_dwWorkUs * frequency.QuadPart / 1000000;
+		do
+		{
+			YieldProcessor();
+			::QueryPerformanceCounter(&now);
+		} while (now.QuadPart - begin.QuadPart < llWorkTicks);
+
+		static const char s_body[] = "ok";
+		Respond(pSocketContext, request.nSequence, 200, "text/plain", s_body, sizeof(s_body) - 1);
+	}
+
+private:
+
+	DWORD m_dwWorkUs;
+};
+
+// 压测连接：发送线程记下每个请求的发出时间，接收线程按序取出，HTTP/1.1的响应与请求一一对应且有序
+struct OverloadBenchConn
+{
+	SOCKET sock;
+	std::deque<LONGLONG> sendQpcs;	// 已发出、尚未收到响应的请求的发出时间
+	SpinLock lock;
+	std::string buffer;				// 尚未解析完的响应数据，只由接收线程访问
+};
+
+// 过载测试的统计，只由接收线程写入
+struct OverloadBenchResult
+{
+	std::vector<double> latencies;	// 200响应的时延(微秒)
+	ULONGLONG ullShed;				// 503响应数
+	ULONGLONG ullOther;				// 其他状态码的响应数
+};
+
+// 从连接的缓冲区中取出完整的响应，记录其状态码及时延
+static void ParseBenchResponses(OverloadBenchConn &conn, LONGLONG llNowQpc, double dTickUs, OverloadBenchResult &result)
+{
+	for (;;)
+	{
+		size_t nHeadEnd = conn.buffer.find("\r\n\r\n");
+		if (std::string::npos == nHeadEnd || conn.buffer.size() < 12)
+		{
+			return;
+		}
+
+		size_t nContentLength = 0;
+		size_t nField = conn.buffer.find("Content-Length: ");
+		if (std::string::npos != nField && nField < nHeadEnd)
+		{
+			nContentLength = (size_t)::atoi(conn.buffer.c_str() + nField + 16);
+		}
+
+		size_t nTotal = nHeadEnd + 4 + nContentLength;
+		if (conn.buffer.size() < nTotal)
+		{
+			return;
+		}
+
+		int nStatus = ::atoi(conn.buffer.c_str() + 9);
+		conn.buffer.erase(0, nTotal);
+
+		LONGLONG llSendQpc = llNowQpc;
+		{
+			AutoLock<SpinLock> lock(conn.lock);
+			if (!conn.sendQpcs.empty())
+			{
+				llSendQpc = conn.sendQpcs.front();
+				conn.sendQpcs.pop_front();
+			}
+		}
+
+		if (200 == nStatus)
+		{
+			result.latencies.push_back((double)(llNowQpc - llSendQpc) * dTickUs);
+		}
+		else if (503 == nStatus)
+		{
+			++result.ullShed;
+		}
+		else
+		{
+			++result.ullOther;
+		}
+	}
+}
+
+// 发送线程的参数
+struct OverloadBenchSender
+{
+	std::vector<OverloadBenchConn> *pConns;
+	double dRate;					// 每秒发出的请求数
+	ULONGLONG ullTotal;				// 请求总数
+	volatile LONG64 nSent;			// 已发出的请求数
+	volatile LONG nStop;			// 接收方要求停止或send失败
+};
+
+// 匀速发出请求：第n个请求在开始后n/dRate秒发出，时延从应发出的时刻算起，发送被阻塞时不会少计排队时间
+static DWORD WINAPI OverloadBenchSendProc(LPVOID lpParam)
+{
+	static const char s_request[] = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+	OverloadBenchSender *pSender = static_cast<OverloadBenchSender *>(lpParam);
+	std::vector<OverloadBenchConn> &conns = *pSender->pConns;
+
+	LARGE_INTEGER frequency, start, current;
+	::QueryPerformanceFrequency(&frequency);
+	::QueryPerformanceCounter(&start);
+	for (ULONGLONG ullIndex = 0; !pSender->nStop && ullIndex < pSender->ullTotal; ++ullIndex)
+	{
+		LONGLONG llDueQpc = start.QuadPart + (LONGLONG)((double)ullIndex * frequency.QuadPart / pSender->dRate);
+		for (::QueryPerformanceCounter(&current); current.QuadPart < llDueQpc; ::QueryPerformanceCounter(&current))
+		{
+			YieldProcessor();
+		}
+
+		OverloadBenchConn &conn = conns[ullIndex % conns.size()];
+		{
+			AutoLock<SpinLock> lock(conn.lock);
+			conn.sendQpcs.push_back(llDueQpc);
+		}
+		if ((int)(sizeof(s_request) - 1) != ::send(conn.sock, s_request, (int)(sizeof(s_request) - 1), 0))
+		{
+			::InterlockedExchange(&pSender->nStop, 1);
+			break;
+		}
+		::InterlockedIncrement64(&pSender->nSent);
+	}
+
+	return 0;
+}
+
+// 以服务能力的OVERLOAD_BENCH_FACTOR倍匀速发出请求(开环，不等待响应)，施压结束后等待积压的响应，
+// 输出200响应的p50/p99时延与有效吞吐(每秒200响应数)；bAdmission为true时服务端开启准入控制
+static bool RunOverloadPass(DWORD dwWorkUs, bool bAdmission)
+{
+	IOEngine engine;
+	if (!engine.Start(OVERLOAD_BENCH_WORKERS))
+	{
+		return false;
+	}
+
+	SlowHttpServer server(&engine, dwWorkUs);
+	if (bAdmission)
+	{
+		server.EnableAdmissionControl(OVERLOAD_BENCH_TARGET_US);
+	}
+	if (!server.Start(OVERLOAD_BENCH_PORT))
+	{
+		std::cout << "start server failed ......" << std::endl;
+		return false;
+	}
+
+	sockaddr_in addr;
+	::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = ::htons(OVERLOAD_BENCH_PORT);
+	::inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+	std::vector<OverloadBenchConn> conns(OVERLOAD_BENCH_CONNS);
+	std::vector<WSAPOLLFD> pollFds(OVERLOAD_BENCH_CONNS);
+	bool bOk = true;
+	for (size_t index = 0; index < conns.size(); ++index)
+	{
+		conns[index].sock = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (INVALID_SOCKET == conns[index].sock || SOCKET_ERROR == ::connect(conns[index].sock, (sockaddr*)&addr, sizeof(addr)))
+		{
+			bOk = false;
+		}
+		BOOL bNoDelay = TRUE;
+		::setsockopt(conns[index].sock, IPPROTO_TCP, TCP_NODELAY, (char *)&bNoDelay, sizeof(bNoDelay));
+		pollFds[index].fd = conns[index].sock;
+		pollFds[index].events = POLLRDNORM;
+	}
+
+	LARGE_INTEGER frequency, now;
+	::QueryPerformanceFrequency(&frequency);
+	double dTickUs = 1000000.0 / (double)frequency.QuadPart;
+
+	OverloadBenchSender sender;
+	sender.pConns = &conns;
+	sender.dRate = (double)OVERLOAD_BENCH_FACTOR * OVERLOAD_BENCH_WORKERS * 1000000.0 / (double)dwWorkUs;
+	sender.ullTotal = (ULONGLONG)(sender.dRate * OVERLOAD_BENCH_SECONDS);
+	sender.nSent = 0;
+	sender.nStop = bOk ? 0 : 1;
+	HANDLE hSender = ::CreateThread(0, 0, &OverloadBenchSendProc, &sender, 0, 0);
+	bOk = bOk && (NULL != hSender);
+
+	// 接收所有响应，直到发送结束且响应全部收到，或等待积压超时
+	OverloadBenchResult result;
+	result.ullShed = 0;
+	result.ullOther = 0;
+	result.latencies.reserve((size_t)sender.ullTotal);
+	ULONGLONG ullDeadline = 0;
+	char buffer[MAX_BUFFER_SIZE];
+	while (bOk && !sender.nStop)
+	{
+		ULONGLONG ullReceived = result.latencies.size() + result.ullShed + result.ullOther;
+		if ((ULONGLONG)sender.nSent == sender.ullTotal)
+		{
+			if (ullReceived == sender.ullTotal)
+			{
+				break;
+			}
+			if (!ullDeadline)
+			{
+				ullDeadline = ::GetTickCount64() + OVERLOAD_BENCH_DRAIN_MS;
+			}
+			if (::GetTickCount64() > ullDeadline)
+			{
+				break;
+			}
+		}
+
+		if (SOCKET_ERROR == ::WSAPoll(pollFds.data(), (ULONG)pollFds.size(), 10))
+		{
+			bOk = false;
+			break;
+		}
+
+		for (size_t index = 0; index < pollFds.size(); ++index)
+		{
+			if (!(pollFds[index].revents & (POLLRDNORM | POLLHUP | POLLERR)))
+			{
+				continue;
+			}
+
+			int nRet = ::recv(conns[index].sock, buffer, sizeof(buffer), 0);
+			if (nRet <= 0)
+			{
+				bOk = false;
+				break;
+			}
+			conns[index].buffer.append(buffer, nRet);
+			::QueryPerformanceCounter(&now);
+			ParseBenchResponses(conns[index], now.QuadPart, dTickUs, result);
+		}
+	}
+
+	// 发送线程可能阻塞在send上，先关闭socket再等待其退出
+	bOk = bOk && !sender.nStop;
+	::InterlockedExchange(&sender.nStop, 1);
+	for (size_t index = 0; index < conns.size(); ++index)
+	{
+		::closesocket(conns[index].sock);
+	}
+	if (hSender)
+	{
+		::WaitForSingleObject(hSender, INFINITE);
+		::CloseHandle(hSender);
+	}
+	server.Stop();
+	engine.Stop();
+
+	if (!bOk)
+	{
+		std::cout << "overload bench failed ......" << std::endl;
+		return false;
+	}
+
+	ULONGLONG ullLost = sender.ullTotal - (result.latencies.size() + result.ullShed + result.ullOther);
+	std::sort(result.latencies.begin(), result.latencies.end());
+	size_t nGood = result.latencies.size();
+	printf("admission %-3s: offered %.0f req/s, goodput %.0f req/s, p50 %.1fms, p99 %.1fms, shed %llu, other %llu, unanswered %llu\n",
+		bAdmission ? "on" : "off",
+		sender.dRate,
+		(double)nGood / OVERLOAD_BENCH_SECONDS,
+		nGood ? result.latencies[nGood / 2] / 1000.0 : 0.0,
+		nGood ? result.latencies[nGood * 99 / 100] / 1000.0 : 0.0,
+		result.ullShed,
+		result.ullOther,
+		ullLost);
+	if (bAdmission)
+	{
+		server.GetAdmissionController().Dump(stdout);
+	}
+	return true;
+}
+
+// 过载场景：先关闭、再开启准入控制，对比2倍过载下已接纳请求的尾时延与有效吞吐
+static int RunOverloadBench(DWORD dwWorkUs)
+{
+	printf("overload bench: %u workers, %u us per request, capacity %.0f req/s, %ux load for %u s\n",
+		OVERLOAD_BENCH_WORKERS, dwWorkUs, OVERLOAD_BENCH_WORKERS * 1000000.0 / dwWorkUs, OVERLOAD_BENCH_FACTOR, OVERLOAD_BENCH_SECONDS);
+	bool bOff = RunOverloadPass(dwWorkUs, false);
+	bool bOn = RunOverloadPass(dwWorkUs, true);
+	return (bOff && bOn) ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    std::cout << "start server ......." << std::endl;
+
+	// --http 以HTTP/1.1服务端代替回显服务端，--ws 以WebSocket回显服务端代替
+	// --ws-bench 对比SIMD与逐字节的WebSocket去掩码吞吐后退出
+	// --alloc-check 驱动环回回显流量，检查稳态下收发路径没有堆分配后退出
+	// --overload-bench [单请求微秒] 以2倍于服务能力的负载压测HTTP服务端，对比关闭与开启准入控制时的p99时延与有效吞吐后退出
+	bool bHttp = false;
+	bool bWebSocket = false;
+	for (int index = 1; index < argc; ++index)
+	{
+		if (0 == ::strcmp(argv[index], "--http"))
+		{
+			bHttp = true;
+		}
+		else if (0 == ::strcmp(argv[index], "--ws"))
+		{
+			bWebSocket = true;
+		}
+		else if (0 == ::strcmp(argv[index], "--ws-bench"))
+		{
+			IOWebSocketCodec::Benchmark(stdout);
+			return 0;
+		}
+		else if (0 == ::strcmp(argv[index], "--alloc-check"))
+		{
+			return RunAllocCheck();
+		}
+		else if (0 == ::strcmp(argv[index], "--overload-bench"))
+		{
+			DWORD dwWorkUs = (index + 1 < argc) ? (DWORD)::atoi(argv[index + 1]) : 0;
+			return RunOverloadBench(dwWorkUs ? dwWorkUs : OVERLOAD_BENCH_WORK_US);
+		}
+	}
+
+	// 所有监听共用一个引擎
+	IOEngine engine;
+	ConcreteServer echoServer(&engine);
+	ConcreteServer bulkServer(&engine);
+	ConcreteServer unixServer(&engine);
+	ConcreteServer shmServer(&engine);
+	ConcreteHttpServer httpServer(&engine);
+	ConcreteWebSocketServer webSocketServer(&engine);
+	IServer *pServer = &echoServer;
+	if (bWebSocket)
+	{
+		pServer = &webSocketServer;
+	}
+	else if (bHttp)
+	{
+		pServer = &httpServer;
+	}
+	IServer &server = *pServer;
+
+	// --tls <证书主题名> 启用TLS，--compress 接受客户端的压缩协商，--capture <文件> 抓取收到的流量
+	// --takeover 从正在运行的旧进程接管监听socket和已建立的连接
+	// --busy-poll <微秒> 工作线程阻塞前先忙轮询完成端口(运行中可经BusyPollOffEvent/BusyPollOnEvent关闭/重新开启)，--quiet 不打印每条消息
+	// --admission <微秒> 完成包排队时延持续超过此目标时暂停接受新连接，--http下对新请求返回503
+	// --shards <数量> 引擎的分片(完成端口)数，--rebalance <毫秒> 按此周期检查分片负载并迁移连接
+	// --bulk-port <端口> 在同一引擎上再开一个回显监听，使用64K的recv缓冲区与1M的socket缓冲区，供大块传输使用
+	// --unix <路径> 在同一引擎上再开一个AF_UNIX回显监听，供同机对端绕过TCP环回
+	// --shm <名称> 再开一个共享内存回显监听，同机对端经环形队列收发，不经过内核
+	bool bTakeOver = false;
+	DWORD dwBusyPollUs = 0;
+	USHORT nBulkPort = 0;
+	const char *szUnixPath = nullptr;
+	const char *szShmName = nullptr;
+	for (int index = 1; index < argc; ++index)
+	{
+		if (0 == ::strcmp(argv[index], "--takeover"))
+		{
+			bTakeOver = true;
+		}
+		else if (0 == ::strcmp(argv[index], "--compress"))
+		{
+			server.EnableCompression();
+		}
+		else if (0 == ::strcmp(argv[index], "--capture") && index + 1 < argc)
+		{
+			if (!server.StartCapture(argv[++index]))
+			{
+				std::cout << "open capture file failed ......" << std::endl;
+				return 1;
+			}
+		}
+		else if (0 == ::strcmp(argv[index], "--busy-poll") && index + 1 < argc)
+		{
+			dwBusyPollUs = (DWORD)::atoi(argv[++index]);
+			server.EnableBusyPoll(dwBusyPollUs);
+		}
+		else if (0 == ::strcmp(argv[index], "--admission") && index + 1 < argc)
+		{
+			server.EnableAdmissionControl((DWORD)::atoi(argv[++index]));
+		}
+		else if (0 == ::strcmp(argv[index], "--shards") && index + 1 < argc)
+		{
+			engine.SetShardCount((USHORT)::atoi(argv[++index]));
+		}
+		else if (0 == ::strcmp(argv[index], "--rebalance") && index + 1 < argc)
+		{
+			server.EnableRebalance((DWORD)::atoi(argv[++index]));
+		}
+		else if (0 == ::strcmp(argv[index], "--quiet"))
+		{
+			echoServer.SetQuiet(true);
+			bulkServer.SetQuiet(true);
+			unixServer.SetQuiet(true);
+			shmServer.SetQuiet(true);
+		}
+		else if (0 == ::strcmp(argv[index], "--unix") && index + 1 < argc)
+		{
+			szUnixPath = argv[++index];
+		}
+		else if (0 == ::strcmp(argv[index], "--shm") && index + 1 < argc)
+		{
+			szShmName = argv[++index];
+		}
+		else if (0 == ::strcmp(argv[index], "--bulk-port") && index + 1 < argc)
+		{
+			nBulkPort = (USHORT)::atoi(argv[++index]);
+		}
+		else if (0 == ::strcmp(argv[index], "--tls") && index + 1 < argc)
+		{
+			if (!server.EnableTls(argv[++index]))
+			{
+				std::cout << "load tls certificate failed ......" << std::endl;
+				return 1;
+			}
+		}
+	}
+
+	if (bTakeOver)
+	{
+		if (!server.StartFromHandOff(HOT_RESTART_PIPE_NAME))
+		{
+			std::cout << "take over failed ......" << std::endl;
+			return 1;
+		}
+	}
+	else
+	{
+		server.Start();
+	}
+
+	if (nBulkPort)
+	{
+		IOListenerConfig bulkConfig;
+		bulkConfig.nPort = nBulkPort;
+		bulkConfig.dwRecvBufferSize = RECV_BUFFER_SIZE_MAX;
+		bulkConfig.nSocketRecvBuf = 1024 * 1024;
+		bulkConfig.nSocketSendBuf = 1024 * 1024;
+		if (!bulkServer.Start(bulkConfig))
+		{
+			std::cout << "start bulk listener failed ......" << std::endl;
+		}
+	}
+
+	if (szUnixPath)
+	{
+		IOListenerConfig unixConfig;
+		unixConfig.unixPath = szUnixPath;
+		if (!unixServer.Start(unixConfig))
+		{
+			std::cout << "start unix listener failed ......" << std::endl;
+		}
+	}
+
+	if (szShmName)
+	{
+		IOListenerConfig shmConfig;
+		shmConfig.shmName = szShmName;
+		if (!shmServer.Start(shmConfig))
+		{
+			std::cout << "start shm listener failed ......" << std::endl;
+		}
+	}
+
+	// ShutdownEvent直接退出；HotRestartEvent将连接交接给以--takeover启动的新进程后退出
+	// TraceDumpEvent将各线程最近的跟踪事件导出为iocp_trace.json(可在chrome://tracing或Perfetto中查看)，并输出工作者线程的时间统计后继续运行
+	// BusyPollOffEvent/BusyPollOnEvent关闭/按--busy-poll的时长重新开启忙轮询后继续运行，客户端的--ping据此在两轮之间同时切换两端
+	HANDLE hEvents[5] = {
+		::CreateEvent(nullptr, FALSE, FALSE, L"ShutdownEvent"),
+		::CreateEvent(nullptr, FALSE, FALSE, L"HotRestartEvent"),
+		::CreateEvent(nullptr, FALSE, FALSE, L"TraceDumpEvent"),
+		::CreateEvent(nullptr, FALSE, FALSE, L"BusyPollOffEvent"),
+		::CreateEvent(nullptr, FALSE, FALSE, L"BusyPollOnEvent")
+	};
+	bool bRunning = true;
+	while (bRunning)
+	{
+		DWORD dwWait = ::WaitForMultipleObjects(5, hEvents, FALSE, INFINITE);
+		if (WAIT_OBJECT_0 + 1 == dwWait)
+		{
+			std::cout << "hand off to new process ......" << std::endl;
+			server.HandOff(HOT_RESTART_PIPE_NAME, true);
+			bRunning = false;
+		}
+		else if (WAIT_OBJECT_0 + 2 == dwWait)
+		{
+			IOTracer::GetInstance().Dump("iocp_trace.json");
+			engine.DumpWorkerTimes(stdout);
+		}
+		else if (WAIT_OBJECT_0 + 3 == dwWait)
+		{
+			server.EnableBusyPoll(0);
+		}
+		else if (WAIT_OBJECT_0 + 4 == dwWait)
+		{
+			server.EnableBusyPoll(dwBusyPollUs);
+		}
+		else
+		{
+			bRunning = false;
+		}
+	}
+	for (int index = 0; index < 5; ++index)
+	{
+		::CloseHandle(hEvents[index]);
+	}
+
+	server.Stop();
+	bulkServer.Stop();
+	unixServer.Stop();
+	shmServer.Stop();
+	engine.Stop();
+
+	// 与未压缩的回显对比CPU耗时与带宽
+	IOCompressStats::GetInstance().Dump(stdout);
+	server.GetBusyPoller().Dump(stdout);
+	server.GetAdmissionController().Dump(stdout);
+	engine.DumpWorkerTimes(stdout);
+
+#ifdef IO_ENGINE_LOCK_PROFILE
+	LockProfiler::GetInstance().Dump(stdout);
+#endif
+
 	std::cout << "stop server ......" << std::endl;
 
 	return 0;